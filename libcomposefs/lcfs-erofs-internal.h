@@ -97,31 +97,29 @@ static inline int erofs_get_xattr_prefix(const char *str)
 	return 0;
 }
 
-static inline char *erofs_get_xattr_name(uint8_t index, const char *name,
-					 size_t name_len)
+/* Room for the longest prefix and a name of UINT8_MAX bytes */
+#define EROFS_XATTR_NAME_BUF_SIZE (sizeof("system.posix_acl_default") + UINT8_MAX)
+
+static inline int erofs_get_xattr_name(uint8_t index, const char *name,
+				       uint8_t name_len,
+				       char buf[EROFS_XATTR_NAME_BUF_SIZE])
 {
-	char *res;
 	const char *prefix;
 	size_t prefix_len;
 
 	if (index >= EROFS_N_XATTR_PREFIXES) {
 		errno = EINVAL;
-		return NULL;
+		return -1;
 	}
 
 	prefix = erofs_xattr_prefixes[index];
 	prefix_len = strlen(prefix);
 
-	res = malloc(prefix_len + name_len + 1);
-	if (res == NULL) {
-		errno = ENOMEM;
-		return NULL;
-	}
-	memcpy(res, prefix, prefix_len);
-	memcpy(res + prefix_len, name, name_len);
-	res[prefix_len + name_len] = 0;
+	memcpy(buf, prefix, prefix_len);
+	memcpy(buf + prefix_len, name, name_len);
+	buf[prefix_len + name_len] = 0;
 
-	return res;
+	return 0;
 }
 
 void erofs_compute_chunking(uint64_t file_size, uint32_t *chunkbits,
@@ -403,8 +403,33 @@ static void lcfs_fsverity_context_update_level(FsVerityContext *ctx, uint8_t *da
 
 void lcfs_fsverity_context_update(FsVerityContext *ctx, void *data, size_t data_len)
 {
-	lcfs_fsverity_context_update_level(ctx, data, data_len, 0);
+	uint8_t *p = data;
+
 	ctx->file_size += data_len;
+
+	/* Whole blocks starting at a block boundary are hashed in place
+	   rather than copied. The last one is still buffered, as a full
+	   block must only be flushed if more data follows it. */
+	if (ctx->buffer_pos[0] % FSVERITY_BLOCK_SIZE == 0 &&
+	    data_len > FSVERITY_BLOCK_SIZE) {
+		size_t n_blocks = (data_len - 1) / FSVERITY_BLOCK_SIZE;
+		uint8_t digest[LCFS_SHA256_DIGEST_LEN];
+
+		if (ctx->buffer_pos[0] == FSVERITY_BLOCK_SIZE) {
+			do_sha256(ctx, ctx->buffer[0], FSVERITY_BLOCK_SIZE, digest);
+			lcfs_fsverity_context_update_level(ctx, digest, 32, 1);
+			ctx->buffer_pos[0] = 0;
+		}
+
+		for (size_t i = 0; i < n_blocks; i++) {
+			do_sha256(ctx, p, FSVERITY_BLOCK_SIZE, digest);
+			lcfs_fsverity_context_update_level(ctx, digest, 32, 1);
+			p += FSVERITY_BLOCK_SIZE;
+		}
+		data_len -= n_blocks * FSVERITY_BLOCK_SIZE;
+	}
+
+	lcfs_fsverity_context_update_level(ctx, p, data_len, 0);
 }
 
 static void lcfs_fsverity_context_flush_level(FsVerityContext *ctx, uint32_t level)
@@ -0,0 +1,289 @@
+/* lcfs
+
+   SPDX-License-Identifier: GPL-2.0-or-later OR Apache-2.0
+*/
+#ifndef _LCFS_HT_H
+#define _LCFS_HT_H
+
+/* A small open-addressing hash table using Robin Hood probing, for the
+ * hot paths where gnulib's chained Hash_table is too slow. The full
+ * 64-bit hash of every entry is kept next to the value, so most probes
+ * are decided without calling the equality function or touching the
+ * value, and growing never needs to rehash.
+ *
+ * Values are opaque non-NULL pointers owned by the caller, the table
+ * never frees them. Everything is inline so the equality callback can
+ * be inlined into the probe loop. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+struct lcfs_ht_entry {
+	uint64_t hash;
+	void *value; /* NULL for empty slots */
+};
+
+struct lcfs_ht {
+	struct lcfs_ht_entry *entries;
+	size_t mask; /* Number of slots - 1, always a power of two */
+	size_t n_entries;
+};
+
+typedef bool (*lcfs_ht_eq_fn)(const void *value, const void *key);
+
+static inline uint64_t lcfs_ht_hash_u64(uint64_t v)
+{
+	/* The murmur3 finalizer, a bijection so no two keys collide */
+	v ^= v >> 33;
+	v *= 0xff51afd7ed558ccdULL;
+	v ^= v >> 33;
+	v *= 0xc4ceb9fe1a85ec53ULL;
+	v ^= v >> 33;
+	return v;
+}
+
+static inline uint64_t lcfs_ht_hash_bytes(const void *data, size_t len,
+					  uint64_t seed)
+{
+	const uint8_t *p = data;
+	uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+	uint64_t v;
+
+	while (len >= sizeof(v)) {
+		memcpy(&v, p, sizeof(v));
+		h ^= v * 0x87c37b91114253d5ULL;
+		h = ((h << 31) | (h >> 33)) * 0x4cf5ad432745937fULL;
+		p += sizeof(v);
+		len -= sizeof(v);
+	}
+	if (len > 0) {
+		v = 0;
+		memcpy(&v, p, len);
+		h ^= v * 0x87c37b91114253d5ULL;
+		h = ((h << 31) | (h >> 33)) * 0x4cf5ad432745937fULL;
+	}
+
+	return lcfs_ht_hash_u64(h);
+}
+
+static inline uint64_t lcfs_ht_hash_string(const char *str)
+{
+	return lcfs_ht_hash_bytes(str, strlen(str), 0);
+}
+
+/* Keep the load factor below 7/8 */
+static inline size_t lcfs_ht_max_entries(size_t n_slots)
+{
+	return n_slots - n_slots / 8;
+}
+
+static inline int lcfs_ht_init(struct lcfs_ht *ht, size_t n_expected)
+{
+	size_t n_slots = 16;
+
+	while (lcfs_ht_max_entries(n_slots) < n_expected) {
+		if (n_slots > SIZE_MAX / 2 / sizeof(struct lcfs_ht_entry)) {
+			errno = ENOMEM;
+			return -1;
+		}
+		n_slots *= 2;
+	}
+
+	ht->entries = calloc(n_slots, sizeof(struct lcfs_ht_entry));
+	if (ht->entries == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ht->mask = n_slots - 1;
+	ht->n_entries = 0;
+
+	return 0;
+}
+
+static inline void lcfs_ht_destroy(struct lcfs_ht *ht)
+{
+	free(ht->entries);
+	ht->entries = NULL;
+	ht->mask = 0;
+	ht->n_entries = 0;
+}
+
+/* How far the entry in @slot is from its preferred slot */
+static inline size_t lcfs_ht_distance(const struct lcfs_ht *ht, size_t slot,
+				      uint64_t hash)
+{
+	return (slot - (size_t)hash) & ht->mask;
+}
+
+/* Robin Hood insertion of a value known not to be in the table,
+ * starting at @slot which is @dist away from the preferred slot. */
+static inline void lcfs_ht_place(struct lcfs_ht *ht, size_t slot, size_t dist,
+				 uint64_t hash, void *value)
+{
+	for (;;) {
+		struct lcfs_ht_entry *e = &ht->entries[slot];
+		size_t e_dist;
+
+		if (e->value == NULL) {
+			e->hash = hash;
+			e->value = value;
+			ht->n_entries++;
+			return;
+		}
+
+		e_dist = lcfs_ht_distance(ht, slot, e->hash);
+		if (e_dist < dist) {
+			struct lcfs_ht_entry tmp = *e;
+
+			e->hash = hash;
+			e->value = value;
+			hash = tmp.hash;
+			value = tmp.value;
+			dist = e_dist;
+		}
+
+		slot = (slot + 1) & ht->mask;
+		dist++;
+	}
+}
+
+static inline int lcfs_ht_grow(struct lcfs_ht *ht)
+{
+	struct lcfs_ht old = *ht;
+	size_t n_slots = (old.mask + 1) * 2;
+
+	if (n_slots > SIZE_MAX / sizeof(struct lcfs_ht_entry)) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ht->entries = calloc(n_slots, sizeof(struct lcfs_ht_entry));
+	if (ht->entries == NULL) {
+		*ht = old;
+		errno = ENOMEM;
+		return -1;
+	}
+	ht->mask = n_slots - 1;
+	ht->n_entries = 0;
+
+	for (size_t i = 0; i <= old.mask; i++) {
+		struct lcfs_ht_entry *e = &old.entries[i];
+		if (e->value != NULL)
+			lcfs_ht_place(ht, (size_t)e->hash & ht->mask, 0,
+				      e->hash, e->value);
+	}
+
+	free(old.entries);
+	return 0;
+}
+
+static inline void *lcfs_ht_lookup(const struct lcfs_ht *ht, uint64_t hash,
+				   const void *key, lcfs_ht_eq_fn eq)
+{
+	size_t slot = (size_t)hash & ht->mask;
+
+	for (size_t dist = 0;; dist++) {
+		const struct lcfs_ht_entry *e = &ht->entries[slot];
+
+		/* Any match would have displaced an entry closer to its
+		 * preferred slot, so we can stop early. */
+		if (e->value == NULL || lcfs_ht_distance(ht, slot, e->hash) < dist)
+			return NULL;
+
+		if (e->hash == hash && eq(e->value, key))
+			return e->value;
+
+		slot = (slot + 1) & ht->mask;
+	}
+}
+
+/* Returns the value matching @key if there is one, otherwise inserts
+ * @value and returns it. Returns NULL if out of memory. */
+static inline void *lcfs_ht_insert_if_absent(struct lcfs_ht *ht, uint64_t hash,
+					     const void *key, lcfs_ht_eq_fn eq,
+					     void *value)
+{
+	size_t slot;
+
+	if (ht->n_entries + 1 > lcfs_ht_max_entries(ht->mask + 1) &&
+	    lcfs_ht_grow(ht) < 0)
+		return NULL;
+
+	slot = (size_t)hash & ht->mask;
+	for (size_t dist = 0;; dist++) {
+		const struct lcfs_ht_entry *e = &ht->entries[slot];
+
+		if (e->value == NULL || lcfs_ht_distance(ht, slot, e->hash) < dist) {
+			lcfs_ht_place(ht, slot, dist, hash, value);
+			return value;
+		}
+
+		if (e->hash == hash && eq(e->value, key))
+			return e->value;
+
+		slot = (slot + 1) & ht->mask;
+	}
+}
+
+/* Inserts a value whose key is known not to be in the table */
+static inline int lcfs_ht_insert(struct lcfs_ht *ht, uint64_t hash, void *value)
+{
+	if (ht->n_entries + 1 > lcfs_ht_max_entries(ht->mask + 1) &&
+	    lcfs_ht_grow(ht) < 0)
+		return -1;
+
+	lcfs_ht_place(ht, (size_t)hash & ht->mask, 0, hash, value);
+	return 0;
+}
+
+/* Removes and returns the value matching @key, or NULL */
+static inline void *lcfs_ht_remove(struct lcfs_ht *ht, uint64_t hash,
+				   const void *key, lcfs_ht_eq_fn eq)
+{
+	size_t slot = (size_t)hash & ht->mask;
+	size_t next;
+	void *value;
+
+	for (size_t dist = 0;; dist++) {
+		const struct lcfs_ht_entry *e = &ht->entries[slot];
+
+		if (e->value == NULL || lcfs_ht_distance(ht, slot, e->hash) < dist)
+			return NULL;
+
+		if (e->hash == hash && eq(e->value, key))
+			break;
+
+		slot = (slot + 1) & ht->mask;
+	}
+
+	value = ht->entries[slot].value;
+
+	/* Shift the following entries back, so no tombstones are needed */
+	next = (slot + 1) & ht->mask;
+	while (ht->entries[next].value != NULL &&
+	       lcfs_ht_distance(ht, next, ht->entries[next].hash) > 0) {
+		ht->entries[slot] = ht->entries[next];
+		slot = next;
+		next = (next + 1) & ht->mask;
+	}
+	ht->entries[slot].value = NULL;
+	ht->n_entries--;
+
+	return value;
+}
+
+/* Iterates over all values in unspecified order, start with *iter = 0 */
+static inline void *lcfs_ht_next(const struct lcfs_ht *ht, size_t *iter)
+{
+	while (*iter <= ht->mask) {
+		void *value = ht->entries[(*iter)++].value;
+		if (value != NULL)
+			return value;
+	}
+	return NULL;
+}
+
+#endif
@@ -20,7 +20,6 @@
 
 #include "lcfs-writer.h"
 #include "lcfs-fsverity.h"
-#include "hash.h"
 
 /* This is used for (internal) functions that return zero or -errno, functions that set errno return int */
 typedef int errint_t;
@@ -90,12 +89,16 @@ typedef int errint_t;
 
 /* In memory representation used to build the file.  */
 
+struct hasher_xattr_s;
+
 struct lcfs_xattr_s {
 	char *key;
 	char *value;
 	uint16_t value_len;
+	uint64_t hash; /* Of key and value, updated when either changes */
 
 	/* Used during writing */
+	struct hasher_xattr_s *erofs_entry; /* Only valid while computing shared xattrs */
 	int64_t erofs_shared_xattr_offset; /* shared offset, or -1 if not shared */
 };
 
@@ -152,9 +155,28 @@ struct lcfs_node_s {
 	uint32_t erofs_isize;
 	uint64_t erofs_nid;
 	uint32_t erofs_n_blocks;
+	uint32_t erofs_first_block; /* relative to the start of the data blocks */
+	struct lcfs_node_s *erofs_dedup_of; /* shares data blocks with this node */
 	uint32_t erofs_tailsize;
 };
 
+/* Output for LCFS_FLAGS_SEEKABLE_FD, writes at an explicit offset */
+struct lcfs_fd_output {
+	int fd;
+	off_t offset;
+};
+
+ssize_t lcfs_fd_output_write(void *file, void *buf, size_t count);
+
+/* Output when only the digest is wanted, fs-verity gets whole blocks */
+struct lcfs_digest_output {
+	FsVerityContext *fsverity_ctx;
+	size_t pos;
+	uint8_t block[FSVERITY_BLOCK_SIZE];
+};
+
+ssize_t lcfs_digest_output_write(void *file, void *buf, size_t count);
+
 struct lcfs_ctx_s {
 	struct lcfs_write_options_s *options;
 	struct lcfs_node_s *root;
@@ -171,6 +193,8 @@ struct lcfs_ctx_s {
 	lcfs_write_cb write_cb;
 	off_t bytes_written;
 	FsVerityContext *fsverity_ctx;
+	struct lcfs_fd_output fd_output;
+	struct lcfs_digest_output *digest_output;
 
 	void (*finalize)(struct lcfs_ctx_s *ctx);
 };
@@ -185,7 +209,6 @@ static inline void lcfs_node_unrefp(struct lcfs_node_s **nodep)
 #define cleanup_node __attribute__((cleanup(lcfs_node_unrefp)))
 
 /* lcfs-writer.c */
-size_t hash_memory(const char *string, size_t len, size_t n_buckets);
 int lcfs_write(struct lcfs_ctx_s *ctx, void *_data, size_t data_len);
 int lcfs_write_align(struct lcfs_ctx_s *ctx, size_t align_size);
 int lcfs_write_pad(struct lcfs_ctx_s *ctx, size_t data_len);
@@ -193,6 +216,8 @@ int lcfs_compute_tree(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root);
 int lcfs_clone_root(struct lcfs_ctx_s *ctx);
 char *maybe_join_path(const char *a, const char *b);
 int follow_links(struct lcfs_node_s *node, struct lcfs_node_s **out_node);
+struct lcfs_node_s *lcfs_node_bsearch_child(struct lcfs_node_s *node,
+					    const char *name, size_t *pos);
 int node_get_dtype(struct lcfs_node_s *node);
 
 int lcfs_node_rename_xattr(struct lcfs_node_s *node, size_t index,
@@ -204,6 +229,10 @@ int lcfs_node_set_xattr_internal(struct lcfs_node_s *node, const char *name,
 int lcfs_validate_mode(mode_t mode);
 int lcfs_node_validate(struct lcfs_node_s *node);
 
+typedef void (*lcfs_parallel_fn)(void *data, size_t start, size_t end);
+void lcfs_parallel_for(uint32_t n_threads, size_t n_items, size_t min_chunk,
+		       lcfs_parallel_fn fn, void *data);
+
 /* lcfs-writer-erofs.c */
 
 int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx);
@@ -0,0 +1,158 @@
+/* lcfs
+
+   SPDX-License-Identifier: GPL-2.0-or-later OR Apache-2.0
+*/
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lcfs-internal.h"
+#include "lcfs-utils.h"
+#include "lcfs-objindex.h"
+
+struct lcfs_objindex_s {
+	uint8_t *data;
+	size_t data_size;
+	const struct lcfs_objindex_entry_s *entries;
+	size_t n_entries;
+};
+
+static int cmp_objindex_entry(const void *_a, const void *_b)
+{
+	const struct lcfs_objindex_entry_s *a = _a;
+	const struct lcfs_objindex_entry_s *b = _b;
+
+	return memcmp(a->digest, b->digest, LCFS_DIGEST_SIZE);
+}
+
+int lcfs_objindex_write(FILE *file, struct lcfs_objindex_entry_s *entries,
+			size_t n_entries)
+{
+	struct lcfs_objindex_header_s header = { 0 };
+	size_t n_unique = 0;
+
+	if (n_entries > 1)
+		qsort(entries, n_entries, sizeof(struct lcfs_objindex_entry_s),
+		      cmp_objindex_entry);
+
+	/* The same digest is the same content, so also the same size */
+	for (size_t i = 0; i < n_entries; i++) {
+		if (n_unique > 0 &&
+		    cmp_objindex_entry(&entries[n_unique - 1], &entries[i]) == 0)
+			continue;
+		entries[n_unique] = entries[i];
+		entries[n_unique].size = lcfs_u64_to_file(entries[i].size);
+		n_unique++;
+	}
+
+	header.magic = lcfs_u32_to_file(LCFS_OBJINDEX_MAGIC);
+	header.version = lcfs_u32_to_file(LCFS_OBJINDEX_VERSION);
+	header.n_entries = lcfs_u64_to_file(n_unique);
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+	    (n_unique > 0 && fwrite(entries, sizeof(struct lcfs_objindex_entry_s),
+				    n_unique, file) != n_unique)) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+bool lcfs_objindex_is_index(int fd)
+{
+	uint32_t magic;
+
+	return pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+	       lcfs_u32_from_file(magic) == LCFS_OBJINDEX_MAGIC;
+}
+
+struct lcfs_objindex_s *lcfs_objindex_open(int fd)
+{
+	cleanup_free struct lcfs_objindex_s *index = NULL;
+	const struct lcfs_objindex_header_s *header;
+	uint64_t n_entries;
+	struct stat st;
+	void *data;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+
+	if ((uint64_t)st.st_size < sizeof(struct lcfs_objindex_header_s)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	index = calloc(1, sizeof(struct lcfs_objindex_s));
+	if (index == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	header = data;
+	n_entries = lcfs_u64_from_file(header->n_entries);
+	if (lcfs_u32_from_file(header->magic) != LCFS_OBJINDEX_MAGIC ||
+	    lcfs_u32_from_file(header->version) != LCFS_OBJINDEX_VERSION ||
+	    n_entries > ((uint64_t)st.st_size - sizeof(*header)) /
+				sizeof(struct lcfs_objindex_entry_s)) {
+		munmap(data, st.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	index->data = data;
+	index->data_size = st.st_size;
+	index->entries = (const struct lcfs_objindex_entry_s *)(header + 1);
+	index->n_entries = n_entries;
+
+	return steal_pointer(&index);
+}
+
+void lcfs_objindex_free(struct lcfs_objindex_s *index)
+{
+	if (index == NULL)
+		return;
+
+	munmap(index->data, index->data_size);
+	free(index);
+}
+
+size_t lcfs_objindex_get_n_entries(struct lcfs_objindex_s *index)
+{
+	return index->n_entries;
+}
+
+void lcfs_objindex_get_entry(struct lcfs_objindex_s *index, size_t i,
+			     uint8_t *digest, uint64_t *size)
+{
+	const struct lcfs_objindex_entry_s *entry = &index->entries[i];
+
+	assert(i < index->n_entries);
+	memcpy(digest, entry->digest, LCFS_DIGEST_SIZE);
+	*size = lcfs_u64_from_file(entry->size);
+}
+
+int lcfs_objindex_lookup(struct lcfs_objindex_s *index, const uint8_t *digest,
+			 uint64_t *size)
+{
+	const struct lcfs_objindex_entry_s *entry;
+
+	/* The digest is the first member, so it can stand in for an entry */
+	entry = bsearch(digest, index->entries, index->n_entries,
+			sizeof(struct lcfs_objindex_entry_s), cmp_objindex_entry);
+	if (entry == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	*size = lcfs_u64_from_file(entry->size);
+	return 0;
+}
@@ -0,0 +1,48 @@
+/* lcfs
+
+   SPDX-License-Identifier: GPL-2.0-or-later OR Apache-2.0
+*/
+#ifndef _LCFS_OBJINDEX_H
+#define _LCFS_OBJINDEX_H
+
+#include "lcfs-writer.h"
+
+/* An object index is a sidecar to an image, listing the backing files it
+ * references by digest so they can be found without decoding the image.
+ * It is a header followed by fixed size entries sorted by digest, with
+ * all integers little endian. Only backing files stored by digest, as
+ * with mkcomposefs --digest-store, can be indexed. */
+
+#define LCFS_OBJINDEX_MAGIC 0x584a424fU
+#define LCFS_OBJINDEX_VERSION 1
+
+struct lcfs_objindex_header_s {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t n_entries;
+	uint32_t unused[4];
+} __attribute__((__packed__));
+
+struct lcfs_objindex_entry_s {
+	uint8_t digest[LCFS_DIGEST_SIZE];
+	uint64_t size;
+} __attribute__((__packed__));
+
+struct lcfs_objindex_s;
+
+/* Sorts and deduplicates entries in place, with sizes in host order */
+int lcfs_objindex_write(FILE *file, struct lcfs_objindex_entry_s *entries,
+			size_t n_entries);
+
+bool lcfs_objindex_is_index(int fd);
+struct lcfs_objindex_s *lcfs_objindex_open(int fd);
+void lcfs_objindex_free(struct lcfs_objindex_s *index);
+
+size_t lcfs_objindex_get_n_entries(struct lcfs_objindex_s *index);
+void lcfs_objindex_get_entry(struct lcfs_objindex_s *index, size_t i,
+			     uint8_t *digest, uint64_t *size);
+/* Fails with ENOENT if @digest isn't in the index */
+int lcfs_objindex_lookup(struct lcfs_objindex_s *index, const uint8_t *digest,
+			 uint64_t *size);
+
+#endif
@@ -6,6 +6,9 @@
 
 #include "config.h"
 
+#include <sched.h>
+#include <sys/sysinfo.h>
+
 #include "lcfs-utils.h"
 #include "lcfs-writer.h"
 
@@ -22,6 +25,38 @@ void digest_to_string(const uint8_t *csum, char *buf)
 	buf[j] = '\0';
 }
 
+/* The path of a backing file stored by digest, like "ab/cdef..." */
+void digest_to_path(const uint8_t *csum, char *buf)
+{
+	static const char hexchars[] = "0123456789abcdef";
+	uint32_t i, j;
+
+	for (i = 0, j = 0; i < LCFS_DIGEST_SIZE; i++, j += 2) {
+		uint8_t byte = csum[i];
+		if (i == 1)
+			buf[j++] = '/';
+		buf[j] = hexchars[byte >> 4];
+		buf[j + 1] = hexchars[byte & 0xF];
+	}
+	buf[j] = '\0';
+}
+
+/* The reverse of digest_to_path(), also taking a leading slash */
+int digest_from_path(const char *path, uint8_t *csum)
+{
+	char hex[LCFS_DIGEST_SIZE * 2 + 1];
+
+	if (*path == '/')
+		path++;
+	if (strlen(path) != LCFS_DIGEST_SIZE * 2 + 1 || path[2] != '/')
+		return -1;
+
+	memcpy(hex, path, 2);
+	memcpy(hex + 2, path + 3, LCFS_DIGEST_SIZE * 2 - 2 + 1);
+
+	return digest_to_raw(hex, csum, LCFS_DIGEST_SIZE) == LCFS_DIGEST_SIZE ? 0 : -1;
+}
+
 int digest_to_raw(const char *digest, uint8_t *raw, int max_size)
 {
 	int size = 0;
@@ -48,3 +83,14 @@ int digest_to_raw(const char *digest, uint8_t *raw, int max_size)
 
 	return size;
 }
+
+/* The number of CPUs this process may run on */
+int get_cpu_count(void)
+{
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		return CPU_COUNT(&set);
+
+	return get_nprocs();
+}
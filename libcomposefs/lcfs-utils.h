@@ -13,6 +13,7 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
 
 #define max(a, b) ((a > b) ? (a) : (b))
 #define min(a, b) (((a) < (b)) ? (a) : (b))
@@ -60,7 +61,10 @@ static inline int hexdigit(char c)
 }
 
 void digest_to_string(const uint8_t *csum, char *buf);
+void digest_to_path(const uint8_t *csum, char *buf);
+int digest_from_path(const char *path, uint8_t *csum);
 int digest_to_raw(const char *digest, uint8_t *raw, int max_size);
+int get_cpu_count(void);
 
 static inline char *str_join(const char *a, const char *b)
 {
@@ -134,4 +138,12 @@ static inline const char *gnu_basename(const char *filename)
 	return p ? p + 1 : filename;
 }
 
+static inline uint64_t lcfs_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
 #endif
@@ -13,7 +13,7 @@
 #include "lcfs-fsverity.h"
 #include "lcfs-erofs-internal.h"
 #include "lcfs-utils.h"
-#include "hash.h"
+#include "lcfs-ht.h"
 
 #include <errno.h>
 #include <string.h>
@@ -27,6 +27,7 @@
 #include <sys/sysmacros.h>
 #include <assert.h>
 #include <linux/fsverity.h>
+#include <pthread.h>
 
 /* The xxh32 hash function is copied from the linux kernel at:
  *  https://github.com/torvalds/linux/blob/d89775fc929c5a1d91ed518a71b456da0865e5ff/lib/xxhash.c
@@ -152,9 +153,14 @@ struct lcfs_ctx_erofs_s {
 	uint64_t inodes_end; /* start of xattrs */
 	uint64_t shared_xattr_size;
 	uint64_t n_data_blocks;
-	uint64_t current_end;
+	uint64_t n_dedup_blocks; /* Data blocks shared with an earlier inode */
+	uint64_t tail_padding; /* Bytes inserted to keep inode tails in a block */
+	uint64_t padding_saved; /* Less than without LCFS_FLAGS_PACK_INODES */
+	uint64_t data_block_start;
 	struct lcfs_xattr_s **shared_xattrs;
 	size_t n_shared_xattrs;
+	struct lcfs_node_s **nodes; /* All inodes in nid order */
+	size_t n_nodes;
 };
 
 static void lcfs_ctx_erofs_finalize(struct lcfs_ctx_s *ctx)
@@ -162,6 +168,7 @@ static void lcfs_ctx_erofs_finalize(struct lcfs_ctx_s *ctx)
 	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
 
 	free(ctx_erofs->shared_xattrs);
+	free(ctx_erofs->nodes);
 }
 
 struct lcfs_ctx_s *lcfs_ctx_erofs_new(void)
@@ -206,26 +213,18 @@ struct hasher_xattr_s {
 	uint64_t shared_offset; /* offset in bytes from start of shared xattrs */
 };
 
-static size_t xattrs_ht_hasher(const void *d, size_t n)
-{
-	const struct hasher_xattr_s *v = d;
-	return (hash_string(v->xattr->key, n) ^
-		hash_memory(v->xattr->value, v->xattr->value_len, n)) %
-	       n;
-}
-
-static bool xattrs_ht_comparator(const void *d1, const void *d2)
+static bool xattrs_ht_eq(const void *value, const void *key)
 {
-	const struct hasher_xattr_s *v1 = d1;
-	const struct hasher_xattr_s *v2 = d2;
+	const struct lcfs_xattr_s *x1 = ((const struct hasher_xattr_s *)value)->xattr;
+	const struct lcfs_xattr_s *x2 = key;
 
-	if (v1->xattr->value_len != v2->xattr->value_len)
+	if (x1->value_len != x2->value_len)
 		return false;
 
-	if (memcmp(v1->xattr->value, v2->xattr->value, v1->xattr->value_len) != 0)
+	if (memcmp(x1->value, x2->value, x1->value_len) != 0)
 		return false;
 
-	return strcmp(v1->xattr->key, v2->xattr->key) == 0;
+	return strcmp(x1->key, x2->key) == 0;
 }
 
 /* Sort alphabetically by key and value to get some canonical order */
@@ -312,53 +311,52 @@ static int compute_erofs_shared_xattrs(struct lcfs_ctx_s *ctx)
 {
 	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
 	struct lcfs_node_s *node;
-	Hash_table *xattr_hash;
+	struct lcfs_ht xattr_ht = { 0 };
+	struct hasher_xattr_s *entries = NULL;
 	struct hasher_xattr_s **sorted = NULL;
 	size_t n_xattrs;
 	uint64_t xattr_offset;
 
-	size_t n_files = 0;
+	/* There can't be more unique xattrs than xattrs in total, so
+	 * allocate all entries up front. */
+	size_t n_total = 0;
 	for (node = ctx->root; node != NULL; node = node->next)
-		n_files++;
+		n_total += node->n_xattrs;
+
+	entries = calloc(n_total + 1, sizeof(struct hasher_xattr_s));
+	if (entries == NULL)
+		goto fail;
 
 	/* Find the use count for each xattr key/value in use */
-	xattr_hash = hash_initialize(n_files, NULL, xattrs_ht_hasher,
-				     xattrs_ht_comparator, free);
-	if (xattr_hash == NULL) {
-		errno = ENOMEM;
-		return -1;
-	}
+	if (lcfs_ht_init(&xattr_ht, 0) < 0)
+		goto fail;
 
+	n_xattrs = 0;
 	for (node = ctx->root; node != NULL; node = node->next) {
 		for (size_t i = 0; i < node->n_xattrs; i++) {
-			struct hasher_xattr_s hkey = { .xattr = &node->xattrs[i] };
+			struct lcfs_xattr_s *xattr = &node->xattrs[i];
+			struct hasher_xattr_s *new_ent = &entries[n_xattrs];
 			struct hasher_xattr_s *ent;
 
-			ent = hash_lookup(xattr_hash, &hkey);
-			if (ent == NULL) {
-				cleanup_free struct hasher_xattr_s *new_ent =
-					calloc(1, sizeof(struct hasher_xattr_s));
-				if (new_ent == NULL) {
-					goto fail;
-				}
-				new_ent->xattr = &node->xattrs[i];
-				ent = hash_insert(xattr_hash, new_ent);
-				if (ent == NULL)
-					goto fail;
-				assert(ent == new_ent); /* Due to result from previously run hash_lookup() */
-				new_ent = NULL;
-			}
+			new_ent->xattr = xattr;
+			ent = lcfs_ht_insert_if_absent(&xattr_ht, xattr->hash,
+						       xattr, xattrs_ht_eq, new_ent);
+			if (ent == NULL)
+				goto fail;
+			if (ent == new_ent)
+				n_xattrs++;
 			ent->count++;
+			xattr->erofs_entry = ent;
 		}
 	}
 
 	/* Compute the xattr list in canonical order */
 
-	n_xattrs = hash_get_n_entries(xattr_hash);
-	sorted = calloc(n_xattrs, sizeof(struct hasher_xattr_s *));
+	sorted = calloc(n_xattrs + 1, sizeof(struct hasher_xattr_s *));
 	if (sorted == NULL)
 		goto fail;
-	n_xattrs = hash_get_entries(xattr_hash, (void **)sorted, n_xattrs);
+	for (size_t i = 0; i < n_xattrs; i++)
+		sorted[i] = &entries[i];
 	qsort(sorted, n_xattrs, sizeof(struct hasher_xattr_s *), xattrs_ht_sort);
 
 	/* Compute the list of shared (multi-use) xattrs and their offsets */
@@ -390,11 +388,9 @@ static int compute_erofs_shared_xattrs(struct lcfs_ctx_s *ctx)
 		int n_shared = 0;
 		for (size_t i = 0; i < node->n_xattrs; i++) {
 			struct lcfs_xattr_s *xattr = &node->xattrs[i];
-			struct hasher_xattr_s hkey = { .xattr = xattr };
-			struct hasher_xattr_s *ent;
+			struct hasher_xattr_s *ent = xattr->erofs_entry;
 
-			ent = hash_lookup(xattr_hash, &hkey);
-			assert(ent != NULL);
+			xattr->erofs_entry = NULL;
 			if (ent->shared && n_shared < EROFS_XATTR_LONG_PREFIX) {
 				xattr->erofs_shared_xattr_offset = ent->shared_offset;
 				n_shared++;
@@ -405,13 +401,15 @@ static int compute_erofs_shared_xattrs(struct lcfs_ctx_s *ctx)
 	}
 
 	free(sorted);
-	hash_free(xattr_hash);
+	free(entries);
+	lcfs_ht_destroy(&xattr_ht);
 	return 0;
 
 fail:
 	errno = ENOMEM;
 	free(sorted);
-	hash_free(xattr_hash);
+	free(entries);
+	lcfs_ht_destroy(&xattr_ht);
 	return -1;
 }
 
@@ -632,49 +630,229 @@ static uint64_t compute_erofs_inode_padding_for_tail(struct lcfs_node_s *node,
 	return 0;
 }
 
+/* Don't bother with threads for fewer inodes than this */
+#define EROFS_LAYOUT_MIN_CHUNK 4096
+
+/* How far ahead LCFS_FLAGS_PACK_INODES looks for an inode to fill the
+ * padding in front of a tail, this bounds how far from their place in
+ * the layout order inodes move. */
+#define EROFS_PACK_WINDOW 64
+
+static size_t erofs_inode_base_size(struct lcfs_node_s *node)
+{
+	return node->erofs_compact ? sizeof(struct erofs_inode_compact) :
+				     sizeof(struct erofs_inode_extended);
+}
+
+/* The tail padding @node would need at @pos, without changing it */
+static uint64_t erofs_inode_padding_at(struct lcfs_node_s *node, uint64_t pos,
+				       size_t *isize)
+{
+	uint32_t n_blocks = node->erofs_n_blocks;
+	uint32_t tailsize = node->erofs_tailsize;
+	size_t inode_size = erofs_inode_base_size(node);
+	uint64_t pad;
+
+	pad = compute_erofs_inode_padding_for_tail(node, pos, inode_size,
+						   node->erofs_xattr_size);
+	*isize = inode_size + node->erofs_xattr_size + node->erofs_tailsize;
+
+	node->erofs_n_blocks = n_blocks;
+	node->erofs_tailsize = tailsize;
+
+	return pad;
+}
+
+/* Finds a later inode in the window that can be placed at @pos without
+ * padding of its own and that fits in @gap, returns 0 if there is none. */
+static size_t erofs_find_filler(struct lcfs_ctx_erofs_s *ctx_erofs, size_t i,
+				uint64_t pos, uint64_t gap)
+{
+	size_t end = min(i + 1 + EROFS_PACK_WINDOW, ctx_erofs->n_nodes);
+
+	for (size_t j = i + 1; j < end; j++) {
+		size_t isize;
+
+		if (erofs_inode_padding_at(ctx_erofs->nodes[j], pos, &isize) == 0 &&
+		    round_up(isize, EROFS_SLOTSIZE) <= gap)
+			return j;
+	}
+	return 0;
+}
+
+/* The tail padding of the inodes placed in their current order, so
+ * that the padding saved by packing them can be reported. */
+static uint64_t erofs_unpacked_tail_padding(struct lcfs_ctx_erofs_s *ctx_erofs,
+					    uint64_t pos)
+{
+	uint64_t padding = 0;
+
+	for (size_t i = 0; i < ctx_erofs->n_nodes; i++) {
+		size_t isize;
+		uint64_t pad;
+
+		pos = round_up(pos, EROFS_SLOTSIZE);
+		pad = erofs_inode_padding_at(ctx_erofs->nodes[i], pos, &isize);
+		padding += pad;
+		pos += pad + isize;
+	}
+	return padding;
+}
+
+/* The part of the layout that only depends on the node itself, and
+ * can be computed in parallel. */
+static void compute_erofs_inode_sizes(void *data, size_t start, size_t end)
+{
+	struct lcfs_ctx_s *ctx = data;
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+
+	for (size_t i = start; i < end; i++) {
+		struct lcfs_node_s *node = ctx_erofs->nodes[i];
+		size_t n_shared_xattrs, unshared_xattrs_size;
+
+		compute_erofs_inode_size(node);
+		node->erofs_compact = lcfs_fits_in_erofs_compact(ctx, node);
+
+		compute_erofs_xattr_counts(node, &n_shared_xattrs,
+					   &unshared_xattrs_size);
+		node->erofs_xattr_size =
+			xattr_erofs_inode_size(n_shared_xattrs, unshared_xattrs_size);
+	}
+}
+
+/* The content written to the data blocks of a regular file, the tail
+ * (if any) is inlined in the inode and not part of it. */
+static size_t erofs_content_run_size(const struct lcfs_node_s *node)
+{
+	return min((uint64_t)node->inode.st_size,
+		   (uint64_t)node->erofs_n_blocks * EROFS_BLKSIZ);
+}
+
+static bool erofs_content_run_eq(const void *value, const void *key)
+{
+	const struct lcfs_node_s *a = value;
+	const struct lcfs_node_s *b = key;
+	size_t len = erofs_content_run_size(a);
+
+	return a->erofs_n_blocks == b->erofs_n_blocks &&
+	       len == erofs_content_run_size(b) &&
+	       memcmp(a->content, b->content, len) == 0;
+}
+
+/* Returns an earlier node with the same data blocks as @node, or @node
+ * itself if it is the first, or NULL if out of memory. */
+static struct lcfs_node_s *erofs_dedup_content(struct lcfs_ht *dedup_ht,
+					       struct lcfs_node_s *node)
+{
+	size_t len = erofs_content_run_size(node);
+
+	return lcfs_ht_insert_if_absent(
+		dedup_ht,
+		lcfs_ht_hash_bytes(node->content, len, node->erofs_n_blocks),
+		node, erofs_content_run_eq, node);
+}
+
 static int compute_erofs_inodes(struct lcfs_ctx_s *ctx)
 {
 	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+	bool dedup = (ctx->options->flags & LCFS_FLAGS_DEDUP_BLOCKS) != 0;
+	bool pack = (ctx->options->flags & LCFS_FLAGS_PACK_INODES) != 0;
+	struct lcfs_ht dedup_ht = { 0 };
 	struct lcfs_node_s *node;
 	uint64_t pos, ppos;
 	uint64_t meta_start, extra_pad;
 
+	ctx_erofs->nodes = calloc(ctx->num_inodes + 1, sizeof(struct lcfs_node_s *));
+	if (ctx_erofs->nodes == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	ctx_erofs->n_nodes = 0;
+	for (node = ctx->root; node != NULL; node = node->next)
+		ctx_erofs->nodes[ctx_erofs->n_nodes++] = node;
+	assert(ctx_erofs->n_nodes == ctx->num_inodes);
+
+	lcfs_parallel_for(ctx->options->threads, ctx_erofs->n_nodes,
+			  EROFS_LAYOUT_MIN_CHUNK, compute_erofs_inode_sizes, ctx);
+
 	// Start inode data directly after superblock
 	pos = EROFS_SUPER_OFFSET + sizeof(struct erofs_super_block);
 
 	// But inode offsets (nids) are relative to start of block
 	meta_start = round_down(pos, EROFS_BLKSIZ);
 
-	for (node = ctx->root; node != NULL; node = node->next) {
-		size_t n_shared_xattrs, unshared_xattrs_size;
-		size_t inode_size, xattr_size;
+	if (dedup && lcfs_ht_init(&dedup_ht, 0) < 0)
+		return -1;
 
-		compute_erofs_inode_size(node);
-		node->erofs_compact = lcfs_fits_in_erofs_compact(ctx, node);
-		inode_size = node->erofs_compact ?
-				     sizeof(struct erofs_inode_compact) :
-				     sizeof(struct erofs_inode_extended);
+	if (pack)
+		ctx_erofs->padding_saved = erofs_unpacked_tail_padding(ctx_erofs,
+								       pos);
 
-		compute_erofs_xattr_counts(node, &n_shared_xattrs,
-					   &unshared_xattrs_size);
-		node->erofs_xattr_size = xattr_size =
-			xattr_erofs_inode_size(n_shared_xattrs, unshared_xattrs_size);
+	/* Only the placement is sequential, as each position depends on
+	 * all previous inodes. */
+	for (size_t i = 0; i < ctx_erofs->n_nodes; i++) {
+		size_t inode_size, xattr_size;
 
 		/* Align inode start to next slot */
 		ppos = pos;
 		pos = round_up(pos, EROFS_SLOTSIZE);
+
+		/* If this inode needs padding, move a later one that fits
+		 * into the gap in front of it. The root stays first. */
+		if (pack && i > 0) {
+			size_t isize;
+			uint64_t gap = erofs_inode_padding_at(ctx_erofs->nodes[i],
+							      pos, &isize);
+			size_t j = gap > 0 ? erofs_find_filler(ctx_erofs, i,
+							       pos, gap) :
+					     0;
+
+			if (j > 0) {
+				struct lcfs_node_s *filler = ctx_erofs->nodes[j];
+
+				memmove(&ctx_erofs->nodes[i + 1],
+					&ctx_erofs->nodes[i],
+					(j - i) * sizeof(struct lcfs_node_s *));
+				ctx_erofs->nodes[i] = filler;
+			}
+		}
+
+		node = ctx_erofs->nodes[i];
+		inode_size = erofs_inode_base_size(node);
+		xattr_size = node->erofs_xattr_size;
 		node->erofs_ipad = pos - ppos;
 
 		/* Ensure tail does not straddle block boundaries */
 		extra_pad = compute_erofs_inode_padding_for_tail(
 			node, pos, inode_size, xattr_size);
+		ctx_erofs->tail_padding += extra_pad;
 		node->erofs_ipad += extra_pad;
 		assert(node->erofs_ipad < EROFS_BLKSIZ);
 		pos += extra_pad;
 		assert(pos % EROFS_SLOTSIZE == 0);
 
 		node->erofs_isize = inode_size + xattr_size + node->erofs_tailsize;
-		ctx_erofs->n_data_blocks += node->erofs_n_blocks;
+		node->erofs_first_block = ctx_erofs->n_data_blocks;
+		node->erofs_dedup_of = NULL;
+
+		/* The number of blocks is final only after the tail
+		 * padding has been decided above. */
+		if (dedup && (node->inode.st_mode & S_IFMT) == S_IFREG &&
+		    node->content != NULL && node->erofs_n_blocks > 0) {
+			struct lcfs_node_s *first =
+				erofs_dedup_content(&dedup_ht, node);
+
+			if (first == NULL) {
+				lcfs_ht_destroy(&dedup_ht);
+				return -1;
+			}
+			if (first != node) {
+				node->erofs_dedup_of = first;
+				ctx_erofs->n_dedup_blocks += node->erofs_n_blocks;
+			}
+		}
+		if (node->erofs_dedup_of == NULL)
+			ctx_erofs->n_data_blocks += node->erofs_n_blocks;
 		node->erofs_nid = (pos - meta_start) / EROFS_SLOTSIZE;
 
 		/* Assert that tails never span multiple blocks */
@@ -687,6 +865,18 @@ static int compute_erofs_inodes(struct lcfs_ctx_s *ctx)
 
 	ctx_erofs->inodes_end = round_up(pos, EROFS_SLOTSIZE);
 
+	/* The rest of the writer walks the list, so it must follow any
+	 * inodes moved by the packing. */
+	if (pack) {
+		ctx_erofs->padding_saved -= min(ctx_erofs->padding_saved,
+						ctx_erofs->tail_padding);
+		for (size_t i = 0; i + 1 < ctx_erofs->n_nodes; i++)
+			ctx_erofs->nodes[i]->next = ctx_erofs->nodes[i + 1];
+		ctx_erofs->nodes[ctx_erofs->n_nodes - 1]->next = NULL;
+	}
+
+	lcfs_ht_destroy(&dedup_ht);
+
 	return 0;
 }
 
@@ -819,6 +1009,16 @@ static int write_nullptr_chunks(struct lcfs_ctx_s *ctx, uint32_t chunk_count)
 	return 0;
 }
 
+static uint32_t erofs_node_blkaddr(struct lcfs_ctx_erofs_s *ctx_erofs,
+				   struct lcfs_node_s *node)
+{
+	if (node->erofs_dedup_of != NULL)
+		node = node->erofs_dedup_of;
+
+	return (uint32_t)(ctx_erofs->data_block_start / EROFS_BLKSIZ +
+			  node->erofs_first_block);
+}
+
 static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node)
 {
 	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
@@ -904,20 +1104,14 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 		if (type == S_IFDIR) {
 			if (node->erofs_n_blocks > 0) {
 				i.i_u.raw_blkaddr = lcfs_u32_to_file(
-					(uint32_t)(ctx_erofs->current_end /
-						   EROFS_BLKSIZ));
-				ctx_erofs->current_end +=
-					EROFS_BLKSIZ * node->erofs_n_blocks;
+					erofs_node_blkaddr(ctx_erofs, node));
 			}
 		} else if (type == S_IFCHR || type == S_IFBLK) {
 			i.i_u.rdev = lcfs_u32_to_file(node->inode.st_rdev);
 		} else if (type == S_IFREG || type == S_IFLNK) {
 			if (node->erofs_n_blocks > 0) {
 				i.i_u.raw_blkaddr = lcfs_u32_to_file(
-					(uint32_t)(ctx_erofs->current_end /
-						   EROFS_BLKSIZ));
-				ctx_erofs->current_end +=
-					EROFS_BLKSIZ * node->erofs_n_blocks;
+					erofs_node_blkaddr(ctx_erofs, node));
 			}
 			if (datalayout == EROFS_INODE_CHUNK_BASED) {
 				i.i_u.c.format = lcfs_u16_to_file(chunk_format);
@@ -943,20 +1137,14 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 		if (type == S_IFDIR) {
 			if (node->erofs_n_blocks > 0) {
 				i.i_u.raw_blkaddr = lcfs_u32_to_file(
-					(uint32_t)(ctx_erofs->current_end /
-						   EROFS_BLKSIZ));
-				ctx_erofs->current_end +=
-					EROFS_BLKSIZ * node->erofs_n_blocks;
+					erofs_node_blkaddr(ctx_erofs, node));
 			}
 		} else if (type == S_IFCHR || type == S_IFBLK) {
 			i.i_u.rdev = lcfs_u32_to_file(node->inode.st_rdev);
 		} else if (type == S_IFREG || type == S_IFLNK) {
 			if (node->erofs_n_blocks > 0) {
 				i.i_u.raw_blkaddr = lcfs_u32_to_file(
-					(uint32_t)(ctx_erofs->current_end /
-						   EROFS_BLKSIZ));
-				ctx_erofs->current_end +=
-					EROFS_BLKSIZ * node->erofs_n_blocks;
+					erofs_node_blkaddr(ctx_erofs, node));
 			}
 			if (datalayout == EROFS_INODE_CHUNK_BASED) {
 				i.i_u.c.format = lcfs_u16_to_file(chunk_format);
@@ -1042,15 +1230,310 @@ static int write_erofs_inode_data(struct lcfs_ctx_s *ctx, struct lcfs_node_s *no
 	return 0;
 }
 
+typedef int (*erofs_render_fn)(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node);
+typedef uint64_t (*erofs_offset_fn)(struct lcfs_ctx_erofs_s *ctx_erofs, size_t index);
+
+/* Nodes per range rendered by a worker thread */
+#define EROFS_RENDER_CHUNK 4096
+/* Ranges per thread that may be rendered ahead of the writer */
+#define EROFS_RENDER_AHEAD 2
+
+struct erofs_render_chunk {
+	size_t start;
+	size_t end;
+	uint64_t offset; /* in the image */
+	uint8_t *data;
+	size_t size;
+	size_t used;
+	bool done;
+	int err;
+};
+
+struct erofs_render_job {
+	struct lcfs_ctx_erofs_s ctx; /* Snapshot, the writer changes the real one */
+	erofs_render_fn render;
+	struct erofs_render_chunk *chunks;
+	size_t n_chunks;
+	size_t max_ahead;
+	bool direct; /* Ranges go straight to the seekable output */
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	size_t next_chunk; /* Next one to render */
+	size_t n_written; /* Handed to lcfs_write() */
+	bool cancel;
+};
+
+static ssize_t erofs_render_write_cb(void *file, void *buf, size_t count)
+{
+	struct erofs_render_chunk *chunk = file;
+
+	/* The layout says exactly how much each range renders to */
+	if (count > chunk->size - chunk->used) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(chunk->data + chunk->used, buf, count);
+	chunk->used += count;
+	return count;
+}
+
+/* Renders a range of nodes using a copy of the context that has the
+ * real image offsets, but writes to the chunk buffer, or directly at
+ * the right offset for seekable output. */
+static int erofs_render_chunk(struct erofs_render_job *job,
+			      struct erofs_render_chunk *chunk)
+{
+	struct lcfs_ctx_erofs_s sub = job->ctx;
+	struct lcfs_fd_output output = {
+		.fd = job->ctx.base.fd_output.fd,
+		.offset = chunk->offset,
+	};
+
+	sub.base.fsverity_ctx = NULL;
+	sub.base.bytes_written = chunk->offset;
+
+	if (job->direct) {
+		sub.base.file = &output;
+	} else {
+		sub.base.file = chunk;
+		sub.base.write_cb = erofs_render_write_cb;
+
+		chunk->data = malloc(chunk->size + 1);
+		if (chunk->data == NULL)
+			return ENOMEM;
+	}
+
+	for (size_t i = chunk->start; i < chunk->end; i++) {
+		if (job->render(&sub.base, sub.nodes[i]) < 0)
+			return errno ? errno : EIO;
+	}
+
+	if ((uint64_t)sub.base.bytes_written != chunk->offset + chunk->size)
+		return EINVAL;
+	chunk->used = chunk->size;
+
+	return 0;
+}
+
+static void erofs_render_chunks(void *data, size_t start, size_t end)
+{
+	struct erofs_render_job *job = data;
+
+	for (size_t i = start; i < end; i++)
+		job->chunks[i].err = erofs_render_chunk(job, &job->chunks[i]);
+}
+
+/* With seekable output there is nothing to order, every range is
+ * written at its own offset as soon as it is rendered. */
+static int erofs_render_direct(struct lcfs_ctx_s *ctx, struct erofs_render_job *job)
+{
+	uint64_t size = 0;
+
+	lcfs_parallel_for(ctx->options->threads, job->n_chunks, 1,
+			  erofs_render_chunks, job);
+
+	for (size_t i = 0; i < job->n_chunks; i++) {
+		if (job->chunks[i].err != 0) {
+			errno = job->chunks[i].err;
+			return -1;
+		}
+		size += job->chunks[i].size;
+	}
+
+	ctx->bytes_written += size;
+	ctx->fd_output.offset += size;
+
+	return 0;
+}
+
+static void *erofs_render_thread(void *data)
+{
+	struct erofs_render_job *job = data;
+
+	pthread_mutex_lock(&job->mutex);
+	for (;;) {
+		struct erofs_render_chunk *chunk;
+
+		while (!job->cancel && job->next_chunk < job->n_chunks &&
+		       job->next_chunk >= job->n_written + job->max_ahead)
+			pthread_cond_wait(&job->cond, &job->mutex);
+
+		if (job->cancel || job->next_chunk >= job->n_chunks)
+			break;
+
+		chunk = &job->chunks[job->next_chunk++];
+		pthread_mutex_unlock(&job->mutex);
+
+		chunk->err = erofs_render_chunk(job, chunk);
+
+		pthread_mutex_lock(&job->mutex);
+		chunk->done = true;
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_mutex_unlock(&job->mutex);
+
+	return NULL;
+}
+
+/* Worker threads render ranges of nodes into buffers, while this thread
+ * feeds the finished buffers in order to lcfs_write(), which does the
+ * fs-verity digest and calls the write callback. Seekable output skips
+ * the buffers and the ordering. */
+static int erofs_render_parallel(struct lcfs_ctx_s *ctx, erofs_render_fn render,
+				 erofs_offset_fn offset)
+{
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+	struct erofs_render_job job = {
+		.ctx = *ctx_erofs,
+		.render = render,
+		.direct = ctx->write_cb == lcfs_fd_output_write,
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	cleanup_free pthread_t *threads = NULL;
+	size_t n_workers;
+	int ret = 0;
+	int err = 0;
+
+	job.n_chunks = DIV_ROUND_UP(ctx_erofs->n_nodes, EROFS_RENDER_CHUNK);
+	job.chunks = calloc(job.n_chunks, sizeof(struct erofs_render_chunk));
+	if (job.chunks == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (size_t i = 0; i < job.n_chunks; i++) {
+		struct erofs_render_chunk *chunk = &job.chunks[i];
+
+		chunk->start = i * EROFS_RENDER_CHUNK;
+		chunk->end = min(chunk->start + EROFS_RENDER_CHUNK, ctx_erofs->n_nodes);
+		chunk->offset = offset(ctx_erofs, chunk->start);
+		chunk->size = offset(ctx_erofs, chunk->end) - chunk->offset;
+	}
+
+	if (job.direct) {
+		ret = erofs_render_direct(ctx, &job);
+		PROTECT_ERRNO;
+		free(job.chunks);
+		return ret;
+	}
+
+	/* This thread is busy writing, so use the others for rendering */
+	n_workers = min((size_t)ctx->options->threads - 1, job.n_chunks);
+	if (n_workers == 0)
+		n_workers = 1;
+	job.max_ahead = n_workers * EROFS_RENDER_AHEAD;
+
+	threads = calloc(n_workers, sizeof(pthread_t));
+	if (threads == NULL) {
+		free(job.chunks);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (size_t i = 0; i < n_workers; i++) {
+		err = pthread_create(&threads[i], NULL, erofs_render_thread, &job);
+		if (err != 0) {
+			n_workers = i;
+			break;
+		}
+	}
+
+	if (n_workers == 0) {
+		free(job.chunks);
+		errno = err;
+		return -1;
+	}
+
+	for (size_t i = 0; i < job.n_chunks; i++) {
+		struct erofs_render_chunk *chunk = &job.chunks[i];
+
+		pthread_mutex_lock(&job.mutex);
+		while (!chunk->done)
+			pthread_cond_wait(&job.cond, &job.mutex);
+		pthread_mutex_unlock(&job.mutex);
+
+		if (chunk->err != 0) {
+			err = chunk->err;
+			ret = -1;
+			break;
+		}
+
+		ret = lcfs_write(ctx, chunk->data, chunk->used);
+		if (ret < 0) {
+			err = errno;
+			break;
+		}
+		free(steal_pointer(&chunk->data));
+
+		pthread_mutex_lock(&job.mutex);
+		job.n_written++;
+		pthread_cond_broadcast(&job.cond);
+		pthread_mutex_unlock(&job.mutex);
+	}
+
+	pthread_mutex_lock(&job.mutex);
+	job.cancel = true;
+	pthread_cond_broadcast(&job.cond);
+	pthread_mutex_unlock(&job.mutex);
+
+	for (size_t i = 0; i < n_workers; i++)
+		pthread_join(threads[i], NULL);
+
+	for (size_t i = 0; i < job.n_chunks; i++)
+		free(job.chunks[i].data);
+	free(job.chunks);
+	pthread_mutex_destroy(&job.mutex);
+	pthread_cond_destroy(&job.cond);
+
+	if (ret < 0)
+		errno = err;
+	return ret;
+}
+
+static bool erofs_render_in_parallel(struct lcfs_ctx_s *ctx)
+{
+	struct lcfs_ctx_erofs_s *ctx_erofs = (struct lcfs_ctx_erofs_s *)ctx;
+
+	return ctx->options->threads > 1 && ctx_erofs->n_nodes > EROFS_RENDER_CHUNK;
+}
+
+/* Start of the inode data (including padding) for nodes[index] */
+static uint64_t erofs_inode_offset(struct lcfs_ctx_erofs_s *ctx_erofs, size_t index)
+{
+	uint64_t meta_start =
+		round_down(EROFS_SUPER_OFFSET + sizeof(struct erofs_super_block),
+			   EROFS_BLKSIZ);
+	struct lcfs_node_s *node;
+
+	if (index == ctx_erofs->n_nodes) {
+		node = ctx_erofs->nodes[index - 1];
+		return meta_start + node->erofs_nid * EROFS_SLOTSIZE +
+		       node->erofs_isize;
+	}
+
+	node = ctx_erofs->nodes[index];
+	return meta_start + node->erofs_nid * EROFS_SLOTSIZE - node->erofs_ipad;
+}
+
 static int write_erofs_inodes(struct lcfs_ctx_s *ctx)
 {
 	struct lcfs_node_s *node;
 	int ret;
 
-	for (node = ctx->root; node != NULL; node = node->next) {
-		ret = write_erofs_inode_data(ctx, node);
+	if (erofs_render_in_parallel(ctx)) {
+		ret = erofs_render_parallel(ctx, write_erofs_inode_data,
+					    erofs_inode_offset);
 		if (ret < 0)
 			return ret;
+	} else {
+		for (node = ctx->root; node != NULL; node = node->next) {
+			ret = write_erofs_inode_data(ctx, node);
+			if (ret < 0)
+				return ret;
+		}
 	}
 
 	ret = lcfs_write_align(ctx, EROFS_SLOTSIZE);
@@ -1068,6 +1551,7 @@ static int write_erofs_file_content(struct lcfs_ctx_s *ctx, struct lcfs_node_s *
 
 	uint8_t *target;
 	bool has_blocks = node->erofs_n_blocks > 0;
+	int ret;
 	if (type == S_IFREG && has_blocks) {
 		// If this is a non-inline file, then we need to write at most
 		// a single block-sized chunk.
@@ -1087,17 +1571,37 @@ static int write_erofs_file_content(struct lcfs_ctx_s *ctx, struct lcfs_node_s *
 		return 0;
 	}
 
-	for (size_t i = 0; i < node->erofs_n_blocks; i++) {
-		off_t offset = i * EROFS_BLKSIZ;
-		off_t len = min(size - offset, EROFS_BLKSIZ);
-		int ret;
+	/* The blocks of an identical earlier file are used instead */
+	if (node->erofs_dedup_of != NULL)
+		return 0;
 
-		ret = lcfs_write(ctx, target + offset, len);
-		if (ret < 0)
-			return ret;
-		return lcfs_write_align(ctx, EROFS_BLKSIZ);
-	}
-	return 0;
+	ret = lcfs_write(ctx, target,
+			 min(size, (off_t)node->erofs_n_blocks * EROFS_BLKSIZ));
+	if (ret < 0)
+		return ret;
+	return lcfs_write_align(ctx, EROFS_BLKSIZ);
+}
+
+static int write_erofs_node_data_blocks(struct lcfs_ctx_s *ctx,
+					struct lcfs_node_s *node)
+{
+	int ret;
+
+	ret = write_erofs_dentries(ctx, node, true, false);
+	if (ret < 0)
+		return ret;
+
+	return write_erofs_file_content(ctx, node);
+}
+
+/* Start of the data blocks for nodes[index] */
+static uint64_t erofs_data_offset(struct lcfs_ctx_erofs_s *ctx_erofs, size_t index)
+{
+	uint64_t block = index == ctx_erofs->n_nodes ?
+				 ctx_erofs->n_data_blocks :
+				 ctx_erofs->nodes[index]->erofs_first_block;
+
+	return ctx_erofs->data_block_start + block * EROFS_BLKSIZ;
 }
 
 static int write_erofs_data_blocks(struct lcfs_ctx_s *ctx)
@@ -1105,11 +1609,12 @@ static int write_erofs_data_blocks(struct lcfs_ctx_s *ctx)
 	struct lcfs_node_s *node;
 	int ret;
 
+	if (erofs_render_in_parallel(ctx))
+		return erofs_render_parallel(ctx, write_erofs_node_data_blocks,
+					     erofs_data_offset);
+
 	for (node = ctx->root; node != NULL; node = node->next) {
-		ret = write_erofs_dentries(ctx, node, true, false);
-		if (ret < 0)
-			return ret;
-		ret = write_erofs_file_content(ctx, node);
+		ret = write_erofs_node_data_blocks(ctx, node);
 		if (ret < 0)
 			return ret;
 	}
@@ -1398,6 +1903,9 @@ int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
 	};
 	int ret = 0;
 	uint64_t data_block_start;
+	uint64_t layout_start, write_start;
+
+	layout_start = lcfs_now_ns();
 
 	/* Clone root so we can make required modifications to it */
 	ret = lcfs_clone_root(ctx);
@@ -1423,6 +1931,20 @@ int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
 	if (ret < 0)
 		return ret;
 
+	data_block_start =
+		round_up(ctx_erofs->inodes_end + ctx_erofs->shared_xattr_size,
+			 EROFS_BLKSIZ);
+
+	/* Start from a zero-filled file of the final size, so padding can be
+	 * skipped and regions written in any order. */
+	if (ctx->write_cb == lcfs_fd_output_write &&
+	    (ftruncate(ctx->fd_output.fd, 0) < 0 ||
+	     ftruncate(ctx->fd_output.fd,
+		       data_block_start + ctx_erofs->n_data_blocks * EROFS_BLKSIZ) < 0))
+		return -1;
+
+	write_start = lcfs_now_ns();
+
 	header_flags = 0;
 	if (ctx->has_acl)
 		header_flags |= LCFS_EROFS_FLAGS_HAS_ACL;
@@ -1454,10 +1976,6 @@ int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
 	superblock.xattr_blkaddr =
 		lcfs_u32_to_file((uint32_t)(ctx_erofs->inodes_end / EROFS_BLKSIZ));
 
-	data_block_start =
-		round_up(ctx_erofs->inodes_end + ctx_erofs->shared_xattr_size,
-			 EROFS_BLKSIZ);
-
 	superblock.blocks =
 		lcfs_u32_to_file((uint32_t)(data_block_start / EROFS_BLKSIZ +
 					    ctx_erofs->n_data_blocks));
@@ -1471,7 +1989,7 @@ int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
 	if (ret < 0)
 		return ret;
 
-	ctx_erofs->current_end = data_block_start;
+	ctx_erofs->data_block_start = data_block_start;
 
 	ret = write_erofs_inodes(ctx);
 	if (ret < 0)
@@ -1497,18 +2015,25 @@ int lcfs_write_erofs_to(struct lcfs_ctx_s *ctx)
 	if (ret < 0)
 		return ret;
 
-	assert(ctx_erofs->current_end == (uint64_t)ctx->bytes_written);
 	assert(data_block_start + ctx_erofs->n_data_blocks * EROFS_BLKSIZ ==
 	       (uint64_t)ctx->bytes_written);
 
+	if (ctx->options->stats_out) {
+		struct lcfs_write_stats_s *stats = ctx->options->stats_out;
+
+		stats->n_inodes = ctx->num_inodes;
+		stats->image_size = (uint64_t)ctx->bytes_written;
+		stats->layout_time_ns = write_start - layout_start;
+		stats->write_time_ns = lcfs_now_ns() - write_start;
+		stats->n_data_blocks = ctx_erofs->n_data_blocks;
+		stats->n_dedup_blocks = ctx_erofs->n_dedup_blocks;
+		stats->tail_padding = ctx_erofs->tail_padding;
+		stats->padding_saved = ctx_erofs->padding_saved;
+	}
+
 	return 0;
 }
 
-struct hasher_node_s {
-	uint64_t nid;
-	struct lcfs_node_s *node;
-};
-
 struct lcfs_image_data {
 	const uint8_t *erofs_data;
 	size_t erofs_data_size;
@@ -1518,15 +2043,50 @@ struct lcfs_image_data {
 	const uint8_t *erofs_xattrdata_end;
 	uint64_t erofs_build_time;
 	uint32_t erofs_build_time_nsec;
-	Hash_table *node_hash;
+	struct lcfs_ht node_ht; /* nid -> node */
+	struct lcfs_image_loader *loader; /* Set when loading in parallel */
+	const char *const *include_paths;
+	const char *const *exclude_paths;
+	uint32_t max_depth;
 };
 
-static const erofs_inode *lcfs_image_get_erofs_inode(struct lcfs_image_data *data,
-						     uint64_t nid)
-{
-	const uint8_t *inode_data = data->erofs_metadata + (nid << EROFS_ISLOTBITS);
+/* The path of a directory being read, when filtering on paths */
+struct erofs_dir_path {
+	char *buf; /* The directory path and a '/', with room for a name */
+	size_t len;
+	uint32_t depth; /* Of the entries */
+};
 
-	if (inode_data >= data->erofs_metadata_end) {
+/* Shards of the nid -> node map used when loading in parallel, so the
+ * threads rarely wait for each other. */
+#define LCFS_LOADER_SHARD_BITS 6
+
+struct lcfs_image_loader_shard {
+	pthread_mutex_t lock;
+	struct lcfs_ht ht; /* nid -> node, holds a ref on each node */
+};
+
+/* When loading in parallel, each directory is decoded first and its
+ * entries are read later by whichever thread takes it from the queue.
+ * Each directory is only ever modified by the thread reading it. */
+struct lcfs_image_loader {
+	struct lcfs_image_loader_shard shards[1 << LCFS_LOADER_SHARD_BITS];
+
+	pthread_mutex_t lock; /* Protects the rest */
+	pthread_cond_t cond;
+	struct lcfs_node_s **dirs; /* Directories whose entries are not read */
+	size_t n_dirs;
+	size_t dirs_capacity;
+	size_t n_busy; /* Threads reading a directory */
+	int error; /* The errno of the first failure */
+};
+
+static const erofs_inode *lcfs_image_get_erofs_inode(struct lcfs_image_data *data,
+						     uint64_t nid)
+{
+	const uint8_t *inode_data = data->erofs_metadata + (nid << EROFS_ISLOTBITS);
+
+	if (inode_data >= data->erofs_metadata_end) {
 		errno = EINVAL;
 		return NULL;
 	}
@@ -1535,543 +2095,2410 @@ static const erofs_inode *lcfs_image_get_erofs_inode(struct lcfs_image_data *dat
 }
 
 static struct lcfs_node_s *lcfs_build_node_from_image(struct lcfs_image_data *data,
-						      uint64_t nid,
-						      Hash_table *filter);
+						      uint64_t nid);
+static int erofs_read_dir(struct lcfs_image_data *data, struct lcfs_node_s *node,
+			  const struct lcfs_ht *filter);
 
-static int erofs_readdir_block(struct lcfs_image_data *data,
-			       struct lcfs_node_s *parent, const uint8_t *block,
-			       size_t block_size, Hash_table *filter)
+static bool node_ht_eq(const void *value, const void *key)
 {
-	const struct erofs_dirent *dirents = (struct erofs_dirent *)block;
-	size_t dirents_size = lcfs_u16_from_file(dirents[0].nameoff);
-	size_t n_dirents, i;
+	const struct lcfs_node_s *node = value;
 
-	if (dirents_size % sizeof(struct erofs_dirent) != 0) {
-		/* This should not happen for valid filesystems */
-		errno = EINVAL;
-		return -1;
-	}
+	return node->erofs_nid == *(const uint64_t *)key;
+}
 
-	n_dirents = dirents_size / sizeof(struct erofs_dirent);
+static bool str_ht_eq(const void *value, const void *key)
+{
+	return strcmp(value, key) == 0;
+}
 
-	for (i = 0; i < n_dirents; i++) {
-		char name_buf[PATH_MAX];
-		uint64_t nid = lcfs_u64_from_file(dirents[i].nid);
-		uint16_t nameoff = lcfs_u16_from_file(dirents[i].nameoff);
-		const char *child_name;
-		uint16_t child_name_len;
-		cleanup_node struct lcfs_node_s *child = NULL;
+static bool lcfs_image_filters_paths(struct lcfs_image_data *data)
+{
+	return data->include_paths != NULL || data->exclude_paths != NULL ||
+	       data->max_depth != 0;
+}
 
-		/* Compute length of the name, which is a bit weird for the last dirent */
-		child_name = (char *)(block + nameoff);
-		if (i + 1 < n_dirents)
-			child_name_len =
-				lcfs_u16_from_file(dirents[i + 1].nameoff) - nameoff;
-		else
-			child_name_len = strnlen(child_name, block_size - nameoff);
+/* Whether @path is @prefix or below it, ignoring slashes at the ends of
+ * @prefix, which the empty path is a prefix of everything. */
+static bool path_is_within(const char *path, size_t path_len,
+			   const char *prefix, size_t prefix_len)
+{
+	while (prefix_len > 0 && prefix[0] == '/') {
+		prefix++;
+		prefix_len--;
+	}
+	while (prefix_len > 0 && prefix[prefix_len - 1] == '/')
+		prefix_len--;
 
-		if ((child_name_len == 1 && child_name[0] == '.') ||
-		    (child_name_len == 2 && child_name[0] == '.' &&
-		     child_name[1] == '.'))
-			continue;
+	if (prefix_len == 0)
+		return true;
+	return path_len >= prefix_len && memcmp(path, prefix, prefix_len) == 0 &&
+	       (path_len == prefix_len || path[prefix_len] == '/');
+}
 
-		/* Copy to null terminate */
-		child_name_len = min(child_name_len, PATH_MAX - 1);
-		memcpy(name_buf, child_name, child_name_len);
-		name_buf[child_name_len] = 0;
+/* @path is relative to the root, without a leading '/' */
+static bool lcfs_image_path_wanted(struct lcfs_image_data *data,
+				   const char *path, size_t path_len,
+				   uint32_t depth)
+{
+	if (data->max_depth != 0 && depth > data->max_depth)
+		return false;
 
-		if (filter != NULL && hash_lookup(filter, name_buf) == NULL) {
-			continue;
-		}
+	for (const char *const *it = data->exclude_paths; it && *it; it++) {
+		if (path_is_within(path, path_len, *it, strlen(*it)))
+			return false;
+	}
 
-		child = lcfs_build_node_from_image(data, nid, NULL);
-		if (child == NULL) {
-			if (errno == ENOTSUP)
-				continue; /* Skip real whiteouts (00-ff) */
-			else
-				return -1;
-		}
+	if (data->include_paths == NULL)
+		return true;
 
-		if (lcfs_node_add_child(parent, child, /* Takes ownership on success */
-					name_buf) < 0)
-			return -1;
-		steal_pointer(&child);
-	}
+	for (const char *const *it = data->include_paths; it && *it; it++) {
+		const char *include = *it;
+		size_t include_len = strlen(include);
 
-	return 0;
+		/* Below an included path, or leading to one */
+		if (path_is_within(path, path_len, include, include_len))
+			return true;
+		while (include_len > 0 && include[0] == '/') {
+			include++;
+			include_len--;
+		}
+		if (path_is_within(include, include_len, path, path_len))
+			return true;
+	}
+	return false;
 }
 
-static int lcfs_build_node_erofs_xattr(struct lcfs_node_s *node, uint8_t name_index,
-				       const char *entry_name, uint8_t name_len,
-				       const char *value, uint16_t value_size)
+/* Sets up @dir_path for reading the entries of @node */
+static int lcfs_image_dir_path(struct lcfs_node_s *node,
+			       struct erofs_dir_path *dir_path)
 {
-	static_assert((sizeof(struct erofs_xattr_ibody_header) == LCFS_XATTR_HEADER_SIZE),
-		      "Verifying sizeof xattr header entry");
-	static_assert((sizeof(struct erofs_xattr_entry) == LCFS_INODE_XATTRMETA_SIZE),
-		      "Verifying sizeof xattr entry");
-
-	cleanup_free char *name =
-		erofs_get_xattr_name(name_index, entry_name, name_len);
-	if (name == NULL)
-		return -1;
+	size_t len = 0;
+	uint32_t depth = 1;
+	char *p;
 
-	if (strcmp(name, OVERLAY_XATTR_REDIRECT) == 0) {
-		if ((node->inode.st_mode & S_IFMT) == S_IFREG) {
-			if (value_size > 1 && value[0] == '/') {
-				value_size++;
-				value++;
-			}
-			node->payload = strndup(value, value_size);
-			if (node->payload == NULL) {
-				errno = ENOMEM;
-				return -1;
-			}
-		}
-		return 0;
+	for (struct lcfs_node_s *n = node; n->parent != NULL; n = n->parent) {
+		len += strlen(n->name) + 1;
+		depth++;
 	}
 
-	if (strcmp(name, OVERLAY_XATTR_METACOPY) == 0) {
-		if ((node->inode.st_mode & S_IFMT) == S_IFREG &&
-		    value_size == 4 + LCFS_DIGEST_SIZE)
-			lcfs_node_set_fsverity_digest(node, (uint8_t *)value + 4);
-		return 0;
+	dir_path->buf = malloc(len + PATH_MAX + 1);
+	if (dir_path->buf == NULL) {
+		errno = ENOMEM;
+		return -1;
 	}
+	dir_path->len = len;
+	dir_path->depth = depth;
 
-	if (strcmp(name, OVERLAY_XATTR_ESCAPED_WHITEOUT) == 0 &&
-	    (node->inode.st_mode & S_IFMT) == S_IFREG) {
-		/* Rewrite to regular whiteout */
-		node->inode.st_mode = (node->inode.st_mode & ~S_IFMT) | S_IFCHR;
-		node->inode.st_rdev = makedev(0, 0);
-		node->inode.st_size = 0;
-		return 0;
-	}
-	if (strcmp(name, OVERLAY_XATTR_ESCAPED_WHITEOUTS) == 0 ||
-	    strcmp(name, OVERLAY_XATTR_USERXATTR_WHITEOUT) == 0 ||
-	    strcmp(name, OVERLAY_XATTR_USERXATTR_WHITEOUTS) == 0) {
-		/* skip */
-		return 0;
+	/* Filled in from the end, as "a/b/" */
+	p = dir_path->buf + len;
+	for (struct lcfs_node_s *n = node; n->parent != NULL; n = n->parent) {
+		size_t name_len = strlen(n->name);
+
+		*--p = '/';
+		p -= name_len;
+		memcpy(p, n->name, name_len);
 	}
 
-	if (str_has_prefix(name, OVERLAY_XATTR_PREFIX)) {
-		if (str_has_prefix(name, OVERLAY_XATTR_ESCAPE_PREFIX)) {
-			/* Unescape */
-			memmove(name + strlen(OVERLAY_XATTR_TRUSTED_PREFIX),
-				name + strlen(OVERLAY_XATTR_PREFIX),
-				strlen(name) - strlen(OVERLAY_XATTR_PREFIX) + 1);
-		} else {
-			/* skip */
-			return 0;
-		}
+	return 0;
+}
+
+static struct lcfs_image_loader_shard *
+lcfs_image_loader_shard(struct lcfs_image_loader *loader, uint64_t nid_hash)
+{
+	return &loader->shards[nid_hash >> (64 - LCFS_LOADER_SHARD_BITS)];
+}
+
+/* Returns a new ref to the node already loaded for @nid, if any */
+static struct lcfs_node_s *lcfs_image_ref_node(struct lcfs_image_data *data,
+					       uint64_t nid, uint64_t nid_hash)
+{
+	struct lcfs_image_loader_shard *shard;
+	struct lcfs_node_s *node;
+
+	if (data->loader == NULL) {
+		node = lcfs_ht_lookup(&data->node_ht, nid_hash, &nid, node_ht_eq);
+		return node ? lcfs_node_ref(node) : NULL;
 	}
 
-	if (lcfs_node_set_xattr_internal(node, name, value, value_size, false) < 0)
-		return -1;
+	shard = lcfs_image_loader_shard(data->loader, nid_hash);
+	pthread_mutex_lock(&shard->lock);
+	node = lcfs_ht_lookup(&shard->ht, nid_hash, &nid, node_ht_eq);
+	if (node)
+		lcfs_node_ref(node);
+	pthread_mutex_unlock(&shard->lock);
 
-	return 0;
+	return node;
 }
 
-static struct lcfs_node_s *lcfs_build_node_from_image(struct lcfs_image_data *data,
-						      uint64_t nid, Hash_table *filter)
+/* Makes a fully decoded @node visible to the other loader threads, taking
+ * ownership of it. If another thread got to the same nid first, the
+ * result is a hardlink to that node instead. */
+static struct lcfs_node_s *lcfs_image_publish_node(struct lcfs_image_data *data,
+						   struct lcfs_node_s *node,
+						   uint64_t nid_hash)
 {
-	const erofs_inode *cino;
-	cleanup_node struct lcfs_node_s *node = NULL;
-	uint64_t file_size;
-	uint16_t xattr_icount;
-	uint32_t raw_blkaddr;
-	int type;
-	size_t isize;
-	bool tailpacked;
-	size_t xattr_size;
-	struct hasher_node_s ht_entry = { nid };
-	cleanup_free struct hasher_node_s *new_ht_entry = NULL;
-	struct hasher_node_s *existing;
-	uint64_t n_blocks;
-	uint64_t last_oob_block;
-	size_t tail_size;
-	const uint8_t *tail_data;
-	const uint8_t *oob_data;
-	int ret;
+	struct lcfs_image_loader_shard *shard =
+		lcfs_image_loader_shard(data->loader, nid_hash);
+	cleanup_node struct lcfs_node_s *owned = node;
+	cleanup_node struct lcfs_node_s *link = lcfs_node_new();
+	struct lcfs_node_s *existing;
 
-	cino = lcfs_image_get_erofs_inode(data, nid);
-	if (cino == NULL)
+	if (link == NULL)
 		return NULL;
 
-	node = lcfs_node_new();
-	if (node == NULL) {
+	pthread_mutex_lock(&shard->lock);
+	existing = lcfs_ht_insert_if_absent(&shard->ht, nid_hash,
+					    &node->erofs_nid, node_ht_eq, node);
+	if (existing)
+		lcfs_node_ref(existing);
+	pthread_mutex_unlock(&shard->lock);
+
+	if (existing == NULL)
 		return NULL;
-	}
+	if (existing == node)
+		return steal_pointer(&owned);
 
-	existing = hash_lookup(data->node_hash, &ht_entry);
-	if (existing) {
-		node->link_to = lcfs_node_ref(existing->node);
-		return steal_pointer(&node);
-	}
+	link->link_to = existing;
+	return steal_pointer(&link);
+}
 
-	new_ht_entry = malloc(sizeof(struct hasher_node_s));
-	if (new_ht_entry == NULL) {
-		errno = ENOMEM;
-		return NULL;
-	}
-	new_ht_entry->nid = nid;
-	new_ht_entry->node = node;
-	if (hash_insert(data->node_hash, new_ht_entry) == NULL) {
+/* Drops a node that other loader threads may hold refs to, or link to */
+static void lcfs_image_unref_node(struct lcfs_image_data *data,
+				  struct lcfs_node_s *node)
+{
+	struct lcfs_node_s *shared = node->link_to ? node->link_to : node;
+	struct lcfs_image_loader_shard *shard;
+
+	if (data->loader == NULL) {
 		lcfs_node_unref(node);
-		errno = ENOMEM;
-		return NULL;
+		return;
+	}
+
+	shard = lcfs_image_loader_shard(data->loader,
+					lcfs_ht_hash_u64(shared->erofs_nid));
+	pthread_mutex_lock(&shard->lock);
+	lcfs_node_unref(node);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* Queues a directory for its entries to be read by a loader thread */
+static int lcfs_image_push_dir(struct lcfs_image_data *data,
+			       struct lcfs_node_s *dir)
+{
+	struct lcfs_image_loader *loader = data->loader;
+	int ret = 0;
+
+	pthread_mutex_lock(&loader->lock);
+	if (loader->n_dirs == loader->dirs_capacity) {
+		size_t new_capacity = max(loader->dirs_capacity * 2, 64);
+		struct lcfs_node_s **new_dirs = reallocarray(
+			loader->dirs, new_capacity, sizeof(struct lcfs_node_s *));
+
+		if (new_dirs == NULL) {
+			errno = ENOMEM;
+			ret = -1;
+			goto out;
+		}
+		loader->dirs = new_dirs;
+		loader->dirs_capacity = new_capacity;
 	}
-	new_ht_entry = NULL;
+	loader->dirs[loader->n_dirs++] = dir;
+	pthread_cond_signal(&loader->cond);
+out:
+	pthread_mutex_unlock(&loader->lock);
+	return ret;
+}
+
+/* Where the data and xattrs of an inode are, see erofs_decode_inode() */
+struct erofs_inode_info {
+	uint64_t file_size;
+	uint16_t xattr_icount;
+	uint32_t raw_blkaddr;
+	size_t isize;
+};
+
+static void erofs_decode_inode(struct lcfs_image_data *data,
+			       const erofs_inode *cino, struct lcfs_inode_s *inode,
+			       struct erofs_inode_info *info)
+{
+	int type;
 
 	if (erofs_inode_is_compact(cino)) {
 		const struct erofs_inode_compact *c = &cino->compact;
 
-		node->inode.st_mode = lcfs_u16_from_file(c->i_mode);
-		node->inode.st_nlink = lcfs_u16_from_file(c->i_nlink);
-		node->inode.st_size = lcfs_u32_from_file(c->i_size);
-		node->inode.st_uid = lcfs_u16_from_file(c->i_uid);
-		node->inode.st_gid = lcfs_u16_from_file(c->i_gid);
+		inode->st_mode = lcfs_u16_from_file(c->i_mode);
+		inode->st_nlink = lcfs_u16_from_file(c->i_nlink);
+		inode->st_size = lcfs_u32_from_file(c->i_size);
+		inode->st_uid = lcfs_u16_from_file(c->i_uid);
+		inode->st_gid = lcfs_u16_from_file(c->i_gid);
 
-		node->inode.st_mtim_sec = data->erofs_build_time;
-		node->inode.st_mtim_nsec = data->erofs_build_time_nsec;
+		inode->st_mtim_sec = data->erofs_build_time;
+		inode->st_mtim_nsec = data->erofs_build_time_nsec;
 
-		type = node->inode.st_mode & S_IFMT;
+		type = inode->st_mode & S_IFMT;
 
 		if (type == S_IFCHR || type == S_IFBLK)
-			node->inode.st_rdev = lcfs_u32_from_file(c->i_u.rdev);
-
-		file_size = lcfs_u32_from_file(c->i_size);
-		xattr_icount = lcfs_u16_from_file(c->i_xattr_icount);
-		raw_blkaddr = lcfs_u32_from_file(c->i_u.raw_blkaddr);
-		isize = sizeof(struct erofs_inode_compact);
+			inode->st_rdev = lcfs_u32_from_file(c->i_u.rdev);
 
+		info->xattr_icount = lcfs_u16_from_file(c->i_xattr_icount);
+		info->raw_blkaddr = lcfs_u32_from_file(c->i_u.raw_blkaddr);
+		info->isize = sizeof(struct erofs_inode_compact);
 	} else {
 		const struct erofs_inode_extended *e = &cino->extended;
 
-		node->inode.st_mode = lcfs_u16_from_file(e->i_mode);
-		node->inode.st_size = lcfs_u64_from_file(e->i_size);
-		node->inode.st_uid = lcfs_u32_from_file(e->i_uid);
-		node->inode.st_gid = lcfs_u32_from_file(e->i_gid);
-		node->inode.st_mtim_sec = lcfs_u64_from_file(e->i_mtime);
-		node->inode.st_mtim_nsec = lcfs_u32_from_file(e->i_mtime_nsec);
-		node->inode.st_nlink = lcfs_u32_from_file(e->i_nlink);
+		inode->st_mode = lcfs_u16_from_file(e->i_mode);
+		inode->st_size = lcfs_u64_from_file(e->i_size);
+		inode->st_uid = lcfs_u32_from_file(e->i_uid);
+		inode->st_gid = lcfs_u32_from_file(e->i_gid);
+		inode->st_mtim_sec = lcfs_u64_from_file(e->i_mtime);
+		inode->st_mtim_nsec = lcfs_u32_from_file(e->i_mtime_nsec);
+		inode->st_nlink = lcfs_u32_from_file(e->i_nlink);
 
-		type = node->inode.st_mode & S_IFMT;
+		type = inode->st_mode & S_IFMT;
 
 		if (type == S_IFCHR || type == S_IFBLK)
-			node->inode.st_rdev = lcfs_u32_from_file(e->i_u.rdev);
+			inode->st_rdev = lcfs_u32_from_file(e->i_u.rdev);
 
-		file_size = lcfs_u64_from_file(e->i_size);
-		xattr_icount = lcfs_u16_from_file(e->i_xattr_icount);
-		raw_blkaddr = lcfs_u32_from_file(e->i_u.raw_blkaddr);
-		isize = sizeof(struct erofs_inode_extended);
+		info->xattr_icount = lcfs_u16_from_file(e->i_xattr_icount);
+		info->raw_blkaddr = lcfs_u32_from_file(e->i_u.raw_blkaddr);
+		info->isize = sizeof(struct erofs_inode_extended);
 	}
 
-	if (type == S_IFCHR && node->inode.st_rdev == 0) {
-		/* A whiteout (chardev rdev=0) with nlink>1 is semantically
-		 * invalid: a whiteout represents the absence of a file, so it
-		 * cannot be hard-linked.  Reject the image explicitly rather
-		 * than silently skipping what would be a dangling alias. */
-		if (node->inode.st_nlink > 1) {
-			free(hash_remove(data->node_hash, &ht_entry));
-			errno = EINVAL;
-			return NULL;
-		}
-		free(hash_remove(data->node_hash, &ht_entry));
-		errno = ENOTSUP; /* Signal to caller: skip this whiteout entry */
-		return NULL;
-	}
+	info->file_size = inode->st_size;
+}
 
-	xattr_size = erofs_xattr_inode_size(xattr_icount);
+static const uint8_t *erofs_inode_tail_data(const erofs_inode *cino,
+					    const struct erofs_inode_info *info)
+{
+	return ((const uint8_t *)cino) + info->isize +
+	       erofs_xattr_inode_size(info->xattr_icount);
+}
 
-	tailpacked = erofs_inode_is_tailpacked(cino);
-	tail_size = tailpacked ? file_size % EROFS_BLKSIZ : 0;
-	tail_data = ((uint8_t *)cino) + isize + xattr_size;
-	oob_data = data->erofs_data + raw_blkaddr * EROFS_BLKSIZ;
+static size_t erofs_inode_tail_size(const erofs_inode *cino,
+				    const struct erofs_inode_info *info)
+{
+	return erofs_inode_is_tailpacked(cino) ? info->file_size % EROFS_BLKSIZ : 0;
+}
 
-	n_blocks = round_up(file_size, EROFS_BLKSIZ) / EROFS_BLKSIZ;
-	last_oob_block = tailpacked ? n_blocks - 1 : n_blocks;
+/* The first @size bytes of the data blocks of an inode */
+static const uint8_t *erofs_inode_oob_data(struct lcfs_image_data *data,
+					   const struct erofs_inode_info *info,
+					   uint64_t size)
+{
+	uint64_t offset = (uint64_t)info->raw_blkaddr * EROFS_BLKSIZ;
 
-	if (type == S_IFDIR) {
-		/* First read the out-of-band blocks */
-		for (uint64_t block = 0; block < last_oob_block; block++) {
-			const uint8_t *block_data = oob_data + block * EROFS_BLKSIZ;
-			size_t block_size = EROFS_BLKSIZ;
-
-			if (!tailpacked && block + 1 == last_oob_block) {
-				block_size = file_size % EROFS_BLKSIZ;
-				if (block_size == 0) {
-					block_size = EROFS_BLKSIZ;
-				}
-			}
+	if (size != 0 && (offset > data->erofs_data_size ||
+			  size > data->erofs_data_size - offset)) {
+		errno = EINVAL;
+		return NULL;
+	}
 
-			if (erofs_readdir_block(data, node, block_data,
-						block_size, filter) < 0)
-				return NULL;
-		}
+	return data->erofs_data + offset;
+}
 
-		/* Then inline */
-		if (tailpacked) {
-			if (erofs_readdir_block(data, node, tail_data,
-						tail_size, filter) < 0)
-				return NULL;
-		}
+/* Copies the data of the flat inode @cino to @dest, which has room for
+ * all of it */
+static int erofs_read_inode_data(struct lcfs_image_data *data,
+				 const erofs_inode *cino,
+				 const struct erofs_inode_info *info, uint8_t *dest)
+{
+	size_t tail_size = erofs_inode_tail_size(cino, info);
+	uint64_t oob_size = info->file_size - tail_size;
+	const uint8_t *oob_data;
 
-	} else if (type == S_IFLNK) {
-		char name_buf[PATH_MAX];
+	oob_data = erofs_inode_oob_data(data, info, oob_size);
+	if (oob_data == NULL)
+		return -1;
 
-		// Filter only applies to toplevel
-		assert(filter == NULL);
+	memcpy(dest, oob_data, oob_size);
+	memcpy(dest + oob_size, erofs_inode_tail_data(cino, info), tail_size);
 
-		if (file_size >= PATH_MAX) {
-			errno = EINVAL;
-			return NULL;
-		}
+	return 0;
+}
 
-		if (tailpacked) {
-			memcpy(name_buf, tail_data, file_size);
-		} else {
-			memcpy(name_buf, data->erofs_data + raw_blkaddr * EROFS_BLKSIZ,
-			       file_size);
-		}
-		name_buf[file_size] = 0;
-		if (lcfs_node_set_symlink_payload(node, name_buf) < 0)
-			return NULL;
-	} else if (type == S_IFREG && file_size != 0 && erofs_inode_is_flat(cino)) {
-		cleanup_free uint8_t *content = NULL;
-		size_t oob_size;
+typedef int (*erofs_xattr_cb)(uint8_t name_index, const char *name,
+			      uint8_t name_len, const char *value,
+			      uint16_t value_size, void *userdata);
 
-		// Filter only applies to toplevel
-		assert(filter == NULL);
+static int erofs_call_xattr_cb(const struct erofs_xattr_entry *entry,
+			       erofs_xattr_cb cb, void *userdata)
+{
+	const char *entry_name = (const char *)entry + sizeof(struct erofs_xattr_entry);
 
-		// Strictly limit to our max size, and for good measure
-		// the size of the file (which should always be larger than 4k
-		// in reality).
-		if (file_size > min(LCFS_INLINE_CONTENT_MAX, data->erofs_data_size)) {
-			errno = EINVAL;
-			return NULL;
-		}
+	return cb(entry->e_name_index, entry_name, entry->e_name_len,
+		  entry_name + entry->e_name_len,
+		  lcfs_u16_from_file(entry->e_value_size), userdata);
+}
 
-		content = malloc(file_size);
-		if (content == NULL) {
-			errno = ENOMEM;
-			return NULL;
-		}
+/* Calls @cb for the inline xattrs of @cino, then the shared ones. A
+ * non-zero return from @cb stops the iteration and is returned. */
+static int erofs_foreach_xattr(struct lcfs_image_data *data,
+			       const erofs_inode *cino,
+			       const struct erofs_inode_info *info,
+			       erofs_xattr_cb cb, void *userdata)
+{
+	static_assert((sizeof(struct erofs_xattr_ibody_header) == LCFS_XATTR_HEADER_SIZE),
+		      "Verifying sizeof xattr header entry");
+	static_assert((sizeof(struct erofs_xattr_entry) == LCFS_INODE_XATTRMETA_SIZE),
+		      "Verifying sizeof xattr entry");
 
-		oob_size = tailpacked ? last_oob_block * EROFS_BLKSIZ : file_size;
-		memcpy(content, data->erofs_data + raw_blkaddr * EROFS_BLKSIZ,
-		       oob_size);
-		if (tailpacked)
-			memcpy(content + oob_size, tail_data, tail_size);
+	const struct erofs_xattr_ibody_header *xattr_header;
+	const uint8_t *xattrs_inline;
+	const uint8_t *xattrs_start;
+	const uint8_t *xattrs_end;
+	uint8_t shared_count;
+	int ret;
 
-		ret = lcfs_node_set_content(node, content, file_size);
-		if (ret < 0) {
-			return NULL;
-		}
-	} else if (type == S_IFREG && file_size != 0) {
-		// If it's not an inline file, then it must be chunk based.
-		uint16_t layout = erofs_inode_datalayout(cino);
-		if (layout != EROFS_INODE_CHUNK_BASED) {
-			errno = EINVAL;
-			return NULL;
-		}
-		// In an extended "fsck" mode we could verify that we have
-		// EROFS_NULL_ADDR blocks here.
+	if (info->xattr_icount == 0)
+		return 0;
+
+	xattrs_start = ((const uint8_t *)cino) + info->isize;
+	xattrs_end = xattrs_start + erofs_xattr_inode_size(info->xattr_icount);
+	xattr_header = (const struct erofs_xattr_ibody_header *)xattrs_start;
+	shared_count = xattr_header->h_shared_count;
+
+	xattrs_inline = xattrs_start + sizeof(struct erofs_xattr_ibody_header) +
+			shared_count * 4;
+
+	/* Inline xattrs */
+	while (xattrs_inline + sizeof(struct erofs_xattr_entry) < xattrs_end) {
+		const struct erofs_xattr_entry *entry =
+			(const struct erofs_xattr_entry *)xattrs_inline;
+		size_t el_size = round_up(sizeof(struct erofs_xattr_entry) +
+						  entry->e_name_len +
+						  lcfs_u16_from_file(entry->e_value_size),
+					  4);
+
+		ret = erofs_call_xattr_cb(entry, cb, userdata);
+		if (ret != 0)
+			return ret;
+
+		xattrs_inline += el_size;
 	}
 
-	if (xattr_icount > 0) {
-		const struct erofs_xattr_ibody_header *xattr_header;
-		const uint8_t *xattrs_inline;
-		const uint8_t *xattrs_start;
-		const uint8_t *xattrs_end;
-		uint8_t shared_count;
-
-		xattrs_start = ((uint8_t *)cino) + isize;
-		xattrs_end = ((uint8_t *)cino) + isize + xattr_size;
-		xattr_header = (struct erofs_xattr_ibody_header *)xattrs_start;
-		shared_count = xattr_header->h_shared_count;
-
-		xattrs_inline = xattrs_start +
-				sizeof(struct erofs_xattr_ibody_header) +
-				shared_count * 4;
-
-		/* Inline xattrs */
-		while (xattrs_inline + sizeof(struct erofs_xattr_entry) < xattrs_end) {
-			const struct erofs_xattr_entry *entry =
-				(const struct erofs_xattr_entry *)xattrs_inline;
-			const char *entry_data = (const char *)entry +
-						 sizeof(struct erofs_xattr_entry);
-			const char *entry_name = entry_data;
-			uint8_t name_len = entry->e_name_len;
-			uint8_t name_index = entry->e_name_index;
-			const char *value = entry_data + name_len;
-			uint16_t value_size =
-				lcfs_u16_from_file(entry->e_value_size);
-			size_t el_size = round_up(sizeof(struct erofs_xattr_entry) +
-							  name_len + value_size,
-						  4);
-
-			if (lcfs_build_node_erofs_xattr(node, name_index,
-							entry_name, name_len,
-							value, value_size) < 0)
-				return NULL;
-
-			xattrs_inline += el_size;
-		}
-
-		/* Shared xattrs */
-		for (int i = 0; i < shared_count; i++) {
-			uint32_t idx = lcfs_u32_from_file(
-				xattr_header->h_shared_xattrs[i]);
-			const struct erofs_xattr_entry *entry =
-				(const struct erofs_xattr_entry *)(data->erofs_xattrdata +
-								   idx * 4);
-			const char *entry_data = (const char *)entry +
-						 sizeof(struct erofs_xattr_entry);
-			const char *entry_name = entry_data;
-			uint8_t name_len = entry->e_name_len;
-			uint8_t name_index = entry->e_name_index;
-			const char *value = entry_data + name_len;
-			uint16_t value_size =
-				lcfs_u16_from_file(entry->e_value_size);
-
-			if (lcfs_build_node_erofs_xattr(node, name_index,
-							entry_name, name_len,
-							value, value_size) < 0)
-				return NULL;
-		}
+	/* Shared xattrs */
+	for (int i = 0; i < shared_count; i++) {
+		uint32_t idx = lcfs_u32_from_file(xattr_header->h_shared_xattrs[i]);
+		const struct erofs_xattr_entry *entry =
+			(const struct erofs_xattr_entry *)(data->erofs_xattrdata +
+							   idx * 4);
+
+		ret = erofs_call_xattr_cb(entry, cb, userdata);
+		if (ret != 0)
+			return ret;
 	}
 
-	return steal_pointer(&node);
+	return 0;
 }
 
-static size_t node_ht_hasher(const void *d, size_t n)
-{
-	const struct hasher_node_s *v = d;
-	return v->nid % n;
-}
+enum erofs_xattr_kind {
+	EROFS_XATTR_KIND_PLAIN, /* Anything from the source, unescaped */
+	EROFS_XATTR_KIND_REDIRECT,
+	EROFS_XATTR_KIND_METACOPY,
+	EROFS_XATTR_KIND_ESCAPED_WHITEOUT,
+	EROFS_XATTR_KIND_HIDDEN,
+};
 
-static bool node_ht_comparator(const void *d1, const void *d2)
+/* Tells the overlayfs xattrs that the writer adds from the ones that were
+ * in the source, and unescapes the name of the latter in place. */
+static enum erofs_xattr_kind erofs_classify_xattr(char *name, int type)
 {
-	const struct hasher_node_s *v1 = d1;
-	const struct hasher_node_s *v2 = d2;
+	if (strcmp(name, OVERLAY_XATTR_REDIRECT) == 0)
+		return EROFS_XATTR_KIND_REDIRECT;
 
-	return v1->nid == v2->nid;
-}
+	if (strcmp(name, OVERLAY_XATTR_METACOPY) == 0)
+		return EROFS_XATTR_KIND_METACOPY;
 
-static size_t str_ht_hash(const void *entry, size_t table_size)
-{
-	return hash_string(entry, table_size);
+	if (strcmp(name, OVERLAY_XATTR_ESCAPED_WHITEOUT) == 0 && type == S_IFREG)
+		return EROFS_XATTR_KIND_ESCAPED_WHITEOUT;
+
+	if (strcmp(name, OVERLAY_XATTR_ESCAPED_WHITEOUTS) == 0 ||
+	    strcmp(name, OVERLAY_XATTR_USERXATTR_WHITEOUT) == 0 ||
+	    strcmp(name, OVERLAY_XATTR_USERXATTR_WHITEOUTS) == 0)
+		return EROFS_XATTR_KIND_HIDDEN;
+
+	if (str_has_prefix(name, OVERLAY_XATTR_PREFIX)) {
+		if (!str_has_prefix(name, OVERLAY_XATTR_ESCAPE_PREFIX))
+			return EROFS_XATTR_KIND_HIDDEN;
+
+		/* Unescape */
+		memmove(name + strlen(OVERLAY_XATTR_TRUSTED_PREFIX),
+			name + strlen(OVERLAY_XATTR_PREFIX),
+			strlen(name) - strlen(OVERLAY_XATTR_PREFIX) + 1);
+	}
+
+	return EROFS_XATTR_KIND_PLAIN;
 }
 
-static bool str_ht_eq(const void *entry1, const void *entry2)
+/* Strips the leading '/' off the object path in a redirect xattr */
+static void erofs_redirect_to_payload(const char **value, uint16_t *value_size)
 {
-	return strcmp(entry1, entry2) == 0;
+	if (*value_size > 1 && (*value)[0] == '/') {
+		(*value_size)--;
+		(*value)++;
+	}
 }
 
-struct lcfs_node_s *
-lcfs_load_node_from_image_ext(const uint8_t *image_data, size_t image_data_size,
-			      const struct lcfs_read_options_s *opts)
-{
-	const uint8_t *image_data_end;
-	struct lcfs_image_data data = { image_data, image_data_size };
-	const struct lcfs_erofs_header_s *cfs_header;
-	const struct erofs_super_block *erofs_super;
-	uint64_t erofs_root_nid;
-	struct lcfs_node_s *root;
+typedef int (*erofs_dirent_cb)(uint64_t nid, uint8_t file_type, const char *name,
+			       size_t name_len, void *userdata);
 
-	assert(opts);
+static int erofs_foreach_dirent_block(const uint8_t *block, size_t block_size,
+				      erofs_dirent_cb cb, void *userdata)
+{
+	const struct erofs_dirent *dirents = (struct erofs_dirent *)block;
+	size_t dirents_size;
+	size_t n_dirents, i;
+	int ret;
 
-	if (image_data_size < EROFS_BLKSIZ) {
+	if (block_size < sizeof(struct erofs_dirent)) {
 		errno = EINVAL;
-		return NULL;
+		return -1;
 	}
 
-	/* Avoid wrapping */
-	image_data_end = image_data + image_data_size;
-	if (image_data_end < image_data) {
+	dirents_size = lcfs_u16_from_file(dirents[0].nameoff);
+	if (dirents_size % sizeof(struct erofs_dirent) != 0 ||
+	    dirents_size > block_size) {
+		/* This should not happen for valid filesystems */
 		errno = EINVAL;
-		return NULL;
+		return -1;
 	}
 
-	cfs_header = (struct lcfs_erofs_header_s *)(image_data);
-	if (lcfs_u32_from_file(cfs_header->magic) != LCFS_EROFS_MAGIC) {
-		errno = EINVAL; /* Wrong cfs magic */
-		return NULL;
+	n_dirents = dirents_size / sizeof(struct erofs_dirent);
+
+	for (i = 0; i < n_dirents; i++) {
+		uint64_t nid = lcfs_u64_from_file(dirents[i].nid);
+		size_t nameoff = lcfs_u16_from_file(dirents[i].nameoff);
+		const char *child_name;
+		size_t child_name_len;
+
+		if (nameoff > block_size) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		/* Compute length of the name, which is a bit weird for the last dirent */
+		child_name = (char *)(block + nameoff);
+		if (i + 1 < n_dirents) {
+			size_t next_nameoff =
+				lcfs_u16_from_file(dirents[i + 1].nameoff);
+
+			if (next_nameoff < nameoff || next_nameoff > block_size) {
+				errno = EINVAL;
+				return -1;
+			}
+			child_name_len = next_nameoff - nameoff;
+		} else {
+			child_name_len = strnlen(child_name, block_size - nameoff);
+		}
+
+		if ((child_name_len == 1 && child_name[0] == '.') ||
+		    (child_name_len == 2 && child_name[0] == '.' &&
+		     child_name[1] == '.'))
+			continue;
+
+		ret = cb(nid, dirents[i].file_type, child_name, child_name_len,
+			 userdata);
+		if (ret != 0)
+			return ret;
 	}
 
-	if (lcfs_u32_from_file(cfs_header->version) != LCFS_EROFS_VERSION) {
-		errno = ENOTSUP; /* Wrong cfs version */
-		return NULL;
+	return 0;
+}
+
+/* Calls @cb for the entries of the directory @cino, other than "." and
+ * "..", in the order they are stored. A non-zero return from @cb stops
+ * the iteration and is returned. */
+static int erofs_foreach_dirent(struct lcfs_image_data *data,
+				const erofs_inode *cino,
+				const struct erofs_inode_info *info,
+				erofs_dirent_cb cb, void *userdata)
+{
+	size_t tail_size = erofs_inode_tail_size(cino, info);
+	uint64_t oob_size = info->file_size - tail_size;
+	const uint8_t *oob_data;
+	int ret;
+
+	oob_data = erofs_inode_oob_data(data, info, oob_size);
+	if (oob_data == NULL)
+		return -1;
+
+	/* First read the out-of-band blocks */
+	for (uint64_t offset = 0; offset < oob_size; offset += EROFS_BLKSIZ) {
+		uint64_t block_size = oob_size - offset;
+
+		if (block_size > EROFS_BLKSIZ)
+			block_size = EROFS_BLKSIZ;
+
+		ret = erofs_foreach_dirent_block(oob_data + offset, block_size,
+						 cb, userdata);
+		if (ret != 0)
+			return ret;
 	}
 
-	erofs_super = (struct erofs_super_block *)(image_data + EROFS_SUPER_OFFSET);
+	/* Then inline */
+	if (tail_size > 0)
+		return erofs_foreach_dirent_block(erofs_inode_tail_data(cino, info),
+						  tail_size, cb, userdata);
 
-	if (lcfs_u32_from_file(erofs_super->magic) != EROFS_SUPER_MAGIC_V1) {
-		errno = EINVAL; /* Wrong erofs magic */
-		return NULL;
+	return 0;
+}
+
+struct erofs_readdir_state {
+	struct lcfs_image_data *data;
+	struct lcfs_node_s *parent;
+	const struct lcfs_ht *filter;
+	struct erofs_dir_path *dir_path;
+};
+
+static int erofs_readdir_entry(uint64_t nid, uint8_t file_type,
+			       const char *child_name, size_t child_name_len,
+			       void *userdata)
+{
+	struct erofs_readdir_state *state = userdata;
+	struct lcfs_image_data *data = state->data;
+	struct erofs_dir_path *dir_path = state->dir_path;
+	char name_buf[PATH_MAX];
+	cleanup_node struct lcfs_node_s *child = NULL;
+	struct lcfs_node_s *added;
+
+	/* Copy to null terminate */
+	child_name_len = min(child_name_len, PATH_MAX - 1);
+	memcpy(name_buf, child_name, child_name_len);
+	name_buf[child_name_len] = 0;
+
+	if (state->filter != NULL &&
+	    lcfs_ht_lookup(state->filter, lcfs_ht_hash_string(name_buf),
+			   name_buf, str_ht_eq) == NULL) {
+		return 0;
 	}
 
-	data.erofs_metadata =
-		image_data +
-		lcfs_u32_from_file(erofs_super->meta_blkaddr) * EROFS_BLKSIZ;
-	data.erofs_xattrdata =
-		image_data +
-		lcfs_u32_from_file(erofs_super->xattr_blkaddr) * EROFS_BLKSIZ;
+	if (dir_path != NULL) {
+		memcpy(dir_path->buf + dir_path->len, name_buf, child_name_len);
+		if (!lcfs_image_path_wanted(data, dir_path->buf,
+					    dir_path->len + child_name_len,
+					    dir_path->depth))
+			return 0;
+	}
 
-	if (data.erofs_metadata >= image_data_end ||
-	    data.erofs_xattrdata >= image_data_end) {
-		errno = EINVAL;
+	child = lcfs_build_node_from_image(data, nid);
+	if (child == NULL) {
+		if (errno == ENOTSUP)
+			return 0; /* Skip real whiteouts (00-ff) */
+		else
+			return -1;
+	}
+
+	if (lcfs_node_add_child(state->parent, child, /* Takes ownership on success */
+				name_buf) < 0) {
+		lcfs_image_unref_node(data, steal_pointer(&child));
+		return -1;
+	}
+	added = steal_pointer(&child);
+
+	/* Directories are read once they are in the tree, so their
+	 * path is known */
+	if (added->link_to != NULL || (added->inode.st_mode & S_IFMT) != S_IFDIR)
+		return 0;
+	if (data->loader != NULL)
+		return lcfs_image_push_dir(data, added);
+	return erofs_read_dir(data, added, NULL);
+}
+
+static int lcfs_build_node_erofs_xattr(uint8_t name_index, const char *entry_name,
+				       uint8_t name_len, const char *value,
+				       uint16_t value_size, void *userdata)
+{
+	struct lcfs_node_s *node = userdata;
+	int type = node->inode.st_mode & S_IFMT;
+	char name[EROFS_XATTR_NAME_BUF_SIZE];
+
+	if (erofs_get_xattr_name(name_index, entry_name, name_len, name) < 0)
+		return -1;
+
+	switch (erofs_classify_xattr(name, type)) {
+	case EROFS_XATTR_KIND_REDIRECT:
+		if (type == S_IFREG) {
+			erofs_redirect_to_payload(&value, &value_size);
+			node->payload = strndup(value, value_size);
+			if (node->payload == NULL) {
+				errno = ENOMEM;
+				return -1;
+			}
+		}
+		return 0;
+	case EROFS_XATTR_KIND_METACOPY:
+		if (type == S_IFREG && value_size == 4 + LCFS_DIGEST_SIZE)
+			lcfs_node_set_fsverity_digest(node, (uint8_t *)value + 4);
+		return 0;
+	case EROFS_XATTR_KIND_ESCAPED_WHITEOUT:
+		/* Rewrite to regular whiteout */
+		node->inode.st_mode = (node->inode.st_mode & ~S_IFMT) | S_IFCHR;
+		node->inode.st_rdev = makedev(0, 0);
+		node->inode.st_size = 0;
+		return 0;
+	case EROFS_XATTR_KIND_HIDDEN:
+		return 0;
+	case EROFS_XATTR_KIND_PLAIN:
+		break;
+	}
+
+	if (lcfs_node_set_xattr_internal(node, name, value, value_size, false) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Reads the entries of the directory @node */
+static int erofs_read_dir(struct lcfs_image_data *data, struct lcfs_node_s *node,
+			  const struct lcfs_ht *filter)
+{
+	const erofs_inode *cino = lcfs_image_get_erofs_inode(data, node->erofs_nid);
+	struct erofs_readdir_state state = { data, node, filter, NULL };
+	struct erofs_dir_path dir_path = { 0 };
+	cleanup_free char *path_buf = NULL;
+	struct lcfs_inode_s inode = { 0 };
+	struct erofs_inode_info info;
+
+	if (cino == NULL)
+		return -1;
+
+	if (lcfs_image_filters_paths(data)) {
+		if (lcfs_image_dir_path(node, &dir_path) < 0)
+			return -1;
+		path_buf = dir_path.buf;
+		state.dir_path = &dir_path;
+
+		/* None of the entries would be loaded */
+		if (data->max_depth != 0 && dir_path.depth > data->max_depth)
+			return 0;
+	}
+
+	erofs_decode_inode(data, cino, &inode, &info);
+
+	return erofs_foreach_dirent(data, cino, &info, erofs_readdir_entry, &state);
+}
+
+/* Decodes the inode @nid, but not the entries of a directory */
+static struct lcfs_node_s *lcfs_build_node_from_image(struct lcfs_image_data *data,
+						      uint64_t nid)
+{
+	const erofs_inode *cino;
+	cleanup_node struct lcfs_node_s *node = NULL;
+	struct erofs_inode_info info;
+	int type;
+	uint64_t nid_hash = lcfs_ht_hash_u64(nid);
+	struct lcfs_node_s *existing;
+	int ret;
+
+	cino = lcfs_image_get_erofs_inode(data, nid);
+	if (cino == NULL)
+		return NULL;
+
+	node = lcfs_node_new();
+	if (node == NULL) {
 		return NULL;
 	}
 
-	data.erofs_metadata_end = image_data_end;
-	data.erofs_xattrdata_end = image_data_end;
+	existing = lcfs_image_ref_node(data, nid, nid_hash);
+	if (existing) {
+		node->link_to = existing;
+		return steal_pointer(&node);
+	}
 
-	data.erofs_build_time = lcfs_u64_from_file(erofs_super->build_time);
-	data.erofs_build_time_nsec =
-		lcfs_u32_from_file(erofs_super->build_time_nsec);
+	node->erofs_nid = nid;
 
-	erofs_root_nid = lcfs_u16_from_file(erofs_super->root_nid);
+	erofs_decode_inode(data, cino, &node->inode, &info);
+	type = node->inode.st_mode & S_IFMT;
 
-	data.node_hash =
-		hash_initialize(0, NULL, node_ht_hasher, node_ht_comparator, free);
-	if (data.node_hash == NULL) {
-		errno = ENOMEM;
+	if (type == S_IFCHR && node->inode.st_rdev == 0) {
+		/* A whiteout (chardev rdev=0) with nlink>1 is semantically
+		 * invalid: a whiteout represents the absence of a file, so it
+		 * cannot be hard-linked.  Reject the image explicitly rather
+		 * than silently skipping what would be a dangling alias. */
+		if (node->inode.st_nlink > 1) {
+			errno = EINVAL;
+			return NULL;
+		}
+		errno = ENOTSUP; /* Signal to caller: skip this whiteout entry */
 		return NULL;
 	}
 
-	Hash_table *toplevel_entries_hash = NULL;
-	if (opts->toplevel_entries) {
-		toplevel_entries_hash =
-			hash_initialize(0, NULL, str_ht_hash, str_ht_eq, NULL);
-		if (toplevel_entries_hash == NULL) {
+	/* Loading in parallel, the node is only published once it is fully
+	 * decoded. Either way a directory is known before its entries are
+	 * read, which breaks cycles. */
+	if (data->loader == NULL && lcfs_ht_insert(&data->node_ht, nid_hash, node) < 0)
+		return NULL;
+
+	if (type == S_IFLNK) {
+		char name_buf[PATH_MAX];
+
+		if (info.file_size >= PATH_MAX) {
+			errno = EINVAL;
+			return NULL;
+		}
+
+		if (erofs_read_inode_data(data, cino, &info, (uint8_t *)name_buf) < 0)
+			return NULL;
+		name_buf[info.file_size] = 0;
+		if (lcfs_node_set_symlink_payload(node, name_buf) < 0)
+			return NULL;
+	} else if (type == S_IFREG && info.file_size != 0 && erofs_inode_is_flat(cino)) {
+		cleanup_free uint8_t *content = NULL;
+
+		// Strictly limit to our max size, and for good measure
+		// the size of the file (which should always be larger than 4k
+		// in reality).
+		if (info.file_size > min(LCFS_INLINE_CONTENT_MAX, data->erofs_data_size)) {
+			errno = EINVAL;
+			return NULL;
+		}
+
+		content = malloc(info.file_size);
+		if (content == NULL) {
 			errno = ENOMEM;
 			return NULL;
 		}
-		for (const char *const *it = opts->toplevel_entries; it && *it; it++) {
-			const char *name = *it;
-			if (hash_insert_if_absent(toplevel_entries_hash, name,
-						  NULL) < 0) {
-				errno = ENOMEM;
-				return NULL;
+
+		if (erofs_read_inode_data(data, cino, &info, content) < 0)
+			return NULL;
+
+		ret = lcfs_node_set_content(node, content, info.file_size);
+		if (ret < 0) {
+			return NULL;
+		}
+	} else if (type == S_IFREG && info.file_size != 0) {
+		// If it's not an inline file, then it must be chunk based.
+		uint16_t layout = erofs_inode_datalayout(cino);
+		if (layout != EROFS_INODE_CHUNK_BASED) {
+			errno = EINVAL;
+			return NULL;
+		}
+		// In an extended "fsck" mode we could verify that we have
+		// EROFS_NULL_ADDR blocks here.
+	}
+
+	if (erofs_foreach_xattr(data, cino, &info, lcfs_build_node_erofs_xattr,
+				node) < 0)
+		return NULL;
+
+	if (data->loader != NULL)
+		return lcfs_image_publish_node(data, steal_pointer(&node), nid_hash);
+
+	return steal_pointer(&node);
+}
+
+static void *lcfs_image_loader_thread(void *arg)
+{
+	struct lcfs_image_data *data = arg;
+	struct lcfs_image_loader *loader = data->loader;
+
+	pthread_mutex_lock(&loader->lock);
+	for (;;) {
+		struct lcfs_node_s *dir;
+		int ret;
+
+		while (loader->n_dirs == 0 && loader->n_busy > 0 &&
+		       loader->error == 0)
+			pthread_cond_wait(&loader->cond, &loader->lock);
+		if (loader->n_dirs == 0 || loader->error != 0)
+			break;
+
+		dir = loader->dirs[--loader->n_dirs];
+		loader->n_busy++;
+		pthread_mutex_unlock(&loader->lock);
+
+		ret = erofs_read_dir(data, dir, NULL);
+
+		pthread_mutex_lock(&loader->lock);
+		loader->n_busy--;
+		if (ret < 0 && loader->error == 0)
+			loader->error = errno ? errno : EINVAL;
+	}
+	/* Done or failed, either way the others should stop waiting */
+	pthread_cond_broadcast(&loader->cond);
+	pthread_mutex_unlock(&loader->lock);
+
+	return NULL;
+}
+
+/* The loader threads may have made any occurrence of a hardlinked inode
+ * the node itself, while loading on one thread makes it the first one
+ * in the tree. This swaps them back to match, so the result doesn't
+ * depend on the number of threads. */
+static void lcfs_image_swap_nodes(struct lcfs_node_s *a, struct lcfs_node_s *b)
+{
+	struct lcfs_node_s *parent_a = a->parent;
+	struct lcfs_node_s *parent_b = b->parent;
+	char *name_a = a->name;
+	size_t pos_a, pos_b;
+
+	lcfs_node_bsearch_child(parent_a, a->name, &pos_a);
+	lcfs_node_bsearch_child(parent_b, b->name, &pos_b);
+
+	parent_a->children[pos_a] = b;
+	parent_b->children[pos_b] = a;
+	a->parent = parent_b;
+	b->parent = parent_a;
+	a->name = b->name;
+	b->name = name_a;
+}
+
+/* @targets holds the hardlinked nodes not yet seen in the walk */
+static void lcfs_image_order_links(struct lcfs_ht *targets,
+				   struct lcfs_node_s *node)
+{
+	for (size_t i = 0; i < node->children_size; i++) {
+		struct lcfs_node_s *child = node->children[i];
+		struct lcfs_node_s *target = child->link_to ? child->link_to : child;
+
+		if (targets->n_entries == 0)
+			return;
+
+		if (lcfs_ht_remove(targets, lcfs_ht_hash_u64(target->erofs_nid),
+				   &target->erofs_nid, node_ht_eq) != NULL &&
+		    target != child) {
+			lcfs_image_swap_nodes(child, target);
+			child = target;
+		}
+		if (child->link_to == NULL)
+			lcfs_image_order_links(targets, child);
+	}
+}
+
+static int lcfs_image_finish_links(struct lcfs_image_data *data,
+				   struct lcfs_node_s *root)
+{
+	struct lcfs_ht targets = { 0 };
+	size_t iter;
+
+	if (lcfs_ht_init(&targets, 0) < 0)
+		return -1;
+
+	for (size_t i = 0; i < (1 << LCFS_LOADER_SHARD_BITS); i++) {
+		struct lcfs_ht *ht = &data->loader->shards[i].ht;
+		struct lcfs_node_s *node;
+
+		/* A ref besides the map's and the tree's is a hardlink */
+		iter = 0;
+		while ((node = lcfs_ht_next(ht, &iter)) != NULL) {
+			if (node->ref_count > 2 && node != root &&
+			    lcfs_ht_insert(&targets,
+					   lcfs_ht_hash_u64(node->erofs_nid),
+					   node) < 0) {
+				lcfs_ht_destroy(&targets);
+				return -1;
 			}
 		}
 	}
 
-	root = lcfs_build_node_from_image(&data, erofs_root_nid,
-					  toplevel_entries_hash);
+	lcfs_image_order_links(&targets, root);
+	lcfs_ht_destroy(&targets);
+
+	return 0;
+}
+
+static void lcfs_image_loader_free(struct lcfs_image_loader *loader)
+{
+	for (size_t i = 0; i < (1 << LCFS_LOADER_SHARD_BITS); i++) {
+		struct lcfs_ht *ht = &loader->shards[i].ht;
+		struct lcfs_node_s *node;
+		size_t iter = 0;
+
+		while ((node = lcfs_ht_next(ht, &iter)) != NULL)
+			lcfs_node_unref(node);
+		lcfs_ht_destroy(ht);
+		pthread_mutex_destroy(&loader->shards[i].lock);
+	}
+	pthread_mutex_destroy(&loader->lock);
+	pthread_cond_destroy(&loader->cond);
+	free(loader->dirs);
+	free(loader);
+}
+
+static struct lcfs_node_s *lcfs_image_load_serial(struct lcfs_image_data *data,
+						  uint64_t root_nid,
+						  const struct lcfs_ht *filter)
+{
+	cleanup_node struct lcfs_node_s *root = NULL;
+
+	root = lcfs_build_node_from_image(data, root_nid);
+	if (root == NULL)
+		return NULL;
 
-	if (toplevel_entries_hash != NULL)
-		hash_free(toplevel_entries_hash);
-	hash_free(data.node_hash);
+	if ((root->inode.st_mode & S_IFMT) == S_IFDIR &&
+	    erofs_read_dir(data, root, filter) < 0)
+		return NULL;
 
-	return root;
+	return steal_pointer(&root);
 }
 
-struct lcfs_node_s *lcfs_load_node_from_image(const uint8_t *image_data,
-					      size_t image_data_size)
+/* Loads the image from opts->threads threads, including the calling one */
+static struct lcfs_node_s *lcfs_image_load_parallel(struct lcfs_image_data *data,
+						    uint64_t root_nid,
+						    const struct lcfs_ht *filter,
+						    uint32_t n_threads)
 {
-	struct lcfs_read_options_s opts = {
-		0,
-	};
-	return lcfs_load_node_from_image_ext(image_data, image_data_size, &opts);
-}
\ No newline at end of file
+	cleanup_node struct lcfs_node_s *root = NULL;
+	pthread_t *threads;
+	size_t n_workers = n_threads - 1;
+	int errsv = 0;
+
+	data->loader = calloc(1, sizeof(struct lcfs_image_loader));
+	if (data->loader == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	for (size_t i = 0; i < (1 << LCFS_LOADER_SHARD_BITS); i++) {
+		pthread_mutex_init(&data->loader->shards[i].lock, NULL);
+		if (lcfs_ht_init(&data->loader->shards[i].ht, 0) < 0) {
+			lcfs_image_loader_free(data->loader);
+			return NULL;
+		}
+	}
+	pthread_mutex_init(&data->loader->lock, NULL);
+	pthread_cond_init(&data->loader->cond, NULL);
+
+	/* The toplevel filter only applies to the root, which is read
+	 * here before any other thread starts. */
+	root = lcfs_build_node_from_image(data, root_nid);
+	if (root == NULL ||
+	    ((root->inode.st_mode & S_IFMT) == S_IFDIR &&
+	     erofs_read_dir(data, root, filter) < 0)) {
+		errsv = errno;
+		goto out;
+	}
+
+	threads = calloc(n_workers + 1, sizeof(pthread_t));
+	if (threads == NULL)
+		n_workers = 0;
+
+	for (size_t i = 0; i < n_workers; i++) {
+		if (pthread_create(&threads[i], NULL, lcfs_image_loader_thread,
+				   data) != 0) {
+			n_workers = i;
+			break;
+		}
+	}
+
+	lcfs_image_loader_thread(data);
+
+	for (size_t i = 0; i < n_workers; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	errsv = data->loader->error;
+	if (errsv == 0 && lcfs_image_finish_links(data, root) < 0)
+		errsv = errno;
+
+out:
+	/* The map's refs go first, so failures free the tree below */
+	lcfs_image_loader_free(data->loader);
+	data->loader = NULL;
+	if (errsv != 0) {
+		errno = errsv;
+		return NULL;
+	}
+
+	return steal_pointer(&root);
+}
+
+/* Checks the headers of the image and finds the metadata in it */
+static int lcfs_image_data_init(struct lcfs_image_data *data,
+				const uint8_t *image_data, size_t image_data_size,
+				uint64_t *root_nid)
+{
+	const uint8_t *image_data_end;
+	const struct lcfs_erofs_header_s *cfs_header;
+	const struct erofs_super_block *erofs_super;
+
+	if (image_data_size < EROFS_BLKSIZ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Avoid wrapping */
+	image_data_end = image_data + image_data_size;
+	if (image_data_end < image_data) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	cfs_header = (struct lcfs_erofs_header_s *)(image_data);
+	if (lcfs_u32_from_file(cfs_header->magic) != LCFS_EROFS_MAGIC) {
+		errno = EINVAL; /* Wrong cfs magic */
+		return -1;
+	}
+
+	if (lcfs_u32_from_file(cfs_header->version) != LCFS_EROFS_VERSION) {
+		errno = ENOTSUP; /* Wrong cfs version */
+		return -1;
+	}
+
+	erofs_super = (struct erofs_super_block *)(image_data + EROFS_SUPER_OFFSET);
+
+	if (lcfs_u32_from_file(erofs_super->magic) != EROFS_SUPER_MAGIC_V1) {
+		errno = EINVAL; /* Wrong erofs magic */
+		return -1;
+	}
+
+	data->erofs_data = image_data;
+	data->erofs_data_size = image_data_size;
+	data->erofs_metadata =
+		image_data +
+		lcfs_u32_from_file(erofs_super->meta_blkaddr) * EROFS_BLKSIZ;
+	data->erofs_xattrdata =
+		image_data +
+		lcfs_u32_from_file(erofs_super->xattr_blkaddr) * EROFS_BLKSIZ;
+
+	if (data->erofs_metadata >= image_data_end ||
+	    data->erofs_xattrdata >= image_data_end) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	data->erofs_metadata_end = image_data_end;
+	data->erofs_xattrdata_end = image_data_end;
+
+	data->erofs_build_time = lcfs_u64_from_file(erofs_super->build_time);
+	data->erofs_build_time_nsec =
+		lcfs_u32_from_file(erofs_super->build_time_nsec);
+
+	*root_nid = lcfs_u16_from_file(erofs_super->root_nid);
+
+	return 0;
+}
+
+/* Fills @ht with the names in @toplevel_entries, if any */
+static int lcfs_image_toplevel_filter(struct lcfs_ht *ht,
+				      const char *const *toplevel_entries)
+{
+	if (toplevel_entries == NULL)
+		return 0;
+
+	if (lcfs_ht_init(ht, 0) < 0)
+		return -1;
+
+	for (const char *const *it = toplevel_entries; *it; it++) {
+		char *name = (char *)*it;
+		if (lcfs_ht_insert_if_absent(ht, lcfs_ht_hash_string(name), name,
+					     str_ht_eq, name) == NULL) {
+			lcfs_ht_destroy(ht);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+struct lcfs_node_s *
+lcfs_load_node_from_image_ext(const uint8_t *image_data, size_t image_data_size,
+			      const struct lcfs_read_options_s *opts)
+{
+	struct lcfs_image_data data = { 0 };
+	struct lcfs_ht toplevel_entries_ht = { 0 };
+	uint64_t erofs_root_nid;
+	struct lcfs_node_s *root;
+
+	assert(opts);
+
+	if (lcfs_image_data_init(&data, image_data, image_data_size,
+				 &erofs_root_nid) < 0)
+		return NULL;
+
+	if (lcfs_ht_init(&data.node_ht, 0) < 0)
+		return NULL;
+
+	if (lcfs_image_toplevel_filter(&toplevel_entries_ht,
+				       opts->toplevel_entries) < 0) {
+		lcfs_ht_destroy(&data.node_ht);
+		return NULL;
+	}
+
+	data.include_paths = opts->include_paths;
+	data.exclude_paths = opts->exclude_paths;
+	data.max_depth = opts->max_depth;
+
+	if (opts->threads > 1)
+		root = lcfs_image_load_parallel(
+			&data, erofs_root_nid,
+			opts->toplevel_entries ? &toplevel_entries_ht : NULL,
+			opts->threads);
+	else
+		root = lcfs_image_load_serial(
+			&data, erofs_root_nid,
+			opts->toplevel_entries ? &toplevel_entries_ht : NULL);
+
+	lcfs_ht_destroy(&toplevel_entries_ht);
+	lcfs_ht_destroy(&data.node_ht);
+
+	return root;
+}
+
+struct lcfs_node_s *lcfs_load_node_from_image(const uint8_t *image_data,
+					      size_t image_data_size)
+{
+	struct lcfs_read_options_s opts = {
+		0,
+	};
+	return lcfs_load_node_from_image_ext(image_data, image_data_size, &opts);
+}
+
+/* The first path a hardlinked inode was walked at */
+struct lcfs_image_walk_link {
+	uint64_t nid;
+	char path[];
+};
+
+static bool walk_link_ht_eq(const void *value, const void *key)
+{
+	const struct lcfs_image_walk_link *link = value;
+
+	return link->nid == *(const uint64_t *)key;
+}
+
+/* Everything is reused from one entry to the next, so other than the
+ * bitmaps and the paths of hardlinked files nothing here grows with the
+ * size of the image. */
+struct lcfs_image_walker {
+	struct lcfs_image_data *data;
+	struct lcfs_ht toplevel_ht;
+	const struct lcfs_ht *filter; /* &toplevel_ht, if filtering */
+	lcfs_image_walk_cb cb;
+	void *userdata;
+
+	char *path; /* Of the current entry */
+	size_t path_size;
+
+	struct lcfs_ht links; /* struct lcfs_image_walk_link */
+	uint8_t *nids_seen; /* Bitmap, against cycles */
+	uint8_t *nids_shared; /* Bitmap of inodes in more than one entry */
+	uint64_t n_nids;
+
+	char payload[PATH_MAX];
+	uint8_t *content; /* LCFS_INLINE_CONTENT_MAX bytes */
+	const uint8_t *digest;
+	struct lcfs_inode_s inode;
+
+	struct lcfs_image_xattr_s *xattrs;
+	char (*xattr_names)[EROFS_XATTR_NAME_BUF_SIZE];
+	size_t n_xattrs;
+	size_t xattrs_capacity;
+};
+
+static int lcfs_image_walk_xattr(uint8_t name_index, const char *entry_name,
+				 uint8_t name_len, const char *value,
+				 uint16_t value_size, void *userdata)
+{
+	struct lcfs_image_walker *walker = userdata;
+	struct lcfs_inode_s *inode = &walker->inode;
+	int type = inode->st_mode & S_IFMT;
+	char name[EROFS_XATTR_NAME_BUF_SIZE];
+	size_t len;
+
+	if (erofs_get_xattr_name(name_index, entry_name, name_len, name) < 0)
+		return -1;
+
+	switch (erofs_classify_xattr(name, type)) {
+	case EROFS_XATTR_KIND_REDIRECT:
+		if (type == S_IFREG) {
+			erofs_redirect_to_payload(&value, &value_size);
+			len = strnlen(value, value_size);
+			if (len >= PATH_MAX) {
+				errno = EINVAL;
+				return -1;
+			}
+			memcpy(walker->payload, value, len);
+			walker->payload[len] = 0;
+		}
+		return 0;
+	case EROFS_XATTR_KIND_METACOPY:
+		if (type == S_IFREG && value_size == 4 + LCFS_DIGEST_SIZE)
+			walker->digest = (const uint8_t *)value + 4;
+		return 0;
+	case EROFS_XATTR_KIND_ESCAPED_WHITEOUT:
+		/* Rewrite to regular whiteout */
+		inode->st_mode = (inode->st_mode & ~S_IFMT) | S_IFCHR;
+		inode->st_rdev = makedev(0, 0);
+		inode->st_size = 0;
+		return 0;
+	case EROFS_XATTR_KIND_HIDDEN:
+		return 0;
+	case EROFS_XATTR_KIND_PLAIN:
+		break;
+	}
+
+	if (walker->n_xattrs == walker->xattrs_capacity) {
+		size_t new_capacity = max(walker->xattrs_capacity * 2, 16);
+		struct lcfs_image_xattr_s *new_xattrs;
+		char(*new_names)[EROFS_XATTR_NAME_BUF_SIZE];
+
+		new_xattrs = reallocarray(walker->xattrs, new_capacity,
+					  sizeof(*new_xattrs));
+		if (new_xattrs == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		walker->xattrs = new_xattrs;
+
+		new_names = reallocarray(walker->xattr_names, new_capacity,
+					 sizeof(*new_names));
+		if (new_names == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		walker->xattr_names = new_names;
+		walker->xattrs_capacity = new_capacity;
+	}
+
+	/* Names are pointed at once all are collected, as the array moves */
+	strcpy(walker->xattr_names[walker->n_xattrs], name);
+	walker->xattrs[walker->n_xattrs].value = value;
+	walker->xattrs[walker->n_xattrs].value_len = value_size;
+	walker->n_xattrs++;
+
+	return 0;
+}
+
+/* Makes room for a path of @len bytes, and its terminator */
+static int lcfs_image_walk_grow_path(struct lcfs_image_walker *walker, size_t len)
+{
+	char *new_path;
+	size_t new_size;
+
+	if (len < walker->path_size)
+		return 0;
+
+	new_size = max(walker->path_size * 2, len + 1);
+	new_path = realloc(walker->path, new_size);
+	if (new_path == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	walker->path = new_path;
+	walker->path_size = new_size;
+
+	return 0;
+}
+
+static bool nid_bitmap_test_and_set(uint8_t *bitmap, uint64_t nid)
+{
+	bool was_set = (bitmap[nid / 8] & (1 << (nid % 8))) != 0;
+
+	bitmap[nid / 8] |= 1 << (nid % 8);
+	return was_set;
+}
+
+struct lcfs_image_walk_dir {
+	struct lcfs_image_walker *walker;
+	size_t path_len; /* Of the directory, 0 for the root */
+	uint32_t depth; /* Of its entries */
+};
+
+/* Puts the path of an entry of @dir in walker->path, and checks it
+ * against the filters */
+static int lcfs_image_walk_wanted(struct lcfs_image_walk_dir *dir,
+				  const char *name, size_t name_len,
+				  size_t *path_len_out)
+{
+	struct lcfs_image_walker *walker = dir->walker;
+	size_t path_len = dir->path_len + 1 + name_len;
+	char *child_name;
+
+	if (lcfs_image_walk_grow_path(walker, path_len) < 0)
+		return -1;
+
+	walker->path[dir->path_len] = '/';
+	child_name = walker->path + dir->path_len + 1;
+	memcpy(child_name, name, name_len);
+	child_name[name_len] = 0;
+	*path_len_out = path_len;
+
+	if (dir->depth == 1 && walker->filter != NULL &&
+	    lcfs_ht_lookup(walker->filter, lcfs_ht_hash_string(child_name),
+			   child_name, str_ht_eq) == NULL)
+		return 0;
+
+	if (lcfs_image_filters_paths(walker->data) &&
+	    !lcfs_image_path_wanted(walker->data, walker->path + 1,
+				    path_len - 1, dir->depth))
+		return 0;
+
+	return 1;
+}
+
+static int lcfs_image_find_links(struct lcfs_image_walker *walker,
+				 uint64_t nid, size_t path_len, uint32_t depth);
+
+static int lcfs_image_find_links_dirent(uint64_t nid, uint8_t file_type,
+					const char *name, size_t name_len,
+					void *userdata)
+{
+	struct lcfs_image_walk_dir *dir = userdata;
+	struct lcfs_image_walker *walker = dir->walker;
+	size_t path_len;
+	int wanted;
+
+	wanted = lcfs_image_walk_wanted(dir, name, name_len, &path_len);
+	if (wanted <= 0)
+		return wanted;
+
+	if (file_type == EROFS_FT_DIR)
+		return lcfs_image_find_links(walker, nid, path_len, dir->depth);
+
+	if (nid >= walker->n_nids) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (nid_bitmap_test_and_set(walker->nids_seen, nid))
+		nid_bitmap_test_and_set(walker->nids_shared, nid);
+
+	return 0;
+}
+
+/* Marks the inodes that more than one of the entries below the directory
+ * @nid point to, going by the directory entries alone. The nlink of an
+ * inode can't be relied on for this, images built from a dump have
+ * whatever it says. */
+static int lcfs_image_find_links(struct lcfs_image_walker *walker,
+				 uint64_t nid, size_t path_len, uint32_t depth)
+{
+	struct lcfs_image_data *data = walker->data;
+	struct lcfs_inode_s inode = { 0 };
+	struct lcfs_image_walk_dir dir;
+	struct erofs_inode_info info;
+	const erofs_inode *cino;
+
+	cino = lcfs_image_get_erofs_inode(data, nid);
+	if (cino == NULL)
+		return -1;
+
+	/* Broken images are left to the walk proper to reject */
+	if (nid >= walker->n_nids ||
+	    nid_bitmap_test_and_set(walker->nids_seen, nid))
+		return 0;
+
+	erofs_decode_inode(data, cino, &inode, &info);
+	if ((inode.st_mode & S_IFMT) != S_IFDIR)
+		return 0;
+
+	if (data->max_depth != 0 && depth + 1 > data->max_depth)
+		return 0;
+
+	dir.walker = walker;
+	dir.path_len = depth == 0 ? 0 : path_len;
+	dir.depth = depth + 1;
+
+	return erofs_foreach_dirent(data, cino, &info,
+				    lcfs_image_find_links_dirent, &dir);
+}
+
+static int lcfs_image_walk_inode(struct lcfs_image_walker *walker,
+				 uint64_t nid, size_t path_len, uint32_t depth);
+
+static int lcfs_image_walk_dirent(uint64_t nid, uint8_t file_type,
+				  const char *name, size_t name_len, void *userdata)
+{
+	struct lcfs_image_walk_dir *dir = userdata;
+	size_t path_len;
+	int wanted;
+
+	wanted = lcfs_image_walk_wanted(dir, name, name_len, &path_len);
+	if (wanted <= 0)
+		return wanted;
+
+	return lcfs_image_walk_inode(dir->walker, nid, path_len, dir->depth);
+}
+
+/* Decodes the inode @nid into @entry, with its path in walker->path.
+ * Returns 0 for the entries that are never walked, like whiteouts. */
+static int lcfs_image_walk_decode(struct lcfs_image_walker *walker,
+				  uint64_t nid, size_t path_len, uint32_t depth,
+				  struct lcfs_image_entry_s *entry,
+				  const erofs_inode **cino_out,
+				  struct erofs_inode_info *info)
+{
+	struct lcfs_image_data *data = walker->data;
+	struct lcfs_inode_s *inode = &walker->inode;
+	const erofs_inode *cino;
+	int type;
+
+	cino = lcfs_image_get_erofs_inode(data, nid);
+	if (cino == NULL)
+		return -1;
+	if (nid >= walker->n_nids) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(entry, 0, sizeof(*entry));
+	memset(inode, 0, sizeof(*inode));
+	erofs_decode_inode(data, cino, inode, info);
+	type = inode->st_mode & S_IFMT;
+
+	if (type == S_IFCHR && inode->st_rdev == 0) {
+		/* Real whiteouts are skipped, see lcfs_build_node_from_image() */
+		if (inode->st_nlink > 1) {
+			errno = EINVAL;
+			return -1;
+		}
+		return 0;
+	}
+
+	walker->payload[0] = 0;
+	walker->digest = NULL;
+	walker->n_xattrs = 0;
+	if (erofs_foreach_xattr(data, cino, info, lcfs_image_walk_xattr, walker) < 0)
+		return -1;
+	/* An escaped whiteout is now a chardev */
+	type = inode->st_mode & S_IFMT;
+
+	if (type == S_IFLNK) {
+		if (info->file_size >= PATH_MAX) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (erofs_read_inode_data(data, cino, info,
+					  (uint8_t *)walker->payload) < 0)
+			return -1;
+		walker->payload[info->file_size] = 0;
+		if (walker->payload[0] == 0) {
+			errno = EINVAL;
+			return -1;
+		}
+	} else if (type == S_IFREG && info->file_size != 0 && erofs_inode_is_flat(cino)) {
+		if (info->file_size > min(LCFS_INLINE_CONTENT_MAX, data->erofs_data_size)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		/* Only a tail packed into the inode needs copying */
+		if (erofs_inode_tail_size(cino, info) == 0) {
+			entry->content = erofs_inode_oob_data(data, info,
+							      info->file_size);
+			if (entry->content == NULL)
+				return -1;
+		} else {
+			if (erofs_read_inode_data(data, cino, info,
+						  walker->content) < 0)
+				return -1;
+			entry->content = walker->content;
+		}
+	} else if (type == S_IFREG && info->file_size != 0) {
+		if (erofs_inode_datalayout(cino) != EROFS_INODE_CHUNK_BASED) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	if (type != S_IFDIR && (walker->nids_shared[nid / 8] & (1 << (nid % 8)))) {
+		uint64_t nid_hash = lcfs_ht_hash_u64(nid);
+		struct lcfs_image_walk_link *link;
+
+		link = lcfs_ht_lookup(&walker->links, nid_hash, &nid, walk_link_ht_eq);
+		if (link != NULL) {
+			entry->hardlink_target = link->path;
+		} else {
+			link = malloc(sizeof(*link) + path_len + 1);
+			if (link == NULL) {
+				errno = ENOMEM;
+				return -1;
+			}
+			link->nid = nid;
+			memcpy(link->path, walker->path, path_len + 1);
+			if (lcfs_ht_insert(&walker->links, nid_hash, link) < 0) {
+				free(link);
+				return -1;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < walker->n_xattrs; i++)
+		walker->xattrs[i].name = walker->xattr_names[i];
+
+	entry->path = walker->path;
+	entry->depth = depth;
+	entry->mode = inode->st_mode;
+	entry->nlink = inode->st_nlink;
+	entry->uid = inode->st_uid;
+	entry->gid = inode->st_gid;
+	entry->rdev = inode->st_rdev;
+	entry->size = inode->st_size;
+	entry->mtime_sec = inode->st_mtim_sec;
+	entry->mtime_nsec = inode->st_mtim_nsec;
+	entry->payload = walker->payload[0] != 0 ? walker->payload : NULL;
+	entry->digest = walker->digest;
+	entry->n_xattrs = walker->n_xattrs;
+	entry->xattrs = walker->xattrs;
+
+	*cino_out = cino;
+	return 1;
+}
+
+/* Marks the directory @nid at @depth as walked. Returns 0 if none of
+ * its entries would be walked. */
+static int lcfs_image_walk_enter(struct lcfs_image_walker *walker,
+				 uint64_t nid, uint32_t depth)
+{
+	uint32_t max_depth = walker->data->max_depth;
+
+	/* Directories can't be hardlinked, this is a broken image */
+	if (nid_bitmap_test_and_set(walker->nids_seen, nid)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return max_depth == 0 || depth + 1 <= max_depth;
+}
+
+/* Calls @cb for the entries of the directory @nid */
+static int lcfs_image_walk_children(struct lcfs_image_walker *walker,
+				    uint64_t nid, const erofs_inode *cino,
+				    const struct erofs_inode_info *info,
+				    uint32_t depth, erofs_dirent_cb cb, void *userdata)
+{
+	int ret;
+
+	ret = lcfs_image_walk_enter(walker, nid, depth);
+	if (ret <= 0)
+		return ret;
+
+	return erofs_foreach_dirent(walker->data, cino, info, cb, userdata);
+}
+
+/* Passes a decoded entry to the callback, and then the entries below it */
+static int lcfs_image_walk_emit(struct lcfs_image_walker *walker,
+				const struct lcfs_image_entry_s *entry,
+				uint64_t nid, const erofs_inode *cino,
+				const struct erofs_inode_info *info, size_t path_len)
+{
+	struct lcfs_image_walk_dir dir;
+	int ret;
+
+	ret = walker->cb(entry, walker->userdata);
+	if (ret != 0 || (entry->mode & S_IFMT) != S_IFDIR)
+		return ret;
+
+	dir.walker = walker;
+	dir.path_len = entry->depth == 0 ? 0 : path_len;
+	dir.depth = entry->depth + 1;
+
+	return lcfs_image_walk_children(walker, nid, cino, info, entry->depth,
+					lcfs_image_walk_dirent, &dir);
+}
+
+/* Passes the inode @nid, with its path in walker->path, to the callback,
+ * and then the entries below it */
+static int lcfs_image_walk_inode(struct lcfs_image_walker *walker,
+				 uint64_t nid, size_t path_len, uint32_t depth)
+{
+	struct lcfs_image_entry_s entry;
+	struct erofs_inode_info info;
+	const erofs_inode *cino;
+	int ret;
+
+	ret = lcfs_image_walk_decode(walker, nid, path_len, depth, &entry,
+				     &cino, &info);
+	if (ret <= 0)
+		return ret;
+
+	return lcfs_image_walk_emit(walker, &entry, nid, cino, &info, path_len);
+}
+
+static void lcfs_image_walker_free(struct lcfs_image_walker *walker)
+{
+	struct lcfs_image_walk_link *link;
+	size_t iter = 0;
+
+	if (walker == NULL)
+		return;
+
+	while ((link = lcfs_ht_next(&walker->links, &iter)) != NULL)
+		free(link);
+	lcfs_ht_destroy(&walker->links);
+	lcfs_ht_destroy(&walker->toplevel_ht);
+	free(walker->nids_seen);
+	free(walker->nids_shared);
+	free(walker->content);
+	free(walker->path);
+	free(walker->xattrs);
+	free(walker->xattr_names);
+	free(walker);
+}
+
+static struct lcfs_image_walker *
+lcfs_image_walker_new(struct lcfs_image_data *data,
+		      const struct lcfs_read_options_s *opts,
+		      lcfs_image_walk_cb cb, void *userdata)
+{
+	struct lcfs_image_walker *walker;
+
+	/* Too big for the stack, with the payload buffer */
+	walker = calloc(1, sizeof(struct lcfs_image_walker));
+	if (walker == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	walker->data = data;
+	walker->cb = cb;
+	walker->userdata = userdata;
+	walker->n_nids = (data->erofs_metadata_end - data->erofs_metadata) >>
+			 EROFS_ISLOTBITS;
+	walker->nids_seen = calloc(walker->n_nids / 8 + 1, 1);
+	walker->nids_shared = calloc(walker->n_nids / 8 + 1, 1);
+	walker->content = malloc(LCFS_INLINE_CONTENT_MAX);
+	if (walker->nids_seen == NULL || walker->nids_shared == NULL ||
+	    walker->content == NULL ||
+	    lcfs_image_walk_grow_path(walker, PATH_MAX) < 0) {
+		lcfs_image_walker_free(walker);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (lcfs_ht_init(&walker->links, 0) < 0 ||
+	    lcfs_image_toplevel_filter(&walker->toplevel_ht,
+				       opts->toplevel_entries) < 0) {
+		lcfs_image_walker_free(walker);
+		return NULL;
+	}
+	if (opts->toplevel_entries)
+		walker->filter = &walker->toplevel_ht;
+
+	return walker;
+}
+
+/* Gets ready to walk from the root @nid, with the root path set */
+static int lcfs_image_walker_start(struct lcfs_image_walker *walker, uint64_t nid)
+{
+	if (lcfs_image_find_links(walker, nid, 1, 0) < 0)
+		return -1;
+
+	memset(walker->nids_seen, 0, walker->n_nids / 8 + 1);
+	strcpy(walker->path, "/");
+
+	return 0;
+}
+
+int lcfs_image_walk_data(const uint8_t *image_data, size_t image_data_size,
+			 const struct lcfs_read_options_s *opts,
+			 lcfs_image_walk_cb cb, void *userdata)
+{
+	struct lcfs_image_data data = { 0 };
+	struct lcfs_image_walker *walker;
+	uint64_t erofs_root_nid;
+	int errsv;
+	int ret;
+
+	assert(opts);
+
+	if (lcfs_image_data_init(&data, image_data, image_data_size,
+				 &erofs_root_nid) < 0)
+		return -1;
+
+	data.include_paths = opts->include_paths;
+	data.exclude_paths = opts->exclude_paths;
+	data.max_depth = opts->max_depth;
+
+	walker = lcfs_image_walker_new(&data, opts, cb, userdata);
+	if (walker == NULL)
+		return -1;
+
+	ret = lcfs_image_walker_start(walker, erofs_root_nid);
+	if (ret == 0)
+		ret = lcfs_image_walk_inode(walker, erofs_root_nid, 1, 0);
+
+	errsv = errno;
+	lcfs_image_walker_free(walker);
+	errno = errsv;
+
+	return ret;
+}
+
+#define LCFS_IMAGE_NO_NID UINT64_MAX
+
+/* Walks two images side by side, with the walker of the old image
+ * passing what only it has as removed, and the new one as added */
+struct lcfs_image_differ {
+	struct lcfs_image_walker *old;
+	struct lcfs_image_walker *new;
+	lcfs_image_diff_cb cb;
+	void *userdata;
+};
+
+struct lcfs_image_diff_dirent {
+	uint64_t nid;
+	const char *name; /* Not NUL terminated */
+	size_t name_len;
+};
+
+struct lcfs_image_diff_dirents {
+	struct lcfs_image_diff_dirent *dirents;
+	size_t n_dirents;
+	size_t capacity;
+};
+
+static int lcfs_image_diff_removed(const struct lcfs_image_entry_s *entry,
+				   void *userdata)
+{
+	struct lcfs_image_differ *differ = userdata;
+
+	return differ->cb(LCFS_IMAGE_CHANGE_REMOVED, entry, NULL, differ->userdata);
+}
+
+static int lcfs_image_diff_added(const struct lcfs_image_entry_s *entry,
+				 void *userdata)
+{
+	struct lcfs_image_differ *differ = userdata;
+
+	return differ->cb(LCFS_IMAGE_CHANGE_ADDED, NULL, entry, differ->userdata);
+}
+
+static bool lcfs_image_str_equal(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+	return strcmp(a, b) == 0;
+}
+
+/* The xattrs are compared as sets, their order in the image doesn't matter */
+static bool lcfs_image_xattrs_equal(const struct lcfs_image_entry_s *a,
+				    const struct lcfs_image_entry_s *b)
+{
+	if (a->n_xattrs != b->n_xattrs)
+		return false;
+
+	for (size_t i = 0; i < a->n_xattrs; i++) {
+		const struct lcfs_image_xattr_s *xa = &a->xattrs[i];
+		bool found = false;
+
+		for (size_t j = 0; j < b->n_xattrs; j++) {
+			const struct lcfs_image_xattr_s *xb = &b->xattrs[j];
+
+			if (strcmp(xa->name, xb->name) == 0) {
+				found = xa->value_len == xb->value_len &&
+					memcmp(xa->value, xb->value, xa->value_len) == 0;
+				break;
+			}
+		}
+		if (!found)
+			return false;
+	}
+
+	return true;
+}
+
+static bool lcfs_image_entries_equal(const struct lcfs_image_entry_s *a,
+				     const struct lcfs_image_entry_s *b)
+{
+	if (a->mode != b->mode || a->uid != b->uid || a->gid != b->gid ||
+	    a->rdev != b->rdev || a->mtime_sec != b->mtime_sec ||
+	    a->mtime_nsec != b->mtime_nsec)
+		return false;
+
+	/* The size and nlink of a directory follow from its entries,
+	 * which are compared on their own */
+	if ((a->mode & S_IFMT) != S_IFDIR &&
+	    (a->nlink != b->nlink || a->size != b->size))
+		return false;
+
+	if ((a->content == NULL) != (b->content == NULL) ||
+	    (a->content != NULL && memcmp(a->content, b->content, a->size) != 0))
+		return false;
+
+	if ((a->digest == NULL) != (b->digest == NULL) ||
+	    (a->digest != NULL && memcmp(a->digest, b->digest, LCFS_DIGEST_SIZE) != 0))
+		return false;
+
+	return lcfs_image_str_equal(a->payload, b->payload) &&
+	       lcfs_image_str_equal(a->hardlink_target, b->hardlink_target) &&
+	       lcfs_image_xattrs_equal(a, b);
+}
+
+static int lcfs_image_diff_collect(uint64_t nid, uint8_t file_type,
+				   const char *name, size_t name_len, void *userdata)
+{
+	struct lcfs_image_diff_dirents *dirents = userdata;
+	struct lcfs_image_diff_dirent *d;
+
+	if (dirents->n_dirents == dirents->capacity) {
+		size_t capacity = dirents->capacity ? dirents->capacity * 2 : 16;
+
+		d = reallocarray(dirents->dirents, capacity, sizeof(*d));
+		if (d == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		dirents->dirents = d;
+		dirents->capacity = capacity;
+	}
+
+	d = &dirents->dirents[dirents->n_dirents++];
+	d->nid = nid;
+	d->name = name;
+	d->name_len = name_len;
+
+	return 0;
+}
+
+/* The order of erofs dirents, which is strcmp() order of the names */
+static int lcfs_image_diff_dirent_cmp(const void *_a, const void *_b)
+{
+	const struct lcfs_image_diff_dirent *a = _a;
+	const struct lcfs_image_diff_dirent *b = _b;
+	int ret;
+
+	ret = memcmp(a->name, b->name, min(a->name_len, b->name_len));
+	if (ret != 0)
+		return ret;
+	if (a->name_len != b->name_len)
+		return a->name_len < b->name_len ? -1 : 1;
+	return 0;
+}
+
+static int lcfs_image_diff_pair(struct lcfs_image_differ *differ,
+				uint64_t old_nid, size_t old_path_len,
+				uint64_t new_nid, size_t new_path_len,
+				uint32_t depth);
+
+/* Diffs the entries called @name, from one or both of the directories */
+static int lcfs_image_diff_dirent(struct lcfs_image_differ *differ,
+				  const struct lcfs_image_diff_dirent *old_dirent,
+				  struct lcfs_image_walk_dir *old_dir,
+				  const struct lcfs_image_diff_dirent *new_dirent,
+				  struct lcfs_image_walk_dir *new_dir)
+{
+	size_t old_path_len = 0;
+	size_t new_path_len = 0;
+	int wanted;
+
+	/* Both images have the same filters, so the name is wanted or not in both */
+	if (old_dirent != NULL) {
+		wanted = lcfs_image_walk_wanted(old_dir, old_dirent->name,
+						old_dirent->name_len, &old_path_len);
+		if (wanted <= 0)
+			return wanted;
+	}
+	if (new_dirent != NULL) {
+		wanted = lcfs_image_walk_wanted(new_dir, new_dirent->name,
+						new_dirent->name_len, &new_path_len);
+		if (wanted <= 0)
+			return wanted;
+	}
+
+	return lcfs_image_diff_pair(
+		differ, old_dirent ? old_dirent->nid : LCFS_IMAGE_NO_NID, old_path_len,
+		new_dirent ? new_dirent->nid : LCFS_IMAGE_NO_NID, new_path_len,
+		old_dir->depth);
+}
+
+/* Merges the entries of two directories at @depth, in name order */
+static int lcfs_image_diff_dir(struct lcfs_image_differ *differ,
+			       uint64_t old_nid, const erofs_inode *old_cino,
+			       const struct erofs_inode_info *old_info,
+			       size_t old_path_len, uint64_t new_nid,
+			       const erofs_inode *new_cino,
+			       const struct erofs_inode_info *new_info,
+			       size_t new_path_len, uint32_t depth)
+{
+	struct lcfs_image_diff_dirents old_dirents = { 0 };
+	struct lcfs_image_diff_dirents new_dirents = { 0 };
+	struct lcfs_image_walk_dir old_dir = {
+		.walker = differ->old,
+		.path_len = depth == 0 ? 0 : old_path_len,
+		.depth = depth + 1,
+	};
+	struct lcfs_image_walk_dir new_dir = {
+		.walker = differ->new,
+		.path_len = depth == 0 ? 0 : new_path_len,
+		.depth = depth + 1,
+	};
+	size_t i = 0, j = 0;
+	int ret;
+
+	ret = lcfs_image_walk_enter(differ->old, old_nid, depth);
+	if (ret < 0)
+		return ret;
+	ret = lcfs_image_walk_enter(differ->new, new_nid, depth);
+	if (ret <= 0)
+		return ret;
+
+	ret = erofs_foreach_dirent(differ->old->data, old_cino, old_info,
+				   lcfs_image_diff_collect, &old_dirents);
+	if (ret == 0)
+		ret = erofs_foreach_dirent(differ->new->data, new_cino, new_info,
+					   lcfs_image_diff_collect, &new_dirents);
+	if (ret != 0)
+		goto out;
+
+	/* Already sorted in images written by mkcomposefs, but it isn't
+	 * worth trusting that for others */
+	if (old_dirents.n_dirents > 1)
+		qsort(old_dirents.dirents, old_dirents.n_dirents,
+		      sizeof(struct lcfs_image_diff_dirent),
+		      lcfs_image_diff_dirent_cmp);
+	if (new_dirents.n_dirents > 1)
+		qsort(new_dirents.dirents, new_dirents.n_dirents,
+		      sizeof(struct lcfs_image_diff_dirent),
+		      lcfs_image_diff_dirent_cmp);
+
+	while (ret == 0 && (i < old_dirents.n_dirents || j < new_dirents.n_dirents)) {
+		const struct lcfs_image_diff_dirent *old_dirent = NULL;
+		const struct lcfs_image_diff_dirent *new_dirent = NULL;
+		int cmp;
+
+		if (i == old_dirents.n_dirents)
+			cmp = 1;
+		else if (j == new_dirents.n_dirents)
+			cmp = -1;
+		else
+			cmp = lcfs_image_diff_dirent_cmp(&old_dirents.dirents[i],
+							 &new_dirents.dirents[j]);
+
+		if (cmp <= 0)
+			old_dirent = &old_dirents.dirents[i++];
+		if (cmp >= 0)
+			new_dirent = &new_dirents.dirents[j++];
+
+		ret = lcfs_image_diff_dirent(differ, old_dirent, &old_dir,
+					     new_dirent, &new_dir);
+	}
+
+out:
+	free(old_dirents.dirents);
+	free(new_dirents.dirents);
+	return ret;
+}
+
+/* Diffs the inodes @old_nid and @new_nid, either of which may be
+ * LCFS_IMAGE_NO_NID, with their paths in the walkers */
+static int lcfs_image_diff_pair(struct lcfs_image_differ *differ,
+				uint64_t old_nid, size_t old_path_len,
+				uint64_t new_nid, size_t new_path_len, uint32_t depth)
+{
+	struct lcfs_image_entry_s old_entry, new_entry;
+	struct erofs_inode_info old_info, new_info;
+	const erofs_inode *old_cino = NULL;
+	const erofs_inode *new_cino = NULL;
+	int have_old = 0;
+	int have_new = 0;
+	int ret;
+
+	if (old_nid != LCFS_IMAGE_NO_NID) {
+		have_old = lcfs_image_walk_decode(differ->old, old_nid,
+						  old_path_len, depth, &old_entry,
+						  &old_cino, &old_info);
+		if (have_old < 0)
+			return -1;
+	}
+	if (new_nid != LCFS_IMAGE_NO_NID) {
+		have_new = lcfs_image_walk_decode(differ->new, new_nid,
+						  new_path_len, depth, &new_entry,
+						  &new_cino, &new_info);
+		if (have_new < 0)
+			return -1;
+	}
+
+	if (have_old && have_new &&
+	    (old_entry.mode & S_IFMT) == (new_entry.mode & S_IFMT)) {
+		if (!lcfs_image_entries_equal(&old_entry, &new_entry)) {
+			ret = differ->cb(LCFS_IMAGE_CHANGE_MODIFIED, &old_entry,
+					 &new_entry, differ->userdata);
+			if (ret != 0)
+				return ret;
+		}
+
+		if ((old_entry.mode & S_IFMT) != S_IFDIR)
+			return 0;
+
+		return lcfs_image_diff_dir(differ, old_nid, old_cino, &old_info,
+					   old_path_len, new_nid, new_cino,
+					   &new_info, new_path_len, depth);
+	}
+
+	/* Only in one of the images, or replaced by another type of file,
+	 * which for directories means everything below them too */
+	if (have_old) {
+		ret = lcfs_image_walk_emit(differ->old, &old_entry, old_nid,
+					   old_cino, &old_info, old_path_len);
+		if (ret != 0)
+			return ret;
+	}
+	if (have_new)
+		return lcfs_image_walk_emit(differ->new, &new_entry, new_nid,
+					    new_cino, &new_info, new_path_len);
+
+	return 0;
+}
+
+int lcfs_image_diff_data(const uint8_t *old_image_data, size_t old_image_data_size,
+			 const uint8_t *new_image_data, size_t new_image_data_size,
+			 const struct lcfs_read_options_s *opts,
+			 lcfs_image_diff_cb cb, void *userdata)
+{
+	struct lcfs_image_data old_data = { 0 };
+	struct lcfs_image_data new_data = { 0 };
+	struct lcfs_image_differ differ = { 0 };
+	uint64_t old_root_nid, new_root_nid;
+	int errsv;
+	int ret = -1;
+
+	assert(opts);
+
+	if (lcfs_image_data_init(&old_data, old_image_data, old_image_data_size,
+				 &old_root_nid) < 0 ||
+	    lcfs_image_data_init(&new_data, new_image_data, new_image_data_size,
+				 &new_root_nid) < 0)
+		return -1;
+
+	old_data.include_paths = new_data.include_paths = opts->include_paths;
+	old_data.exclude_paths = new_data.exclude_paths = opts->exclude_paths;
+	old_data.max_depth = new_data.max_depth = opts->max_depth;
+
+	differ.cb = cb;
+	differ.userdata = userdata;
+	differ.old = lcfs_image_walker_new(&old_data, opts,
+					   lcfs_image_diff_removed, &differ);
+	if (differ.old == NULL)
+		goto out;
+	differ.new = lcfs_image_walker_new(&new_data, opts,
+					   lcfs_image_diff_added, &differ);
+	if (differ.new == NULL)
+		goto out;
+
+	if (lcfs_image_walker_start(differ.old, old_root_nid) < 0 ||
+	    lcfs_image_walker_start(differ.new, new_root_nid) < 0)
+		goto out;
+
+	ret = lcfs_image_diff_pair(&differ, old_root_nid, 1, new_root_nid, 1, 0);
+
+out:
+	errsv = errno;
+	lcfs_image_walker_free(differ.old);
+	lcfs_image_walker_free(differ.new);
+	errno = errsv;
+
+	return ret;
+}
+
+struct lcfs_image_shared_xattr {
+	uint32_t idx;
+};
+
+static bool shared_xattr_ht_eq(const void *value, const void *key)
+{
+	const struct lcfs_image_shared_xattr *xattr = value;
+
+	return xattr->idx == *(const uint32_t *)key;
+}
+
+struct lcfs_image_stats_ctx {
+	struct lcfs_image_data *data;
+	struct lcfs_image_stats_s *stats;
+	lcfs_image_stats_dir_cb dir_cb;
+	void *userdata;
+
+	char *path;
+	size_t path_size;
+
+	uint8_t *nids_seen; /* Bitmap */
+	uint64_t n_nids;
+	uint8_t *blocks_seen; /* Bitmap, for blocks shared by dedup */
+	uint64_t n_blocks;
+	struct lcfs_ht shared_xattrs; /* struct lcfs_image_shared_xattr */
+	uint64_t inodes_end;
+};
+
+struct lcfs_image_stats_dir {
+	struct lcfs_image_stats_ctx *ctx;
+	size_t path_len; /* Of the directory, 0 for the root */
+	uint64_t n_entries;
+};
+
+static int lcfs_image_stats_inode(struct lcfs_image_stats_ctx *ctx,
+				  uint64_t nid, size_t path_len);
+
+static int lcfs_image_stats_dirent(uint64_t nid, uint8_t file_type,
+				   const char *name, size_t name_len,
+				   void *userdata)
+{
+	struct lcfs_image_stats_dir *dir = userdata;
+	struct lcfs_image_stats_ctx *ctx = dir->ctx;
+	size_t path_len = dir->path_len + 1 + name_len;
+
+	dir->n_entries++;
+
+	if (path_len >= ctx->path_size) {
+		size_t new_size = max(ctx->path_size * 2, path_len + 1);
+		char *new_path = realloc(ctx->path, new_size);
+
+		if (new_path == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		ctx->path = new_path;
+		ctx->path_size = new_size;
+	}
+	ctx->path[dir->path_len] = '/';
+	memcpy(ctx->path + dir->path_len + 1, name, name_len);
+	ctx->path[path_len] = 0;
+
+	return lcfs_image_stats_inode(ctx, nid, path_len);
+}
+
+/* Counts the shared xattrs of @cino, and the table entries they use */
+static int lcfs_image_stats_shared_xattrs(struct lcfs_image_stats_ctx *ctx,
+					  const erofs_inode *cino,
+					  const struct erofs_inode_info *info)
+{
+	struct lcfs_image_data *data = ctx->data;
+	struct lcfs_image_stats_s *stats = ctx->stats;
+	const struct erofs_xattr_ibody_header *xattr_header =
+		(const void *)((const uint8_t *)cino + info->isize);
+
+	for (int i = 0; i < xattr_header->h_shared_count; i++) {
+		uint32_t idx = lcfs_u32_from_file(xattr_header->h_shared_xattrs[i]);
+		uint64_t hash = lcfs_ht_hash_u64(idx);
+		const struct erofs_xattr_entry *entry =
+			(const void *)(data->erofs_xattrdata + (uint64_t)idx * 4);
+		struct lcfs_image_shared_xattr *xattr;
+
+		stats->shared_xattr_refs++;
+
+		if (lcfs_ht_lookup(&ctx->shared_xattrs, hash, &idx, shared_xattr_ht_eq))
+			continue;
+
+		if ((const uint8_t *)entry + sizeof(*entry) > data->erofs_xattrdata_end) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		xattr = malloc(sizeof(*xattr));
+		if (xattr == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		xattr->idx = idx;
+		if (lcfs_ht_insert(&ctx->shared_xattrs, hash, xattr) < 0) {
+			free(xattr);
+			errno = ENOMEM;
+			return -1;
+		}
+
+		stats->shared_xattrs++;
+		stats->shared_xattr_size +=
+			round_up(sizeof(*entry) + entry->e_name_len +
+					 lcfs_u16_from_file(entry->e_value_size),
+				 4);
+	}
+
+	return 0;
+}
+
+/* Counts the data blocks of the flat inode @cino, returning how many
+ * there are */
+static int lcfs_image_stats_blocks(struct lcfs_image_stats_ctx *ctx,
+				   const struct erofs_inode_info *info,
+				   uint64_t oob_size, uint64_t *n_blocks_out)
+{
+	struct lcfs_image_stats_s *stats = ctx->stats;
+	uint64_t n_blocks = DIV_ROUND_UP(oob_size, EROFS_BLKSIZ);
+
+	if (erofs_inode_oob_data(ctx->data, info, oob_size) == NULL)
+		return -1;
+
+	for (uint64_t i = 0; i < n_blocks; i++) {
+		uint64_t block = info->raw_blkaddr + i;
+
+		if (nid_bitmap_test_and_set(ctx->blocks_seen, block))
+			continue;
+
+		stats->data_blocks++;
+		stats->data_bytes += min(oob_size - i * EROFS_BLKSIZ,
+					 (uint64_t)EROFS_BLKSIZ);
+	}
+
+	*n_blocks_out = n_blocks;
+	return 0;
+}
+
+static int lcfs_image_stats_inode(struct lcfs_image_stats_ctx *ctx,
+				  uint64_t nid, size_t path_len)
+{
+	struct lcfs_image_data *data = ctx->data;
+	struct lcfs_image_stats_s *stats = ctx->stats;
+	struct lcfs_image_stats_dir dir;
+	struct lcfs_inode_s inode = { 0 };
+	struct erofs_inode_info info;
+	const erofs_inode *cino;
+	const uint8_t *inode_end;
+	size_t xattr_size;
+	size_t tail_size = 0;
+	uint64_t n_blocks = 0;
+	uint16_t layout;
+	int ret;
+
+	if (nid >= ctx->n_nids) {
+		errno = EINVAL;
+		return -1;
+	}
+	cino = lcfs_image_get_erofs_inode(data, nid);
+	if (cino == NULL)
+		return -1;
+
+	/* Hardlinks, and directories linked twice in a broken image */
+	if (nid_bitmap_test_and_set(ctx->nids_seen, nid))
+		return 0;
+
+	erofs_decode_inode(data, cino, &inode, &info);
+	xattr_size = erofs_xattr_inode_size(info.xattr_icount);
+	layout = erofs_inode_datalayout(cino);
+
+	if (layout == EROFS_INODE_FLAT_INLINE) {
+		tail_size = erofs_inode_tail_size(cino, &info);
+	} else if (layout == EROFS_INODE_CHUNK_BASED && info.file_size > 0) {
+		uint16_t format = lcfs_u16_from_file(
+			erofs_inode_is_compact(cino) ? cino->compact.i_u.c.format :
+						       cino->extended.i_u.c.format);
+		uint32_t chunkbits = EROFS_BLKSIZ_BITS +
+				     (format & EROFS_CHUNK_FORMAT_BLKBITS_MASK);
+		size_t index_size = (format & EROFS_CHUNK_FORMAT_INDEXES) ?
+					    sizeof(struct erofs_inode_chunk_index) :
+					    sizeof(uint32_t);
+
+		if (chunkbits >= 64) {
+			errno = EINVAL;
+			return -1;
+		}
+		tail_size = DIV_ROUND_UP(info.file_size, (uint64_t)1 << chunkbits) *
+			    index_size;
+	}
+
+	inode_end = (const uint8_t *)cino + info.isize + xattr_size;
+	if (inode_end > data->erofs_metadata_end ||
+	    tail_size > (size_t)(data->erofs_metadata_end - inode_end)) {
+		errno = EINVAL;
+		return -1;
+	}
+	inode_end += tail_size;
+	ctx->inodes_end = max(ctx->inodes_end, (uint64_t)(inode_end - data->erofs_data));
+
+	stats->inodes++;
+	if (erofs_inode_is_compact(cino))
+		stats->compact_inodes++;
+	else
+		stats->extended_inodes++;
+	stats->inode_bytes += info.isize;
+	stats->inline_xattr_bytes += xattr_size;
+
+	if (xattr_size > 0 && lcfs_image_stats_shared_xattrs(ctx, cino, &info) < 0)
+		return -1;
+
+	if (layout == EROFS_INODE_CHUNK_BASED) {
+		stats->chunk_index_bytes += tail_size;
+	} else if (erofs_inode_is_flat(cino) && info.file_size > 0) {
+		stats->inline_data_bytes += tail_size;
+		switch (inode.st_mode & S_IFMT) {
+		case S_IFDIR:
+			stats->inline_dirent_bytes += tail_size;
+			break;
+		case S_IFLNK:
+			stats->inline_symlink_bytes += tail_size;
+			break;
+		default:
+			stats->inline_file_bytes += tail_size;
+			break;
+		}
+		stats->flat_inodes++;
+		if (tail_size > 0)
+			stats->tailpacked_inodes++;
+		if (lcfs_image_stats_blocks(ctx, &info, info.file_size - tail_size,
+					    &n_blocks) < 0)
+			return -1;
+	}
+
+	if ((inode.st_mode & S_IFMT) != S_IFDIR)
+		return 0;
+
+	stats->dirs++;
+	stats->dir_blocks += n_blocks;
+
+	dir.ctx = ctx;
+	dir.path_len = path_len;
+	dir.n_entries = 0;
+	ret = erofs_foreach_dirent(data, cino, &info, lcfs_image_stats_dirent, &dir);
+	if (ret != 0)
+		return ret;
+
+	if (ctx->dir_cb == NULL)
+		return 0;
+
+	/* The entries have used the path buffer past our own path */
+	ctx->path[path_len] = 0;
+	return ctx->dir_cb(path_len == 0 ? "/" : ctx->path, info.file_size,
+			   dir.n_entries, ctx->userdata);
+}
+
+int lcfs_image_stats_data(const uint8_t *image_data, size_t image_data_size,
+			  struct lcfs_image_stats_s *stats,
+			  lcfs_image_stats_dir_cb dir_cb, void *userdata)
+{
+	struct lcfs_image_data data = { 0 };
+	struct lcfs_image_stats_ctx ctx = { 0 };
+	struct lcfs_image_shared_xattr *xattr;
+	uint64_t erofs_root_nid;
+	uint64_t used;
+	size_t iter = 0;
+	int errsv;
+	int ret = -1;
+
+	if (lcfs_image_data_init(&data, image_data, image_data_size,
+				 &erofs_root_nid) < 0)
+		return -1;
+
+	if (lcfs_ht_init(&ctx.shared_xattrs, 0) < 0)
+		return -1;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->image_size = image_data_size;
+
+	ctx.data = &data;
+	ctx.stats = stats;
+	ctx.dir_cb = dir_cb;
+	ctx.userdata = userdata;
+	ctx.n_nids = (data.erofs_metadata_end - data.erofs_metadata) >>
+		     EROFS_ISLOTBITS;
+	ctx.n_blocks = DIV_ROUND_UP(image_data_size, EROFS_BLKSIZ);
+	ctx.path_size = PATH_MAX;
+	ctx.path = malloc(ctx.path_size);
+	ctx.nids_seen = calloc(ctx.n_nids / 8 + 1, 1);
+	ctx.blocks_seen = calloc(ctx.n_blocks / 8 + 1, 1);
+	if (ctx.path == NULL || ctx.nids_seen == NULL || ctx.blocks_seen == NULL) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	ctx.path[0] = 0;
+	ret = lcfs_image_stats_inode(&ctx, erofs_root_nid, 0);
+	if (ret != 0)
+		goto out;
+
+	/* What isn't counted is alignment, of inodes to slots and of the
+	 * areas and file data to blocks */
+	stats->metadata_size = ctx.inodes_end;
+	used = EROFS_SUPER_OFFSET + sizeof(struct erofs_super_block) +
+	       stats->inode_bytes + stats->inline_xattr_bytes +
+	       stats->inline_data_bytes + stats->chunk_index_bytes +
+	       stats->shared_xattr_size + stats->data_bytes;
+	if (used < stats->image_size)
+		stats->padding_bytes = stats->image_size - used;
+
+out:
+	errsv = errno;
+	while ((xattr = lcfs_ht_next(&ctx.shared_xattrs, &iter)) != NULL)
+		free(xattr);
+	lcfs_ht_destroy(&ctx.shared_xattrs);
+	free(ctx.path);
+	free(ctx.nids_seen);
+	free(ctx.blocks_seen);
+	errno = errsv;
+
+	return ret;
+}
@@ -14,7 +14,7 @@
 #include "lcfs-mount.h"
 #include "lcfs-erofs.h"
 #include "lcfs-erofs-internal.h"
-#include "hash.h"
+#include "lcfs-ht.h"
 
 #include <errno.h>
 #include <string.h>
@@ -31,6 +31,8 @@
 #include <assert.h>
 #include <sys/mman.h>
 #include <sys/sysmacros.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 static void lcfs_node_remove_all_children(struct lcfs_node_s *node);
 static void lcfs_node_destroy(struct lcfs_node_s *node);
@@ -58,14 +60,73 @@ char *maybe_join_path(const char *a, const char *b)
 	return res;
 }
 
-size_t hash_memory(const char *string, size_t len, size_t n_buckets)
+struct lcfs_parallel_job {
+	lcfs_parallel_fn fn;
+	void *data;
+	size_t n_items;
+	size_t chunk_size;
+	atomic_size_t next;
+};
+
+static void *lcfs_parallel_thread(void *data)
 {
-	size_t i, value = 0;
+	struct lcfs_parallel_job *job = data;
 
-	for (i = 0; i < len; i++) {
-		value = (value * 31 + string[i]);
+	for (;;) {
+		size_t start = atomic_fetch_add(&job->next, job->chunk_size);
+		if (start >= job->n_items)
+			break;
+		job->fn(job->data, start, min(start + job->chunk_size, job->n_items));
 	}
-	return value % n_buckets;
+
+	return NULL;
+}
+
+/* Calls fn on consecutive ranges of [0, n_items) from up to n_threads
+ * threads, including the calling one. Ranges are at least min_chunk
+ * items, so small inputs never pay for starting threads. If threads
+ * can't be started the calling thread does the remaining work. */
+void lcfs_parallel_for(uint32_t n_threads, size_t n_items, size_t min_chunk,
+		       lcfs_parallel_fn fn, void *data)
+{
+	struct lcfs_parallel_job job = {
+		.fn = fn,
+		.data = data,
+		.n_items = n_items,
+	};
+	pthread_t *threads;
+	size_t n_workers;
+
+	if (n_threads <= 1 || n_items <= min_chunk) {
+		fn(data, 0, n_items);
+		return;
+	}
+
+	/* A few chunks per thread evens out differences in cost */
+	job.chunk_size = max(min_chunk, n_items / ((size_t)n_threads * 4));
+	n_workers = min((size_t)n_threads,
+			(n_items + job.chunk_size - 1) / job.chunk_size) -
+		    1;
+	atomic_init(&job.next, 0);
+
+	threads = calloc(n_workers + 1, sizeof(pthread_t));
+	if (threads == NULL)
+		n_workers = 0;
+
+	for (size_t i = 0; i < n_workers; i++) {
+		if (pthread_create(&threads[i], NULL, lcfs_parallel_thread,
+				   &job) != 0) {
+			n_workers = i;
+			break;
+		}
+	}
+
+	lcfs_parallel_thread(&job);
+
+	for (size_t i = 0; i < n_workers; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
 }
 
 // Verify a mode value; we don't accept unknown values
@@ -109,6 +170,32 @@ static struct lcfs_ctx_s *lcfs_new_ctx(struct lcfs_node_s *root,
 	ret->options = options;
 	ret->root = lcfs_node_ref(root);
 
+	if (options->flags & LCFS_FLAGS_SEEKABLE_FD) {
+		/* The digest is computed from the file at the end */
+		ret->fd_output.fd = options->fd;
+		ret->file = &ret->fd_output;
+		ret->write_cb = lcfs_fd_output_write;
+		return ret;
+	}
+
+	if (options->digest_out && options->file_write_cb == NULL) {
+		ret->digest_output = calloc(1, sizeof(struct lcfs_digest_output));
+		if (ret->digest_output == NULL) {
+			lcfs_close(ret);
+			errno = ENOMEM;
+			return NULL;
+		}
+		ret->digest_output->fsverity_ctx = lcfs_fsverity_context_new();
+		if (ret->digest_output->fsverity_ctx == NULL) {
+			lcfs_close(ret);
+			errno = ENOMEM;
+			return NULL;
+		}
+		ret->file = ret->digest_output;
+		ret->write_cb = lcfs_digest_output_write;
+		return ret;
+	}
+
 	ret->file = options->file;
 	ret->write_cb = options->file_write_cb;
 	if (options->digest_out) {
@@ -170,18 +257,187 @@ static int cmp_xattr(const void *a, const void *b)
 	return strcmp(na->key, nb->key);
 }
 
-/* This ensures that the tree is in a well defined order, with
-   children sorted by name, and the nodes visited in breadth-first
-   order.  It also updates the inode offset. */
-int lcfs_compute_tree(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root)
+/* Places node next in the image, after all nodes placed so far, and
+   marks it so it isn't placed again. */
+static void lcfs_order_append(struct lcfs_ctx_s *ctx, struct lcfs_node_s *node)
 {
-	uint32_t index;
+	/* Avoid recursion */
+	assert(!node->in_tree);
+
+	node->in_tree = true;
+	node->next = NULL;
+	ctx->queue_end->next = node;
+	ctx->queue_end = node;
+}
+
+static int lcfs_order_push(struct lcfs_node_s ***stack, size_t *n_stack,
+			   size_t *stack_size, struct lcfs_node_s *node)
+{
+	if (*n_stack == *stack_size) {
+		size_t new_size = *stack_size ? *stack_size * 2 : 64;
+		struct lcfs_node_s **new_stack =
+			reallocarray(*stack, new_size, sizeof(struct lcfs_node_s *));
+		if (new_stack == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		*stack = new_stack;
+		*stack_size = new_size;
+	}
+	(*stack)[(*n_stack)++] = node;
+	return 0;
+}
+
+/* Places the nodes of the layout hints, and the directories leading to
+ * them, first */
+static int lcfs_order_hints(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root)
+{
+	const char *const *hints = ctx->options->layout_hints;
+
+	if (hints == NULL)
+		return 0;
+
+	for (; *hints != NULL; hints++) {
+		const char *path = *hints;
+		struct lcfs_node_s *node = root;
+		char name[NAME_MAX + 1];
+
+		for (;;) {
+			size_t len;
+
+			while (*path == '/')
+				path++;
+			len = strcspn(path, "/");
+			if (len == 0 || len > NAME_MAX)
+				break;
+
+			memcpy(name, path, len);
+			name[len] = 0;
+			path += len;
+
+			if (!lcfs_node_dirp(node))
+				break;
+			node = lcfs_node_lookup_child(node, name);
+			if (node == NULL)
+				break;
+			if (follow_links(node, &node) < 0)
+				return -1;
+			if (!node->in_tree)
+				lcfs_order_append(ctx, node);
+		}
+	}
+
+	return 0;
+}
+
+/* Links all nodes, except hardlinks, into the ctx->root list in the order
+ * they will be in the image, according to the layout options. Nodes are
+ * pushed in reverse on the stack so that siblings keep their order. Only
+ * directories are descended into, any children of other nodes are left
+ * for lcfs_compute_tree() to reject. */
+static int lcfs_order_tree(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root)
+{
+	cleanup_free struct lcfs_node_s **stack = NULL;
+	size_t n_stack = 0, stack_size = 0;
 	struct lcfs_node_s *node;
 
 	/* Start with the root node. */
-
 	ctx->queue_end = root;
 	root->in_tree = true;
+	root->next = NULL;
+
+	if (lcfs_order_hints(ctx, root) < 0)
+		return -1;
+
+	/* The hinted nodes are already in the tree, the rest are placed
+	 * around them. */
+	switch (ctx->options->layout) {
+	case LCFS_LAYOUT_BFS:
+		for (node = root; node != NULL; node = node->next) {
+			if (!lcfs_node_dirp(node))
+				continue;
+
+			for (size_t i = 0; i < node->children_size; i++) {
+				struct lcfs_node_s *child = node->children[i];
+
+				/* Skip hardlinks, they will not be serialized separately */
+				if (child->link_to == NULL && !child->in_tree)
+					lcfs_order_append(ctx, child);
+			}
+		}
+		break;
+
+	case LCFS_LAYOUT_DFS:
+		node = root;
+		for (;;) {
+			for (size_t i = lcfs_node_dirp(node) ? node->children_size : 0;
+			     i > 0; i--) {
+				struct lcfs_node_s *child = node->children[i - 1];
+
+				if (child->link_to == NULL &&
+				    lcfs_order_push(&stack, &n_stack, &stack_size,
+						    child) < 0)
+					return -1;
+			}
+
+			if (n_stack == 0)
+				break;
+			node = stack[--n_stack];
+			if (!node->in_tree)
+				lcfs_order_append(ctx, node);
+		}
+		break;
+
+	case LCFS_LAYOUT_CLUSTERED:
+		/* Only directories are pushed, so only the root can be
+		 * anything else */
+		node = root;
+		for (;;) {
+			if (!lcfs_node_dirp(node))
+				break;
+
+			for (size_t i = 0; i < node->children_size; i++) {
+				struct lcfs_node_s *child = node->children[i];
+
+				if (child->link_to == NULL && !child->in_tree)
+					lcfs_order_append(ctx, child);
+			}
+
+			for (size_t i = node->children_size; i > 0; i--) {
+				struct lcfs_node_s *child = node->children[i - 1];
+
+				if (child->link_to == NULL && lcfs_node_dirp(child) &&
+				    child->children_size > 0 &&
+				    lcfs_order_push(&stack, &n_stack, &stack_size,
+						    child) < 0)
+					return -1;
+			}
+
+			if (n_stack == 0)
+				break;
+			node = stack[--n_stack];
+		}
+		break;
+
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* This puts the tree in a well defined order, with the nodes in the
+   order chosen by lcfs_order_tree() for the layout option and their
+   xattrs sorted, and assigns the inode indexes in that order. It also
+   validates the tree and computes the per-image values. */
+int lcfs_compute_tree(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root)
+{
+	uint32_t index;
+	struct lcfs_node_s *node;
+
+	if (lcfs_order_tree(ctx, root) < 0)
+		return -1;
 
 	ctx->min_mtim_sec = root->inode.st_mtim_sec;
 	ctx->min_mtim_nsec = root->inode.st_mtim_nsec;
@@ -236,23 +492,6 @@ int lcfs_compute_tree(struct lcfs_ctx_s *ctx, struct lcfs_node_s *root)
 		if (lcfs_node_get_xattr(node, "system.posix_acl_access", NULL) != NULL ||
 		    lcfs_node_get_xattr(node, "system.posix_acl_default", NULL) != NULL)
 			ctx->has_acl = true;
-
-		node->in_tree = true;
-		/* Append to queue for more work */
-		for (size_t i = 0; i < node->children_size; i++) {
-			struct lcfs_node_s *child = node->children[i];
-
-			/* Skip hardlinks, they will not be serialized separately */
-			if (child->link_to != NULL) {
-				continue;
-			}
-
-			/* Avoid recursion */
-			assert(!child->in_tree);
-
-			ctx->queue_end->next = child;
-			ctx->queue_end = child;
-		}
 	}
 
 	/* Ensure all hardlinks are in tree */
@@ -296,6 +535,92 @@ int follow_links(struct lcfs_node_s *node, struct lcfs_node_s **out_node)
 	return 0;
 }
 
+ssize_t lcfs_fd_output_write(void *file, void *buf, size_t count)
+{
+	struct lcfs_fd_output *output = file;
+	ssize_t r;
+
+	do
+		r = pwrite(output->fd, buf, count, output->offset);
+	while (r < 0 && errno == EINTR);
+
+	if (r > 0)
+		output->offset += r;
+
+	return r;
+}
+
+static void lcfs_digest_output_flush(struct lcfs_digest_output *output)
+{
+	if (output->pos == FSVERITY_BLOCK_SIZE) {
+		lcfs_fsverity_context_update(output->fsverity_ctx,
+					     output->block, FSVERITY_BLOCK_SIZE);
+		output->pos = 0;
+	}
+}
+
+/* Gathers small writes into a block, and passes whole blocks through */
+ssize_t lcfs_digest_output_write(void *file, void *buf, size_t count)
+{
+	struct lcfs_digest_output *output = file;
+	uint8_t *data = buf;
+	size_t len = count;
+
+	if (output->pos > 0) {
+		size_t n = MIN(FSVERITY_BLOCK_SIZE - output->pos, len);
+
+		memcpy(output->block + output->pos, data, n);
+		output->pos += n;
+		data += n;
+		len -= n;
+		lcfs_digest_output_flush(output);
+		if (output->pos > 0)
+			return count;
+	}
+
+	if (len >= FSVERITY_BLOCK_SIZE) {
+		size_t n = round_down(len, FSVERITY_BLOCK_SIZE);
+
+		lcfs_fsverity_context_update(output->fsverity_ctx, data, n);
+		data += n;
+		len -= n;
+	}
+
+	memcpy(output->block, data, len);
+	output->pos = len;
+
+	return count;
+}
+
+static void lcfs_digest_output_pad(struct lcfs_digest_output *output, size_t len)
+{
+	while (len > 0) {
+		size_t n = MIN(FSVERITY_BLOCK_SIZE - output->pos, len);
+
+		memset(output->block + output->pos, 0, n);
+		output->pos += n;
+		len -= n;
+		lcfs_digest_output_flush(output);
+	}
+}
+
+/* Computes the fs-verity digest of the image written to a seekable fd */
+static int lcfs_fd_output_digest(struct lcfs_ctx_s *ctx, uint8_t *digest)
+{
+	size_t size = ctx->bytes_written;
+	void *data;
+
+	data = mmap(NULL, size, PROT_READ, MAP_SHARED, ctx->fd_output.fd, 0);
+	if (data == MAP_FAILED)
+		return -1;
+
+	madvise(data, size, MADV_SEQUENTIAL);
+	lcfs_compute_fsverity_from_data(digest, data, size);
+	munmap(data, size);
+
+	return 0;
+}
+
 int lcfs_write(struct lcfs_ctx_s *ctx, void *_data, size_t data_len)
 {
 	uint8_t *data = _data;
@@ -323,6 +648,21 @@ int lcfs_write_pad(struct lcfs_ctx_s *ctx, size_t data_len)
 {
 	char buf[256] = { 0 };
 
+	if (ctx->write_cb == lcfs_digest_output_write) {
+		ctx->bytes_written += data_len;
+		lcfs_digest_output_pad(ctx->file, data_len);
+		return 0;
+	}
+
+	/* Seekable output is zero-filled up front, leave a hole */
+	if (ctx->write_cb == lcfs_fd_output_write) {
+		struct lcfs_fd_output *output = ctx->file;
+
+		ctx->bytes_written += data_len;
+		output->offset += data_len;
+		return 0;
+	}
+
 	for (size_t i = 0; i < data_len; i += sizeof(buf)) {
 		size_t to_write = MIN(sizeof(buf), data_len - i);
 		int r = lcfs_write(ctx, buf, to_write);
@@ -353,6 +693,11 @@ static int lcfs_close(struct lcfs_ctx_s *ctx)
 
 	if (ctx->fsverity_ctx)
 		lcfs_fsverity_context_free(ctx->fsverity_ctx);
+	if (ctx->digest_output) {
+		if (ctx->digest_output->fsverity_ctx)
+			lcfs_fsverity_context_free(ctx->digest_output->fsverity_ctx);
+		free(ctx->digest_output);
+	}
 	if (ctx->root) {
 		if (ctx->destroy_root) {
 			lcfs_node_destroy(ctx->root);
@@ -408,6 +753,17 @@ int lcfs_write_to(struct lcfs_node_s *root, struct lcfs_write_options_s *options
 		options->max_version = options->version;
 	}
 
+	if (options->layout > LCFS_LAYOUT_CLUSTERED) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((options->flags & LCFS_FLAGS_SEEKABLE_FD) &&
+	    (options->fd < 0 || options->file_write_cb != NULL)) {
+		errno = EINVAL;
+		return -1;
+	}
+
 	/* Update options->version up to options->max_version if needed */
 	lcfs_write_update_version(root, options);
 
@@ -429,7 +785,21 @@ int lcfs_write_to(struct lcfs_node_s *root, struct lcfs_write_options_s *options
 		return res;
 	}
 
-	if (options->digest_out) {
+	if (options->digest_out && (options->flags & LCFS_FLAGS_SEEKABLE_FD)) {
+		res = lcfs_fd_output_digest(ctx, options->digest_out);
+		if (res < 0) {
+			PROTECT_ERRNO;
+			lcfs_close(ctx);
+			return res;
+		}
+	} else if (ctx->digest_output) {
+		struct lcfs_digest_output *output = ctx->digest_output;
+
+		lcfs_fsverity_context_update(output->fsverity_ctx,
+					     output->block, output->pos);
+		lcfs_fsverity_context_get_digest(output->fsverity_ctx,
+						 options->digest_out);
+	} else if (options->digest_out) {
 		lcfs_fsverity_context_get_digest(ctx->fsverity_ctx,
 						 options->digest_out);
 	}
@@ -703,21 +1073,6 @@ int lcfs_fd_enable_fsverity(int fd)
 	return 0;
 }
 
-static void digest_to_path(const uint8_t *csum, char *buf)
-{
-	static const char hexchars[] = "0123456789abcdef";
-	uint32_t i, j;
-
-	for (i = 0, j = 0; i < LCFS_DIGEST_SIZE; i++, j += 2) {
-		uint8_t byte = csum[i];
-		if (i == 1)
-			buf[j++] = '/';
-		buf[j] = hexchars[byte >> 4];
-		buf[j + 1] = hexchars[byte & 0xF];
-	}
-	buf[j] = '\0';
-}
-
 int lcfs_node_set_from_content(struct lcfs_node_s *node, int dirfd,
 			       const char *fname, int buildflags)
 {
@@ -899,6 +1254,105 @@ struct lcfs_node_s *lcfs_load_node_from_fd_ext(int fd,
 	return node;
 }
 
+int lcfs_image_walk(int fd, const struct lcfs_read_options_s *opts,
+		    lcfs_image_walk_cb cb, void *userdata)
+{
+	uint8_t *image_data;
+	size_t image_data_size;
+	struct stat s;
+	int errsv;
+	int r;
+
+	r = fstat(fd, &s);
+	if (r < 0) {
+		return -1;
+	}
+
+	image_data_size = s.st_size;
+
+	image_data = mmap(0, image_data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (image_data == MAP_FAILED) {
+		return -1;
+	}
+
+	r = lcfs_image_walk_data(image_data, image_data_size, opts, cb, userdata);
+
+	errsv = errno;
+	munmap(image_data, image_data_size);
+	errno = errsv;
+
+	return r;
+}
+
+static uint8_t *lcfs_mmap_image(int fd, size_t *size_out)
+{
+	uint8_t *image_data;
+	struct stat s;
+
+	if (fstat(fd, &s) < 0)
+		return NULL;
+
+	image_data = mmap(0, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (image_data == MAP_FAILED)
+		return NULL;
+
+	*size_out = s.st_size;
+	return image_data;
+}
+
+int lcfs_image_diff(int old_fd, int new_fd, const struct lcfs_read_options_s *opts,
+		    lcfs_image_diff_cb cb, void *userdata)
+{
+	uint8_t *old_data, *new_data;
+	size_t old_size, new_size;
+	int errsv;
+	int r;
+
+	old_data = lcfs_mmap_image(old_fd, &old_size);
+	if (old_data == NULL)
+		return -1;
+
+	new_data = lcfs_mmap_image(new_fd, &new_size);
+	if (new_data == NULL) {
+		errsv = errno;
+		munmap(old_data, old_size);
+		errno = errsv;
+		return -1;
+	}
+
+	r = lcfs_image_diff_data(old_data, old_size, new_data, new_size, opts,
+				 cb, userdata);
+
+	errsv = errno;
+	munmap(old_data, old_size);
+	munmap(new_data, new_size);
+	errno = errsv;
+
+	return r;
+}
+
+int lcfs_image_stats(int fd, struct lcfs_image_stats_s *stats,
+		     lcfs_image_stats_dir_cb dir_cb, void *userdata)
+{
+	uint8_t *image_data;
+	size_t image_data_size;
+	int errsv;
+	int r;
+
+	image_data = lcfs_mmap_image(fd, &image_data_size);
+	if (image_data == NULL)
+		return -1;
+
+	r = lcfs_image_stats_data(image_data, image_data_size, stats, dir_cb,
+				  userdata);
+
+	errsv = errno;
+	munmap(image_data, image_data_size);
+	errno = errsv;
+
+	return r;
+}
+
 struct lcfs_node_s *lcfs_load_node_from_fd(int fd)
 {
 	struct lcfs_read_options_s opts = {
@@ -1120,8 +1574,8 @@ void lcfs_node_get_mtime(struct lcfs_node_s *node, struct timespec *time)
 	time->tv_nsec = node->inode.st_mtim_nsec;
 }
 
-static struct lcfs_node_s *lcfs_node_bsearch_child(struct lcfs_node_s *node,
-						   const char *name, size_t *pos)
+struct lcfs_node_s *lcfs_node_bsearch_child(struct lcfs_node_s *node,
+					    const char *name, size_t *pos)
 {
 	size_t start = 0, end = node->children_size;
 
@@ -1299,6 +1753,28 @@ int lcfs_node_add_child(struct lcfs_node_s *parent, struct lcfs_node_s *child,
 	return 0;
 }
 
+/* Unlinks the child and drops the reference the parent had to it */
+int lcfs_node_remove_child(struct lcfs_node_s *parent, const char *name)
+{
+	size_t pos;
+	struct lcfs_node_s *child = lcfs_node_bsearch_child(parent, name, &pos);
+	if (child == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	memmove(parent->children + pos, parent->children + pos + 1,
+		(parent->children_size - pos - 1) * sizeof(struct lcfs_node_s *));
+	parent->children_size -= 1;
+
+	free(child->name);
+	child->name = NULL;
+	child->parent = NULL;
+	lcfs_node_destroy(child);
+
+	return 0;
+}
+
 struct lcfs_node_s *lcfs_node_ref(struct lcfs_node_s *node)
 {
 	node->ref_count++;
@@ -1404,6 +1880,7 @@ struct lcfs_node_s *lcfs_node_clone(struct lcfs_node_s *node)
 			new->xattrs[i].key = key;
 			new->xattrs[i].value = value;
 			new->xattrs[i].value_len = node->xattrs[i].value_len;
+			new->xattrs[i].hash = node->xattrs[i].hash;
 			new->n_xattrs++;
 		}
 	}
@@ -1504,8 +1981,9 @@ bool lcfs_node_dirp(struct lcfs_node_s *node)
 	return (node->inode.st_mode & S_IFMT) == S_IFDIR;
 }
 
-struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
-			       char **failed_path_out)
+struct lcfs_node_s *lcfs_build_with_cb(int dirfd, const char *fname,
+				       int buildflags, char **failed_path_out,
+				       lcfs_build_cb cb, void *userdata)
 {
 	struct lcfs_node_s *node = NULL;
 	struct dirent *de;
@@ -1521,6 +1999,9 @@ struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
 		goto fail;
 	}
 
+	if (cb)
+		cb(node, userdata);
+
 	if (!lcfs_node_dirp(node)) {
 		return node;
 	}
@@ -1572,8 +2053,9 @@ struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
 		}
 
 		if (de->d_type == DT_DIR) {
-			n = lcfs_build(dfd, de->d_name, buildflags,
-				       &free_failed_subpath);
+			n = lcfs_build_with_cb(dfd, de->d_name, buildflags,
+					       &free_failed_subpath, cb,
+					       userdata);
 			if (n == NULL) {
 				failed_subpath = free_failed_subpath;
 				errsv = errno;
@@ -1591,6 +2073,8 @@ struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
 				failed_subpath = de->d_name;
 				goto fail;
 			}
+			if (cb)
+				cb(n, userdata);
 		}
 
 		r = lcfs_node_add_child(node, n, de->d_name);
@@ -1617,6 +2101,13 @@ fail:
 	return NULL;
 }
 
+struct lcfs_node_s *lcfs_build(int dirfd, const char *fname, int buildflags,
+			       char **failed_path_out)
+{
+	return lcfs_build_with_cb(dirfd, fname, buildflags, failed_path_out,
+				  NULL, NULL);
+}
+
 size_t lcfs_node_get_n_xattr(struct lcfs_node_s *node)
 {
 	return node->n_xattrs;
@@ -1630,6 +2121,12 @@ const char *lcfs_node_get_xattr_name(struct lcfs_node_s *node, size_t index)
 	return node->xattrs[index].key;
 }
 
+static void update_xattr_hash(struct lcfs_xattr_s *xattr)
+{
+	xattr->hash = lcfs_ht_hash_bytes(xattr->value, xattr->value_len,
+					 lcfs_ht_hash_string(xattr->key));
+}
+
 static ssize_t find_xattr(struct lcfs_node_s *node, const char *name)
 {
 	ssize_t i;
@@ -1743,6 +2240,7 @@ int lcfs_node_set_xattr_internal(struct lcfs_node_s *node, const char *name,
 	xattrs[node->n_xattrs].key = k;
 	xattrs[node->n_xattrs].value = v;
 	xattrs[node->n_xattrs].value_len = value_len;
+	update_xattr_hash(&xattrs[node->n_xattrs]);
 	node->n_xattrs++;
 	node->xattr_size += entry_size;
 
@@ -1776,5 +2274,6 @@ int lcfs_node_rename_xattr(struct lcfs_node_s *node, size_t index, const char *n
 	xattr = &node->xattrs[index];
 	free(xattr->key);
 	xattr->key = steal_pointer(&dup);
+	update_xattr_hash(xattr);
 	return 0;
 }
@@ -32,9 +32,20 @@ enum lcfs_format_t {
 	LCFS_FORMAT_EROFS,
 };
 
+// The order of inodes, and of their data blocks, in the image
+enum lcfs_layout_t {
+	LCFS_LAYOUT_BFS, /* Breadth first, the default */
+	LCFS_LAYOUT_DFS, /* Depth first */
+	LCFS_LAYOUT_CLUSTERED, /* The children of each directory together, depth first */
+};
+
 enum lcfs_flags_t {
 	LCFS_FLAGS_NONE = 0,
-	LCFS_FLAGS_MASK = 0,
+	LCFS_FLAGS_SEEKABLE_FD = (1 << 0), /* Write to options->fd with pwrite() */
+	LCFS_FLAGS_DEDUP_BLOCKS = (1 << 1), /* Share identical inline content blocks */
+	LCFS_FLAGS_PACK_INODES = (1 << 2), /* Fill tail padding with nearby inodes */
+	LCFS_FLAGS_MASK = LCFS_FLAGS_SEEKABLE_FD | LCFS_FLAGS_DEDUP_BLOCKS |
+			  LCFS_FLAGS_PACK_INODES,
 };
 
 #define LCFS_VERSION_MAX 1
@@ -70,6 +81,25 @@ enum lcfs_flags_t {
 typedef ssize_t (*lcfs_read_cb)(void *file, void *buf, size_t count);
 typedef ssize_t (*lcfs_write_cb)(void *file, void *buf, size_t count);
 
+// Statistics about a written image, filled in by lcfs_write_to() when
+// stats_out is set in the write options. Times are in nanoseconds, the
+// layout phase covers everything up to and including inode placement.
+// n_dedup_blocks counts the content blocks that were not written because
+// an identical earlier file already has them (LCFS_FLAGS_DEDUP_BLOCKS).
+// tail_padding is the padding added so inline tails don't cross a block,
+// and padding_saved how much of it LCFS_FLAGS_PACK_INODES avoided.
+struct lcfs_write_stats_s {
+	uint64_t n_inodes;
+	uint64_t image_size;
+	uint64_t layout_time_ns;
+	uint64_t write_time_ns;
+	uint64_t n_data_blocks;
+	uint64_t n_dedup_blocks;
+	uint64_t tail_padding;
+	uint64_t padding_saved;
+	uint64_t reserved[4];
+};
+
 struct lcfs_write_options_s {
 	uint32_t format;
 	uint32_t version;
@@ -78,8 +108,22 @@ struct lcfs_write_options_s {
 	void *file;
 	lcfs_write_cb file_write_cb;
 	uint32_t max_version;
-	uint32_t reserved[3];
-	void *reserved2[4];
+	// Number of threads to use for computing the image layout, 0 or 1
+	// means everything is done in the calling thread.
+	uint32_t threads;
+	// With LCFS_FLAGS_SEEKABLE_FD, the image is written to this regular
+	// file, which must be open for reading and writing, instead of
+	// through file_write_cb. The file is truncated to the image size
+	// and regions are written out of order, and the digest is computed
+	// from the written file at the end.
+	int32_t fd;
+	uint32_t layout; /* enum lcfs_layout_t */
+	struct lcfs_write_stats_s *stats_out;
+	// If non-NULL, a NULL terminated array of paths that are placed
+	// first in the image, in this order, together with the directories
+	// leading to them. Paths that don't exist are ignored.
+	const char *const *layout_hints;
+	void *reserved2[2];
 };
 
 LCFS_EXTERN struct lcfs_node_s *lcfs_node_new(void);
@@ -93,11 +137,23 @@ LCFS_EXTERN struct lcfs_node_s *lcfs_load_node_from_image(const uint8_t *image_d
 							  size_t image_data_size);
 struct lcfs_read_options_s {
 	// If non-NULL, this is a NULL terminated array of filenames; only entries
-	// for these files will be loaded. At the current time only filenames (not full paths)
-	// are supported.
+	// for these files will be loaded. Only filenames (not full paths) are
+	// supported here, use include_paths for full paths.
 	const char *const *toplevel_entries;
-	uint32_t reserved[3];
-	void *reserved2[4];
+	// Number of threads to decode the image with, 0 or 1 decodes it on
+	// the calling thread. The result is the same either way.
+	uint32_t threads;
+	// If non-zero, entries more than this many levels below the root
+	// are not loaded.
+	uint32_t max_depth;
+	uint32_t reserved[1];
+	// If non-NULL, NULL terminated arrays of full paths in the image.
+	// Only entries at, below or leading to one of include_paths are
+	// loaded, and nothing at or below one of exclude_paths. Subtrees
+	// that are left out are never decoded.
+	const char *const *include_paths;
+	const char *const *exclude_paths;
+	void *reserved2[2];
 };
 LCFS_EXTERN struct lcfs_node_s *
 lcfs_load_node_from_image_ext(const uint8_t *image_data, size_t image_data_size,
@@ -107,6 +163,122 @@ LCFS_EXTERN struct lcfs_node_s *
 lcfs_load_node_from_fd_ext(int fd, const struct lcfs_read_options_s *opts);
 LCFS_EXTERN int lcfs_version_from_fd(int fd);
 
+struct lcfs_image_xattr_s {
+	const char *name;
+	const char *value;
+	size_t value_len;
+};
+
+// One entry of an image, as passed to a lcfs_image_walk_cb. None of it
+// is valid after the callback returns.
+struct lcfs_image_entry_s {
+	const char *path; // Absolute, "/" for the root
+	uint32_t depth; // 0 for the root
+	uint32_t mode;
+	uint32_t nlink;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t rdev;
+	uint64_t size;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	const char *payload; // Symlink target or backing file, or NULL
+	const uint8_t *content; // size bytes of inline content, or NULL
+	const uint8_t *digest; // LCFS_DIGEST_SIZE bytes, or NULL
+	// For all but the first occurrence of a hardlinked inode, the path
+	// of the first one. The rest of the entry is the same for all.
+	const char *hardlink_target;
+	size_t n_xattrs;
+	const struct lcfs_image_xattr_s *xattrs;
+	uint64_t reserved[4];
+};
+// A non-zero return stops the walk, which returns it.
+typedef int (*lcfs_image_walk_cb)(const struct lcfs_image_entry_s *entry,
+				  void *userdata);
+
+// Calls cb for the entries of an image in the order lcfs_load_node_from_fd()
+// would put them in the tree, parents before their children, but without
+// building it, so memory use doesn't grow with the image. The filters in
+// opts apply as when loading; threads is ignored.
+LCFS_EXTERN int lcfs_image_walk_data(const uint8_t *image_data,
+				     size_t image_data_size,
+				     const struct lcfs_read_options_s *opts,
+				     lcfs_image_walk_cb cb, void *userdata);
+LCFS_EXTERN int lcfs_image_walk(int fd, const struct lcfs_read_options_s *opts,
+				lcfs_image_walk_cb cb, void *userdata);
+
+enum lcfs_image_change_t {
+	LCFS_IMAGE_CHANGE_ADDED,
+	LCFS_IMAGE_CHANGE_REMOVED,
+	LCFS_IMAGE_CHANGE_MODIFIED,
+};
+
+// old_entry is NULL for added entries, new_entry for removed ones. The
+// entries are only valid during the callback, as for lcfs_image_walk_cb.
+typedef int (*lcfs_image_diff_cb)(enum lcfs_image_change_t change,
+				  const struct lcfs_image_entry_s *old_entry,
+				  const struct lcfs_image_entry_s *new_entry,
+				  void *userdata);
+
+// Walks two images side by side in dirent order, calling cb for what
+// differs. Everything below an added or removed directory is passed on
+// as well, in walk order. A file replaced by one of another type is
+// removed, then added. The size and nlink of directories are not
+// compared, as they follow from the entries.
+LCFS_EXTERN int lcfs_image_diff_data(const uint8_t *old_image_data,
+				     size_t old_image_data_size,
+				     const uint8_t *new_image_data,
+				     size_t new_image_data_size,
+				     const struct lcfs_read_options_s *opts,
+				     lcfs_image_diff_cb cb, void *userdata);
+LCFS_EXTERN int lcfs_image_diff(int old_fd, int new_fd,
+				const struct lcfs_read_options_s *opts,
+				lcfs_image_diff_cb cb, void *userdata);
+
+// Where the bytes of an image go. Hardlinked inodes and data blocks shared
+// by several inodes are only counted once.
+struct lcfs_image_stats_s {
+	uint64_t image_size;
+	uint64_t metadata_size; // Header, superblock and inode table
+	uint64_t inodes;
+	uint64_t compact_inodes;
+	uint64_t extended_inodes;
+	uint64_t dirs;
+	uint64_t inode_bytes; // The inodes without their xattrs and tails
+	uint64_t inline_xattr_bytes;
+	uint64_t shared_xattrs; // Entries of the shared xattr table in use
+	uint64_t shared_xattr_size;
+	uint64_t shared_xattr_refs; // From inodes to those entries
+	uint64_t inline_data_bytes; // Tail-packed content, dirents and symlinks
+	uint64_t inline_file_bytes; // Of inline_data_bytes, file content
+	uint64_t inline_dirent_bytes; // Of inline_data_bytes, directories
+	uint64_t inline_symlink_bytes; // Of inline_data_bytes, symlink targets
+	uint64_t chunk_index_bytes; // Of files with a backing file
+	uint64_t data_blocks;
+	uint64_t data_bytes; // Used in the data blocks
+	uint64_t dir_blocks;
+	uint64_t flat_inodes; // With data stored in the image
+	uint64_t tailpacked_inodes; // Of those, the ones with an inline tail
+	uint64_t padding_bytes; // Everything not counted above
+	uint64_t reserved[8];
+};
+
+// Called for each directory after its entries, with its size in bytes and
+// its number of entries other than "." and "..". A non-zero return stops
+// the walk, which returns it.
+typedef int (*lcfs_image_stats_dir_cb)(const char *path, uint64_t size,
+				       uint64_t n_entries, void *userdata);
+
+// Fills stats from the EROFS structures of an image. Only the inode headers,
+// xattr headers and directories are read, no nodes or entries are built.
+// dir_cb may be NULL.
+LCFS_EXTERN int lcfs_image_stats_data(const uint8_t *image_data,
+				      size_t image_data_size,
+				      struct lcfs_image_stats_s *stats,
+				      lcfs_image_stats_dir_cb dir_cb, void *userdata);
+LCFS_EXTERN int lcfs_image_stats(int fd, struct lcfs_image_stats_s *stats,
+				 lcfs_image_stats_dir_cb dir_cb, void *userdata);
+
 LCFS_EXTERN const char *lcfs_node_get_xattr(struct lcfs_node_s *node,
 					    const char *name, size_t *length);
 LCFS_EXTERN int lcfs_node_set_xattr(struct lcfs_node_s *node, const char *name,
@@ -131,6 +303,10 @@ LCFS_EXTERN struct lcfs_node_s *lcfs_node_get_parent(struct lcfs_node_s *node);
 LCFS_EXTERN int lcfs_node_add_child(struct lcfs_node_s *parent,
 				    struct lcfs_node_s *child, /* Takes ownership on success */
 				    const char *name);
+// Unlinks the child called name from parent and drops the reference
+// the parent held on it. Fails with ENOENT if there is no such child.
+LCFS_EXTERN int lcfs_node_remove_child(struct lcfs_node_s *parent,
+				       const char *name);
 LCFS_EXTERN const char *lcfs_node_get_name(struct lcfs_node_s *node);
 LCFS_EXTERN size_t lcfs_node_get_n_children(struct lcfs_node_s *node);
 LCFS_EXTERN struct lcfs_node_s *lcfs_node_get_child(struct lcfs_node_s *node,
@@ -172,6 +348,13 @@ LCFS_EXTERN int lcfs_node_set_fsverity_from_fd(struct lcfs_node_s *node, int fd)
 
 LCFS_EXTERN struct lcfs_node_s *lcfs_build(int dirfd, const char *fname,
 					   int buildflags, char **failed_path_out);
+// Called by lcfs_build_with_cb() for each node as it is loaded, a
+// directory before its children, e.g. to report progress.
+typedef void (*lcfs_build_cb)(struct lcfs_node_s *node, void *userdata);
+LCFS_EXTERN struct lcfs_node_s *lcfs_build_with_cb(int dirfd, const char *fname,
+						   int buildflags,
+						   char **failed_path_out,
+						   lcfs_build_cb cb, void *userdata);
 
 LCFS_EXTERN int lcfs_write_to(struct lcfs_node_s *root,
 			      struct lcfs_write_options_s *options);
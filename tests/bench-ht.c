@@ -0,0 +1,221 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR Apache-2.0 */
+/* Compares lcfs-ht.h with the gnulib Hash_table it replaced, on the
+ * kinds of keys the writer and loader use: object paths and nids. */
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "hash.h"
+#include "lcfs-ht.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#define N_KEYS 1000000
+#define N_ROUNDS 3
+#define DIGEST_SIZE 32
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t gl_str_hash(const void *entry, size_t table_size)
+{
+	return hash_string(entry, table_size);
+}
+
+static bool gl_str_eq(const void *entry1, const void *entry2)
+{
+	return strcmp(entry1, entry2) == 0;
+}
+
+static bool ht_str_eq(const void *value, const void *key)
+{
+	return strcmp(value, key) == 0;
+}
+
+struct nid_entry {
+	uint64_t nid;
+};
+
+static size_t gl_nid_hash(const void *entry, size_t table_size)
+{
+	return ((const struct nid_entry *)entry)->nid % table_size;
+}
+
+static bool gl_nid_eq(const void *entry1, const void *entry2)
+{
+	return ((const struct nid_entry *)entry1)->nid ==
+	       ((const struct nid_entry *)entry2)->nid;
+}
+
+static bool ht_nid_eq(const void *value, const void *key)
+{
+	return ((const struct nid_entry *)value)->nid == *(const uint64_t *)key;
+}
+
+static void report(const char *name, double gl, double ht)
+{
+	printf("%-22s hash.c %8.3f ms  lcfs-ht %8.3f ms  (%.2fx)\n", name,
+	       gl * 1000, ht * 1000, gl / ht);
+}
+
+static void bench_strings(char **keys, char **misses)
+{
+	double gl_insert = 0, gl_lookup = 0, ht_insert = 0, ht_lookup = 0;
+	size_t found;
+
+	for (int round = 0; round < N_ROUNDS; round++) {
+		Hash_table *gl;
+		struct lcfs_ht ht;
+		double t;
+
+		t = now();
+		gl = hash_initialize(0, NULL, gl_str_hash, gl_str_eq, NULL);
+		assert(gl != NULL);
+		for (size_t i = 0; i < N_KEYS; i++)
+			if (hash_insert(gl, keys[i]) == NULL)
+				abort();
+		gl_insert += now() - t;
+
+		t = now();
+		found = 0;
+		for (size_t i = 0; i < N_KEYS; i++) {
+			found += hash_lookup(gl, keys[i]) != NULL;
+			found += hash_lookup(gl, misses[i]) != NULL;
+		}
+		gl_lookup += now() - t;
+		assert(found == N_KEYS);
+		hash_free(gl);
+
+		t = now();
+		if (lcfs_ht_init(&ht, 0) < 0)
+			abort();
+		for (size_t i = 0; i < N_KEYS; i++)
+			if (lcfs_ht_insert_if_absent(&ht, lcfs_ht_hash_string(keys[i]),
+						     keys[i], ht_str_eq,
+						     keys[i]) == NULL)
+				abort();
+		ht_insert += now() - t;
+
+		t = now();
+		found = 0;
+		for (size_t i = 0; i < N_KEYS; i++) {
+			found += lcfs_ht_lookup(&ht, lcfs_ht_hash_string(keys[i]),
+						keys[i], ht_str_eq) != NULL;
+			found += lcfs_ht_lookup(&ht, lcfs_ht_hash_string(misses[i]),
+						misses[i], ht_str_eq) != NULL;
+		}
+		ht_lookup += now() - t;
+		assert(found == N_KEYS);
+		lcfs_ht_destroy(&ht);
+	}
+
+	report("object insert", gl_insert, ht_insert);
+	report("object lookup", gl_lookup, ht_lookup);
+}
+
+static void bench_nids(struct nid_entry *entries)
+{
+	double gl_insert = 0, gl_lookup = 0, ht_insert = 0, ht_lookup = 0;
+	size_t found;
+
+	for (int round = 0; round < N_ROUNDS; round++) {
+		Hash_table *gl;
+		struct lcfs_ht ht;
+		double t;
+
+		t = now();
+		gl = hash_initialize(0, NULL, gl_nid_hash, gl_nid_eq, NULL);
+		assert(gl != NULL);
+		for (size_t i = 0; i < N_KEYS; i++)
+			if (hash_insert(gl, &entries[i]) == NULL)
+				abort();
+		gl_insert += now() - t;
+
+		t = now();
+		found = 0;
+		for (size_t i = 0; i < N_KEYS; i++) {
+			struct nid_entry key = { entries[i].nid };
+			found += hash_lookup(gl, &key) != NULL;
+		}
+		gl_lookup += now() - t;
+		assert(found == N_KEYS);
+		hash_free(gl);
+
+		t = now();
+		if (lcfs_ht_init(&ht, 0) < 0)
+			abort();
+		for (size_t i = 0; i < N_KEYS; i++)
+			if (lcfs_ht_insert(&ht, lcfs_ht_hash_u64(entries[i].nid),
+					   &entries[i]) < 0)
+				abort();
+		ht_insert += now() - t;
+
+		t = now();
+		found = 0;
+		for (size_t i = 0; i < N_KEYS; i++) {
+			uint64_t nid = entries[i].nid;
+			found += lcfs_ht_lookup(&ht, lcfs_ht_hash_u64(nid), &nid,
+						ht_nid_eq) != NULL;
+		}
+		ht_lookup += now() - t;
+		assert(found == N_KEYS);
+		lcfs_ht_destroy(&ht);
+	}
+
+	report("nid insert", gl_insert, ht_insert);
+	report("nid lookup", gl_lookup, ht_lookup);
+}
+
+int main(int argc, char **argv)
+{
+	char **keys = calloc(N_KEYS, sizeof(char *));
+	char **misses = calloc(N_KEYS, sizeof(char *));
+	struct nid_entry *entries = calloc(N_KEYS, sizeof(struct nid_entry));
+
+	(void)argc;
+	(void)argv;
+
+	assert(keys != NULL && misses != NULL && entries != NULL);
+
+	srandom(42);
+	for (size_t i = 0; i < N_KEYS; i++) {
+		char buf[2 * DIGEST_SIZE + 2];
+		char *p = buf;
+
+		/* Same shape as a by-digest object path */
+		for (size_t j = 0; j < DIGEST_SIZE; j++) {
+			p += sprintf(p, "%02x", (unsigned)(random() & 0xff));
+			if (j == 0)
+				*p++ = '/';
+		}
+		keys[i] = strdup(buf);
+		buf[0] = 'x'; /* Not a hex digit, never a hit */
+		misses[i] = strdup(buf);
+		assert(keys[i] != NULL && misses[i] != NULL);
+
+		/* Nids of inodes in a typical image, spread by inode size */
+		entries[i].nid = i * 3 + (random() % 3);
+	}
+
+	bench_strings(keys, misses);
+	bench_nids(entries);
+
+	for (size_t i = 0; i < N_KEYS; i++) {
+		free(keys[i]);
+		free(misses[i]);
+	}
+	free(keys);
+	free(misses);
+	free(entries);
+
+	return 0;
+}
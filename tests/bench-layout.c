@@ -0,0 +1,429 @@
+/* SPDX-License-Identifier: GPL-2.0-only OR Apache-2.0 */
+/* Counts the 4 KiB metadata blocks that path lookups touch in an image
+ * written with each of the layout policies. Lookups are done the way
+ * the kernel EROFS driver and composefs-fuse do them: the inode of
+ * every directory on the path, then a binary search over its directory
+ * blocks.
+ *
+ *   bench-layout [IMAGE [PATHS]]
+ *
+ * Without arguments a synthetic tree is used. Otherwise the tree is
+ * loaded from IMAGE, and looked up either for all the non-directories
+ * in it or for the paths listed in PATHS, one per line. Listed paths
+ * are also tried as layout hints, as a trace of them would be. */
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#include "lcfs-writer.h"
+#include "lcfs-erofs-internal.h"
+
+static const struct {
+	const char *name;
+	uint32_t layout;
+} layouts[] = {
+	{ "bfs", LCFS_LAYOUT_BFS },
+	{ "dfs", LCFS_LAYOUT_DFS },
+	{ "clustered", LCFS_LAYOUT_CLUSTERED },
+};
+
+struct image {
+	uint8_t *data;
+	size_t size;
+	const uint8_t *metadata;
+	uint64_t root_nid;
+	size_t n_blocks;
+	uint32_t *seen; /* Per block, the last lookup that touched it + 1 */
+	uint8_t *seen_any;
+	size_t lookup;
+	size_t touched; /* Over all lookups, each one with a cold cache */
+	size_t touched_any; /* Over all lookups, with a shared cache */
+};
+
+struct paths {
+	char **paths;
+	size_t n_paths;
+	size_t size;
+};
+
+static void add_path(struct paths *paths, const char *path)
+{
+	if (paths->n_paths == paths->size) {
+		paths->size = paths->size ? paths->size * 2 : 1024;
+		paths->paths = reallocarray(paths->paths, paths->size, sizeof(char *));
+		assert(paths->paths != NULL);
+	}
+	paths->paths[paths->n_paths] = strdup(path);
+	assert(paths->paths[paths->n_paths] != NULL);
+	paths->n_paths++;
+}
+
+static void collect_paths(struct lcfs_node_s *node, char *path, size_t len,
+			  struct paths *paths)
+{
+	for (size_t i = 0; i < lcfs_node_get_n_children(node); i++) {
+		struct lcfs_node_s *child = lcfs_node_get_child(node, i);
+		const char *name = lcfs_node_get_name(child);
+		size_t name_len = strlen(name);
+
+		if (len + 1 + name_len >= PATH_MAX)
+			continue;
+		path[len] = '/';
+		memcpy(path + len + 1, name, name_len + 1);
+
+		if ((lcfs_node_get_mode(child) & S_IFMT) == S_IFDIR)
+			collect_paths(child, path, len + 1 + name_len, paths);
+		else
+			add_path(paths, path);
+	}
+	path[len] = 0;
+}
+
+static struct lcfs_node_s *synthetic_tree(void)
+{
+	struct lcfs_node_s *root = lcfs_node_new();
+	char name[64];
+
+	assert(root != NULL);
+	lcfs_node_set_mode(root, S_IFDIR | 0755);
+
+	/* Something like /usr/lib/pythonX/site-packages/pkgN/moduleM.py */
+	for (int a = 0; a < 20; a++) {
+		struct lcfs_node_s *top = lcfs_node_new();
+
+		lcfs_node_set_mode(top, S_IFDIR | 0755);
+		sprintf(name, "top-%d", a);
+		assert(lcfs_node_add_child(root, top, name) == 0);
+
+		for (int b = 0; b < 50; b++) {
+			struct lcfs_node_s *pkg = lcfs_node_new();
+
+			lcfs_node_set_mode(pkg, S_IFDIR | 0755);
+			sprintf(name, "pkg-%d", b);
+			assert(lcfs_node_add_child(top, pkg, name) == 0);
+
+			for (int c = 0; c < 20; c++) {
+				struct lcfs_node_s *file = lcfs_node_new();
+
+				lcfs_node_set_mode(file, S_IFREG | 0644);
+				sprintf(name, "module-%d.py", c);
+				lcfs_node_set_payload(file, "00/1234");
+				assert(lcfs_node_add_child(pkg, file, name) == 0);
+			}
+		}
+	}
+
+	return root;
+}
+
+static ssize_t write_cb(void *_file, void *buf, size_t count)
+{
+	return fwrite(buf, 1, count, _file);
+}
+
+static void write_image(struct lcfs_node_s *root, uint32_t layout,
+			const char *const *hints, struct image *image)
+{
+	const struct erofs_super_block *super;
+	struct lcfs_write_options_s options = { 0 };
+	char *data = NULL;
+	FILE *f = open_memstream(&data, &image->size);
+
+	assert(f != NULL);
+	options.format = LCFS_FORMAT_EROFS;
+	options.version = 1;
+	options.max_version = 1;
+	options.layout = layout;
+	options.layout_hints = hints;
+	options.file = f;
+	options.file_write_cb = write_cb;
+	if (lcfs_write_to(root, &options) < 0) {
+		perror("lcfs_write_to");
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+
+	image->data = (uint8_t *)data;
+	super = (const struct erofs_super_block *)(image->data + EROFS_SUPER_OFFSET);
+	image->metadata = image->data +
+			  lcfs_u32_from_file(super->meta_blkaddr) * EROFS_BLKSIZ;
+	image->root_nid = lcfs_u16_from_file(super->root_nid);
+	image->n_blocks = DIV_ROUND_UP(image->size, EROFS_BLKSIZ);
+	image->seen = calloc(image->n_blocks, sizeof(uint32_t));
+	image->seen_any = calloc(image->n_blocks, 1);
+	assert(image->seen != NULL && image->seen_any != NULL);
+}
+
+static void touch(struct image *image, const uint8_t *start, size_t len)
+{
+	size_t first = (start - image->data) / EROFS_BLKSIZ;
+	size_t last = (start + len - 1 - image->data) / EROFS_BLKSIZ;
+
+	for (size_t block = first; block <= last; block++) {
+		if (image->seen[block] != image->lookup + 1) {
+			image->seen[block] = image->lookup + 1;
+			image->touched++;
+		}
+		if (!image->seen_any[block]) {
+			image->seen_any[block] = 1;
+			image->touched_any++;
+		}
+	}
+}
+
+struct inode_info {
+	const erofs_inode *cino;
+	uint16_t mode;
+	uint64_t size;
+	uint32_t raw_blkaddr;
+	size_t isize; /* Including xattrs */
+};
+
+static void get_inode(struct image *image, uint64_t nid, struct inode_info *info)
+{
+	const erofs_inode *cino =
+		(const erofs_inode *)(image->metadata + (nid << EROFS_ISLOTBITS));
+	uint16_t xattr_icount;
+
+	info->cino = cino;
+	if (erofs_inode_is_compact(cino)) {
+		info->mode = lcfs_u16_from_file(cino->compact.i_mode);
+		info->size = lcfs_u32_from_file(cino->compact.i_size);
+		info->raw_blkaddr = lcfs_u32_from_file(cino->compact.i_u.raw_blkaddr);
+		xattr_icount = lcfs_u16_from_file(cino->compact.i_xattr_icount);
+		info->isize = sizeof(struct erofs_inode_compact);
+	} else {
+		info->mode = lcfs_u16_from_file(cino->extended.i_mode);
+		info->size = lcfs_u64_from_file(cino->extended.i_size);
+		info->raw_blkaddr = lcfs_u32_from_file(cino->extended.i_u.raw_blkaddr);
+		xattr_icount = lcfs_u16_from_file(cino->extended.i_xattr_icount);
+		info->isize = sizeof(struct erofs_inode_extended);
+	}
+	info->isize += erofs_xattr_inode_size(xattr_icount);
+
+	touch(image, (const uint8_t *)cino, info->isize);
+}
+
+static int cmp_name(const char *name, size_t name_len, const char *other,
+		    size_t other_len)
+{
+	int res = memcmp(name, other, MIN(name_len, other_len));
+
+	if (res != 0 || name_len == other_len)
+		return res;
+	return name_len < other_len ? -1 : 1;
+}
+
+/* Returns 0 and sets *nid if found, otherwise <0 if name sorts before
+ * the block and >0 if after it, or INT_MAX if it should have been
+ * inside it. */
+static int lookup_block(const uint8_t *block, size_t block_size,
+			const char *name, size_t name_len, uint64_t *nid)
+{
+	const struct erofs_dirent *dirents = (const struct erofs_dirent *)block;
+	size_t n_dirents = lcfs_u16_from_file(dirents[0].nameoff) /
+			   sizeof(struct erofs_dirent);
+	ssize_t start = 0, end = n_dirents - 1;
+
+	while (start <= end) {
+		ssize_t mid = start + (end - start) / 2;
+		uint16_t nameoff = lcfs_u16_from_file(dirents[mid].nameoff);
+		const char *child = (const char *)block + nameoff;
+		size_t child_len;
+		int cmp;
+
+		if ((size_t)mid + 1 < n_dirents)
+			child_len = lcfs_u16_from_file(dirents[mid + 1].nameoff) - nameoff;
+		else
+			child_len = strnlen(child, block_size - nameoff);
+
+		cmp = cmp_name(name, name_len, child, child_len);
+		if (cmp == 0) {
+			*nid = lcfs_u64_from_file(dirents[mid].nid);
+			return 0;
+		}
+		if (cmp > 0)
+			start = mid + 1;
+		else
+			end = mid - 1;
+	}
+
+	if (end < 0)
+		return -1;
+	if ((size_t)start >= n_dirents)
+		return 1;
+	return INT_MAX;
+}
+
+static bool lookup_child(struct image *image, struct inode_info *dir,
+			 const char *name, size_t name_len, uint64_t *nid)
+{
+	bool tailpacked = erofs_inode_is_tailpacked(dir->cino);
+	size_t n_blocks = DIV_ROUND_UP(dir->size, EROFS_BLKSIZ);
+	size_t n_oob = tailpacked ? n_blocks - 1 : n_blocks;
+	const uint8_t *oob = image->data + (size_t)dir->raw_blkaddr * EROFS_BLKSIZ;
+	ssize_t start = 0, end = n_oob - 1;
+
+	while (start <= end) {
+		ssize_t mid = start + (end - start) / 2;
+		size_t block_size = EROFS_BLKSIZ;
+		int cmp;
+
+		if ((size_t)mid + 1 == n_blocks && dir->size % EROFS_BLKSIZ != 0)
+			block_size = dir->size % EROFS_BLKSIZ;
+
+		touch(image, oob + mid * EROFS_BLKSIZ, block_size);
+		cmp = lookup_block(oob + mid * EROFS_BLKSIZ, block_size, name,
+				   name_len, nid);
+		if (cmp == 0)
+			return true;
+		if (cmp == INT_MAX)
+			return false;
+		if (cmp > 0)
+			start = mid + 1;
+		else
+			end = mid - 1;
+	}
+
+	if (tailpacked && (size_t)start == n_oob) {
+		const uint8_t *tail = (const uint8_t *)dir->cino + dir->isize;
+		size_t tail_size = dir->size % EROFS_BLKSIZ;
+
+		touch(image, tail, tail_size);
+		return lookup_block(tail, tail_size, name, name_len, nid) == 0;
+	}
+
+	return false;
+}
+
+static bool lookup_path(struct image *image, const char *path)
+{
+	struct inode_info info;
+	uint64_t nid = image->root_nid;
+
+	get_inode(image, nid, &info);
+	for (;;) {
+		size_t len;
+
+		while (*path == '/')
+			path++;
+		if (*path == 0)
+			return true;
+
+		if ((info.mode & S_IFMT) != S_IFDIR)
+			return false;
+
+		len = strcspn(path, "/");
+		if (!lookup_child(image, &info, path, len, &nid))
+			return false;
+		get_inode(image, nid, &info);
+		path += len;
+	}
+}
+
+static void bench(struct lcfs_node_s *root, struct paths *paths, bool use_hints)
+{
+	const char **hints = NULL;
+
+	if (use_hints) {
+		hints = calloc(paths->n_paths + 1, sizeof(char *));
+		assert(hints != NULL);
+		memcpy(hints, paths->paths, paths->n_paths * sizeof(char *));
+	}
+
+	for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+		struct image image = { 0 };
+		size_t missing = 0;
+
+		write_image(root, layouts[i].layout, hints, &image);
+
+		for (size_t j = 0; j < paths->n_paths; j++) {
+			image.lookup = j;
+			if (!lookup_path(&image, paths->paths[j]))
+				missing++;
+		}
+
+		printf("%-10s%-6s image %7zu blocks  touched %7zu distinct  %6.2f per lookup",
+		       layouts[i].name, use_hints ? "+hints" : "",
+		       image.n_blocks, image.touched_any,
+		       paths->n_paths ? (double)image.touched / paths->n_paths : 0.0);
+		if (missing)
+			printf("  (%zu not found)", missing);
+		printf("\n");
+
+		free(image.data);
+		free(image.seen);
+		free(image.seen_any);
+	}
+
+	free(hints);
+}
+
+int main(int argc, char **argv)
+{
+	struct lcfs_node_s *root;
+	struct paths paths = { 0 };
+
+	if (argc > 1) {
+		int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			perror(argv[1]);
+			exit(EXIT_FAILURE);
+		}
+		root = lcfs_load_node_from_fd(fd);
+		if (root == NULL) {
+			perror(argv[1]);
+			exit(EXIT_FAILURE);
+		}
+		close(fd);
+	} else {
+		root = synthetic_tree();
+	}
+
+	if (argc > 2) {
+		FILE *f = fopen(argv[2], "re");
+		char *line = NULL;
+		size_t line_size = 0;
+		ssize_t len;
+
+		if (f == NULL) {
+			perror(argv[2]);
+			exit(EXIT_FAILURE);
+		}
+		while ((len = getline(&line, &line_size, f)) > 0) {
+			if (line[len - 1] == '\n')
+				line[len - 1] = 0;
+			if (*line != 0)
+				add_path(&paths, line);
+		}
+		free(line);
+		fclose(f);
+	} else {
+		char path[PATH_MAX];
+
+		collect_paths(root, path, 0, &paths);
+	}
+
+	printf("%zu paths\n", paths.n_paths);
+	bench(root, &paths, false);
+	if (argc > 2)
+		bench(root, &paths, true);
+
+	for (size_t i = 0; i < paths.n_paths; i++)
+		free(paths.paths[i]);
+	free(paths.paths);
+	lcfs_node_unref(root);
+
+	return 0;
+}
@@ -12,7 +12,8 @@ has_fsck=$(check_erofs_fsck)
 set -e
 tmpfile=$(mktemp --tmpdir lcfs-test.XXXXXX)
 tmpfile2=$(mktemp --tmpdir lcfs-test.XXXXXX)
-trap 'rm -rf -- "$tmpfile" "$tmpfile2"' EXIT
+tmpdump=$(mktemp --tmpdir lcfs-test.XXXXXX)
+trap 'rm -rf -- "$tmpfile" "$tmpfile2" "$tmpdump"' EXIT
 
 # Ensure our builtin dumpfiles are strict, minus some exceptions
 declare -A nonstrict
@@ -52,6 +53,23 @@ for format in erofs ; do
         $CAT $ASSET_DIR/$file | ${VALGRIND_PREFIX} ${BINDIR}/mkcomposefs $VERSION_ARG --from-file - $tmpfile
         SHA=$(sha256sum $tmpfile | awk "{print \$1}")
 
+        # Regular files are mapped and parsed in parallel rather than
+        # streamed, ensure that gives the same result
+        $CAT $ASSET_DIR/$file > $tmpdump
+        ${VALGRIND_PREFIX} ${BINDIR}/mkcomposefs $VERSION_ARG --threads=4 --from-file $tmpdump $tmpfile2
+        if ! cmp $tmpfile $tmpfile2; then
+            echo Mapped dump file is not equal to streamed dump file
+            exit 1
+        fi
+
+        # The digest-only path must agree with the written image
+        DIGEST=$(${VALGRIND_PREFIX} ${BINDIR}/mkcomposefs $VERSION_ARG --threads=4 --from-file --print-digest-only $tmpdump)
+        MEASURED=$(${VALGRIND_PREFIX} ${BINDIR}/composefs-info measure-file $tmpfile)
+        if [ "$DIGEST" != "$MEASURED" ]; then
+            echo Digest-only path gives $DIGEST, expected $MEASURED
+            exit 1
+        fi
+
         # Run fsck.erofs to make sure we're not generating anything weird
         if [ $has_fsck == y ]; then
             fsck.erofs $tmpfile
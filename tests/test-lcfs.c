@@ -5,6 +5,8 @@
 #include "lcfs-mount.h"
 #include "lcfs-erofs.h"
 #include "erofs_fs_wrapper.h"
+#include "lcfs-ht.h"
+#include "lcfs-objindex.h"
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
@@ -49,6 +51,95 @@ static int testwrite_node(struct lcfs_node_s *node)
 	return r;
 }
 
+// Writes an image of root to a newly allocated buffer
+static void write_image(struct lcfs_node_s *root, char **bufp, size_t *bufsz)
+{
+	FILE *buf = open_memstream(bufp, bufsz);
+	struct lcfs_write_options_s options = { 0 };
+	options.format = LCFS_FORMAT_EROFS;
+	options.file = buf;
+	options.file_write_cb = write_cb;
+	int r = lcfs_write_to(root, &options);
+	assert(r == 0);
+	fclose(buf);
+}
+
+// One row of a tree for build_tree(), parents must come before their
+// children. content is the target of symlinks, and size is only used
+// for files with a backing file in payload.
+struct tree_entry {
+	const char *path;
+	uint32_t mode;
+	const char *content;
+	const char *payload;
+	uint64_t size;
+	const char *hardlink; // Path of the file this is a link to
+	const char *xattrs[2]; // "name=value"
+};
+
+static struct lcfs_node_s *lookup_path(struct lcfs_node_s *root, const char *path)
+{
+	char *copy = strdup(path);
+	char *save = NULL;
+	struct lcfs_node_s *node = root;
+
+	for (char *name = strtok_r(copy, "/", &save); name != NULL;
+	     name = strtok_r(NULL, "/", &save)) {
+		node = lcfs_node_lookup_child(node, name);
+		assert(node != NULL);
+	}
+	free(copy);
+	return node;
+}
+
+static struct lcfs_node_s *build_tree(const struct tree_entry *entries,
+				      size_t n_entries)
+{
+	struct lcfs_node_s *root = lcfs_node_new();
+
+	assert(strcmp(entries[0].path, "/") == 0);
+	lcfs_node_set_mode(root, entries[0].mode);
+	for (size_t i = 1; i < n_entries; i++) {
+		const struct tree_entry *e = &entries[i];
+		struct lcfs_node_s *node = lcfs_node_new();
+		char *parent_path = strdup(e->path);
+		char *name = strrchr(parent_path, '/');
+		int r;
+
+		*name++ = '\0';
+		if (e->hardlink) {
+			lcfs_node_make_hardlink(node,
+						lookup_path(root, e->hardlink));
+		} else {
+			lcfs_node_set_mode(node, e->mode);
+		}
+		if (e->content && S_ISLNK(e->mode)) {
+			r = lcfs_node_set_symlink_payload(node, e->content);
+			assert(r == 0);
+		} else if (e->content) {
+			r = lcfs_node_set_content(node, (const uint8_t *)e->content,
+						  strlen(e->content));
+			assert(r == 0);
+		}
+		if (e->payload) {
+			r = lcfs_node_set_payload(node, e->payload);
+			assert(r == 0);
+			lcfs_node_set_size(node, e->size);
+		}
+		for (size_t j = 0; j < 2 && e->xattrs[j]; j++) {
+			const char *eq = strchr(e->xattrs[j], '=');
+			char *xname = strndup(e->xattrs[j], eq - e->xattrs[j]);
+			r = lcfs_node_set_xattr(node, xname, eq + 1, strlen(eq + 1));
+			assert(r == 0);
+			free(xname);
+		}
+		r = lcfs_node_add_child(lookup_path(root, parent_path), node, name);
+		assert(r == 0);
+		free(parent_path);
+	}
+	return root;
+}
+
 static void test_basic(void)
 {
 	cleanup_node struct lcfs_node_s *node = lcfs_node_new();
@@ -125,6 +216,300 @@ static void test_add_uninitialized_child(void)
 	assert(errno == EINVAL);
 }
 
+static void test_remove_child(void)
+{
+	cleanup_node struct lcfs_node_s *node = lcfs_node_new();
+	lcfs_node_set_mode(node, S_IFDIR | 0755);
+
+	const char *names[] = { "a", "b", "c" };
+	for (size_t i = 0; i < 3; i++) {
+		struct lcfs_node_s *child = lcfs_node_new();
+		lcfs_node_set_mode(child, S_IFREG | 0644);
+		int r = lcfs_node_add_child(node, child, names[i]);
+		assert(r == 0);
+	}
+
+	// Keep a ref, so we can verify it is unlinked
+	cleanup_node struct lcfs_node_s *b =
+		lcfs_node_ref(lcfs_node_lookup_child(node, "b"));
+
+	int r = lcfs_node_remove_child(node, "b");
+	assert(r == 0);
+	assert(lcfs_node_get_n_children(node) == 2);
+	assert(strcmp(lcfs_node_get_name(lcfs_node_get_child(node, 0)), "a") == 0);
+	assert(strcmp(lcfs_node_get_name(lcfs_node_get_child(node, 1)), "c") == 0);
+	assert(lcfs_node_get_parent(b) == NULL);
+	assert(lcfs_node_get_name(b) == NULL);
+
+	r = lcfs_node_remove_child(node, "b");
+	assert(r == -1);
+	assert(errno == ENOENT);
+
+	// It can be added again
+	r = lcfs_node_add_child(node, lcfs_node_ref(b), "d");
+	assert(r == 0);
+	assert(lcfs_node_get_n_children(node) == 3);
+}
+
+struct walk_data {
+	char paths[8][32];
+	char hardlink_targets[8][32];
+	size_t n_entries;
+	size_t stop_after;
+};
+
+static int walk_cb(const struct lcfs_image_entry_s *entry, void *userdata)
+{
+	struct walk_data *data = userdata;
+
+	assert(data->n_entries < 8);
+	strcpy(data->paths[data->n_entries], entry->path);
+	if (entry->hardlink_target)
+		strcpy(data->hardlink_targets[data->n_entries],
+		       entry->hardlink_target);
+	if ((entry->mode & S_IFMT) == S_IFREG) {
+		assert(entry->size == 2);
+		assert(memcmp(entry->content, "hi", 2) == 0);
+	}
+	if ((entry->mode & S_IFMT) == S_IFLNK)
+		assert(strcmp(entry->payload, "a/f") == 0);
+
+	data->n_entries++;
+	if (data->n_entries == data->stop_after)
+		return 42;
+	return 0;
+}
+
+// Walking an image must give parents before their children, in name
+// order, with later paths of a hardlinked file pointing at the first
+static void test_image_walk(void)
+{
+	cleanup_node struct lcfs_node_s *root = lcfs_node_new();
+	struct lcfs_node_s *dir = lcfs_node_new();
+	struct lcfs_node_s *file = lcfs_node_new();
+	struct lcfs_node_s *link = lcfs_node_new();
+	struct lcfs_node_s *symlink = lcfs_node_new();
+	struct lcfs_read_options_s opts = { 0 };
+	struct walk_data data = { 0 };
+	char *bufp = NULL;
+	size_t bufsz = 0;
+	int r;
+
+	lcfs_node_set_mode(root, S_IFDIR | 0755);
+	lcfs_node_set_mode(dir, S_IFDIR | 0755);
+	lcfs_node_set_mode(file, S_IFREG | 0644);
+	lcfs_node_set_content(file, (const uint8_t *)"hi", 2);
+	lcfs_node_set_mode(symlink, S_IFLNK | 0777);
+	lcfs_node_set_symlink_payload(symlink, "a/f");
+	assert(lcfs_node_add_child(root, dir, "a") == 0);
+	assert(lcfs_node_add_child(dir, file, "f") == 0);
+	lcfs_node_make_hardlink(link, file);
+	assert(lcfs_node_add_child(root, link, "b") == 0);
+	assert(lcfs_node_add_child(root, symlink, "s") == 0);
+	write_image(root, &bufp, &bufsz);
+
+	r = lcfs_image_walk_data((uint8_t *)bufp, bufsz, &opts, walk_cb, &data);
+	assert(r == 0);
+	assert(data.n_entries == 5);
+	assert(strcmp(data.paths[0], "/") == 0);
+	assert(strcmp(data.paths[1], "/a") == 0);
+	assert(strcmp(data.paths[2], "/a/f") == 0);
+	assert(strcmp(data.paths[3], "/b") == 0);
+	assert(strcmp(data.hardlink_targets[3], "/a/f") == 0);
+	assert(strcmp(data.paths[4], "/s") == 0);
+
+	// A non-zero return stops the walk
+	memset(&data, 0, sizeof(data));
+	data.stop_after = 2;
+	r = lcfs_image_walk_data((uint8_t *)bufp, bufsz, &opts, walk_cb, &data);
+	assert(r == 42);
+	assert(data.n_entries == 2);
+
+	free(bufp);
+}
+
+struct payload_data {
+	char payload[32];
+	size_t n_xattrs;
+};
+
+static int payload_cb(const struct lcfs_image_entry_s *entry, void *userdata)
+{
+	struct payload_data *data = userdata;
+
+	if (entry->payload) {
+		strcpy(data->payload, entry->payload);
+		data->n_xattrs = entry->n_xattrs;
+	}
+	return 0;
+}
+
+// A backing file path that fills its xattr slot, so another xattr
+// follows right after it, must read back without bytes of the next one
+static void test_redirect_payload(void)
+{
+	static const struct tree_entry tree[] = {
+		{ "/", S_IFDIR | 0755 },
+		{ "/file", S_IFREG | 0644, NULL, "abc", 10, NULL, { "user.a=b" } },
+	};
+	cleanup_node struct lcfs_node_s *root = build_tree(tree, 2);
+	struct lcfs_read_options_s opts = { 0 };
+	struct payload_data data = { 0 };
+	char *bufp = NULL;
+	size_t bufsz = 0;
+
+	write_image(root, &bufp, &bufsz);
+
+	cleanup_node struct lcfs_node_s *loaded =
+		lcfs_load_node_from_image((uint8_t *)bufp, bufsz);
+	assert(loaded != NULL);
+	struct lcfs_node_s *file = lcfs_node_lookup_child(loaded, "file");
+	assert(strcmp(lcfs_node_get_payload(file), "abc") == 0);
+	assert(lcfs_node_get_n_xattr(file) == 1);
+	size_t len;
+	const char *value = lcfs_node_get_xattr(file, "user.a", &len);
+	assert(value != NULL && len == 1 && value[0] == 'b');
+
+	int r = lcfs_image_walk_data((uint8_t *)bufp, bufsz, &opts,
+				     payload_cb, &data);
+	assert(r == 0);
+	assert(strcmp(data.payload, "abc") == 0);
+	assert(data.n_xattrs == 1);
+
+	free(bufp);
+}
+
+// The entries of the root directory of an image from write_image(),
+// which the writer puts in a block of their own
+static struct erofs_dirent *root_dirents(char *bufp)
+{
+	struct erofs_super_block *sb =
+		(struct erofs_super_block *)(bufp + EROFS_SUPER_OFFSET);
+	struct erofs_inode_compact *c =
+		(struct erofs_inode_compact *)(bufp +
+					       le32toh(sb->meta_blkaddr) * EROFS_BLKSIZ +
+					       le16toh(sb->root_nid) * EROFS_SLOTSIZE);
+
+	assert(le16toh(c->i_format) ==
+	       (EROFS_INODE_FLAT_PLAIN << EROFS_I_DATALAYOUT_BIT |
+		EROFS_INODE_LAYOUT_COMPACT << EROFS_I_VERSION_BIT));
+	return (struct erofs_dirent *)(bufp + le32toh(c->i_u.raw_blkaddr) *
+						      EROFS_BLKSIZ);
+}
+
+// Directory entries with names outside of the directory block must be
+// rejected when loading, rather than read past it
+static void test_bad_dirents_load(void)
+{
+	static const struct tree_entry tree[] = {
+		{ "/", S_IFDIR | 0755 },
+	};
+	cleanup_node struct lcfs_node_s *root = build_tree(tree, 1);
+	char *bufp = NULL;
+	size_t bufsz = 0;
+
+	write_image(root, &bufp, &bufsz);
+
+	// Past "." and "..", the root has the whiteouts 00-ff
+	uint16_t dotdot_nameoff = le16toh(root_dirents(bufp)[1].nameoff);
+	const struct {
+		int dirent;
+		uint16_t nameoff;
+	} cases[] = {
+		{ 0, 0xfff0 }, // More entries than fit in the block
+		{ 2, 0xfff0 }, // A name past the end of the block
+		{ 2, dotdot_nameoff - 1 }, // A name before the previous one
+	};
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		char *copy = malloc(bufsz);
+
+		memcpy(copy, bufp, bufsz);
+		root_dirents(copy)[cases[i].dirent].nameoff =
+			htole16(cases[i].nameoff);
+
+		struct lcfs_node_s *loaded =
+			lcfs_load_node_from_image((uint8_t *)copy, bufsz);
+		assert(loaded == NULL);
+		assert(errno == EINVAL);
+		free(copy);
+	}
+
+	free(bufp);
+}
+
+static int diff_cb(enum lcfs_image_change_t change,
+		   const struct lcfs_image_entry_s *old_entry,
+		   const struct lcfs_image_entry_s *new_entry, void *userdata)
+{
+	static const char changes[] = { [LCFS_IMAGE_CHANGE_ADDED] = 'A',
+					[LCFS_IMAGE_CHANGE_REMOVED] = 'D',
+					[LCFS_IMAGE_CHANGE_MODIFIED] = 'M' };
+	const struct lcfs_image_entry_s *entry = new_entry ? new_entry : old_entry;
+
+	fprintf(userdata, "%c %s\n", changes[change], entry->path);
+	return 0;
+}
+
+static char *diff_trees(const struct tree_entry *old_tree, size_t n_old,
+			const struct tree_entry *new_tree, size_t n_new)
+{
+	cleanup_node struct lcfs_node_s *old_root = build_tree(old_tree, n_old);
+	cleanup_node struct lcfs_node_s *new_root = build_tree(new_tree, n_new);
+	struct lcfs_read_options_s opts = { 0 };
+	char *old_buf = NULL, *new_buf = NULL, *out = NULL;
+	size_t old_size = 0, new_size = 0, out_size = 0;
+
+	write_image(old_root, &old_buf, &old_size);
+	write_image(new_root, &new_buf, &new_size);
+	FILE *file = open_memstream(&out, &out_size);
+	int r = lcfs_image_diff_data((uint8_t *)old_buf, old_size,
+				     (uint8_t *)new_buf, new_size, &opts,
+				     diff_cb, file);
+	assert(r == 0);
+	fclose(file);
+	free(old_buf);
+	free(new_buf);
+	return out;
+}
+
+// Diffing two images must give what changed in dirent order, with
+// everything below added and removed directories, a file replaced by a
+// directory as removed and added, and xattrs compared by value
+static void test_image_diff(void)
+{
+	static const struct tree_entry old_tree[] = {
+		{ "/", S_IFDIR | 0755 },
+		{ "/a", S_IFDIR | 0755, .xattrs = { "user.foo=bar" } },
+		{ "/a/file", S_IFREG | 0644, "foo", .xattrs = { "user.x=1", "user.y=2" } },
+		{ "/a/obj", S_IFREG | 0644, NULL, "ab/cdef", 4096 },
+		{ "/gone", S_IFDIR | 0755 },
+		{ "/gone/x", S_IFREG | 0644, NULL, "cd/gone", 10 },
+		{ "/t", S_IFREG | 0644 },
+	};
+	static const struct tree_entry new_tree[] = {
+		{ "/", S_IFDIR | 0755 },
+		{ "/a", S_IFDIR | 0755, .xattrs = { "user.foo=baz" } },
+		{ "/a/copy", S_IFREG | 0644, NULL, "cd/gone", 10 },
+		{ "/a/file", S_IFREG | 0644, "foo", .xattrs = { "user.y=2", "user.x=1" } },
+		{ "/a/obj", S_IFREG | 0644, NULL, "ab/new", 8192 },
+		{ "/new", S_IFDIR | 0755 },
+		{ "/new/y", S_IFREG | 0644, NULL, "ef/y", 5 },
+		{ "/t", S_IFDIR | 0755 },
+		{ "/t/in", S_IFREG | 0644, NULL, "ef/y", 5 },
+	};
+	char *out;
+
+	out = diff_trees(old_tree, 7, new_tree, 9);
+	assert(strcmp(out, "M /a\nA /a/copy\nM /a/obj\nD /gone\nD /gone/x\n"
+			   "A /new\nA /new/y\nD /t\nA /t\nA /t/in\n") == 0);
+	free(out);
+
+	out = diff_trees(new_tree, 9, new_tree, 9);
+	assert(strcmp(out, "") == 0);
+	free(out);
+}
+
 /* Regression test for heap-use-after-free when loading an EROFS image that
  * contains a hardlinked whiteout (chardev with rdev=0, nlink>1).
  *
@@ -225,6 +610,13 @@ static void test_hardlinked_whiteout_load(void)
 	int errsv = errno;
 	assert(root == NULL);
 	assert(errsv == EINVAL);
+
+	/* Walking it must fail the same way */
+	struct lcfs_read_options_s opts = { 0 };
+	struct walk_data data = { 0 };
+	int r = lcfs_image_walk_data(image, sizeof(image), &opts, walk_cb, &data);
+	assert(r < 0);
+	assert(errno == EINVAL);
 }
 
 // Verifies that lcfs_fd_measure_fsverity fails on a fd without fsverity
@@ -267,6 +659,247 @@ static void test_fsverity_empty_file(void)
 	assert(memcmp(digest, expected, LCFS_DIGEST_SIZE) == 0);
 }
 
+static bool u64_ht_eq(const void *value, const void *key)
+{
+	return *(const uint64_t *)value == *(const uint64_t *)key;
+}
+
+static void test_hash_table(void)
+{
+	static uint64_t keys[1000];
+	struct lcfs_ht ht;
+	size_t n_found;
+	size_t iter;
+	void *v;
+
+	int r = lcfs_ht_init(&ht, 0);
+	assert(r == 0);
+
+	// Use a weak hash to get long probe sequences
+	for (size_t i = 0; i < 1000; i++) {
+		keys[i] = i;
+		v = lcfs_ht_insert_if_absent(&ht, keys[i] % 7, &keys[i],
+					     u64_ht_eq, &keys[i]);
+		assert(v == &keys[i]);
+	}
+	assert(ht.n_entries == 1000);
+
+	uint64_t dup = 5;
+	v = lcfs_ht_insert_if_absent(&ht, dup % 7, &dup, u64_ht_eq, &dup);
+	assert(v == &keys[5]);
+	assert(ht.n_entries == 1000);
+
+	for (uint64_t i = 0; i < 1000; i += 2) {
+		v = lcfs_ht_remove(&ht, i % 7, &i, u64_ht_eq);
+		assert(v == &keys[i]);
+	}
+	assert(ht.n_entries == 500);
+
+	for (uint64_t i = 0; i < 1000; i++) {
+		v = lcfs_ht_lookup(&ht, i % 7, &i, u64_ht_eq);
+		assert(v == ((i % 2) ? &keys[i] : NULL));
+	}
+
+	n_found = 0;
+	iter = 0;
+	while ((v = lcfs_ht_next(&ht, &iter)) != NULL) {
+		assert(*(uint64_t *)v % 2 == 1);
+		n_found++;
+	}
+	assert(n_found == 500);
+
+	lcfs_ht_destroy(&ht);
+}
+
+// Writing to a seekable fd must give the same image as the write callback,
+// also when the file had other content before
+static void test_seekable_fd(void)
+{
+	cleanup_node struct lcfs_node_s *node = lcfs_node_new();
+	lcfs_node_set_mode(node, S_IFDIR | 0755);
+	for (int i = 0; i < 100; i++) {
+		struct lcfs_node_s *child = lcfs_node_new();
+		char name[32];
+		uint8_t content[100];
+
+		memset(content, i, sizeof(content));
+		lcfs_node_set_mode(child, S_IFREG | 0644);
+		lcfs_node_set_content(child, content, i);
+		sprintf(name, "file-%d", i);
+		int r = lcfs_node_add_child(node, child, name);
+		assert(r == 0);
+	}
+
+	char *bufp = NULL;
+	size_t bufsz = 0;
+	FILE *buf = open_memstream(&bufp, &bufsz);
+	uint8_t digest[LCFS_DIGEST_SIZE];
+	struct lcfs_write_options_s options = { 0 };
+	options.format = LCFS_FORMAT_EROFS;
+	options.file = buf;
+	options.file_write_cb = write_cb;
+	options.digest_out = digest;
+	int r = lcfs_write_to(node, &options);
+	assert(r == 0);
+	fclose(buf);
+
+	char path[] = "/tmp/test-seekable.XXXXXX";
+	int tmpfd = mkstemp(path);
+	assert(tmpfd > 0);
+	unlink(path);
+	char junk[8192];
+	memset(junk, 0xaa, sizeof(junk));
+	for (size_t i = 0; i < 16; i++)
+		assert(write(tmpfd, junk, sizeof(junk)) == sizeof(junk));
+
+	uint8_t fd_digest[LCFS_DIGEST_SIZE];
+	struct lcfs_write_options_s fd_options = { 0 };
+	fd_options.format = LCFS_FORMAT_EROFS;
+	fd_options.flags = LCFS_FLAGS_SEEKABLE_FD;
+	fd_options.fd = tmpfd;
+	fd_options.digest_out = fd_digest;
+	r = lcfs_write_to(node, &fd_options);
+	assert(r == 0);
+	assert(memcmp(digest, fd_digest, LCFS_DIGEST_SIZE) == 0);
+
+	struct stat st;
+	assert(fstat(tmpfd, &st) == 0);
+	assert((size_t)st.st_size == bufsz);
+	uint8_t *written = malloc(bufsz);
+	assert(pread(tmpfd, written, bufsz, 0) == (ssize_t)bufsz);
+	assert(memcmp(written, bufp, bufsz) == 0);
+
+	// A write callback can't be combined with the fd
+	fd_options.file_write_cb = write_cb;
+	r = lcfs_write_to(node, &fd_options);
+	assert(r < 0 && errno == EINVAL);
+
+	free(written);
+	free(bufp);
+	close(tmpfd);
+}
+
+// An object index must be sorted and without duplicates, so every digest
+// is found by lookup, and only those
+static void test_object_index(void)
+{
+	struct lcfs_objindex_entry_s entries[100];
+	uint8_t digest[LCFS_DIGEST_SIZE];
+	uint64_t size;
+	int r;
+
+	for (size_t i = 0; i < 100; i++) {
+		// Even values, most of them twice, in reverse order
+		memset(entries[i].digest, 0, LCFS_DIGEST_SIZE);
+		entries[i].digest[0] = (100 - i) / 2 * 2;
+		entries[i].size = entries[i].digest[0] * 1000;
+	}
+
+	char path[] = "/tmp/test-objindex.XXXXXX";
+	int tmpfd = mkstemp(path);
+	assert(tmpfd > 0);
+	unlink(path);
+	FILE *file = fdopen(tmpfd, "w+");
+	assert(file != NULL);
+	r = lcfs_objindex_write(file, entries, 100);
+	assert(r == 0);
+	assert(fflush(file) == 0);
+
+	assert(lcfs_objindex_is_index(tmpfd));
+	struct lcfs_objindex_s *index = lcfs_objindex_open(tmpfd);
+	assert(index != NULL);
+	assert(lcfs_objindex_get_n_entries(index) == 51);
+
+	for (size_t i = 0; i < 51; i++) {
+		lcfs_objindex_get_entry(index, i, digest, &size);
+		assert(digest[0] == i * 2 && size == i * 2000);
+	}
+
+	memset(digest, 0, LCFS_DIGEST_SIZE);
+	for (uint8_t i = 0; i <= 102; i++) {
+		digest[0] = i;
+		r = lcfs_objindex_lookup(index, digest, &size);
+		if (i % 2 == 0 && i <= 100)
+			assert(r == 0 && size == i * 1000);
+		else
+			assert(r < 0 && errno == ENOENT);
+	}
+
+	lcfs_objindex_free(index);
+	fclose(file);
+}
+
+struct dirs_data {
+	uint64_t a_entries;
+	uint64_t b_entries;
+};
+
+static int stats_dir_cb(const char *path, uint64_t size, uint64_t n_entries,
+			void *userdata)
+{
+	struct dirs_data *data = userdata;
+
+	if (strcmp(path, "/a") == 0)
+		data->a_entries = n_entries;
+	else if (strcmp(path, "/b") == 0)
+		data->b_entries = n_entries;
+	return 0;
+}
+
+// The image statistics must account for every byte of the image, count
+// hardlinked inodes and shared xattrs once, and split inline data by type
+static void test_image_stats(void)
+{
+	static const struct tree_entry tree[] = {
+		{ "/", S_IFDIR | 0755 },
+		{ "/a", S_IFDIR | 0755, .xattrs = { "user.foo=bar" } },
+		{ "/a/small", S_IFREG | 0644, "foo", .xattrs = { "user.foo=bar" } },
+		{ "/a/obj", S_IFREG | 0644, NULL, "ab/cdef", 4096 },
+		{ "/b", S_IFDIR | 0755, .xattrs = { "user.foo=bar" } },
+		{ "/b/link", .hardlink = "/a/small" },
+		{ "/b/sym", S_IFLNK | 0777, "/a/small" },
+	};
+	cleanup_node struct lcfs_node_s *root = build_tree(tree, 7);
+	struct lcfs_node_s *b = lcfs_node_lookup_child(root, "b");
+	struct lcfs_image_stats_s stats;
+	struct dirs_data dirs = { 0 };
+	char *bufp = NULL;
+	size_t bufsz = 0;
+
+	for (int i = 0; i < 100; i++) {
+		struct lcfs_node_s *file = lcfs_node_new();
+		char name[32];
+
+		lcfs_node_set_mode(file, S_IFREG | 0644);
+		sprintf(name, "file%d", i);
+		int r = lcfs_node_add_child(b, file, name);
+		assert(r == 0);
+	}
+	write_image(root, &bufp, &bufsz);
+
+	int r = lcfs_image_stats_data((uint8_t *)bufp, bufsz, &stats,
+				      stats_dir_cb, &dirs);
+	assert(r == 0);
+	// Everything after the superblock is counted somewhere
+	assert(stats.image_size == bufsz);
+	assert(stats.image_size ==
+	       EROFS_SUPER_OFFSET + sizeof(struct erofs_super_block) +
+		       stats.inode_bytes + stats.inline_xattr_bytes +
+		       stats.inline_data_bytes + stats.chunk_index_bytes +
+		       stats.shared_xattr_size + stats.data_bytes +
+		       stats.padding_bytes);
+	// The whiteouts for overlayfs are inodes too
+	assert(stats.inodes == 106 + 256 && stats.dirs == 3);
+	assert(stats.shared_xattrs == 1 && stats.shared_xattr_refs == 3);
+	assert(stats.inline_file_bytes == 3 && stats.inline_symlink_bytes == 8);
+	assert(stats.inline_data_bytes == stats.inline_file_bytes +
+						  stats.inline_dirent_bytes +
+						  stats.inline_symlink_bytes);
+	assert(dirs.a_entries == 2 && dirs.b_entries == 102);
+
+	free(bufp);
+}
+
 int main(int argc, char **argv)
 {
 	(void)argc;
@@ -277,6 +910,15 @@ int main(int argc, char **argv)
 	test_add_uninitialized_child();
 	test_xattr_addremove();
 	test_xattr_doubleadd();
+	test_remove_child();
+	test_image_walk();
+	test_redirect_payload();
+	test_bad_dirents_load();
+	test_image_diff();
 	test_hardlinked_whiteout_load();
 	test_fsverity_empty_file();
+	test_hash_table();
+	test_seekable_fd();
+	test_object_index();
+	test_image_stats();
 }
@@ -26,10 +26,12 @@
 #include <fuse_lowlevel.h>
 #include <sys/mman.h>
 #include <sys/sysmacros.h>
+#include <pthread.h>
 
 #include "libcomposefs/lcfs-erofs-internal.h"
 #include "libcomposefs/lcfs-internal.h"
 #include "libcomposefs/lcfs-utils.h"
+#include "libcomposefs/lcfs-ht.h"
 
 /* TODO:
  *  Do we want to user ther negative_timeout=T option?
@@ -53,16 +55,99 @@ int basedir_fd;
 struct cfs_data {
 	char *source;
 	char *basedir;
+	char *trace;
 	bool noacl;
 };
 
 static const struct fuse_opt cfs_opts[] = {
 	{ "source=%s", offsetof(struct cfs_data, source), 0 },
 	{ "basedir=%s", offsetof(struct cfs_data, basedir), 0 },
+	{ "trace=%s", offsetof(struct cfs_data, trace), 0 },
 	{ "noacl", offsetof(struct cfs_data, noacl), 1 },
 	FUSE_OPT_END
 };
 
+/* With -o trace=FILE, the path of every inode is written to FILE the
+ * first time it is looked up. As the kernel looks up an inode before
+ * opening, reading or listing it, this is the order in which the image
+ * is accessed, and can be passed to mkcomposefs --layout-hint. Entries
+ * returned by readdirplus are never looked up, so readdirplus is
+ * disabled while tracing. */
+struct cfs_trace_entry {
+	uint64_t nid;
+	char path[];
+};
+
+FILE *trace_file;
+pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct lcfs_ht trace_paths; /* nid -> struct cfs_trace_entry */
+
+static bool cfs_trace_entry_eq(const void *value, const void *key)
+{
+	return ((const struct cfs_trace_entry *)value)->nid == *(const uint64_t *)key;
+}
+
+static void cfs_trace_lookup(uint64_t parent_nid, const char *name, uint64_t nid)
+{
+	const struct cfs_trace_entry *parent;
+	struct cfs_trace_entry *entry;
+	const char *parent_path = "";
+	size_t parent_len, name_len;
+
+	if (trace_file == NULL)
+		return;
+
+	pthread_mutex_lock(&trace_mutex);
+
+	if (lcfs_ht_lookup(&trace_paths, lcfs_ht_hash_u64(nid), &nid,
+			   cfs_trace_entry_eq) != NULL)
+		goto out;
+
+	if (parent_nid != erofs_root_nid) {
+		parent = lcfs_ht_lookup(&trace_paths, lcfs_ht_hash_u64(parent_nid),
+					&parent_nid, cfs_trace_entry_eq);
+		if (parent == NULL)
+			goto out;
+		parent_path = parent->path;
+	}
+
+	parent_len = strlen(parent_path);
+	name_len = strlen(name);
+	entry = malloc(sizeof(struct cfs_trace_entry) + parent_len + 1 + name_len + 1);
+	if (entry == NULL)
+		goto out;
+	entry->nid = nid;
+	memcpy(entry->path, parent_path, parent_len);
+	entry->path[parent_len] = '/';
+	memcpy(entry->path + parent_len + 1, name, name_len + 1);
+
+	if (lcfs_ht_insert(&trace_paths, lcfs_ht_hash_u64(nid), entry) < 0) {
+		free(entry);
+		goto out;
+	}
+
+	fprintf(trace_file, "%s\n", entry->path);
+
+out:
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+static void cfs_trace_close(void)
+{
+	struct cfs_trace_entry *entry;
+	size_t iter = 0;
+
+	if (trace_file == NULL)
+		return;
+
+	fclose(trace_file);
+	trace_file = NULL;
+
+	while ((entry = lcfs_ht_next(&trace_paths, &iter)) != NULL)
+		free(entry);
+	lcfs_ht_destroy(&trace_paths);
+}
+
 static uint64_t cfs_nid_from_ino(fuse_ino_t ino)
 {
 	if (ino == FUSE_ROOT_ID) {
@@ -211,8 +296,9 @@ static inline int memcmp2(const void *a, const size_t a_size, const void *b,
 	return a_size < b_size ? -1 : 1;
 }
 
-static bool cfs_lookup_block(fuse_req_t req, const uint8_t *block,
-			     size_t block_size, const char *name, int *cmp_out)
+static bool cfs_lookup_block(fuse_req_t req, uint64_t parent_nid,
+			     const uint8_t *block, size_t block_size,
+			     const char *name, int *cmp_out)
 {
 	const struct erofs_dirent *dirents = (struct erofs_dirent *)block;
 	size_t n_dirents;
@@ -247,6 +333,8 @@ static bool cfs_lookup_block(fuse_req_t req, const uint8_t *block,
 			if (erofs_inode_is_whiteout(child_cino)) {
 				fuse_reply_err(req, ENOENT);
 			} else {
+				cfs_trace_lookup(parent_nid, name, nid);
+
 				memset(&e, 0, sizeof(e));
 				e.ino = cfs_ino_from_nid(nid);
 				e.attr_timeout = CFS_ATTR_TIMEOUT;
@@ -331,7 +419,8 @@ static void cfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 			}
 		}
 
-		if (cfs_lookup_block(req, block_data, block_size, name, &cmp)) {
+		if (cfs_lookup_block(req, cfs_nid_from_ino(parent), block_data,
+				     block_size, name, &cmp)) {
 			return; /* Found a match */
 		}
 
@@ -347,7 +436,8 @@ static void cfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 
 	if (tailpacked && start_block > end_block) {
 		int cmp;
-		if (cfs_lookup_block(req, tail_data, tail_size, name, &cmp))
+		if (cfs_lookup_block(req, cfs_nid_from_ino(parent), tail_data,
+				     tail_size, name, &cmp))
 			return;
 	}
 
@@ -664,6 +754,9 @@ static void cfs_init(void *userdata, struct fuse_conn_info *conn)
 	if (erofs_use_acl && conn->capable & FUSE_CAP_POSIX_ACL)
 		conn->want |= FUSE_CAP_POSIX_ACL;
 
+	if (trace_file != NULL)
+		conn->want &= ~(FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO);
+
 	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
 		conn->want |= FUSE_CAP_SPLICE_WRITE;
 	if (conn->capable & FUSE_CAP_SPLICE_READ)
@@ -1121,6 +1214,7 @@ static void cleanup_cfs_data(struct cfs_data *data)
 {
 	free(data->source);
 	free(data->basedir);
+	free(data->trace);
 }
 
 int main(int argc, char *argv[])
@@ -1131,7 +1225,7 @@ int main(int argc, char *argv[])
 	struct fuse_cmdline_opts opts;
 	struct fuse_loop_config config;
 	__attribute__((cleanup(cleanup_cfs_data))) struct cfs_data data = {
-		.source = NULL, .basedir = NULL
+		.source = NULL, .basedir = NULL, .trace = NULL
 	};
 	int fd;
 	struct stat s;
@@ -1225,6 +1319,17 @@ int main(int argc, char *argv[])
 	erofs_build_time = lcfs_u64_from_file(erofs_super->build_time);
 	erofs_build_time_nsec = lcfs_u32_from_file(erofs_super->build_time_nsec);
 
+	/* Opened before daemonizing, which changes the working directory */
+	if (data.trace) {
+		trace_file = fopen(data.trace, "we");
+		if (trace_file == NULL)
+			err(EXIT_FAILURE, "Failed to open %s", data.trace);
+		/* Keep the trace usable even if we are killed */
+		setvbuf(trace_file, NULL, _IOLBF, 0);
+		if (lcfs_ht_init(&trace_paths, 0) < 0)
+			err(EXIT_FAILURE, "Failed to allocate trace");
+	}
+
 	se = fuse_session_new(&args, &cfs_oper, sizeof(cfs_oper), NULL);
 	if (se == NULL)
 		goto err_out1;
@@ -1253,6 +1358,7 @@ err_out2:
 	fuse_session_destroy(se);
 err_out1:
 	free(opts.mountpoint);
+	cfs_trace_close();
 
 	return ret ? 1 : 0;
 }
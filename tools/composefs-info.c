@@ -11,7 +11,8 @@
 #include "libcomposefs/lcfs-writer.h"
 #include "libcomposefs/lcfs-utils.h"
 #include "libcomposefs/lcfs-internal.h"
-#include "libcomposefs/hash.h"
+#include "libcomposefs/lcfs-ht.h"
+#include "libcomposefs/lcfs-objindex.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -19,9 +20,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
-#include <ctype.h>
+#include <dirent.h>
 #include <getopt.h>
-#include <locale.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 
 #define ESCAPE_STANDARD 0
 #define NOESCAPE_SPACE (1 << 0)
@@ -34,11 +37,21 @@ static size_t n_filters;
 static size_t filter_capacity = 1;
 static char **opt_filter;
 int opt_basedir_fd;
-
-static locale_t c_locale;
+static uint32_t opt_threads;
+static char **opt_include_paths;
+static size_t n_include_paths;
+static char **opt_exclude_paths;
+static size_t n_exclude_paths;
+static uint32_t opt_max_depth;
+static uint32_t opt_jobs;
+static bool opt_verify;
+static bool opt_delete;
+static uint64_t opt_max_rate;
+static bool opt_json;
+
+static void usage(const char *argv0);
 
 typedef void *(*command_handler_init)(void);
-typedef void (*command_handler)(struct lcfs_node_s *node, void *handler_data);
 typedef void (*command_handler_end)(void *handler_data);
 
 static void oom(void)
@@ -46,101 +59,296 @@ static void oom(void)
 	errx(EXIT_FAILURE, "Out of memory");
 }
 
-static void print_escaped(const char *val, ssize_t len, int escape)
+/* Dumping big images is bound by formatting the output, so rather
+ * than going through stdio for every field, entries are formatted by
+ * hand into a large buffer that is written out when it fills up */
+#define OUT_BUF_SIZE (256 * 1024)
+
+static char out_buf[OUT_BUF_SIZE];
+static size_t out_len;
+
+static void out_flush(void)
+{
+	fwrite(out_buf, 1, out_len, stdout);
+	out_len = 0;
+}
+
+static void out_write(const void *data, size_t len)
+{
+	if (len > OUT_BUF_SIZE - out_len) {
+		out_flush();
+		if (len > OUT_BUF_SIZE) {
+			fwrite(data, 1, len, stdout);
+			return;
+		}
+	}
+	memcpy(out_buf + out_len, data, len);
+	out_len += len;
+}
+
+static void out_char(char c)
+{
+	if (out_len == OUT_BUF_SIZE)
+		out_flush();
+	out_buf[out_len++] = c;
+}
+
+static void out_str(const char *str)
+{
+	out_write(str, strlen(str));
+}
+
+static void out_uint(uint64_t val, unsigned int base)
+{
+	char buf[24];
+	char *p = buf + sizeof(buf);
+
+	do {
+		*--p = '0' + val % base;
+		val /= base;
+	} while (val != 0);
+
+	out_write(p, buf + sizeof(buf) - p);
+}
+
+static void out_int(int64_t val)
+{
+	if (val < 0) {
+		out_char('-');
+		out_uint(-(uint64_t)val, 10);
+	} else {
+		out_uint(val, 10);
+	}
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void out_hex(const uint8_t *data, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		out_char(hex_digits[data[i] >> 4]);
+		out_char(hex_digits[data[i] & 0xf]);
+	}
+}
+
+static void out_hex_escape(uint8_t c)
+{
+	char buf[4] = { '\\', 'x', hex_digits[c >> 4], hex_digits[c & 0xf] };
+	out_write(buf, sizeof(buf));
+}
+
+static void out_escaped(const char *val, ssize_t len, int escape)
 {
 	bool noescape_space = (escape & NOESCAPE_SPACE) != 0;
 	bool escape_equal = (escape & ESCAPE_EQUAL) != 0;
 	bool escape_lone_dash = (escape & ESCAPE_LONE_DASH) != 0;
+	size_t start = 0;
 
 	if (len < 0)
 		len = strlen(val);
 
 	if (escape_lone_dash && len == 1 && val[0] == '-') {
-		printf("\\x%.2x", val[0]);
+		out_hex_escape(val[0]);
 		return;
 	}
 
+	/* Runs of characters that need no escaping are copied at once */
 	for (size_t i = 0; i < len; i++) {
 		uint8_t c = val[i];
-		bool hex_escape = false;
-		const char *special = NULL;
+
+		if (c > ' ' && c < 0x7f && c != '\\' && (c != '=' || !escape_equal))
+			continue;
+		if (c == ' ' && noescape_space)
+			continue;
+
+		out_write(val + start, i - start);
+		start = i + 1;
+
 		switch (c) {
 		case '\\':
-			special = "\\\\";
+			out_write("\\\\", 2);
 			break;
 		case '\n':
-			special = "\\n";
+			out_write("\\n", 2);
 			break;
 		case '\r':
-			special = "\\r";
+			out_write("\\r", 2);
 			break;
 		case '\t':
-			special = "\\t";
-			break;
-		case '=':
-			hex_escape = escape_equal;
+			out_write("\\t", 2);
 			break;
 		default:
-			if (noescape_space)
-				hex_escape = !isprint_l(c, c_locale);
-			else
-				hex_escape = !isgraph_l(c, c_locale);
+			out_hex_escape(c);
 			break;
 		}
-
-		if (special != NULL)
-			printf("%s", special);
-		else if (hex_escape)
-			printf("\\x%.2x", c);
-		else
-			printf("%c", c);
 	}
+
+	out_write(val + start, len - start);
 }
 
-static void print_escaped_optional(const char *val, ssize_t len, int escape)
+static void out_escaped_optional(const char *val, ssize_t len, int escape)
 {
 	if (val == NULL) {
-		printf("-");
+		out_char('-');
 	} else {
-		print_escaped(val, len, escape);
+		out_escaped(val, len, escape);
 	}
 }
 
-static void print_node(struct lcfs_node_s *node, char *parent_path)
+/* Whether @val is valid UTF-8, the only thing JSON strings can hold */
+static bool is_utf8(const char *val, size_t len)
 {
-	for (size_t i = 0; i < lcfs_node_get_n_children(node); i++) {
-		struct lcfs_node_s *child = lcfs_node_get_child(node, i);
-		cleanup_free char *path = NULL;
-		int r;
+	const uint8_t *bytes = (const uint8_t *)val;
+	size_t i = 0;
+
+	while (i < len) {
+		uint8_t c = bytes[i];
+		uint32_t code, min;
+		size_t n;
+
+		if (c < 0x80) {
+			i++;
+			continue;
+		} else if ((c & 0xe0) == 0xc0) {
+			n = 1;
+			code = c & 0x1f;
+			min = 0x80;
+		} else if ((c & 0xf0) == 0xe0) {
+			n = 2;
+			code = c & 0x0f;
+			min = 0x800;
+		} else if ((c & 0xf8) == 0xf0) {
+			n = 3;
+			code = c & 0x07;
+			min = 0x10000;
+		} else {
+			return false;
+		}
 
-		r = asprintf(&path, "%s/%s", parent_path, lcfs_node_get_name(child));
-		if (r < 0)
-			oom();
+		if (len - i - 1 < n)
+			return false;
+		for (size_t j = 1; j <= n; j++) {
+			if ((bytes[i + j] & 0xc0) != 0x80)
+				return false;
+			code = (code << 6) | (bytes[i + j] & 0x3f);
+		}
 
-		uint32_t mode = lcfs_node_get_mode(child);
-		uint32_t type = mode & S_IFMT;
-		const char *payload = lcfs_node_get_payload(child);
+		/* Overlong forms, surrogates and past the last code point */
+		if (code < min || (code >= 0xd800 && code <= 0xdfff) ||
+		    code > 0x10ffff)
+			return false;
 
-		print_escaped(path, -1, NOESCAPE_SPACE);
+		i += n + 1;
+	}
 
-		if (type == S_IFDIR) {
-			printf("/\t");
-		} else if (type == S_IFLNK) {
-			printf("\t-> ");
-			print_escaped(payload, -1, ESCAPE_STANDARD);
-		} else if (type == S_IFREG && payload) {
-			printf("\t@ ");
-			print_escaped(payload, -1, ESCAPE_STANDARD);
+	return true;
+}
+
+/* @val must be valid UTF-8, which is copied through as it is */
+static void out_json_string(const char *val, ssize_t len)
+{
+	size_t start = 0;
+
+	if (len < 0)
+		len = strlen(val);
+
+	out_char('"');
+	for (size_t i = 0; i < len; i++) {
+		uint8_t c = val[i];
+
+		if (c >= ' ' && c != '"' && c != '\\')
+			continue;
+
+		out_write(val + start, i - start);
+		start = i + 1;
+
+		if (c == '"' || c == '\\') {
+			out_char('\\');
+			out_char(c);
+		} else {
+			char buf[6] = { '\\', 'u', '0', '0', hex_digits[c >> 4],
+					hex_digits[c & 0xf] };
+			out_write(buf, sizeof(buf));
 		}
-		printf("\n");
+	}
+	out_write(val + start, len - start);
+	out_char('"');
+}
+
+static const char base64_digits[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
-		print_node(child, path);
+static void out_json_base64(const char *val, size_t len)
+{
+	const uint8_t *bytes = (const uint8_t *)val;
+
+	out_char('"');
+	for (size_t i = 0; i < len; i += 3) {
+		uint32_t v = bytes[i] << 16;
+		char buf[4];
+
+		if (i + 1 < len)
+			v |= bytes[i + 1] << 8;
+		if (i + 2 < len)
+			v |= bytes[i + 2];
+
+		buf[0] = base64_digits[(v >> 18) & 0x3f];
+		buf[1] = base64_digits[(v >> 12) & 0x3f];
+		buf[2] = i + 1 < len ? base64_digits[(v >> 6) & 0x3f] : '=';
+		buf[3] = i + 2 < len ? base64_digits[v & 0x3f] : '=';
+		out_write(buf, sizeof(buf));
 	}
+	out_char('"');
 }
 
-static void print_node_handler(struct lcfs_node_s *node, void *data)
+/* Paths, contents and xattrs can hold any bytes, but JSON strings only
+ * UTF-8. Those that aren't are written base64 encoded instead, under
+ * @key with a "_b64" suffix. */
+static void out_json_member(const char *key, const char *val, ssize_t len)
 {
-	print_node(node, "");
+	out_char('"');
+	out_str(key);
+	if (val == NULL) {
+		out_str("\":null");
+		return;
+	}
+
+	if (len < 0)
+		len = strlen(val);
+	if (is_utf8(val, len)) {
+		out_str("\":");
+		out_json_string(val, len);
+	} else {
+		out_str("_b64\":");
+		out_json_base64(val, len);
+	}
+}
+
+static int print_entry_handler(const struct lcfs_image_entry_s *entry, void *data)
+{
+	uint32_t type = entry->mode & S_IFMT;
+
+	/* The root isn't listed */
+	if (entry->depth == 0)
+		return 0;
+
+	out_escaped(entry->path, -1, NOESCAPE_SPACE);
+
+	/* Hardlinks are listed by path only */
+	if (entry->hardlink_target == NULL) {
+		if (type == S_IFDIR) {
+			out_str("/\t");
+		} else if (type == S_IFLNK) {
+			out_str("\t-> ");
+			out_escaped(entry->payload, -1, ESCAPE_STANDARD);
+		} else if (type == S_IFREG && entry->payload) {
+			out_str("\t@ ");
+			out_escaped(entry->payload, -1, ESCAPE_STANDARD);
+		}
+	}
+	out_char('\n');
+
+	return 0;
 }
 
 static char *node_build_path(struct lcfs_node_s *node)
@@ -180,75 +388,219 @@ static char *node_build_path(struct lcfs_node_s *node)
 	return path;
 }
 
-static void dump_node(struct lcfs_node_s *node, char *path)
+struct walk_path {
+	char *buf;
+	size_t size;
+};
+
+/* Passes a loaded tree to @cb the way lcfs_image_walk() passes the image.
+ * The path of @node is the first @path_len bytes of @path, which the paths
+ * of the children are appended to in turn. */
+static int walk_node(struct lcfs_node_s *node, struct walk_path *path,
+		     size_t path_len, uint32_t depth, lcfs_image_walk_cb cb,
+		     void *data)
 {
 	struct lcfs_node_s *target = lcfs_node_get_hardlink_target(node);
 	cleanup_free char *hardlink_path = NULL;
+	cleanup_free struct lcfs_image_xattr_s *xattrs = NULL;
+	struct lcfs_image_entry_s entry = { 0 };
+	struct timespec mtime;
+	int r;
+
 	if (target == NULL)
 		target = node;
 	else
 		hardlink_path = node_build_path(target);
 
-	struct timespec mtime;
-	lcfs_node_get_mtime(target, &mtime);
-	const char *payload = lcfs_node_get_payload(target);
-	const uint8_t *digest = lcfs_node_get_fsverity_digest(target);
-	const uint8_t *content = lcfs_node_get_content(target);
-	uint64_t size = lcfs_node_get_size(target);
-
-	print_escaped(*path == 0 ? "/" : path, -1, ESCAPE_STANDARD);
-	printf(" %" PRIu64 " %s%o %u %u %u %" PRIu64 " %" PRIi64 ".%u ", size,
-	       hardlink_path != NULL ? "@" : "", lcfs_node_get_mode(target),
-	       lcfs_node_get_nlink(target), lcfs_node_get_uid(target),
-	       lcfs_node_get_gid(target), lcfs_node_get_rdev64(target),
-	       (int64_t)mtime.tv_sec, (unsigned int)mtime.tv_nsec);
-	print_escaped_optional(hardlink_path ? hardlink_path : payload, -1,
-			       ESCAPE_LONE_DASH);
-	printf(" ");
-	print_escaped_optional((char *)content, size, ESCAPE_LONE_DASH);
-
-	if (digest) {
-		char digest_str[LCFS_DIGEST_SIZE * 2 + 1] = { 0 };
-		digest_to_string(digest, digest_str);
-		printf(" %s", digest_str);
-	} else {
-		printf(" -");
-	}
-
 	size_t n_xattr = lcfs_node_get_n_xattr(target);
+	xattrs = calloc(n_xattr + 1, sizeof(struct lcfs_image_xattr_s));
+	if (xattrs == NULL)
+		oom();
 	for (size_t i = 0; i < n_xattr; i++) {
-		const char *name = lcfs_node_get_xattr_name(target, i);
-		size_t value_len;
-		const char *value = lcfs_node_get_xattr(target, name, &value_len);
-
-		printf(" ");
-		print_escaped(name, -1, ESCAPE_EQUAL);
-		printf("=");
-		print_escaped(value, value_len, ESCAPE_EQUAL);
+		xattrs[i].name = lcfs_node_get_xattr_name(target, i);
+		xattrs[i].value = lcfs_node_get_xattr(target, xattrs[i].name,
+						      &xattrs[i].value_len);
 	}
 
-	printf("\n");
+	lcfs_node_get_mtime(target, &mtime);
+	path->buf[path_len] = 0;
+	entry.path = path_len == 0 ? "/" : path->buf;
+	entry.depth = depth;
+	entry.mode = lcfs_node_get_mode(target);
+	entry.nlink = lcfs_node_get_nlink(target);
+	entry.uid = lcfs_node_get_uid(target);
+	entry.gid = lcfs_node_get_gid(target);
+	entry.rdev = lcfs_node_get_rdev64(target);
+	entry.size = lcfs_node_get_size(target);
+	entry.mtime_sec = mtime.tv_sec;
+	entry.mtime_nsec = mtime.tv_nsec;
+	entry.payload = lcfs_node_get_payload(target);
+	entry.content = lcfs_node_get_content(target);
+	entry.digest = lcfs_node_get_fsverity_digest(target);
+	entry.hardlink_target = hardlink_path;
+	entry.n_xattrs = n_xattr;
+	entry.xattrs = xattrs;
+
+	r = cb(&entry, data);
+	if (r != 0)
+		return r;
 
 	for (size_t i = 0; i < lcfs_node_get_n_children(node); i++) {
 		struct lcfs_node_s *child = lcfs_node_get_child(node, i);
-		cleanup_free char *child_path = NULL;
-		int r;
+		const char *name = lcfs_node_get_name(child);
+		size_t name_len = strlen(name);
+		size_t child_len = path_len + 1 + name_len;
+
+		if (child_len >= path->size) {
+			size_t new_size = max(path->size * 2, child_len + 1);
+			char *new_buf = realloc(path->buf, new_size);
+			if (new_buf == NULL)
+				oom();
+			path->buf = new_buf;
+			path->size = new_size;
+		}
+		path->buf[path_len] = '/';
+		memcpy(path->buf + path_len + 1, name, name_len);
 
-		r = asprintf(&child_path, "%s/%s", path, lcfs_node_get_name(child));
-		if (r < 0)
-			oom();
+		r = walk_node(child, path, child_len, depth + 1, cb, data);
+		if (r != 0)
+			return r;
+	}
+
+	return 0;
+}
 
-		dump_node(child, child_path);
+static int dump_entry_handler(const struct lcfs_image_entry_s *entry, void *data)
+{
+	const char *hardlink_path = entry->hardlink_target;
+
+	out_escaped(entry->path, -1, ESCAPE_STANDARD);
+	out_char(' ');
+	out_uint(entry->size, 10);
+	out_str(hardlink_path != NULL ? " @" : " ");
+	out_uint(entry->mode, 8);
+	out_char(' ');
+	out_uint(entry->nlink, 10);
+	out_char(' ');
+	out_uint(entry->uid, 10);
+	out_char(' ');
+	out_uint(entry->gid, 10);
+	out_char(' ');
+	out_uint(entry->rdev, 10);
+	out_char(' ');
+	out_int(entry->mtime_sec);
+	out_char('.');
+	out_uint(entry->mtime_nsec, 10);
+	out_char(' ');
+	out_escaped_optional(hardlink_path ? hardlink_path : entry->payload, -1,
+			     ESCAPE_LONE_DASH);
+	out_char(' ');
+	out_escaped_optional((char *)entry->content, entry->size, ESCAPE_LONE_DASH);
+	out_char(' ');
+
+	if (entry->digest)
+		out_hex(entry->digest, LCFS_DIGEST_SIZE);
+	else
+		out_char('-');
+
+	for (size_t i = 0; i < entry->n_xattrs; i++) {
+		out_char(' ');
+		out_escaped(entry->xattrs[i].name, -1, ESCAPE_EQUAL);
+		out_char('=');
+		out_escaped(entry->xattrs[i].value, entry->xattrs[i].value_len,
+			    ESCAPE_EQUAL);
 	}
+
+	out_char('\n');
+
+	return 0;
+}
+
+static bool xattr_is_utf8(const struct lcfs_image_xattr_s *xattr)
+{
+	return is_utf8(xattr->name, strlen(xattr->name)) &&
+	       is_utf8(xattr->value, xattr->value_len);
 }
 
-static void dump_node_handler(struct lcfs_node_s *node, void *data)
+/* Dumps each entry as a JSON object on a line of its own */
+static int dump_json_entry_handler(const struct lcfs_image_entry_s *entry,
+				   void *data)
 {
-	dump_node(node, "");
+	size_t n_b64 = 0;
+
+	out_char('{');
+	out_json_member("path", entry->path, -1);
+	out_str(",\"size\":");
+	out_uint(entry->size, 10);
+	out_str(",\"mode\":");
+	out_uint(entry->mode, 10);
+	out_str(",\"nlink\":");
+	out_uint(entry->nlink, 10);
+	out_str(",\"uid\":");
+	out_uint(entry->uid, 10);
+	out_str(",\"gid\":");
+	out_uint(entry->gid, 10);
+	out_str(",\"rdev\":");
+	out_uint(entry->rdev, 10);
+	out_str(",\"mtime_sec\":");
+	out_int(entry->mtime_sec);
+	out_str(",\"mtime_nsec\":");
+	out_uint(entry->mtime_nsec, 10);
+	out_char(',');
+	out_json_member("hardlink", entry->hardlink_target, -1);
+	out_char(',');
+	out_json_member("payload", entry->payload, -1);
+	out_char(',');
+	out_json_member("content", (char *)entry->content, entry->size);
+	out_str(",\"digest\":");
+	if (entry->digest) {
+		out_char('"');
+		out_hex(entry->digest, LCFS_DIGEST_SIZE);
+		out_char('"');
+	} else {
+		out_str("null");
+	}
+
+	out_str(",\"xattrs\":{");
+	for (size_t i = 0, n = 0; i < entry->n_xattrs; i++) {
+		const struct lcfs_image_xattr_s *xattr = &entry->xattrs[i];
+
+		if (!xattr_is_utf8(xattr)) {
+			n_b64++;
+			continue;
+		}
+		if (n++ != 0)
+			out_char(',');
+		out_json_string(xattr->name, -1);
+		out_char(':');
+		out_json_string(xattr->value, xattr->value_len);
+	}
+	out_char('}');
+
+	/* Those with a name or value that isn't UTF-8 go into an object
+	 * of their own, with both of them base64 encoded */
+	if (n_b64 > 0) {
+		out_str(",\"xattrs_b64\":{");
+		for (size_t i = 0, n = 0; i < entry->n_xattrs; i++) {
+			const struct lcfs_image_xattr_s *xattr = &entry->xattrs[i];
+
+			if (xattr_is_utf8(xattr))
+				continue;
+			if (n++ != 0)
+				out_char(',');
+			out_json_base64(xattr->name, strlen(xattr->name));
+			out_char(':');
+			out_json_base64(xattr->value, xattr->value_len);
+		}
+		out_char('}');
+	}
+	out_str("}\n");
+
+	return 0;
 }
 
 typedef struct {
-	Hash_table *ht;
+	struct lcfs_ht ht;
 } PrintData;
 
 static const char *abs_to_rel_path(const char *path)
@@ -258,100 +610,1209 @@ static const char *abs_to_rel_path(const char *path)
 	return path;
 }
 
-static void get_objects(struct lcfs_node_s *node, PrintData *data, int basedir_fd)
+static bool str_ht_eq(const void *value, const void *key)
+{
+	return strcmp(value, key) == 0;
+}
+
+static void get_objects(const struct lcfs_image_entry_s *entry, PrintData *data)
 {
-	uint32_t mode = lcfs_node_get_mode(node);
-	uint32_t type = mode & S_IFMT;
-	const char *payload = lcfs_node_get_payload(node);
+	uint32_t type = entry->mode & S_IFMT;
+	const char *payload = entry->payload;
 
-	if (type == S_IFREG && payload && hash_lookup(data->ht, payload) == NULL) {
-		struct stat st;
-		if (basedir_fd == -1 || fstatat(basedir_fd, abs_to_rel_path(payload),
-						&st, AT_EMPTY_PATH) < 0) {
+	/* Only the first path of a hardlinked file is looked at */
+	if (type == S_IFREG && payload && entry->hardlink_target == NULL) {
+		uint64_t hash = lcfs_ht_hash_string(payload);
+
+		if (lcfs_ht_lookup(&data->ht, hash, payload, str_ht_eq) == NULL) {
 			char *dup = strdup(payload);
-			if (dup == NULL || hash_insert(data->ht, dup) == NULL)
+			if (dup == NULL || lcfs_ht_insert(&data->ht, hash, dup) < 0)
 				oom();
 		}
 	}
+}
 
-	for (size_t i = 0; i < lcfs_node_get_n_children(node); i++) {
-		struct lcfs_node_s *child = lcfs_node_get_child(node, i);
-		get_objects(child, data, basedir_fd);
-	}
+static int cmp_obj(const void *_a, const void *_b)
+{
+	const char *const *a = _a;
+	const char *const *b = _b;
+	return strcmp(*a, *b);
 }
 
-static size_t str_ht_hash(const void *entry, size_t table_size)
+static int print_objects_handler(const struct lcfs_image_entry_s *entry, void *_data)
 {
-	return hash_string(entry, table_size);
+	PrintData *data = _data;
+	get_objects(entry, data);
+	return 0;
 }
 
-static bool str_ht_eq(const void *entry1, const void *entry2)
+/* Runs @fn from @n_threads threads, including this one, which does the
+ * remaining work if threads can't be started */
+static void run_in_threads(size_t n_threads, void *(*fn)(void *), void *data)
 {
-	return strcmp(entry1, entry2) == 0;
+	cleanup_free pthread_t *threads = NULL;
+	size_t n_started = 0;
+
+	if (n_threads > 1) {
+		threads = calloc(n_threads - 1, sizeof(pthread_t));
+		if (threads == NULL)
+			oom();
+	}
+
+	for (; n_started + 1 < n_threads; n_started++) {
+		if (pthread_create(&threads[n_started], NULL, fn, data) != 0)
+			break;
+	}
+
+	fn(data);
+
+	for (size_t i = 0; i < n_started; i++)
+		pthread_join(threads[i], NULL);
 }
 
-static int cmp_obj(const void *_a, const void *_b)
+struct backing_object {
+	uint64_t size;
+	uint8_t digest[LCFS_DIGEST_SIZE];
+	bool has_digest;
+	bool missing;
+	char name[];
+};
+
+/* Object indexes written by mkcomposefs --object-index stand in for
+ * their images, and are merged in as they are */
+typedef struct {
+	struct lcfs_ht ht; /* struct backing_object */
+	struct lcfs_objindex_s **indexes;
+	size_t n_indexes;
+} BackingData;
+
+static bool backing_object_ht_eq(const void *value, const void *key)
 {
-	const char *const *a = _a;
-	const char *const *b = _b;
-	return strcmp(*a, *b);
+	const struct backing_object *obj = value;
+	return strcmp(obj->name, key) == 0;
 }
 
-static void *print_objects_handler_init(void)
+static void *backing_objects_handler_init(void)
 {
-	PrintData *data = calloc(1, sizeof(PrintData));
+	BackingData *data = calloc(1, sizeof(BackingData));
 
 	if (data == NULL)
 		oom();
 
-	data->ht = hash_initialize(0, NULL, str_ht_hash, str_ht_eq, free);
-	if (data->ht == NULL)
+	if (lcfs_ht_init(&data->ht, 0) < 0)
 		oom();
 
 	return data;
 }
 
-static void print_objects_handler(struct lcfs_node_s *node, void *_data)
+static int backing_objects_handler(const struct lcfs_image_entry_s *entry,
+				   void *_data)
 {
-	PrintData *data = _data;
-	get_objects(node, data, -1);
+	BackingData *data = _data;
+	uint32_t type = entry->mode & S_IFMT;
+	const char *payload = entry->payload;
+
+	/* Only the first path of a hardlinked file is looked at */
+	if (type == S_IFREG && payload && entry->hardlink_target == NULL) {
+		uint64_t hash = lcfs_ht_hash_string(payload);
+
+		if (lcfs_ht_lookup(&data->ht, hash, payload, backing_object_ht_eq) == NULL) {
+			size_t len = strlen(payload);
+			struct backing_object *obj = calloc(1, sizeof(*obj) + len + 1);
+			if (obj == NULL)
+				oom();
+			obj->size = entry->size;
+			if (entry->digest) {
+				memcpy(obj->digest, entry->digest, LCFS_DIGEST_SIZE);
+				obj->has_digest = true;
+			}
+			memcpy(obj->name, payload, len + 1);
+			if (lcfs_ht_insert(&data->ht, hash, obj) < 0)
+				oom();
+		}
+	}
+
+	return 0;
 }
 
-static void print_missing_objects_handler(struct lcfs_node_s *node, void *_data)
+static int backing_objects_add_index(BackingData *data, int fd)
 {
-	PrintData *data = _data;
-	get_objects(node, data, opt_basedir_fd);
+	struct lcfs_objindex_s *index = lcfs_objindex_open(fd);
+
+	if (index == NULL)
+		return -1;
+
+	data->indexes = reallocarray(data->indexes, data->n_indexes + 1,
+				     sizeof(struct lcfs_objindex_s *));
+	if (data->indexes == NULL)
+		oom();
+	data->indexes[data->n_indexes++] = index;
+	return 0;
+}
+
+static int cmp_backing_object(const void *_a, const void *_b)
+{
+	const struct backing_object *const *a = _a;
+	const struct backing_object *const *b = _b;
+	return strcmp((*a)->name, (*b)->name);
+}
+
+/* Returns the object with the lowest digest that is next in any of the
+ * indexes, advancing past it in all of them, or NULL at the end */
+static struct backing_object *index_objects_next(BackingData *data, size_t *pos)
+{
+	struct backing_object *obj;
+	uint8_t digest[LCFS_DIGEST_SIZE];
+	ssize_t lowest = -1;
+	uint64_t size;
+
+	obj = malloc(sizeof(*obj) + LCFS_DIGEST_SIZE * 2 + 2);
+	if (obj == NULL)
+		oom();
+
+	for (size_t i = 0; i < data->n_indexes; i++) {
+		if (pos[i] == lcfs_objindex_get_n_entries(data->indexes[i]))
+			continue;
+
+		lcfs_objindex_get_entry(data->indexes[i], pos[i], digest, &size);
+		if (lowest < 0 || memcmp(digest, obj->digest, LCFS_DIGEST_SIZE) < 0) {
+			memcpy(obj->digest, digest, LCFS_DIGEST_SIZE);
+			obj->size = size;
+			lowest = i;
+		}
+	}
+
+	if (lowest < 0) {
+		free(obj);
+		return NULL;
+	}
+
+	/* The same object in several indexes is only returned once */
+	for (size_t i = lowest; i < data->n_indexes; i++) {
+		if (pos[i] == lcfs_objindex_get_n_entries(data->indexes[i]))
+			continue;
+
+		lcfs_objindex_get_entry(data->indexes[i], pos[i], digest, &size);
+		if (memcmp(digest, obj->digest, LCFS_DIGEST_SIZE) == 0)
+			pos[i]++;
+	}
+
+	obj->has_digest = true;
+	obj->missing = false;
+	digest_to_path(obj->digest, obj->name);
+	return obj;
+}
+
+/* Frees the collected objects, returning them sorted by name. The
+ * entries of the indexes are sorted by digest, which for their fixed
+ * length names is the same order, so they are merged in as they are. */
+static struct backing_object **backing_objects_steal_sorted(BackingData *data,
+							    size_t *n_objects_out)
+{
+	size_t n_walked = data->ht.n_entries;
+	size_t n_max = n_walked;
+	cleanup_free struct backing_object **walked = NULL;
+	cleanup_free size_t *pos = NULL;
+	struct backing_object **objects;
+	struct backing_object *next;
+	size_t n_objects = 0;
+	size_t iter = 0;
+	size_t w = 0;
+
+	for (size_t i = 0; i < data->n_indexes; i++)
+		n_max += lcfs_objindex_get_n_entries(data->indexes[i]);
+
+	walked = calloc(n_walked + 1, sizeof(struct backing_object *));
+	objects = calloc(n_max + 1, sizeof(struct backing_object *));
+	pos = calloc(data->n_indexes + 1, sizeof(size_t));
+	if (walked == NULL || objects == NULL || pos == NULL)
+		oom();
+
+	for (size_t i = 0; i < n_walked; i++)
+		walked[i] = lcfs_ht_next(&data->ht, &iter);
+
+	/* In name order, objects in the same fan-out directory are
+	 * handled together, which is kinder to the dentry cache */
+	qsort(walked, n_walked, sizeof(struct backing_object *), cmp_backing_object);
+
+	next = index_objects_next(data, pos);
+	while (w < n_walked || next != NULL) {
+		int cmp = next == NULL  ? -1 :
+			  w == n_walked ? 1 :
+					  strcmp(walked[w]->name, next->name);
+
+		/* The index knows the digest, so it wins a tie */
+		if (cmp < 0) {
+			objects[n_objects++] = walked[w++];
+		} else {
+			if (cmp == 0)
+				free(walked[w++]);
+			objects[n_objects++] = next;
+			next = index_objects_next(data, pos);
+		}
+	}
+
+	for (size_t i = 0; i < data->n_indexes; i++)
+		lcfs_objindex_free(data->indexes[i]);
+	free(data->indexes);
+	lcfs_ht_destroy(&data->ht);
+	free(data);
+
+	*n_objects_out = n_objects;
+	return objects;
+}
+
+/* Objects are handled in chunks of consecutive names, so each thread
+ * mostly stays within one fan-out directory at a time */
+#define OBJECT_JOBS_CHUNK 64
+
+struct object_jobs {
+	struct backing_object **objects;
+	size_t n_objects;
+	void (*fn)(struct backing_object *obj);
+	atomic_size_t next;
+};
+
+static void *object_jobs_thread(void *_jobs)
+{
+	struct object_jobs *jobs = _jobs;
+	size_t start;
+
+	while ((start = atomic_fetch_add(&jobs->next, OBJECT_JOBS_CHUNK)) <
+	       jobs->n_objects) {
+		size_t end = min(start + OBJECT_JOBS_CHUNK, jobs->n_objects);
+
+		for (size_t i = start; i < end; i++)
+			jobs->fn(jobs->objects[i]);
+	}
+
+	return NULL;
+}
+
+/* Calls @fn for each object from up to --jobs threads */
+static void run_object_jobs(struct backing_object **objects, size_t n_objects,
+			    void (*fn)(struct backing_object *obj))
+{
+	struct object_jobs jobs = {
+		.objects = objects,
+		.n_objects = n_objects,
+		.fn = fn,
+	};
+
+	atomic_init(&jobs.next, 0);
+
+	/* There is no point in more threads than chunks */
+	run_in_threads(min((size_t)opt_jobs,
+			   (n_objects + OBJECT_JOBS_CHUNK - 1) / OBJECT_JOBS_CHUNK),
+		       object_jobs_thread, &jobs);
+}
+
+static void check_object(struct backing_object *obj)
+{
+	const char *path = abs_to_rel_path(obj->name);
+	uint8_t digest[LCFS_DIGEST_SIZE];
+	struct stat st;
+
+	if (!opt_verify || !obj->has_digest) {
+		obj->missing = fstatat(opt_basedir_fd, path, &st, AT_EMPTY_PATH) < 0;
+		return;
+	}
+
+	/* A backing file with the wrong content is as good as missing */
+	cleanup_fd int fd = openat(opt_basedir_fd, path, O_RDONLY | O_CLOEXEC);
+	obj->missing = fd < 0 || lcfs_fd_get_fsverity(digest, fd) != 0 ||
+		       memcmp(digest, obj->digest, LCFS_DIGEST_SIZE) != 0;
 }
 
 static void print_objects_handler_end(void *_data)
 {
-	PrintData *data = _data;
+	size_t n_objects;
+	cleanup_free struct backing_object **objects =
+		backing_objects_steal_sorted(_data, &n_objects);
 
-	size_t n_objects = hash_get_n_entries(data->ht);
-	cleanup_free char **objects = calloc(n_objects, sizeof(char *));
-	if (objects == NULL)
+	for (size_t i = 0; i < n_objects; i++) {
+		printf("%s\n", objects[i]->name);
+		free(objects[i]);
+	}
+}
+
+static void print_missing_objects_handler_end(void *_data)
+{
+	size_t n_objects;
+	cleanup_free struct backing_object **objects =
+		backing_objects_steal_sorted(_data, &n_objects);
+
+	run_object_jobs(objects, n_objects, check_object);
+
+	for (size_t i = 0; i < n_objects; i++) {
+		if (objects[i]->missing)
+			printf("%s\n", objects[i]->name);
+		free(objects[i]);
+	}
+}
+
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t rate_next_ns;
+
+/* Spaces out reads so that on average no more than --max-rate bytes a
+ * second are asked for */
+static void rate_limit(uint64_t size)
+{
+	uint64_t now = lcfs_now_ns();
+	uint64_t start;
+
+	pthread_mutex_lock(&rate_lock);
+	start = max(now, rate_next_ns);
+	rate_next_ns = start + size / opt_max_rate * 1000000000ULL +
+		       size % opt_max_rate * 1000000000ULL / opt_max_rate;
+	pthread_mutex_unlock(&rate_lock);
+
+	if (start > now) {
+		struct timespec ts = {
+			.tv_sec = (start - now) / 1000000000ULL,
+			.tv_nsec = (start - now) % 1000000000ULL,
+		};
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+			;
+	}
+}
+
+/* A readahead request only reads about this much at once */
+#define PREFETCH_CHUNK_SIZE (128 * 1024)
+
+static void prefetch_object(struct backing_object *obj)
+{
+	const char *path = abs_to_rel_path(obj->name);
+	cleanup_fd int fd = openat(opt_basedir_fd, path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		obj->missing = true;
+		return;
+	}
+
+	/* This only starts the reads, they fill the page cache in the
+	 * background, so a few threads keep many objects in flight */
+	for (uint64_t offset = 0; offset < obj->size;
+	     offset += PREFETCH_CHUNK_SIZE) {
+		uint64_t len = min(obj->size - offset, PREFETCH_CHUNK_SIZE);
+
+		if (opt_max_rate != 0)
+			rate_limit(len);
+
+		if (posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED) != 0)
+			break;
+	}
+}
+
+static void prefetch_objects_handler_end(void *_data)
+{
+	size_t n_objects;
+	cleanup_free struct backing_object **objects =
+		backing_objects_steal_sorted(_data, &n_objects);
+	size_t n_missing = 0;
+	uint64_t total_size = 0;
+
+	run_object_jobs(objects, n_objects, prefetch_object);
+
+	for (size_t i = 0; i < n_objects; i++) {
+		if (objects[i]->missing)
+			n_missing++;
+		else
+			total_size += objects[i]->size;
+		free(objects[i]);
+	}
+
+	fprintf(stderr, "Prefetched %zu objects, %" PRIu64 " bytes, %zu missing\n",
+		n_objects - n_missing, total_size, n_missing);
+}
+
+struct diff_object {
+	uint64_t size;
+	char name[];
+};
+
+typedef struct {
+	struct lcfs_ht objects; /* struct diff_object */
+} DiffData;
+
+static bool diff_object_ht_eq(const void *value, const void *key)
+{
+	const struct diff_object *obj = value;
+	return strcmp(obj->name, key) == 0;
+}
+
+static int diff_handler(enum lcfs_image_change_t change,
+			const struct lcfs_image_entry_s *old_entry,
+			const struct lcfs_image_entry_s *new_entry, void *_data)
+{
+	DiffData *data = _data;
+	const struct lcfs_image_entry_s *entry = new_entry ? new_entry : old_entry;
+
+	switch (change) {
+	case LCFS_IMAGE_CHANGE_ADDED:
+		out_str("A ");
+		break;
+	case LCFS_IMAGE_CHANGE_REMOVED:
+		out_str("D ");
+		break;
+	case LCFS_IMAGE_CHANGE_MODIFIED:
+		out_str("M ");
+		break;
+	}
+	out_escaped(entry->path, -1, NOESCAPE_SPACE);
+	out_char('\n');
+
+	/* Candidates for new objects, unless the old image has them elsewhere */
+	if (new_entry && (new_entry->mode & S_IFMT) == S_IFREG && new_entry->payload) {
+		const char *payload = new_entry->payload;
+		uint64_t hash = lcfs_ht_hash_string(payload);
+
+		if (lcfs_ht_lookup(&data->objects, hash, payload, diff_object_ht_eq) == NULL) {
+			size_t len = strlen(payload);
+			struct diff_object *obj = malloc(sizeof(*obj) + len + 1);
+			if (obj == NULL)
+				oom();
+			obj->size = new_entry->size;
+			memcpy(obj->name, payload, len + 1);
+			if (lcfs_ht_insert(&data->objects, hash, obj) < 0)
+				oom();
+		}
+	}
+
+	return 0;
+}
+
+static int diff_old_objects_handler(const struct lcfs_image_entry_s *entry,
+				    void *_data)
+{
+	DiffData *data = _data;
+	const char *payload = entry->payload;
+
+	if ((entry->mode & S_IFMT) == S_IFREG && payload) {
+		struct diff_object *obj =
+			lcfs_ht_remove(&data->objects, lcfs_ht_hash_string(payload),
+				       payload, diff_object_ht_eq);
+		free(obj);
+		/* Nothing left to look for */
+		if (data->objects.n_entries == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int cmp_diff_object(const void *_a, const void *_b)
+{
+	const struct diff_object *const *a = _a;
+	const struct diff_object *const *b = _b;
+	return strcmp((*a)->name, (*b)->name);
+}
+
+/* Prints the entries that differ between two images, and then the backing
+ * files the new one needs that the old one doesn't reference */
+static int diff_images(const char *bin, int argc, char **argv,
+		       const struct lcfs_read_options_s *opts)
+{
+	const struct lcfs_read_options_s old_opts = { 0 };
+	DiffData data = { 0 };
+	int r;
+
+	if (argc != 4) {
+		fprintf(stderr, "Two images must be specified\n");
+		usage(bin);
+		exit(1);
+	}
+
+	cleanup_fd int old_fd = open(argv[2], O_RDONLY | O_CLOEXEC);
+	if (old_fd < 0)
+		err(EXIT_FAILURE, "Failed to open '%s'", argv[2]);
+	cleanup_fd int new_fd = open(argv[3], O_RDONLY | O_CLOEXEC);
+	if (new_fd < 0)
+		err(EXIT_FAILURE, "Failed to open '%s'", argv[3]);
+
+	if (lcfs_ht_init(&data.objects, 0) < 0)
 		oom();
 
-	hash_get_entries(data->ht, (void **)objects, n_objects);
+	if (lcfs_image_diff(old_fd, new_fd, opts, diff_handler, &data) < 0)
+		err(EXIT_FAILURE, "Failed to diff '%s' and '%s'", argv[2], argv[3]);
+
+	/* The changed entries of the new image may well use objects that
+	 * unchanged ones of the old image already did, wherever they are */
+	if (data.objects.n_entries != 0) {
+		r = lcfs_image_walk(old_fd, &old_opts, diff_old_objects_handler, &data);
+		if (r < 0)
+			err(EXIT_FAILURE, "Failed to load '%s'", argv[2]);
+	}
 
-	qsort(objects, n_objects, sizeof(char *), cmp_obj);
+	size_t n_objects = data.objects.n_entries;
+	cleanup_free struct diff_object **objects =
+		calloc(n_objects + 1, sizeof(struct diff_object *));
+	if (objects == NULL)
+		oom();
 
+	size_t iter = 0;
 	for (size_t i = 0; i < n_objects; i++)
-		printf("%s\n", objects[i]);
+		objects[i] = lcfs_ht_next(&data.objects, &iter);
 
-	hash_free(data->ht);
-	free(data);
+	qsort(objects, n_objects, sizeof(struct diff_object *), cmp_diff_object);
+
+	for (size_t i = 0; i < n_objects; i++) {
+		out_str("O ");
+		out_uint(objects[i]->size, 10);
+		out_char(' ');
+		out_str(objects[i]->name);
+		out_char('\n');
+		free(objects[i]);
+	}
+
+	lcfs_ht_destroy(&data.objects);
+	return 0;
+}
+
+struct gc_image {
+	const char *path;
+	PrintData objects;
+	struct lcfs_objindex_s *index; /* Looked up instead of walked */
+	int errsv; /* Set if the image couldn't be walked */
+};
+
+struct gc_images {
+	struct gc_image *images;
+	size_t n_images;
+	atomic_size_t next;
+};
+
+static void *gc_walk_thread(void *_images)
+{
+	struct gc_images *images = _images;
+	const struct lcfs_read_options_s opts = { 0 };
+	size_t i;
+
+	while ((i = atomic_fetch_add(&images->next, 1)) < images->n_images) {
+		struct gc_image *image = &images->images[i];
+		cleanup_fd int fd = open(image->path, O_RDONLY | O_CLOEXEC);
+		int r;
+
+		if (fd < 0) {
+			image->errsv = errno;
+			continue;
+		}
+
+		if (lcfs_objindex_is_index(fd)) {
+			image->index = lcfs_objindex_open(fd);
+			r = image->index != NULL ? 0 : -1;
+		} else {
+			r = lcfs_image_walk(fd, &opts, print_objects_handler,
+					    &image->objects);
+		}
+		if (r < 0)
+			image->errsv = errno;
+	}
+
+	return NULL;
+}
+
+struct gc_object {
+	uint64_t size;
+	char name[];
+};
+
+struct gc_scan {
+	char **referenced; /* Sorted, relative to the store */
+	size_t n_referenced;
+	struct lcfs_objindex_s **indexes;
+	size_t n_indexes;
+	char **dirs;
+	size_t n_dirs;
+	atomic_size_t next;
+
+	pthread_mutex_t lock;
+	struct gc_object **unreferenced;
+	size_t n_unreferenced;
+	size_t unreferenced_capacity;
+	atomic_int errsv; /* Set, with err_name, if a scan failed */
+	char *err_name;
+};
+
+static void gc_scan_error(struct gc_scan *scan, const char *name)
+{
+	int errsv = errno;
+
+	pthread_mutex_lock(&scan->lock);
+	if (scan->errsv == 0) {
+		scan->errsv = errsv;
+		scan->err_name = strdup(name);
+		if (scan->err_name == NULL)
+			oom();
+	}
+	pthread_mutex_unlock(&scan->lock);
+}
+
+static bool gc_is_referenced(struct gc_scan *scan, const char *name)
+{
+	uint8_t digest[LCFS_DIGEST_SIZE];
+	uint64_t size;
+
+	if (bsearch(&name, scan->referenced, scan->n_referenced,
+		    sizeof(char *), cmp_obj) != NULL)
+		return true;
+
+	if (scan->n_indexes == 0 || digest_from_path(name, digest) < 0)
+		return false;
+	for (size_t i = 0; i < scan->n_indexes; i++) {
+		if (lcfs_objindex_lookup(scan->indexes[i], digest, &size) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static void gc_scan_dir(struct gc_scan *scan, const char *dir_name)
+{
+	struct dirent *de;
+	DIR *dir;
+	int dfd;
+
+	dfd = openat(opt_basedir_fd, dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0) {
+		gc_scan_error(scan, dir_name);
+		return;
+	}
+	dir = fdopendir(dfd);
+	if (dir == NULL) {
+		gc_scan_error(scan, dir_name);
+		close(dfd);
+		return;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		cleanup_free char *name = NULL;
+		struct gc_object *obj;
+		struct stat st;
+
+		/* Also skips the temporary files of mkcomposefs --digest-store */
+		if (de->d_name[0] == '.' || de->d_type == DT_DIR)
+			continue;
+
+		if (asprintf(&name, "%s/%s", dir_name, de->d_name) < 0)
+			oom();
+		if (gc_is_referenced(scan, name))
+			continue;
+
+		if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			gc_scan_error(scan, name);
+			break;
+		}
+		if (!S_ISREG(st.st_mode))
+			continue;
+
+		obj = malloc(sizeof(*obj) + strlen(name) + 1);
+		if (obj == NULL)
+			oom();
+		obj->size = st.st_size;
+		strcpy(obj->name, name);
+
+		pthread_mutex_lock(&scan->lock);
+		if (scan->n_unreferenced == scan->unreferenced_capacity) {
+			scan->unreferenced_capacity =
+				max(scan->unreferenced_capacity * 2, (size_t)64);
+			scan->unreferenced = reallocarray(scan->unreferenced,
+							  scan->unreferenced_capacity,
+							  sizeof(struct gc_object *));
+			if (scan->unreferenced == NULL)
+				oom();
+		}
+		scan->unreferenced[scan->n_unreferenced++] = obj;
+		pthread_mutex_unlock(&scan->lock);
+	}
+
+	closedir(dir);
+}
+
+static void *gc_scan_thread(void *_scan)
+{
+	struct gc_scan *scan = _scan;
+	size_t i;
+
+	/* Once one directory failed nothing is deleted, so there is no
+	 * point scanning the rest */
+	while ((i = atomic_fetch_add(&scan->next, 1)) < scan->n_dirs &&
+	       scan->errsv == 0)
+		gc_scan_dir(scan, scan->dirs[i]);
+
+	return NULL;
+}
+
+/* Lists the fan-out directories of the store */
+static void gc_list_dirs(struct gc_scan *scan)
+{
+	struct dirent *de;
+	size_t capacity = 0;
+	DIR *dir;
+	int dfd;
+
+	dfd = openat(opt_basedir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0)
+		err(EXIT_FAILURE, "Failed to open '%s'", opt_basedir_path);
+	dir = fdopendir(dfd);
+	if (dir == NULL)
+		err(EXIT_FAILURE, "Failed to open '%s'", opt_basedir_path);
+
+	while ((de = readdir(dir)) != NULL) {
+		struct stat st;
+
+		if (de->d_name[0] == '.')
+			continue;
+		if (de->d_type != DT_DIR) {
+			if (de->d_type != DT_UNKNOWN ||
+			    fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+			    !S_ISDIR(st.st_mode))
+				continue;
+		}
+
+		if (scan->n_dirs == capacity) {
+			capacity = max(capacity * 2, (size_t)256);
+			scan->dirs = reallocarray(scan->dirs, capacity, sizeof(char *));
+			if (scan->dirs == NULL)
+				oom();
+		}
+		scan->dirs[scan->n_dirs] = strdup(de->d_name);
+		if (scan->dirs[scan->n_dirs] == NULL)
+			oom();
+		scan->n_dirs++;
+	}
+
+	closedir(dir);
+}
+
+static int cmp_gc_object(const void *_a, const void *_b)
+{
+	const struct gc_object *const *a = _a;
+	const struct gc_object *const *b = _b;
+	return strcmp((*a)->name, (*b)->name);
+}
+
+/* Rewrites a payload, in place, into the path relative to the store that
+ * openat() resolves it to, so that "/aa//b" and "aa/./b" match the
+ * "aa/b" found when scanning. Payloads that would leave the store are
+ * rejected. */
+static int gc_normalize_payload(char *payload)
+{
+	const char *src = payload;
+	char *dst = payload;
+
+	/* Checked up front, so that the error can show the payload */
+	for (const char *p = payload; *p != '\0'; p++) {
+		if ((p == payload || p[-1] == '/') && p[0] == '.' &&
+		    p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+			return -1;
+	}
+
+	while (*src != '\0') {
+		size_t len = strcspn(src, "/");
+
+		/* Empty and "." components resolve to nothing */
+		if (len != 0 && (len != 1 || src[0] != '.')) {
+			if (dst != payload)
+				*dst++ = '/';
+			memmove(dst, src, len);
+			dst += len;
+		}
+		src += len;
+		if (*src == '/')
+			src++;
+	}
+	*dst = '\0';
+
+	return 0;
+}
+
+/* Prints, and with --delete removes, the backing files in the store that
+ * none of the images reference */
+static int gc_objects(const char *bin, int argc, char **argv)
+{
+	struct gc_images images = { 0 };
+	struct gc_scan scan = { 0 };
+	uint64_t total_size = 0;
+	size_t n_referenced = 0;
+
+	if (opt_basedir_path == NULL)
+		errx(EXIT_FAILURE, "No backing file store specified with --basedir");
+	if (argc <= 2) {
+		fprintf(stderr, "No image path specified\n");
+		usage(bin);
+		exit(1);
+	}
+
+	opt_basedir_fd = open(opt_basedir_path,
+			      O_RDONLY | O_CLOEXEC | O_DIRECTORY | O_PATH);
+	if (opt_basedir_fd < 0)
+		err(EXIT_FAILURE, "Can't open basedir `%s`", opt_basedir_path);
+
+	/* Every image is walked in full, whatever filters are given, as
+	 * anything less would delete objects that are still used */
+	images.n_images = argc - 2;
+	images.images = calloc(images.n_images, sizeof(struct gc_image));
+	if (images.images == NULL)
+		oom();
+	for (size_t i = 0; i < images.n_images; i++) {
+		images.images[i].path = argv[i + 2];
+		if (lcfs_ht_init(&images.images[i].objects.ht, 0) < 0)
+			oom();
+	}
+	atomic_init(&images.next, 0);
+
+	run_in_threads(min((size_t)opt_jobs, images.n_images), gc_walk_thread, &images);
+
+	for (size_t i = 0; i < images.n_images; i++) {
+		if (images.images[i].errsv != 0) {
+			errno = images.images[i].errsv;
+			err(EXIT_FAILURE, "Failed to load '%s'", images.images[i].path);
+		}
+		n_referenced += images.images[i].objects.ht.n_entries;
+	}
+
+	/* Merge the objects of all images into one sorted set, the indexes
+	 * are already sorted and are looked up as they are */
+	scan.referenced = calloc(n_referenced + 1, sizeof(char *));
+	scan.indexes = calloc(images.n_images, sizeof(struct lcfs_objindex_s *));
+	if (scan.referenced == NULL || scan.indexes == NULL)
+		oom();
+	for (size_t i = 0; i < images.n_images; i++) {
+		struct lcfs_ht *ht = &images.images[i].objects.ht;
+		size_t iter = 0;
+		char *obj;
+
+		if (images.images[i].index != NULL)
+			scan.indexes[scan.n_indexes++] = images.images[i].index;
+
+		while ((obj = lcfs_ht_next(ht, &iter)) != NULL) {
+			if (gc_normalize_payload(obj) < 0)
+				errx(EXIT_FAILURE,
+				     "Object '%s' of '%s' is outside the store", obj,
+				     images.images[i].path);
+			scan.referenced[scan.n_referenced++] = obj;
+		}
+		lcfs_ht_destroy(ht);
+	}
+	free(images.images);
+
+	qsort(scan.referenced, scan.n_referenced, sizeof(char *), cmp_obj);
+	n_referenced = 0;
+	for (size_t i = 0; i < scan.n_referenced; i++) {
+		if (n_referenced > 0 &&
+		    strcmp(scan.referenced[n_referenced - 1], scan.referenced[i]) == 0)
+			free(scan.referenced[i]);
+		else
+			scan.referenced[n_referenced++] = scan.referenced[i];
+	}
+	scan.n_referenced = n_referenced;
+
+	gc_list_dirs(&scan);
+	atomic_init(&scan.next, 0);
+	atomic_init(&scan.errsv, 0);
+	pthread_mutex_init(&scan.lock, NULL);
+
+	run_in_threads(min((size_t)opt_jobs, scan.n_dirs), gc_scan_thread, &scan);
+
+	pthread_mutex_destroy(&scan.lock);
+
+	if (scan.errsv != 0) {
+		errno = scan.errsv;
+		err(EXIT_FAILURE, "Failed to scan '%s'", scan.err_name);
+	}
+
+	if (scan.n_unreferenced > 1)
+		qsort(scan.unreferenced, scan.n_unreferenced,
+		      sizeof(struct gc_object *), cmp_gc_object);
+
+	/* Only deleted once the whole store was scanned without errors */
+	for (size_t i = 0; i < scan.n_unreferenced; i++) {
+		if (opt_delete &&
+		    unlinkat(opt_basedir_fd, scan.unreferenced[i]->name, 0) < 0)
+			err(EXIT_FAILURE, "Failed to delete '%s'",
+			    scan.unreferenced[i]->name);
+		printf("%" PRIu64 " %s\n", scan.unreferenced[i]->size,
+		       scan.unreferenced[i]->name);
+		total_size += scan.unreferenced[i]->size;
+		free(scan.unreferenced[i]);
+	}
+	fprintf(stderr, "%s %zu unreferenced objects, %" PRIu64 " bytes\n",
+		opt_delete ? "Deleted" : "Found", scan.n_unreferenced, total_size);
+
+	for (size_t i = 0; i < scan.n_referenced; i++)
+		free(scan.referenced[i]);
+	for (size_t i = 0; i < scan.n_indexes; i++)
+		lcfs_objindex_free(scan.indexes[i]);
+	for (size_t i = 0; i < scan.n_dirs; i++)
+		free(scan.dirs[i]);
+	free(scan.indexes);
+	free(scan.referenced);
+	free(scan.dirs);
+	free(scan.unreferenced);
+
+	return 0;
+}
+
+#define STATS_LARGEST_DIRS 10
+
+struct stats_dir {
+	char *path;
+	uint64_t size;
+	uint64_t n_entries;
+};
+
+/* The largest directories seen so far, largest first */
+struct stats_dirs {
+	struct stats_dir dirs[STATS_LARGEST_DIRS];
+	size_t n_dirs;
+};
+
+static int stats_dir_handler(const char *path, uint64_t size,
+			     uint64_t n_entries, void *_dirs)
+{
+	struct stats_dirs *dirs = _dirs;
+	size_t i;
+
+	if (dirs->n_dirs == STATS_LARGEST_DIRS) {
+		if (size <= dirs->dirs[STATS_LARGEST_DIRS - 1].size)
+			return 0;
+		free(dirs->dirs[STATS_LARGEST_DIRS - 1].path);
+		i = STATS_LARGEST_DIRS - 1;
+	} else {
+		i = dirs->n_dirs++;
+	}
+
+	for (; i > 0 && dirs->dirs[i - 1].size < size; i--)
+		dirs->dirs[i] = dirs->dirs[i - 1];
+
+	dirs->dirs[i].path = strdup(path);
+	if (dirs->dirs[i].path == NULL)
+		oom();
+	dirs->dirs[i].size = size;
+	dirs->dirs[i].n_entries = n_entries;
+
+	return 0;
+}
+
+static void out_stats_value(const char *name, const char *value, bool last)
+{
+	if (opt_json) {
+		out_str("  \"");
+		out_str(name);
+		out_str("\": ");
+		out_str(value);
+		out_str(last ? "\n" : ",\n");
+	} else {
+		char buf[32];
+
+		snprintf(buf, sizeof(buf), "%-22s ", name);
+		out_str(buf);
+		out_str(value);
+		out_char('\n');
+	}
+}
+
+#define STATS_COUNTER(name) { #name, offsetof(struct lcfs_image_stats_s, name) }
+
+/* In the order they are printed in */
+static const struct {
+	const char *name;
+	size_t offset;
+} stats_counters[] = {
+	STATS_COUNTER(image_size),
+	STATS_COUNTER(metadata_size),
+	STATS_COUNTER(inodes),
+	STATS_COUNTER(compact_inodes),
+	STATS_COUNTER(extended_inodes),
+	STATS_COUNTER(dirs),
+	STATS_COUNTER(inode_bytes),
+	STATS_COUNTER(inline_xattr_bytes),
+	STATS_COUNTER(shared_xattrs),
+	STATS_COUNTER(shared_xattr_size),
+	STATS_COUNTER(shared_xattr_refs),
+	STATS_COUNTER(inline_data_bytes),
+	STATS_COUNTER(inline_file_bytes),
+	STATS_COUNTER(inline_dirent_bytes),
+	STATS_COUNTER(inline_symlink_bytes),
+	STATS_COUNTER(chunk_index_bytes),
+	STATS_COUNTER(data_blocks),
+	STATS_COUNTER(data_bytes),
+	STATS_COUNTER(dir_blocks),
+	STATS_COUNTER(flat_inodes),
+	STATS_COUNTER(tailpacked_inodes),
+	STATS_COUNTER(padding_bytes),
+};
+
+/* Prints where the bytes of an image go, computed without loading it */
+static int print_image_stats(const char *bin, int argc, char **argv)
+{
+	struct lcfs_image_stats_s stats;
+	struct stats_dirs dirs = { 0 };
+	char buf[32];
+
+	if (argc != 3) {
+		fprintf(stderr, "One image must be specified\n");
+		usage(bin);
+		exit(1);
+	}
+
+	cleanup_fd int fd = open(argv[2], O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		err(EXIT_FAILURE, "Failed to open '%s'", argv[2]);
+
+	if (lcfs_image_stats(fd, &stats, stats_dir_handler, &dirs) < 0)
+		err(EXIT_FAILURE, "Failed to read '%s'", argv[2]);
+
+	/* Fraction of the inodes with data in the image that keep its
+	 * tail in the inode rather than in a block of its own */
+	double tailpacking_ratio =
+		stats.flat_inodes ?
+			(double)stats.tailpacked_inodes / stats.flat_inodes :
+			0;
+
+	if (opt_json)
+		out_str("{\n");
+	for (size_t i = 0; i < sizeof(stats_counters) / sizeof(stats_counters[0]);
+	     i++) {
+		const uint64_t *value =
+			(const uint64_t *)((const char *)&stats +
+					   stats_counters[i].offset);
+
+		snprintf(buf, sizeof(buf), "%" PRIu64, *value);
+		out_stats_value(stats_counters[i].name, buf, false);
+	}
+	snprintf(buf, sizeof(buf), "%.4f", tailpacking_ratio);
+	out_stats_value("tailpacking_ratio", buf, !opt_json);
+
+	if (opt_json)
+		out_str("  \"largest_dirs\": [");
+	for (size_t i = 0; i < dirs.n_dirs; i++) {
+		struct stats_dir *dir = &dirs.dirs[i];
+
+		if (opt_json) {
+			out_str(i == 0 ? "\n    {" : ",\n    {");
+			if (is_utf8(dir->path, strlen(dir->path))) {
+				out_str("\"path\": ");
+				out_json_string(dir->path, -1);
+			} else {
+				out_str("\"path_b64\": ");
+				out_json_base64(dir->path, strlen(dir->path));
+			}
+			out_str(", \"size\": ");
+			out_uint(dir->size, 10);
+			out_str(", \"entries\": ");
+			out_uint(dir->n_entries, 10);
+			out_char('}');
+		} else {
+			snprintf(buf, sizeof(buf), "%-22s ", "largest_dir");
+			out_str(buf);
+			out_uint(dir->size, 10);
+			out_char(' ');
+			out_uint(dir->n_entries, 10);
+			out_char(' ');
+			out_escaped(dir->path, -1, ESCAPE_STANDARD);
+			out_char('\n');
+		}
+		free(dir->path);
+	}
+	if (opt_json)
+		out_str(dirs.n_dirs > 0 ? "\n  ]\n}\n" : "]\n}\n");
+
+	return 0;
 }
 
 static void usage(const char *argv0)
 {
 	fprintf(stderr,
-		"usage: %s [--basedir=path] [ls|objects|dump|missing-objects|measure-file] IMAGES...\n",
-		argv0);
+		"usage: %s [--basedir=path] [--path=PATH] [--exclude=PATH] [--depth=N] [--threads=N] [--jobs=N] [--verify] [--max-rate=BYTES] [--format=text|json] [ls|objects|dump|missing-objects|prefetch|measure-file] IMAGES...\n"
+		"       %s [options] diff OLD-IMAGE NEW-IMAGE\n"
+		"       %s --basedir=STORE [--delete] gc IMAGES...\n"
+		"       %s [--format=text|json] stats IMAGE\n",
+		argv0, argv0, argv0, argv0);
 }
 
 #define OPT_BASEDIR 100
 #define OPT_FILTER 101
+#define OPT_THREADS 102
+#define OPT_PATH 103
+#define OPT_EXCLUDE 104
+#define OPT_DEPTH 105
+#define OPT_JOBS 106
+#define OPT_VERIFY 107
+#define OPT_DELETE 108
+#define OPT_MAX_RATE 109
+#define OPT_FORMAT 110
+
+/* Parses a byte count with an optional K, M or G suffix, returning 0
+ * if it isn't valid or doesn't fit */
+static uint64_t parse_size(const char *str)
+{
+	unsigned int shift = 0;
+	uint64_t size;
+	char *end;
+
+	/* strtoull() would accept, and negate, a sign */
+	if (*str < '0' || *str > '9')
+		return 0;
+
+	errno = 0;
+	size = strtoull(str, &end, 10);
+	if (errno != 0)
+		return 0;
+
+	switch (*end) {
+	case 'G':
+		shift = 30;
+		end++;
+		break;
+	case 'M':
+		shift = 20;
+		end++;
+		break;
+	case 'K':
+		shift = 10;
+		end++;
+		break;
+	}
+
+	if (*end != '\0' || size > UINT64_MAX >> shift)
+		return 0;
+
+	return size << shift;
+}
+
+/* Parses a count for an option, which must be at least 1 and fit in
+ * 32 bits */
+static uint32_t parse_count(const char *str, const char *what)
+{
+	unsigned long val;
+	char *end;
+
+	/* strtoul() would accept, and negate, a sign */
+	if (*str < '0' || *str > '9')
+		errx(EXIT_FAILURE, "Invalid %s %s", what, str);
+
+	errno = 0;
+	val = strtoul(str, &end, 10);
+	if (errno != 0 || *end != '\0' || val == 0 || val > UINT32_MAX)
+		errx(EXIT_FAILURE, "Invalid %s %s", what, str);
+
+	return val;
+}
+
+/* Appends to a NULL terminated array of option values */
+static void append_option(char ***array, size_t *n, const char *value)
+{
+	*array = reallocarray(*array, *n + 2, sizeof(char *));
+	if (*array == NULL)
+		oom();
+	(*array)[*n] = strdup(value);
+	if ((*array)[*n] == NULL)
+		oom();
+	(*n)++;
+	(*array)[*n] = NULL;
+}
 
 // Most of the rest of this code operates on composefs superblocks.  This function
 // just prints the fsverity digest of the provided files.
@@ -399,6 +1860,24 @@ int main(int argc, char **argv)
 		  .has_arg = required_argument,
 		  .flag = NULL,
 		  .val = OPT_FILTER },
+		{ .name = "threads",
+		  .has_arg = required_argument,
+		  .flag = NULL,
+		  .val = OPT_THREADS },
+		{ .name = "path", .has_arg = required_argument, .flag = NULL, .val = OPT_PATH },
+		{ .name = "exclude",
+		  .has_arg = required_argument,
+		  .flag = NULL,
+		  .val = OPT_EXCLUDE },
+		{ .name = "depth", .has_arg = required_argument, .flag = NULL, .val = OPT_DEPTH },
+		{ .name = "jobs", .has_arg = required_argument, .flag = NULL, .val = OPT_JOBS },
+		{ .name = "verify", .has_arg = no_argument, .flag = NULL, .val = OPT_VERIFY },
+		{ .name = "delete", .has_arg = no_argument, .flag = NULL, .val = OPT_DELETE },
+		{ .name = "format", .has_arg = required_argument, .flag = NULL, .val = OPT_FORMAT },
+		{ .name = "max-rate",
+		  .has_arg = required_argument,
+		  .flag = NULL,
+		  .val = OPT_MAX_RATE },
 		{},
 	};
 
@@ -425,6 +1904,40 @@ int main(int argc, char **argv)
 				oom();
 			n_filters++;
 			break;
+		case OPT_THREADS:
+			opt_threads = parse_count(optarg, "thread count");
+			break;
+		case OPT_PATH:
+			append_option(&opt_include_paths, &n_include_paths, optarg);
+			break;
+		case OPT_EXCLUDE:
+			append_option(&opt_exclude_paths, &n_exclude_paths, optarg);
+			break;
+		case OPT_DEPTH:
+			opt_max_depth = parse_count(optarg, "depth");
+			break;
+		case OPT_JOBS:
+			opt_jobs = parse_count(optarg, "job count");
+			break;
+		case OPT_VERIFY:
+			opt_verify = true;
+			break;
+		case OPT_DELETE:
+			opt_delete = true;
+			break;
+		case OPT_FORMAT:
+			if (strcmp(optarg, "text") == 0)
+				opt_json = false;
+			else if (strcmp(optarg, "json") == 0)
+				opt_json = true;
+			else
+				errx(EXIT_FAILURE, "Unknown format %s", optarg);
+			break;
+		case OPT_MAX_RATE:
+			opt_max_rate = parse_size(optarg);
+			if (opt_max_rate == 0)
+				errx(EXIT_FAILURE, "Invalid rate %s", optarg);
+			break;
 		case ':':
 			fprintf(stderr, "option needs a value\n");
 			exit(EXIT_FAILURE);
@@ -438,36 +1951,71 @@ int main(int argc, char **argv)
 	argv += optind - 1;
 	argc -= optind - 1;
 
+	/* Checking for backing files mostly waits on the filesystem, which
+	 * for a network one takes many requests in flight to keep busy */
+	if (opt_jobs == 0)
+		opt_jobs = get_cpu_count() * 4;
+
 	if (argc <= 1) {
 		fprintf(stderr, "No command specified\n");
 		usage(bin);
 		exit(1);
 	}
 
-	c_locale = newlocale(LC_CTYPE, "C", (locale_t)0);
-	if (c_locale == (locale_t)0)
-		err(EXIT_FAILURE, "Failed to get C locale");
+	/* Also when exiting with an error, like stdio would */
+	atexit(out_flush);
+
 	const char *command = argv[1];
 
 	command_handler_init handler_init = NULL;
-	command_handler handler = NULL;
+	lcfs_image_walk_cb handler = NULL;
 	command_handler_end handler_end = NULL;
 	void *handler_data = NULL;
+	bool objects_only = false;
+
+	if (opt_json && strcmp(command, "dump") != 0 &&
+	    strcmp(command, "stats") != 0)
+		errx(EXIT_FAILURE, "The %s command has no JSON output", command);
 
 	if (strcmp(command, "ls") == 0) {
-		handler = print_node_handler;
+		handler = print_entry_handler;
 	} else if (strcmp(command, "dump") == 0) {
-		handler = dump_node_handler;
+		handler = opt_json ? dump_json_entry_handler : dump_entry_handler;
 	} else if (strcmp(command, "objects") == 0) {
-		handler = print_objects_handler;
-		handler_init = print_objects_handler_init;
+		handler = backing_objects_handler;
+		handler_init = backing_objects_handler_init;
 		handler_end = print_objects_handler_end;
+		objects_only = true;
 	} else if (strcmp(command, "missing-objects") == 0) {
-		handler = print_missing_objects_handler;
-		handler_init = print_objects_handler_init;
-		handler_end = print_objects_handler_end;
+		handler = backing_objects_handler;
+		handler_init = backing_objects_handler_init;
+		handler_end = print_missing_objects_handler_end;
+		objects_only = true;
+	} else if (strcmp(command, "prefetch") == 0) {
+		if (opt_basedir_path == NULL)
+			errx(EXIT_FAILURE,
+			     "No backing file store specified with --basedir");
+		handler = backing_objects_handler;
+		handler_init = backing_objects_handler_init;
+		handler_end = prefetch_objects_handler_end;
+		objects_only = true;
 	} else if (strcmp(command, "measure-file") == 0) {
 		return measure_files(bin, argc, argv);
+	} else if (strcmp(command, "gc") == 0) {
+		return gc_objects(bin, argc, argv);
+	} else if (strcmp(command, "stats") == 0) {
+		return print_image_stats(bin, argc, argv);
+	} else if (strcmp(command, "diff") == 0) {
+		// Ensure filters are NULL terminated
+		if (opt_filter)
+			opt_filter[n_filters] = NULL;
+		struct lcfs_read_options_s opts = {
+			.toplevel_entries = (const char *const *)opt_filter,
+			.max_depth = opt_max_depth,
+			.include_paths = (const char *const *)opt_include_paths,
+			.exclude_paths = (const char *const *)opt_exclude_paths,
+		};
+		return diff_images(bin, argc, argv, &opts);
 	} else {
 		errx(EXIT_FAILURE, "Unknown command '%s'\n", command);
 	}
@@ -501,21 +2049,51 @@ int main(int argc, char **argv)
 			err(EXIT_FAILURE, "Failed to open '%s'", image_path);
 		}
 
+		if (objects_only && lcfs_objindex_is_index(fd)) {
+			if (opt_filter || opt_include_paths || opt_exclude_paths ||
+			    opt_max_depth)
+				errx(EXIT_FAILURE,
+				     "Filters can't be used with the object index '%s'",
+				     image_path);
+			if (backing_objects_add_index(handler_data, fd) < 0)
+				err(EXIT_FAILURE, "Failed to load '%s'", image_path);
+			continue;
+		}
+
 		const char *const *toplevel_entries = (const char *const *)opt_filter;
-		struct lcfs_read_options_s opts = { .toplevel_entries =
-							    toplevel_entries };
+		struct lcfs_read_options_s opts = {
+			.toplevel_entries = toplevel_entries,
+			.threads = opt_threads,
+			.max_depth = opt_max_depth,
+			.include_paths = (const char *const *)opt_include_paths,
+			.exclude_paths = (const char *const *)opt_exclude_paths,
+		};
+		/* Walking the image in place doesn't build the tree at all,
+		 * unless it is to be loaded with a number of threads */
+		if (opt_threads == 0) {
+			if (lcfs_image_walk(fd, &opts, handler, handler_data) < 0)
+				err(EXIT_FAILURE, "Failed to load '%s'", image_path);
+			continue;
+		}
+
 		cleanup_node struct lcfs_node_s *root =
 			lcfs_load_node_from_fd_ext(fd, &opts);
 		if (root == NULL) {
 			err(EXIT_FAILURE, "Failed to load '%s'", image_path);
 		}
 
-		handler(root, handler_data);
+		struct walk_path path = { 0 };
+		path.size = 256;
+		path.buf = malloc(path.size);
+		if (path.buf == NULL)
+			oom();
+
+		walk_node(root, &path, 0, 0, handler, handler_data);
+		free(path.buf);
 	}
 
 	if (handler_end)
 		handler_end(handler_data);
 
-	freelocale(c_locale);
 	return 0;
 }
@@ -11,6 +11,8 @@
 #include "libcomposefs/lcfs-writer.h"
 #include "libcomposefs/lcfs-utils.h"
 #include "libcomposefs/lcfs-internal.h"
+#include "libcomposefs/lcfs-objindex.h"
+#include "libcomposefs/lcfs-ht.h"
 
 #include <stdio.h>
 #include <linux/limits.h>
@@ -22,13 +24,17 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <linux/fsverity.h>
 #include <linux/fs.h>
 #include <pthread.h>
-#include <sched.h>
-#include <sys/sysinfo.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <time.h>
 
 static void oom(void)
 {
@@ -59,6 +65,15 @@ static __attribute__((format(printf, 1, 2))) char *make_error(const char *fmt, .
 #define OPT_MIN_VERSION 114
 #define OPT_THREADS 115
 #define OPT_MAX_VERSION 116
+#define OPT_BASE_IMAGE 117
+#define OPT_CHANGED 118
+#define OPT_PROGRESS 119
+#define OPT_STATS 120
+#define OPT_LAYOUT 121
+#define OPT_LAYOUT_HINT 122
+#define OPT_DEDUP_BLOCKS 123
+#define OPT_PACK_INODES 124
+#define OPT_OBJECT_INDEX 125
 
 static size_t split_at(const char **start, size_t *length, char split_char,
 		       bool *partial)
@@ -106,23 +121,90 @@ const char *names[] = {
 	"XATTRS_START",
 };
 
-static char *unescape_string(const char *escaped, size_t escaped_size,
-			     size_t *unescaped_size, char **err)
+struct buffer {
+	char *buf;
+	size_t size;
+	size_t capacity;
+};
+
+static void buffer_ensure_space(struct buffer *buf, size_t free_size_needed)
 {
-	const char *escaped_end = escaped + escaped_size;
-	cleanup_free char *res = malloc(escaped_size + 1);
-	if (res == NULL)
+	size_t min_capacity = buf->size + free_size_needed;
+	if (buf->capacity >= min_capacity)
+		return;
+
+	/* No space, grow */
+	if (buf->capacity == 0)
+		buf->capacity = 64 * 1024;
+	else
+		buf->capacity = buf->capacity * 2;
+
+	if (buf->capacity < min_capacity)
+		buf->capacity = min_capacity;
+
+	buf->buf = realloc(buf->buf, buf->capacity);
+	if (buf->buf == NULL)
 		oom();
+}
+
+/* Fills buffer and returns the amount read. 0 on file end */
+static size_t buffer_fill(struct buffer *buf, FILE *input)
+{
+	/* Grow buffer if needed */
+	buffer_ensure_space(buf, 1);
+
+	size_t bytes_read =
+		fread(buf->buf + buf->size, 1, buf->capacity - buf->size, input);
+	if (bytes_read == 0 && ferror(input))
+		errx(EXIT_FAILURE, "Error reading from file");
+	buf->size += bytes_read;
+
+	return bytes_read;
+}
+
+static void buffer_reset(struct buffer *buf)
+{
+	/* NOTE: Leaves buffer data as is, just modified size */
+	buf->size = 0;
+}
+
+static void buffer_add(struct buffer *buf, const char *src, size_t len)
+{
+	if (len == 0)
+		return;
+
+	buffer_ensure_space(buf, len);
+
+	/* memmove, as src may be in the buf */
+	memmove(buf->buf + buf->size, src, len);
+	buf->size += len;
+}
+
+static void buffer_free(struct buffer *buf)
+{
+	free(buf->buf);
+}
+
+/* Unescapes into @res, which must have space for escaped_size + 1 bytes.
+ * Returns an error string on failure. */
+static char *unescape_into(char *res, const char *escaped, size_t escaped_size,
+			   size_t *unescaped_size)
+{
+	const char *escaped_end = escaped + escaped_size;
 	char *out = res;
 
-	*err = NULL;
+	/* Most fields contain no escapes at all */
+	if (memchr(escaped, '\\', escaped_size) == NULL) {
+		memcpy(out, escaped, escaped_size);
+		out += escaped_size;
+		escaped = escaped_end;
+	}
 
 	while (escaped < escaped_end) {
 		char c = *escaped++;
 		if (c == '\\') {
 			if (escaped >= escaped_end) {
-				*err = make_error("No character after escape");
-				return NULL;
+				return make_error("No character after escape");
 			}
 			c = *escaped++;
 			switch (c) {
@@ -140,29 +222,24 @@ static char *unescape_string(const char *escaped, size_t escaped_size,
 				break;
 			case 'x':
 				if (escaped >= escaped_end) {
-					*err = make_error(
+					return make_error(
 						"No hex characters after hex escape");
-					return NULL;
 				}
 				int x1 = hexdigit(*escaped++);
 				if (escaped >= escaped_end) {
-					*err = make_error(
+					return make_error(
 						"No hex characters after hex escape");
-					return NULL;
 				}
 				int x2 = hexdigit(*escaped++);
 				if (x1 < 0 || x2 < 0) {
-					*err = make_error(
+					return make_error(
 						"Invalid hex characters after hex escape");
-
-					return NULL;
 				}
 
 				*out++ = x1 << 4 | x2;
 				break;
 			default: {
-				*err = make_error("Unsupported escape type %c", c);
-				return NULL;
+				return make_error("Unsupported escape type %c", c);
 			}
 			}
 		} else {
@@ -175,6 +252,20 @@ static char *unescape_string(const char *escaped, size_t escaped_size,
 
 	*out = 0; /* Null terminate */
 
+	return NULL;
+}
+
+static char *unescape_string(const char *escaped, size_t escaped_size,
+			     size_t *unescaped_size, char **err)
+{
+	cleanup_free char *res = malloc(escaped_size + 1);
+	if (res == NULL)
+		oom();
+
+	*err = unescape_into(res, escaped, escaped_size, unescaped_size);
+	if (*err)
+		return NULL;
+
 	return steal_pointer(&res);
 }
 
@@ -189,60 +280,86 @@ static char *unescape_optional_string(const char *escaped, size_t escaped_size,
 	return unescape_string(escaped, escaped_size, unescaped_size, err);
 }
 
-static struct lcfs_node_s *lookup_parent_path(struct lcfs_node_s *node,
-					      const char *path, const char **name_out)
+/* Like unescape_string(), but decodes into a reusable scratch buffer
+ * instead of allocating. The result is valid until the next use of @buf. */
+static char *unescape_string_buf(struct buffer *buf, const char *escaped,
+				 size_t escaped_size, size_t *unescaped_size,
+				 char **err)
 {
-	while (*path == '/')
-		path++;
+	buffer_reset(buf);
+	buffer_ensure_space(buf, escaped_size + 1);
 
-	const char *start = path;
-	while (*path != 0 && *path != '/')
-		path++;
+	*err = unescape_into(buf->buf, escaped, escaped_size, unescaped_size);
+	if (*err)
+		return NULL;
 
-	if (*path == 0) {
-		*name_out = start;
-		return node;
-	}
+	return buf->buf;
+}
 
-	cleanup_free char *name = strndup(start, path - start);
-	if (name == NULL)
-		oom();
+static char *unescape_optional_string_buf(struct buffer *buf, const char *escaped,
+					  size_t escaped_size,
+					  size_t *unescaped_size, char **err)
+{
+	*err = NULL;
+	/* Optional */
+	if (escaped_size == 1 && escaped[0] == '-')
+		return NULL;
 
-	struct lcfs_node_s *child = lcfs_node_lookup_child(node, name);
-	if (child == NULL)
+	return unescape_string_buf(buf, escaped, escaped_size, unescaped_size, err);
+}
+
+/* Look up a child by a name that is not NUL terminated, without allocating */
+static struct lcfs_node_s *lookup_child_n(struct lcfs_node_s *node,
+					  const char *name, size_t name_len)
+{
+	char buf[LCFS_MAX_NAME_LENGTH + 1];
+
+	/* Such names can never have been added */
+	if (name_len > LCFS_MAX_NAME_LENGTH)
 		return NULL;
 
-	return lookup_parent_path(child, path, name_out);
+	memcpy(buf, name, name_len);
+	buf[name_len] = 0;
+
+	return lcfs_node_lookup_child(node, buf);
 }
 
-static struct lcfs_node_s *lookup_path(struct lcfs_node_s *node, const char *path)
+static struct lcfs_node_s *lookup_path_n(struct lcfs_node_s *node,
+					 const char *path, size_t path_len)
 {
-	while (*path == '/')
-		path++;
+	const char *end = path + path_len;
 
-	if (*path == 0)
-		return node;
+	while (node != NULL) {
+		while (path < end && *path == '/')
+			path++;
 
-	const char *start = path;
-	while (*path != 0 && *path != '/')
-		path++;
+		if (path == end)
+			return node;
 
-	cleanup_free char *name = strndup(start, path - start);
-	if (name == NULL)
-		oom();
+		const char *start = path;
+		while (path < end && *path != '/')
+			path++;
 
-	struct lcfs_node_s *child = lcfs_node_lookup_child(node, name);
-	if (child == NULL)
-		return NULL;
+		node = lookup_child_n(node, start, path - start);
+	}
 
-	return lookup_path(child, path);
+	return NULL;
 }
 
 static uint64_t parse_int_field(const char *str, size_t length, int base, char **err)
 {
-	cleanup_free char *s = strndup(str, length);
-	if (s == NULL)
-		oom();
+	char buf[64];
+	cleanup_free char *long_s = NULL;
+	char *s = buf;
+
+	if (length < sizeof(buf)) {
+		memcpy(buf, str, length);
+		buf[length] = 0;
+	} else {
+		s = long_s = strndup(str, length);
+		if (s == NULL)
+			oom();
+	}
 
 	char *endptr = NULL;
 	unsigned long long v = strtoull(s, &endptr, base);
@@ -270,7 +387,84 @@ static char *parse_mtime(const char *str, size_t length, struct timespec *mtime)
 	return NULL;
 }
 
-static char *parse_xattr(const char *data, size_t data_len, struct lcfs_node_s *node)
+typedef struct hardlink_fixup hardlink_fixup;
+struct hardlink_fixup {
+	struct lcfs_node_s *node;
+	char *target_path;
+	hardlink_fixup *next;
+};
+
+/* Reused between lines, to avoid allocating for every field */
+typedef struct dump_scratch dump_scratch;
+struct dump_scratch {
+	struct buffer path_buf;
+	struct buffer payload_buf;
+	struct buffer content_buf;
+	struct buffer digest_buf;
+	struct buffer xattr_key_buf;
+	struct buffer xattr_value_buf;
+};
+
+static void dump_scratch_free(dump_scratch *scratch)
+{
+	buffer_free(&scratch->path_buf);
+	buffer_free(&scratch->payload_buf);
+	buffer_free(&scratch->content_buf);
+	buffer_free(&scratch->digest_buf);
+	buffer_free(&scratch->xattr_key_buf);
+	buffer_free(&scratch->xattr_value_buf);
+}
+
+typedef struct dump_info dump_info;
+struct dump_info {
+	struct lcfs_node_s *root;
+	hardlink_fixup *hardlink_fixups;
+
+	/* The last parent directory looked up, and its (unnormalized)
+	 * path. Dumps list entries of the same directory next to each
+	 * other, so this avoids most walks from the root. */
+	struct lcfs_node_s *cursor_dir;
+	struct buffer cursor_path;
+
+	/* Maps normalized paths to nodes, for resolving hardlinks. The
+	 * entries are the nodes themselves, keyed by their paths. */
+	struct lcfs_ht path_index;
+	struct buffer index_key;
+
+	dump_scratch scratch;
+};
+
+/* A parsed dump line, not yet linked into the tree */
+typedef struct dump_entry dump_entry;
+struct dump_entry {
+	/* NULL if the line failed to parse before the node was created */
+	struct lcfs_node_s *node;
+	/* The escaped path field, pointing into the line */
+	const char *path_data;
+	size_t path_len;
+	bool is_hardlink;
+	char *hardlink_target;
+	/* Error to report once the node has been added to the tree */
+	char *err;
+};
+
+static void dump_entry_clear(dump_entry *entry)
+{
+	if (entry->node)
+		lcfs_node_unref(entry->node);
+	free(entry->hardlink_target);
+	free(entry->err);
+	memset(entry, 0, sizeof(*entry));
+}
+
+typedef struct field_info field_info;
+struct field_info {
+	const char *data;
+	size_t len;
+};
+
+static char *parse_xattr(dump_scratch *scratch, const char *data,
+			 size_t data_len, struct lcfs_node_s *node)
 {
 	const char *xattr_name = data;
 	bool is_partial = false;
@@ -280,12 +474,13 @@ static char *parse_xattr(const char *data, size_t data_len, struct lcfs_node_s *
 	}
 
 	char *err = NULL;
-	cleanup_free char *key =
-		unescape_string(xattr_name, xattr_name_len, NULL, &err);
+	char *key = unescape_string_buf(&scratch->xattr_key_buf, xattr_name,
+					xattr_name_len, NULL, &err);
 	if (key == NULL && err)
 		return err;
 	size_t value_len;
-	cleanup_free char *value = unescape_string(data, data_len, &value_len, &err);
+	char *value = unescape_string_buf(&scratch->xattr_value_buf, data,
+					  data_len, &value_len, &err);
 	if (value == NULL && err)
 		return err;
 
@@ -294,24 +489,138 @@ static char *parse_xattr(const char *data, size_t data_len, struct lcfs_node_s *
 	return NULL;
 }
 
-typedef struct hardlink_fixup hardlink_fixup;
-struct hardlink_fixup {
-	struct lcfs_node_s *node;
-	char *target_path;
-	hardlink_fixup *next;
+/* Lookup keys of the path index */
+typedef struct path_index_key path_index_key;
+struct path_index_key {
+	const char *path;
+	size_t path_len;
 };
 
-typedef struct dump_info dump_info;
-struct dump_info {
-	struct lcfs_node_s *root;
-	hardlink_fixup *hardlink_fixups;
-};
+/* Normalizes a path to the form used by the path index, with no leading,
+ * trailing or repeated slashes. */
+static size_t path_index_normalize(struct buffer *buf, const char *path)
+{
+	buffer_reset(buf);
+	buffer_ensure_space(buf, strlen(path) + 1);
+
+	char *out = buf->buf;
+	while (*path != 0) {
+		while (*path == '/')
+			path++;
+		if (*path == 0)
+			break;
+		if (out != buf->buf)
+			*out++ = '/';
+		while (*path != 0 && *path != '/')
+			*out++ = *path++;
+	}
+	*out = 0;
 
-typedef struct field_info field_info;
-struct field_info {
-	const char *data;
-	size_t len;
-};
+	buf->size = out - buf->buf;
+	return buf->size;
+}
+
+/* Compares the path of a node in the tree to a normalized path, so
+ * that the index need not store the paths. */
+static bool node_has_path(struct lcfs_node_s *node, const char *path,
+			  size_t path_len)
+{
+	struct lcfs_node_s *parent;
+
+	while ((parent = lcfs_node_get_parent(node)) != NULL) {
+		const char *name = lcfs_node_get_name(node);
+		size_t name_len = strlen(name);
+
+		if (path_len < name_len ||
+		    memcmp(path + path_len - name_len, name, name_len) != 0)
+			return false;
+		path_len -= name_len;
+
+		if (lcfs_node_get_parent(parent) == NULL)
+			break;
+
+		if (path_len == 0 || path[path_len - 1] != '/')
+			return false;
+		path_len--;
+
+		node = parent;
+	}
+
+	return path_len == 0;
+}
+
+static bool path_index_eq(const void *value, const void *key)
+{
+	const path_index_key *k = key;
+	return node_has_path((struct lcfs_node_s *)value, k->path, k->path_len);
+}
+
+static void path_index_add(dump_info *info, const char *path,
+			   struct lcfs_node_s *node)
+{
+	size_t path_len = path_index_normalize(&info->index_key, path);
+
+	if (info->path_index.entries == NULL &&
+	    lcfs_ht_init(&info->path_index, 0) < 0)
+		oom();
+
+	/* Can't be a duplicate, as add_child succeeded */
+	if (lcfs_ht_insert(&info->path_index,
+			   lcfs_ht_hash_bytes(info->index_key.buf, path_len, 0),
+			   node) < 0)
+		oom();
+}
+
+static struct lcfs_node_s *path_index_lookup(dump_info *info, const char *path)
+{
+	size_t path_len = path_index_normalize(&info->index_key, path);
+
+	if (path_len == 0)
+		return info->root;
+
+	if (info->path_index.entries == NULL)
+		return NULL;
+
+	path_index_key key = {
+		.path = info->index_key.buf,
+		.path_len = path_len,
+	};
+
+	return lcfs_ht_lookup(&info->path_index,
+			      lcfs_ht_hash_bytes(key.path, path_len, 0), &key,
+			      path_index_eq);
+}
+
+/* Looks up the directory part of a path, starting at the cursor
+ * rather than the root if the cursor is a prefix of it. */
+static struct lcfs_node_s *tree_lookup_dir(dump_info *info, const char *dir,
+					   size_t dir_len)
+{
+	struct lcfs_node_s *start = info->root;
+	const char *rest = dir;
+	size_t rest_len = dir_len;
+	size_t cursor_len = info->cursor_path.size;
+
+	if (info->cursor_dir != NULL && dir_len >= cursor_len &&
+	    (cursor_len == 0 || memcmp(dir, info->cursor_path.buf, cursor_len) == 0) &&
+	    (dir_len == cursor_len || dir[cursor_len] == '/')) {
+		if (dir_len == cursor_len)
+			return info->cursor_dir;
+
+		start = info->cursor_dir;
+		rest = dir + cursor_len;
+		rest_len = dir_len - cursor_len;
+	}
+
+	struct lcfs_node_s *dir_node = lookup_path_n(start, rest, rest_len);
+	if (dir_node != NULL && lcfs_node_dirp(dir_node)) {
+		buffer_reset(&info->cursor_path);
+		buffer_add(&info->cursor_path, dir, dir_len);
+		info->cursor_dir = dir_node;
+	}
+
+	return dir_node;
+}
 
 static char *tree_add_node(dump_info *info, const char *path, struct lcfs_node_s *node)
 {
@@ -325,12 +634,22 @@ static char *tree_add_node(dump_info *info, const char *path, struct lcfs_node_s
 			return make_error("Can't have multiple roots");
 	} else {
 		const char *name;
+		size_t dir_len;
 		struct lcfs_node_s *parent;
 
 		if (info->root == NULL)
 			return make_error("Root node not present");
 
-		parent = lookup_parent_path(info->root, path, &name);
+		name = strrchr(path, '/');
+		if (name != NULL) {
+			dir_len = name - path;
+			name++;
+		} else {
+			dir_len = 0;
+			name = path;
+		}
+
+		parent = tree_lookup_dir(info, path, dir_len);
 
 		if (parent == NULL)
 			return make_error("Parent directory missing for %s", path);
@@ -349,6 +668,8 @@ static char *tree_add_node(dump_info *info, const char *path, struct lcfs_node_s
 		}
 		/* add_child took ownership, ref again */
 		lcfs_node_ref(node);
+
+		path_index_add(info, path, node);
 	}
 	return NULL;
 }
@@ -375,7 +696,7 @@ static char *tree_resolve_hardlinks(dump_info *info)
 		if (fixup->target_path == NULL)
 			return make_error("No target path for the hardlink");
 		struct lcfs_node_s *target =
-			lookup_path(info->root, fixup->target_path);
+			path_index_lookup(info, fixup->target_path);
 		if (target == NULL)
 			return make_error("No target at %s for hardlink",
 					  fixup->target_path);
@@ -413,10 +734,21 @@ static void tree_destroy(dump_info *info)
 		fixup = next;
 	}
 	info->hardlink_fixups = NULL;
+	info->cursor_dir = NULL;
+
+	lcfs_ht_destroy(&info->path_index);
+
+	buffer_free(&info->cursor_path);
+	buffer_free(&info->index_key);
+	dump_scratch_free(&info->scratch);
 }
 
-static char *tree_from_dump_line(dump_info *info, const char *line,
-				 size_t line_len, bool strict_mode)
+/* Parses a line into @entry without touching the tree, so this can run
+ * concurrently for different lines. Errors returned after entry->node
+ * is set must only be reported once the node is linked, to keep the
+ * same error as when adding to the tree failed. */
+static char *parse_dump_line(dump_scratch *scratch, const char *line,
+			     size_t line_len, bool strict_mode, dump_entry *entry)
 {
 	int ret;
 
@@ -441,8 +773,8 @@ static char *tree_from_dump_line(dump_info *info, const char *line,
 	}
 
 	char *err = NULL;
-	cleanup_free char *path = unescape_string(
-		fields[FIELD_PATH].data, fields[FIELD_PATH].len, NULL, &err);
+	char *path = unescape_string_buf(&scratch->path_buf, fields[FIELD_PATH].data,
+					 fields[FIELD_PATH].len, NULL, &err);
 	if (path == NULL && err)
 		return err;
 	if (!*path) {
@@ -461,18 +793,19 @@ static char *tree_from_dump_line(dump_info *info, const char *line,
 	if (mode == 0 && err)
 		return err;
 
-	cleanup_node struct lcfs_node_s *node = lcfs_node_new();
-	if (node == NULL) {
+	cleanup_node struct lcfs_node_s *new_node = lcfs_node_new();
+	if (new_node == NULL) {
 		oom();
 	}
-	if (lcfs_node_try_set_mode(node, mode) < 0) {
+	if (lcfs_node_try_set_mode(new_node, mode) < 0) {
 		return make_error("Invalid mode %o", (unsigned int)mode);
 	}
 	unsigned int type = mode & S_IFMT;
 
-	err = tree_add_node(info, path, node);
-	if (err)
-		return err;
+	struct lcfs_node_s *node = entry->node = steal_pointer(&new_node);
+	entry->path_data = fields[FIELD_PATH].data;
+	entry->path_len = fields[FIELD_PATH].len;
+	entry->is_hardlink = is_hardlink;
 
 	/* For hardlinks, bail out early and handle in a fixup at the
          * end when we can resolve the target path. */
@@ -480,13 +813,12 @@ static char *tree_from_dump_line(dump_info *info, const char *line,
 		if (lcfs_node_dirp(node))
 			return make_error("Directories can't be hardlinked");
 		err = NULL;
-		cleanup_free char *target_path =
+		entry->hardlink_target =
 			unescape_optional_string(fields[FIELD_PAYLOAD].data,
 						 fields[FIELD_PAYLOAD].len,
 						 NULL, &err);
-		if (target_path == NULL && err)
+		if (entry->hardlink_target == NULL && err)
 			return err;
-		tree_add_hardlink_fixup(info, steal_pointer(&target_path), node);
 		return NULL;
 	}
 
@@ -517,16 +849,17 @@ static char *tree_from_dump_line(dump_info *info, const char *line,
 	if (err)
 		return err;
 
-	cleanup_free char *payload =
-		unescape_optional_string(fields[FIELD_PAYLOAD].data,
-					 fields[FIELD_PAYLOAD].len, NULL, &err);
+	char *payload = unescape_optional_string_buf(&scratch->payload_buf,
+						     fields[FIELD_PAYLOAD].data,
+						     fields[FIELD_PAYLOAD].len,
+						     NULL, &err);
 	if (payload == NULL && err)
 		return err;
 	size_t content_len;
-	cleanup_free char *content =
-		unescape_optional_string(fields[FIELD_CONTENT].data,
-					 fields[FIELD_CONTENT].len,
-					 &content_len, &err);
+	char *content = unescape_optional_string_buf(&scratch->content_buf,
+						     fields[FIELD_CONTENT].data,
+						     fields[FIELD_CONTENT].len,
+						     &content_len, &err);
 	if (content == NULL && err)
 		return err;
 #ifndef FUZZER // Bypass this data-dependency when fuzzing to increase coverage
@@ -535,8 +868,10 @@ static char *tree_from_dump_line(dump_info *info, const char *line,
 				  (long long)content_len, (long long)size);
 #endif
 
-	cleanup_free char *digest = unescape_optional_string(
-		fields[FIELD_DIGEST].data, fields[FIELD_DIGEST].len, NULL, &err);
+	char *digest = unescape_optional_string_buf(&scratch->digest_buf,
+						    fields[FIELD_DIGEST].data,
+						    fields[FIELD_DIGEST].len,
+						    NULL, &err);
 	if (digest == NULL && err)
 		return err;
 
@@ -602,83 +937,263 @@ static char *tree_from_dump_line(dump_info *info, const char *line,
 		const char *xattr = line;
 		size_t xattr_len = split_at(&line, &line_len, ' ', NULL);
 
-		err = parse_xattr(xattr, xattr_len, node);
+		err = parse_xattr(scratch, xattr, xattr_len, node);
 		if (err)
 			return err;
 	}
 	return NULL;
 }
 
-struct buffer {
-	char *buf;
-	size_t size;
-	size_t capacity;
-};
-
-static void buffer_ensure_space(struct buffer *buf, size_t free_size_needed)
+/* Adds a parsed entry to the tree, consuming it */
+static char *tree_link_dump_entry(dump_info *info, const char *path,
+				  dump_entry *entry)
 {
-	size_t min_capacity = buf->size + free_size_needed;
-	if (buf->capacity >= min_capacity)
-		return;
+	char *err;
 
-	/* No space, grow */
-	if (buf->capacity == 0)
-		buf->capacity = 64 * 1024;
-	else
-		buf->capacity = buf->capacity * 2;
+	if (entry->node == NULL) {
+		err = steal_pointer(&entry->err);
+		dump_entry_clear(entry);
+		return err;
+	}
 
-	if (buf->capacity < min_capacity)
-		buf->capacity = min_capacity;
+	err = tree_add_node(info, path, entry->node);
+	if (err == NULL)
+		err = steal_pointer(&entry->err);
+	if (err == NULL && entry->is_hardlink)
+		tree_add_hardlink_fixup(info, steal_pointer(&entry->hardlink_target),
+					entry->node);
 
-	buf->buf = realloc(buf->buf, buf->capacity);
-	if (buf->buf == NULL)
-		oom();
+	dump_entry_clear(entry);
+	return err;
 }
 
-/* Fills buffer and returns the amount read. 0 on file end */
-static size_t buffer_fill(struct buffer *buf, FILE *input)
+static char *tree_from_dump_line(dump_info *info, const char *line,
+				 size_t line_len, bool strict_mode)
 {
-	/* Grow buffer if needed */
-	buffer_ensure_space(buf, 1);
+	dump_entry entry = { NULL };
 
-	size_t bytes_read =
-		fread(buf->buf + buf->size, 1, buf->capacity - buf->size, input);
-	if (bytes_read == 0 && ferror(input))
-		errx(EXIT_FAILURE, "Error reading from file");
-	buf->size += bytes_read;
+	entry.err = parse_dump_line(&info->scratch, line, line_len, strict_mode,
+				    &entry);
 
-	return bytes_read;
+	/* The unescaped path is still in the scratch buffer */
+	return tree_link_dump_entry(info, info->scratch.path_buf.buf, &entry);
 }
 
-static void buffer_reset(struct buffer *buf)
+/* Parses a complete in-memory dump, such as a mapped file */
+static char *tree_from_dump_data(dump_info *info, const char *data,
+				 size_t data_len, bool strict_mode)
 {
-	/* NOTE: Leaves buffer data as is, just modified size */
-	buf->size = 0;
+	while (data_len > 0) {
+		const char *line = data;
+		bool partial;
+		size_t line_len = split_at(&data, &data_len, '\n', &partial);
+
+		if (partial && strict_mode)
+			return make_error("Missing trailing newline");
+
+		char *err = tree_from_dump_line(info, line, line_len, strict_mode);
+		if (err != NULL)
+			return err;
+	}
+
+	return NULL;
 }
 
-static void buffer_add(struct buffer *buf, const char *src, size_t len)
+/* Large dumps are split in this many chunks per thread, so that
+ * chunks of uneven cost still balance out between threads. */
+#define DUMP_CHUNKS_PER_THREAD 4
+/* Don't bother splitting into chunks smaller than this */
+#define DUMP_MIN_CHUNK_SIZE (256 * 1024)
+
+typedef struct dump_chunk dump_chunk;
+struct dump_chunk {
+	const char *data;
+	size_t len;
+	dump_entry *entries;
+	size_t n_entries;
+	size_t capacity;
+};
+
+typedef struct dump_parse_job dump_parse_job;
+struct dump_parse_job {
+	dump_chunk *chunks;
+	size_t n_chunks;
+	bool strict_mode;
+
+	pthread_mutex_t mutex;
+	size_t next_chunk;
+	/* Chunks after the first failing one need not be parsed */
+	size_t error_chunk;
+};
+
+static dump_entry *dump_chunk_add_entry(dump_chunk *chunk)
 {
-	buffer_ensure_space(buf, len);
+	if (chunk->n_entries == chunk->capacity) {
+		size_t new_capacity = chunk->capacity == 0 ? 1024 : chunk->capacity * 2;
+		dump_entry *new_entries = reallocarray(
+			chunk->entries, new_capacity, sizeof(dump_entry));
+		if (new_entries == NULL)
+			oom();
+		chunk->entries = new_entries;
+		chunk->capacity = new_capacity;
+	}
+
+	dump_entry *entry = &chunk->entries[chunk->n_entries++];
+	memset(entry, 0, sizeof(*entry));
+	return entry;
+}
 
-	/* memmove, as src may be in the buf */
-	memmove(buf->buf + buf->size, src, len);
-	buf->size += len;
+/* Returns false if parsing stopped at an error */
+static bool dump_chunk_parse(dump_chunk *chunk, dump_scratch *scratch,
+			     bool strict_mode)
+{
+	const char *data = chunk->data;
+	size_t data_len = chunk->len;
+
+	while (data_len > 0) {
+		const char *line = data;
+		bool partial;
+		size_t line_len = split_at(&data, &data_len, '\n', &partial);
+		dump_entry *entry = dump_chunk_add_entry(chunk);
+
+		if (partial && strict_mode) {
+			entry->err = make_error("Missing trailing newline");
+			return false;
+		}
+
+		entry->err = parse_dump_line(scratch, line, line_len,
+					     strict_mode, entry);
+		if (entry->err)
+			return false;
+	}
+
+	return true;
 }
 
-static void buffer_free(struct buffer *buf)
+static void *dump_parse_thread(void *data)
 {
-	free(buf->buf);
+	dump_parse_job *job = data;
+	dump_scratch scratch = { { NULL } };
+
+	while (true) {
+		pthread_mutex_lock(&job->mutex);
+		size_t i = job->next_chunk++;
+		bool done = i >= job->n_chunks || i > job->error_chunk;
+		pthread_mutex_unlock(&job->mutex);
+
+		if (done)
+			break;
+
+		if (!dump_chunk_parse(&job->chunks[i], &scratch, job->strict_mode)) {
+			pthread_mutex_lock(&job->mutex);
+			if (i < job->error_chunk)
+				job->error_chunk = i;
+			pthread_mutex_unlock(&job->mutex);
+		}
+	}
+
+	dump_scratch_free(&scratch);
+	return NULL;
 }
 
-static struct lcfs_node_s *tree_from_dump(FILE *input, char **out_err)
+/* Parses line-aligned chunks of the dump concurrently, then links the
+ * resulting nodes into the tree in dump order. This gives the same
+ * tree, and the same first error, as parsing serially. */
+static char *tree_from_dump_data_parallel(dump_info *info, const char *data,
+					  size_t data_len, bool strict_mode,
+					  int n_threads)
 {
-	dump_info info = { NULL };
+	size_t n_chunks = (size_t)n_threads * DUMP_CHUNKS_PER_THREAD;
+	if (n_chunks > data_len / DUMP_MIN_CHUNK_SIZE)
+		n_chunks = data_len / DUMP_MIN_CHUNK_SIZE;
 
-	struct buffer buf = { NULL };
+	if (n_threads <= 1 || n_chunks <= 1)
+		return tree_from_dump_data(info, data, data_len, strict_mode);
 
-	// For now a hidden environment variable, may be promoted to a stable CLI
-	// option once we're happy with semantics.
-	bool strict_mode = getenv("CFS_PARSE_STRICT") != NULL;
+	cleanup_free dump_chunk *chunks = calloc(n_chunks, sizeof(dump_chunk));
+	if (chunks == NULL)
+		oom();
+
+	const char *end = data + data_len;
+	const char *chunk_start = data;
+	size_t n_used = 0;
+	for (size_t i = 1; i <= n_chunks && chunk_start < end; i++) {
+		const char *chunk_end = end;
+
+		if (i < n_chunks) {
+			const char *split = data + (data_len / n_chunks) * i;
+			if (split < chunk_start)
+				split = chunk_start;
+			const char *nl = memchr(split, '\n', end - split);
+			if (nl != NULL)
+				chunk_end = nl + 1;
+		}
+
+		chunks[n_used].data = chunk_start;
+		chunks[n_used].len = chunk_end - chunk_start;
+		n_used++;
+		chunk_start = chunk_end;
+	}
+
+	dump_parse_job job = {
+		.chunks = chunks,
+		.n_chunks = n_used,
+		.strict_mode = strict_mode,
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.error_chunk = SIZE_MAX,
+	};
+
+	/* This thread parses chunks too */
+	size_t n_workers = (size_t)n_threads;
+	if (n_workers > n_used)
+		n_workers = n_used;
+	n_workers = n_workers > 0 ? n_workers - 1 : 0;
+
+	cleanup_free pthread_t *workers = calloc(n_workers + 1, sizeof(pthread_t));
+	if (workers == NULL)
+		oom();
+
+	size_t n_started = 0;
+	for (; n_started < n_workers; n_started++) {
+		/* On failure, the remaining chunks are parsed by fewer threads */
+		if (pthread_create(&workers[n_started], NULL, dump_parse_thread,
+				   &job) != 0)
+			break;
+	}
+
+	dump_parse_thread(&job);
+
+	for (size_t i = 0; i < n_started; i++)
+		pthread_join(workers[i], NULL);
+
+	char *err = NULL;
+	for (size_t i = 0; i < n_used; i++) {
+		dump_chunk *chunk = &chunks[i];
+
+		for (size_t j = 0; j < chunk->n_entries; j++) {
+			dump_entry *entry = &chunk->entries[j];
+			const char *path = NULL;
+
+			if (err == NULL && entry->node != NULL)
+				path = unescape_string_buf(&info->scratch.path_buf,
+							   entry->path_data,
+							   entry->path_len,
+							   NULL, &err);
+			if (err == NULL)
+				err = tree_link_dump_entry(info, path, entry);
+
+			dump_entry_clear(entry);
+		}
+		free(chunk->entries);
+	}
+
+	return err;
+}
+
+static char *tree_from_dump_stream(dump_info *info, FILE *input, bool strict_mode)
+{
+	struct buffer buf = { NULL };
+	char *err = NULL;
 
 	while (!feof(input)) {
 		size_t bytes_read = buffer_fill(&buf, input);
@@ -695,14 +1210,10 @@ static struct lcfs_node_s *tree_from_dump(FILE *input, char **out_err)
 				split_at(&data, &remaining_data, '\n', &partial);
 
 			if (!partial || short_read) {
-				char *err = tree_from_dump_line(
-					&info, line, line_len, strict_mode);
-				if (err != NULL) {
-					*out_err = err;
-					tree_destroy(&info);
-					buffer_free(&buf);
-					return NULL;
-				}
+				err = tree_from_dump_line(info, line, line_len,
+							  strict_mode);
+				if (err != NULL)
+					goto out;
 			} else {
 				/* Last line didn't have a newline and
 				 * this wasn't a short read, so keep
@@ -713,32 +1224,79 @@ static struct lcfs_node_s *tree_from_dump(FILE *input, char **out_err)
 		}
 	}
 	// Handle no trailing newline
-	if (buf.size > 0 && !strict_mode) {
-		char *err = tree_from_dump_line(&info, buf.buf, buf.size, strict_mode);
-		if (err != NULL) {
-			*out_err = err;
-			tree_destroy(&info);
-			buffer_free(&buf);
-			return NULL;
-		}
-	} else if (buf.size > 0) {
-		*out_err = make_error("Missing trailing newline");
-		tree_destroy(&info);
-		buffer_free(&buf);
-		return NULL;
-	}
+	if (buf.size > 0 && !strict_mode)
+		err = tree_from_dump_line(info, buf.buf, buf.size, strict_mode);
+	else if (buf.size > 0)
+		err = make_error("Missing trailing newline");
 
+out:
 	buffer_free(&buf);
+	return err;
+}
+
+/* Maps the rest of the input if it is a regular file, so lines can be
+ * parsed in place rather than copied through a stdio buffer. */
+static void *map_dump_file(FILE *input, size_t *map_size, size_t *data_offset)
+{
+	struct stat st;
+	int fd = fileno(input);
+	off_t offset;
+	void *map;
+
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return NULL;
+
+	offset = lseek(fd, 0, SEEK_CUR);
+	if (offset < 0 || offset >= st.st_size)
+		return NULL;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	(void)madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	*map_size = st.st_size;
+	*data_offset = offset;
+	return map;
+}
+
+static struct lcfs_node_s *tree_from_dump(FILE *input, int n_threads,
+					  char **out_err)
+{
+	dump_info info = { NULL };
+	size_t map_size = 0;
+	size_t data_offset = 0;
+	char *map;
+	char *err;
+
+	// For now a hidden environment variable, may be promoted to a stable CLI
+	// option once we're happy with semantics.
+	bool strict_mode = getenv("CFS_PARSE_STRICT") != NULL;
+
+	map = map_dump_file(input, &map_size, &data_offset);
+	if (map != NULL) {
+		err = tree_from_dump_data_parallel(&info, map + data_offset,
+						   map_size - data_offset,
+						   strict_mode, n_threads);
+		munmap(map, map_size);
+	} else {
+		err = tree_from_dump_stream(&info, input, strict_mode);
+	}
 
 	/* Fixup hardlinks now that we have all other files */
-	char *err = tree_resolve_hardlinks(&info);
+	if (err == NULL)
+		err = tree_resolve_hardlinks(&info);
+
 	if (err) {
 		*out_err = err;
 		tree_destroy(&info);
 		return NULL;
 	}
 
-	return info.root;
+	struct lcfs_node_s *root = steal_pointer(&info.root);
+	tree_destroy(&info);
+	return root;
 }
 
 static ssize_t write_cb(void *_file, void *buf, size_t count)
@@ -756,7 +1314,7 @@ static int LLVMFuzzerTestOneInput(uint8_t *buf, size_t len)
 	char *err = NULL;
 	FILE *f = fmemopen(buf, len, "r");
 	assert(f);
-	tree = tree_from_dump(f, &err);
+	tree = tree_from_dump(f, 1, &err);
 	bool is_err = err != NULL;
 	free(err);
 	fclose(f);
@@ -1054,7 +1612,8 @@ static int copy_file_data(int sfd, int dfd)
 }
 
 static int copy_file_with_dirs_if_needed(const char *src, const char *dst_base,
-					 const char *dst, bool try_enable_fsverity)
+					 const char *dst, bool try_enable_fsverity,
+					 bool *copied)
 {
 	cleanup_free char *pathbuf = NULL;
 	cleanup_unlink_free char *tmppath = NULL;
@@ -1072,6 +1631,7 @@ static int copy_file_with_dirs_if_needed(const char *src, const char *dst_base,
 	if (ret < 0)
 		return ret;
 
+	*copied = false;
 	if (lstat(pathbuf, &statbuf) == 0)
 		return 0; /* Already exists, no need to copy */
 
@@ -1128,13 +1688,26 @@ static int copy_file_with_dirs_if_needed(const char *src, const char *dst_base,
 		}
 	}
 
-	res = rename(tmppath, pathbuf);
-	if (res < 0) {
-		return res;
-	}
-	// Avoid a spurious extra unlink() from the cleanup
-	free(steal_pointer(&tmppath));
-
+	/* Other threads may be storing the same object, so claim the name
+	 * atomically; if someone else got there first this is a duplicate.
+	 * The temporary file is unlinked by the cleanup either way. */
+	res = linkat(AT_FDCWD, tmppath, AT_FDCWD, pathbuf, 0);
+	if (res < 0) {
+		if (errno == EEXIST)
+			return 0;
+		if (errno != EPERM && errno != EOPNOTSUPP)
+			return res;
+
+		/* No hardlink support in the store */
+		res = rename(tmppath, pathbuf);
+		if (res < 0) {
+			return res;
+		}
+		// Avoid a spurious extra unlink() from the cleanup
+		free(steal_pointer(&tmppath));
+	}
+
+	*copied = true;
 	return 0;
 }
 
@@ -1299,20 +1872,226 @@ static void request_cancel(struct work_item_iterator *iterator, int errorcode)
 	pthread_mutex_unlock(iterator->mutex_node_iterator);
 }
 
+enum build_phase {
+	PHASE_SCAN,
+	PHASE_DIGEST,
+	PHASE_STORE_FILL,
+	PHASE_LAYOUT,
+	PHASE_WRITE,
+	N_PHASES,
+};
+
+static const char *const phase_names[N_PHASES] = {
+	"scan", "digest", "store_fill", "layout", "write",
+};
+
+/* Counters are updated by the worker threads, and read concurrently by
+ * the progress reporter. */
+struct build_stats {
+	atomic_uint_fast64_t files_scanned;
+	atomic_uint_fast64_t bytes_hashed;
+	atomic_uint_fast64_t bytes_copied;
+	atomic_uint_fast64_t objects_deduplicated;
+	atomic_int phase;
+	uint64_t start_ns;
+	uint64_t phase_ns[N_PHASES];
+	uint64_t inodes_written;
+	uint64_t image_size;
+	uint64_t data_blocks;
+	uint64_t dedup_blocks;
+	uint64_t tail_padding;
+	uint64_t padding_saved;
+};
+
+static struct build_stats stats;
+
+static void stats_add(atomic_uint_fast64_t *counter, uint64_t value)
+{
+	atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static uint64_t stats_get(atomic_uint_fast64_t *counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static uint64_t phase_begin(enum build_phase phase)
+{
+	atomic_store_explicit(&stats.phase, phase, memory_order_relaxed);
+	return lcfs_now_ns();
+}
+
+static void phase_end(enum build_phase phase, uint64_t start)
+{
+	stats.phase_ns[phase] += lcfs_now_ns() - start;
+}
+
+static void stats_count_node(struct lcfs_node_s *node, void *userdata)
+{
+	stats_add(&stats.files_scanned, 1);
+}
+
+static void stats_count_nodes(struct lcfs_node_s *node)
+{
+	stats_count_node(node, NULL);
+
+	size_t n_children = lcfs_node_get_n_children(node);
+	for (size_t i = 0; i < n_children; i++)
+		stats_count_nodes(lcfs_node_get_child(node, i));
+}
+
+static pthread_mutex_t progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+static bool progress_done;
+static pthread_t progress_thread;
+
+static void print_progress(bool final)
+{
+	static const char *const labels[N_PHASES] = {
+		"Scanning", "Computing digests", "Filling store",
+		"Writing image", "Writing image",
+	};
+	int phase = atomic_load_explicit(&stats.phase, memory_order_relaxed);
+	uint64_t elapsed = (lcfs_now_ns() - stats.start_ns) / 1000000000;
+	bool tty = isatty(STDERR_FILENO);
+
+	fprintf(stderr,
+		"%s%s: %" PRIu64 " files, %" PRIu64 " MiB hashed, %" PRIu64
+		" MiB copied, %" PRIu64 " deduplicated, %" PRIu64 "s%s",
+		tty ? "\r" : "", final ? "Done" : labels[phase],
+		stats_get(&stats.files_scanned),
+		stats_get(&stats.bytes_hashed) >> 20,
+		stats_get(&stats.bytes_copied) >> 20,
+		stats_get(&stats.objects_deduplicated), elapsed,
+		tty ? "\033[K" : "\n");
+	if (tty && final)
+		fputc('\n', stderr);
+}
+
+static void *progress_proc(void *data)
+{
+	(void)data;
+
+	pthread_mutex_lock(&progress_mutex);
+	while (!progress_done) {
+		struct timespec deadline;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += 1;
+		pthread_cond_timedwait(&progress_cond, &progress_mutex, &deadline);
+		if (!progress_done)
+			print_progress(false);
+	}
+	pthread_mutex_unlock(&progress_mutex);
+
+	return NULL;
+}
+
+static void start_progress(void)
+{
+	int ret = pthread_create(&progress_thread, NULL, progress_proc, NULL);
+	if (ret != 0) {
+		errno = ret;
+		err(EXIT_FAILURE, "pthread_create");
+	}
+}
+
+static void stop_progress(void)
+{
+	pthread_mutex_lock(&progress_mutex);
+	progress_done = true;
+	pthread_cond_signal(&progress_cond);
+	pthread_mutex_unlock(&progress_mutex);
+	pthread_join(progress_thread, NULL);
+
+	print_progress(true);
+}
+
+static void print_stats(bool json)
+{
+	const uint64_t counters[] = {
+		stats_get(&stats.files_scanned),
+		stats_get(&stats.bytes_hashed),
+		stats_get(&stats.bytes_copied),
+		stats_get(&stats.objects_deduplicated),
+		stats.inodes_written,
+		stats.image_size,
+		stats.data_blocks,
+		stats.dedup_blocks,
+		stats.tail_padding,
+		stats.padding_saved,
+	};
+	static const char *const counter_names[] = {
+		"files_scanned",	"bytes_hashed",	  "bytes_copied",
+		"objects_deduplicated", "inodes_written", "image_size",
+		"data_blocks",		"dedup_blocks",	  "tail_padding",
+		"padding_saved",
+	};
+	const size_t n_counters = sizeof(counters) / sizeof(counters[0]);
+	/* Fraction of the content blocks that were shared */
+	uint64_t content_blocks = stats.data_blocks + stats.dedup_blocks;
+	double dedup_ratio =
+		content_blocks ? (double)stats.dedup_blocks / content_blocks : 0;
+
+	if (json)
+		fprintf(stderr, "{\n");
+	for (size_t i = 0; i < n_counters; i++) {
+		if (json)
+			fprintf(stderr, "  \"%s\": %" PRIu64 ",\n",
+				counter_names[i], counters[i]);
+		else
+			fprintf(stderr, "%-22s %" PRIu64 "\n", counter_names[i],
+				counters[i]);
+	}
+	if (json)
+		fprintf(stderr, "  \"dedup_ratio\": %.4f,\n", dedup_ratio);
+	else
+		fprintf(stderr, "%-22s %.4f\n", "dedup_ratio", dedup_ratio);
+	if (json)
+		fprintf(stderr, "  \"phases\": {\n");
+	for (size_t i = 0; i < N_PHASES; i++) {
+		double secs = stats.phase_ns[i] / 1e9;
+		if (json)
+			fprintf(stderr, "    \"%s\": %.6f%s\n", phase_names[i],
+				secs, i + 1 < N_PHASES ? "," : "");
+		else
+			fprintf(stderr, "%-22s %.6fs\n", phase_names[i], secs);
+	}
+	if (json)
+		fprintf(stderr, "  }\n}\n");
+}
+
 typedef int (*THREAD_PROCESS_PROC)(struct work_item *, void *);
 
 static int process_copy(struct work_item *item, void *digest_store_path)
 {
-	return copy_file_with_dirs_if_needed(item->path,
-					     (const char *)digest_store_path,
-					     lcfs_node_get_payload(item->node),
-					     true);
+	bool copied;
+	int ret;
+
+	ret = copy_file_with_dirs_if_needed(item->path,
+					    (const char *)digest_store_path,
+					    lcfs_node_get_payload(item->node),
+					    true, &copied);
+	if (ret == 0) {
+		if (copied)
+			stats_add(&stats.bytes_copied,
+				  lcfs_node_get_size(item->node));
+		else
+			stats_add(&stats.objects_deduplicated, 1);
+	}
+	return ret;
 }
 
 static int process_compute(struct work_item *item, void *data)
 {
 	int buildflag = (int)(long)data;
-	return lcfs_node_set_from_content(item->node, AT_FDCWD, item->path, buildflag);
+	int ret;
+
+	ret = lcfs_node_set_from_content(item->node, AT_FDCWD, item->path,
+					 buildflag);
+	if (ret == 0)
+		stats_add(&stats.bytes_hashed, lcfs_node_get_size(item->node));
+	return ret;
 }
 
 struct thread_data {
@@ -1417,8 +2196,10 @@ static int compute_digest(const int thread_count, struct lcfs_node_s *node,
 		return -1;
 	}
 
+	uint64_t start = phase_begin(PHASE_DIGEST);
 	int ret = execute_in_threads(thread_count, &collection, process_compute,
 				     (void *)(long)buildflag);
+	phase_end(PHASE_DIGEST, start);
 	cleanup_work_items(&collection);
 
 	return ret;
@@ -1436,20 +2217,492 @@ static int fill_store(const int thread_count, struct lcfs_node_s *node,
 		return -1;
 	}
 
+	uint64_t start = phase_begin(PHASE_STORE_FILL);
 	int ret = execute_in_threads(thread_count, &collection, process_copy,
 				     (void *)digest_store_path);
+	phase_end(PHASE_STORE_FILL, start);
 	cleanup_work_items(&collection);
 	return ret;
 }
 
-static int get_cpu_count(void)
+/* Normalizes a path from the changed list to be relative to the source
+ * root, without repeated or trailing slashes or . components. Returns
+ * false for paths with .. components. */
+static bool normalize_changed_path(char *path)
+{
+	char *out = path;
+	const char *p = path;
+
+	while (*p != 0) {
+		while (*p == '/')
+			p++;
+		if (*p == 0)
+			break;
+
+		const char *start = p;
+		while (*p != 0 && *p != '/')
+			p++;
+
+		size_t len = p - start;
+		if (len == 1 && start[0] == '.')
+			continue;
+		if (len == 2 && start[0] == '.' && start[1] == '.')
+			return false;
+
+		if (out != path)
+			*out++ = '/';
+		memmove(out, start, len);
+		out += len;
+	}
+	*out = 0;
+
+	return true;
+}
+
+static int cmp_changed_path(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Is @path, or any of its parents, in the sorted list? */
+static bool changed_paths_contain(char **paths, size_t n_paths,
+				  const char *path, size_t path_len)
+{
+	cleanup_free char *prefix = strndup(path, path_len);
+	if (prefix == NULL)
+		oom();
+
+	for (size_t len = path_len; len > 0; len--) {
+		if (len != path_len && prefix[len] != '/')
+			continue;
+		prefix[len] = 0;
+
+		if (bsearch(&prefix, paths, n_paths, sizeof(char *),
+			    cmp_changed_path) != NULL)
+			return true;
+	}
+
+	return false;
+}
+
+/* Reads the list of changed paths, sorted and with paths below other
+ * listed paths removed. Returns true if the root itself changed. */
+static bool read_changed_paths(const char *changed_path, char ***paths_out,
+			       size_t *n_paths_out)
+{
+	cleanup_free char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	char **paths = NULL;
+	size_t n_paths = 0;
+	bool root_changed = false;
+
+	FILE *f = fopen(changed_path, "re");
+	if (f == NULL)
+		err(EXIT_FAILURE, "open `%s`", changed_path);
+
+	while ((len = getline(&line, &line_size, f)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = 0;
+		if (len == 0)
+			continue;
+
+		if (!normalize_changed_path(line))
+			errx(EXIT_FAILURE, "Invalid changed path `%s`", line);
+
+		if (*line == 0) {
+			root_changed = true;
+			continue;
+		}
+
+		paths = reallocarray(paths, n_paths + 1, sizeof(char *));
+		if (paths == NULL)
+			oom();
+		paths[n_paths] = strdup(line);
+		if (paths[n_paths] == NULL)
+			oom();
+		n_paths++;
+	}
+	if (ferror(f))
+		err(EXIT_FAILURE, "read `%s`", changed_path);
+	fclose(f);
+
+	if (n_paths > 0)
+		qsort(paths, n_paths, sizeof(char *), cmp_changed_path);
+
+	size_t n_kept = 0;
+	for (size_t i = 0; i < n_paths; i++) {
+		char *p = paths[i];
+		char *parent_end = strrchr(p, '/');
+
+		if ((n_kept > 0 && strcmp(paths[n_kept - 1], p) == 0) ||
+		    (parent_end != NULL &&
+		     changed_paths_contain(paths, n_paths, p, parent_end - p)))
+			free(p);
+		else
+			paths[n_kept++] = p;
+	}
+
+	*paths_out = paths;
+	*n_paths_out = n_kept;
+	return root_changed;
+}
+
+/* Entries were added to or removed from a directory, so its own
+ * metadata (mtime in particular) needs to be re-read too. */
+static void refresh_dir_metadata(struct lcfs_node_s *dir, const char *path,
+				 int buildflags)
+{
+	cleanup_node struct lcfs_node_s *fresh =
+		lcfs_load_node_from_file(AT_FDCWD, path, buildflags);
+	if (fresh == NULL)
+		err(EXIT_FAILURE, "error accessing %s", path);
+	if (!lcfs_node_dirp(fresh))
+		errx(EXIT_FAILURE, "%s is no longer a directory", path);
+
+	struct timespec mtime;
+	lcfs_node_get_mtime(fresh, &mtime);
+	lcfs_node_set_mtime(dir, &mtime);
+	lcfs_node_set_mode(dir, lcfs_node_get_mode(fresh));
+	lcfs_node_set_uid(dir, lcfs_node_get_uid(fresh));
+	lcfs_node_set_gid(dir, lcfs_node_get_gid(fresh));
+
+	while (lcfs_node_get_n_xattr(dir) > 0) {
+		cleanup_free char *name = strdup(lcfs_node_get_xattr_name(dir, 0));
+		if (name == NULL)
+			oom();
+		if (lcfs_node_unset_xattr(dir, name) < 0)
+			err(EXIT_FAILURE, "unset xattr");
+	}
+
+	size_t n_xattrs = lcfs_node_get_n_xattr(fresh);
+	for (size_t i = 0; i < n_xattrs; i++) {
+		const char *name = lcfs_node_get_xattr_name(fresh, i);
+		size_t value_len;
+		const char *value = lcfs_node_get_xattr(fresh, name, &value_len);
+
+		if (lcfs_node_set_xattr(dir, name, value, value_len) < 0)
+			err(EXIT_FAILURE, "set xattr");
+	}
+}
+
+/* Finds where @changed gets rebuilt from: the first component that is
+ * missing or not a directory in the tree. Returns the node to replace,
+ * or NULL if there is none, and sets @dir_out, @dir_len_out and
+ * @name_out to its parent, the length of the parent's path in @changed
+ * and its name. */
+static struct lcfs_node_s *find_changed_node(struct lcfs_node_s *root,
+					     const char *changed,
+					     struct lcfs_node_s **dir_out,
+					     size_t *dir_len_out, char **name_out)
+{
+	struct lcfs_node_s *dir = root;
+	const char *p = changed;
+	const char *end;
+	char *name = NULL;
+	struct lcfs_node_s *old;
+
+	for (;;) {
+		end = strchrnul(p, '/');
+
+		free(name);
+		name = strndup(p, end - p);
+		if (name == NULL)
+			oom();
+
+		old = lcfs_node_lookup_child(dir, name);
+		if (*end == 0 || old == NULL || !lcfs_node_dirp(old))
+			break;
+
+		dir = old;
+		p = end + 1;
+	}
+
+	*dir_out = dir;
+	*dir_len_out = p - changed;
+	*name_out = name;
+	return old;
+}
+
+/* Hardlinks can't be rebuilt from a source directory, so a subtree
+ * that contains a hardlink, or a file that something else links to,
+ * can't be replaced without losing them. */
+static bool subtree_has_hardlinks(struct lcfs_node_s *node)
+{
+	if (lcfs_node_get_hardlink_target(node) != NULL)
+		return true;
+	if (!lcfs_node_dirp(node))
+		return lcfs_node_get_nlink(node) > 1;
+
+	size_t n_children = lcfs_node_get_n_children(node);
+	for (size_t i = 0; i < n_children; i++) {
+		if (subtree_has_hardlinks(lcfs_node_get_child(node, i)))
+			return true;
+	}
+
+	return false;
+}
+
+/* The same for the source: a file with other links, whether inside
+ * the subtree or not, can't be rebuilt on its own either. A missing
+ * path has none. */
+static bool source_has_hardlinks(int parent_fd, const char *name)
+{
+	struct dirent *de;
+	struct stat st;
+	bool found = false;
+	DIR *dir;
+	int dfd;
+
+	if (fstatat(parent_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		if (errno == ENOENT)
+			return false;
+		err(EXIT_FAILURE, "error accessing %s", name);
+	}
+	if (!S_ISDIR(st.st_mode))
+		return st.st_nlink > 1;
+
+	dfd = openat(parent_fd, name,
+		     O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dfd < 0)
+		err(EXIT_FAILURE, "error accessing %s", name);
+	dir = fdopendir(dfd);
+	if (dir == NULL)
+		err(EXIT_FAILURE, "error accessing %s", name);
+
+	while (!found && (de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		found = source_has_hardlinks(dfd, de->d_name);
+	}
+
+	closedir(dir);
+	return found;
+}
+
+/* Replaces (or removes) the subtree at @changed with the current
+ * contents of the source directory. */
+static void apply_changed_path(struct lcfs_node_s *root, const char *src_path,
+			       const char *changed, int buildflags,
+			       int buildflag_copy, int threads,
+			       const char *digest_store_path)
+{
+	struct lcfs_node_s *dir;
+	size_t dir_len;
+	cleanup_free char *name = NULL;
+	struct lcfs_node_s *old =
+		find_changed_node(root, changed, &dir, &dir_len, &name);
+
+	cleanup_free char *dir_path = NULL;
+	cleanup_free char *dir_rel = strndup(changed, dir_len);
+	if (dir_rel == NULL || join_paths(&dir_path, src_path, dir_rel) < 0)
+		oom();
+
+	cleanup_free char *full_path = NULL;
+	if (join_paths(&full_path, dir_path, name) < 0)
+		oom();
+
+	cleanup_node struct lcfs_node_s *new = NULL;
+	struct stat st;
+	if (lstat(full_path, &st) < 0) {
+		if (errno != ENOENT)
+			err(EXIT_FAILURE, "error accessing %s", full_path);
+	} else if ((buildflags & LCFS_BUILD_SKIP_DEVICES) &&
+		   (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode))) {
+		/* Skipped, like when building the full tree */
+	} else {
+		char *failed_path = NULL;
+		uint64_t start = phase_begin(PHASE_SCAN);
+
+		new = lcfs_build_with_cb(AT_FDCWD, full_path, buildflag_copy,
+					 &failed_path, stats_count_node, NULL);
+		if (new == NULL)
+			err(EXIT_FAILURE, "error accessing %s", failed_path ?: "");
+		phase_end(PHASE_SCAN, start);
+
+		if (compute_digest(threads, new, full_path, buildflags) < 0)
+			err(EXIT_FAILURE, "error computing digest");
+
+		if (digest_store_path &&
+		    fill_store(threads, new, full_path, digest_store_path) < 0)
+			err(EXIT_FAILURE, "cannot fill store");
+	}
+
+	if (old != NULL && lcfs_node_remove_child(dir, name) < 0)
+		err(EXIT_FAILURE, "remove %s", full_path);
+
+	if (new != NULL) {
+		if (lcfs_node_add_child(dir, new, name) < 0)
+			err(EXIT_FAILURE, "add %s", full_path);
+		/* Owned by the tree now */
+		new = NULL;
+	}
+
+	refresh_dir_metadata(dir, dir_path, buildflag_copy);
+}
+
+/* Loads the tree of a previous image and updates only the changed
+ * paths from the source directory. Returns NULL if the whole tree
+ * needs to be rebuilt, because the root changed or a changed path
+ * involves hardlinks. */
+static struct lcfs_node_s *
+build_incremental(const char *base_image, const char *changed_path,
+		  const char *src_path, int buildflags, int buildflag_copy,
+		  int threads, const char *digest_store_path)
+{
+	char **paths = NULL;
+	size_t n_paths = 0;
+	bool root_changed;
+
+	root_changed = read_changed_paths(changed_path, &paths, &n_paths);
+
+	cleanup_node struct lcfs_node_s *root = NULL;
+	if (!root_changed) {
+		uint64_t start = phase_begin(PHASE_SCAN);
+		cleanup_fd int fd = open(base_image, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			err(EXIT_FAILURE, "open `%s`", base_image);
+
+		root = lcfs_load_node_from_fd(fd);
+		if (root == NULL)
+			err(EXIT_FAILURE, "failed to load `%s`", base_image);
+		phase_end(PHASE_SCAN, start);
+
+		/* Checked for all paths before any is applied, so that
+		 * falling back doesn't scan or count anything twice */
+		for (size_t i = 0; i < n_paths; i++) {
+			struct lcfs_node_s *dir;
+			size_t dir_len;
+			cleanup_free char *name = NULL;
+			struct lcfs_node_s *old = find_changed_node(
+				root, paths[i], &dir, &dir_len, &name);
+			cleanup_free char *rel = NULL;
+			cleanup_free char *full_path = NULL;
+
+			if (asprintf(&rel, "%.*s%s", (int)dir_len, paths[i], name) < 0 ||
+			    join_paths(&full_path, src_path, rel) < 0)
+				oom();
+
+			if ((old != NULL && subtree_has_hardlinks(old)) ||
+			    source_has_hardlinks(AT_FDCWD, full_path)) {
+				lcfs_node_unref(steal_pointer(&root));
+				break;
+			}
+		}
+
+		for (size_t i = 0; root != NULL && i < n_paths; i++)
+			apply_changed_path(root, src_path, paths[i], buildflags,
+					   buildflag_copy, threads,
+					   digest_store_path);
+	}
+
+	for (size_t i = 0; i < n_paths; i++)
+		free(paths[i]);
+	free(paths);
+
+	return steal_pointer(&root);
+}
+
+/* Reads a list of paths, one per line, such as the trace written by
+ * composefs-fuse -o trace=FILE, into a NULL terminated array. */
+static char **read_layout_hints(const char *hints_path)
+{
+	cleanup_free char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	char **hints = NULL;
+	size_t n_hints = 0;
+
+	FILE *f = fopen(hints_path, "re");
+	if (f == NULL)
+		err(EXIT_FAILURE, "open `%s`", hints_path);
+
+	while ((len = getline(&line, &line_size, f)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = 0;
+		if (len == 0)
+			continue;
+
+		hints = reallocarray(hints, n_hints + 2, sizeof(char *));
+		if (hints == NULL)
+			oom();
+		hints[n_hints] = strdup(line);
+		if (hints[n_hints] == NULL)
+			oom();
+		n_hints++;
+		hints[n_hints] = NULL;
+	}
+	if (ferror(f))
+		err(EXIT_FAILURE, "read `%s`", hints_path);
+	fclose(f);
+
+	return hints;
+}
+
+struct object_index {
+	struct lcfs_objindex_entry_s *entries;
+	size_t n_entries;
+	size_t capacity;
+};
+
+/* Returns the payload that can't be indexed, if there is one */
+static const char *collect_objects(struct lcfs_node_s *node,
+				   struct object_index *index)
 {
-	cpu_set_t set;
+	const char *payload = lcfs_node_get_payload(node);
+	size_t n_children = lcfs_node_get_n_children(node);
+
+	/* Only what the image references, so not inline files */
+	if (lcfs_node_get_hardlink_target(node) == NULL &&
+	    (lcfs_node_get_mode(node) & S_IFMT) == S_IFREG &&
+	    lcfs_node_get_size(node) > 0 && lcfs_node_get_content(node) == NULL &&
+	    payload != NULL && *payload != '\0') {
+		struct lcfs_objindex_entry_s *entry;
+
+		if (index->n_entries == index->capacity) {
+			index->capacity = max(index->capacity * 2, (size_t)1024);
+			index->entries = reallocarray(index->entries, index->capacity,
+						      sizeof(*index->entries));
+			if (index->entries == NULL)
+				errx(EXIT_FAILURE, "Out of memory");
+		}
+
+		entry = &index->entries[index->n_entries++];
+		if (digest_from_path(payload, entry->digest) < 0)
+			return payload;
+		entry->size = lcfs_node_get_size(node);
+	}
+
+	for (size_t i = 0; i < n_children; i++) {
+		const char *failed =
+			collect_objects(lcfs_node_get_child(node, i), index);
+		if (failed != NULL)
+			return failed;
+	}
+
+	return NULL;
+}
 
-	if (sched_getaffinity(0, sizeof(set), &set) == 0)
-		return CPU_COUNT(&set);
+/* Writes the backing files of the image to a sidecar, see lcfs-objindex.h */
+static void write_object_index(struct object_index *index, const char *path)
+{
+	FILE *file;
+
+	file = fopen(path, "we");
+	if (file == NULL)
+		err(EXIT_FAILURE, "failed to open object index");
+	if (lcfs_objindex_write(file, index->entries, index->n_entries) < 0 ||
+	    fclose(file) == EOF)
+		err(EXIT_FAILURE, "failed to write object index");
+}
 
-	return get_nprocs();
+static void free_layout_hints(char **hints)
+{
+	if (hints == NULL)
+		return;
+	for (size_t i = 0; hints[i] != NULL; i++)
+		free(hints[i]);
+	free(hints);
 }
 
 static void usage(const char *argv0)
@@ -1468,7 +2721,16 @@ static void usage(const char *argv0)
 		"  --from-file           The source is a dump file, not a directory\n"
 		"  --min-version=N       Use this minimal format version (default=%d)\n"
 		"  --max-version=N       Use this maximum format version (default=%d)\n"
-		"  --threads=N           Use this to override the default number of threads used to calculate digest and copy files (default=%d)\n",
+		"  --threads=N           Use this to override the default number of threads used to calculate digest and copy files (default=%d)\n"
+		"  --base-image=PATH     Update this previous image, rather than building from scratch\n"
+		"  --changed=PATH        File listing the paths changed since the base image\n"
+		"  --progress            Report progress on stderr while building\n"
+		"  --stats=FORMAT        Print build statistics on stderr, FORMAT is text or json\n"
+		"  --layout=ORDER        Order of inodes in the image: bfs (default), dfs or clustered\n"
+		"  --layout-hint=PATH    Place the paths listed in this file first in the image\n"
+		"  --dedup-blocks        Share data blocks between files with identical inline content\n"
+		"  --pack-inodes         Move nearby inodes into the padding in front of inline tails\n"
+		"  --object-index=PATH   Also write an index of the backing files to this path\n",
 		bin, LCFS_DEFAULT_VERSION_MIN, LCFS_DEFAULT_VERSION_MAX,
 		get_cpu_count());
 }
@@ -1514,9 +2776,37 @@ int main(int argc, char **argv)
 		  .has_arg = required_argument,
 		  .flag = NULL,
 		  .val = OPT_THREADS },
+		{ .name = "base-image",
+		  .has_arg = required_argument,
+		  .flag = NULL,
+		  .val = OPT_BASE_IMAGE },
+		{ .name = "changed",
+		  .has_arg = required_argument,
+		  .flag = NULL,
+		  .val = OPT_CHANGED },
+		{ .name = "progress", .has_arg = no_argument, .flag = NULL, .val = OPT_PROGRESS },
+		{ .name = "stats", .has_arg = required_argument, .flag = NULL, .val = OPT_STATS },
+		{ .name = "layout", .has_arg = required_argument, .flag = NULL, .val = OPT_LAYOUT },
+		{ .name = "layout-hint",
+		  .has_arg = required_argument,
+		  .flag = NULL,
+		  .val = OPT_LAYOUT_HINT },
+		{ .name = "dedup-blocks",
+		  .has_arg = no_argument,
+		  .flag = NULL,
+		  .val = OPT_DEDUP_BLOCKS },
+		{ .name = "pack-inodes",
+		  .has_arg = no_argument,
+		  .flag = NULL,
+		  .val = OPT_PACK_INODES },
+		{ .name = "object-index",
+		  .has_arg = required_argument,
+		  .flag = NULL,
+		  .val = OPT_OBJECT_INDEX },
 		{},
 	};
 	struct lcfs_write_options_s options = { 0 };
+	struct lcfs_write_stats_s write_stats = { 0 };
 	const char *bin = argv[0];
 	int buildflags = 0;
 	bool print_digest = false;
@@ -1526,10 +2816,23 @@ int main(int argc, char **argv)
 	const char *out = NULL;
 	const char *src_path = NULL;
 	const char *digest_store_path = NULL;
+	const char *base_image = NULL;
+	const char *changed_path = NULL;
+	bool progress = false;
+	const char *stats_format = NULL;
+	uint32_t layout = LCFS_LAYOUT_BFS;
+	const char *layout_hint_path = NULL;
+	char **layout_hints = NULL;
+	bool dedup_blocks = false;
+	bool pack_inodes = false;
+	const char *object_index_path = NULL;
+	struct object_index object_index = { 0 };
+	uint64_t start;
 	cleanup_free char *pathbuf = NULL;
 	uint8_t digest[LCFS_DIGEST_SIZE];
 	int opt;
 	FILE *out_file;
+	bool seekable_out = false;
 	char *failed_path;
 	bool version_set = false;
 	long min_version = 0;
@@ -1597,6 +2900,46 @@ int main(int argc, char **argv)
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case OPT_BASE_IMAGE:
+			base_image = optarg;
+			break;
+		case OPT_CHANGED:
+			changed_path = optarg;
+			break;
+		case OPT_PROGRESS:
+			progress = true;
+			break;
+		case OPT_STATS:
+			if (strcmp(optarg, "text") != 0 && strcmp(optarg, "json") != 0) {
+				fprintf(stderr, "Invalid stats format %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			stats_format = optarg;
+			break;
+		case OPT_LAYOUT:
+			if (strcmp(optarg, "bfs") == 0) {
+				layout = LCFS_LAYOUT_BFS;
+			} else if (strcmp(optarg, "dfs") == 0) {
+				layout = LCFS_LAYOUT_DFS;
+			} else if (strcmp(optarg, "clustered") == 0) {
+				layout = LCFS_LAYOUT_CLUSTERED;
+			} else {
+				fprintf(stderr, "Invalid layout %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_LAYOUT_HINT:
+			layout_hint_path = optarg;
+			break;
+		case OPT_DEDUP_BLOCKS:
+			dedup_blocks = true;
+			break;
+		case OPT_PACK_INODES:
+			pack_inodes = true;
+			break;
+		case OPT_OBJECT_INDEX:
+			object_index_path = optarg;
+			break;
 		case ':':
 			fprintf(stderr, "option needs a value\n");
 			exit(EXIT_FAILURE);
@@ -1611,6 +2954,15 @@ int main(int argc, char **argv)
 		max_version = LCFS_DEFAULT_VERSION_MAX;
 	}
 
+	if ((base_image == NULL) != (changed_path == NULL)) {
+		fprintf(stderr, "--base-image and --changed must be used together\n");
+		exit(EXIT_FAILURE);
+	}
+	if (base_image && from_file) {
+		fprintf(stderr, "--base-image can't be used with --from-file\n");
+		exit(EXIT_FAILURE);
+	}
+
 	argv += optind;
 	argc -= optind;
 
@@ -1647,6 +2999,13 @@ int main(int argc, char **argv)
 
 	assert(out || print_digest_only);
 
+	if (base_image && out && strcmp(out, "-") != 0) {
+		struct stat base_st, out_st;
+		if (stat(base_image, &base_st) == 0 && stat(out, &out_st) == 0 &&
+		    base_st.st_dev == out_st.st_dev && base_st.st_ino == out_st.st_ino)
+			errx(EXIT_FAILURE, "The base image can't also be the output image");
+	}
+
 	if (print_digest_only) {
 		out_file = NULL;
 	} else if (strcmp(out, "-") == 0) {
@@ -1654,11 +3013,21 @@ int main(int argc, char **argv)
 			errx(EXIT_FAILURE, "stdout is a tty.  Refusing to use it");
 		out_file = stdout;
 	} else {
-		out_file = fopen(out, "we");
+		struct stat out_st;
+
+		/* Read access is needed to compute the digest of a seekable fd */
+		out_file = fopen(out, "w+e");
 		if (out_file == NULL)
 			err(EXIT_FAILURE, "failed to open output file");
+		if (fstat(fileno(out_file), &out_st) < 0)
+			err(EXIT_FAILURE, "failed to stat output file");
+		seekable_out = S_ISREG(out_st.st_mode);
 	}
 
+	stats.start_ns = lcfs_now_ns();
+	if (progress)
+		start_progress();
+
 	if (from_file) {
 		FILE *input = NULL;
 		bool close_input = false;
@@ -1672,13 +3041,16 @@ int main(int argc, char **argv)
 		}
 
 		char *err = NULL;
-		root = tree_from_dump(input, &err);
+		start = phase_begin(PHASE_SCAN);
+		root = tree_from_dump(input, threads, &err);
 		if (root == NULL) {
 			if (err)
 				errx(EXIT_FAILURE, "%s", err);
 			else
 				errx(EXIT_FAILURE, "No files in dump file");
 		}
+		stats_count_nodes(root);
+		phase_end(PHASE_SCAN, start);
 
 		if (close_input)
 			fclose(input);
@@ -1689,35 +3061,92 @@ int main(int argc, char **argv)
 		buildflag_copy &= ~LCFS_BUILD_BY_DIGEST;
 		buildflag_copy |= LCFS_BUILD_NO_INLINE;
 
-		root = lcfs_build(AT_FDCWD, src_path, buildflag_copy, &failed_path);
+		root = NULL;
+		if (base_image)
+			root = build_incremental(base_image, changed_path,
+						 src_path, buildflags,
+						 buildflag_copy, threads,
+						 digest_store_path);
+
 		if (root == NULL) {
-			// An allocation error in maybe_join_path() can cause
-			// failed_path to be set to NULL
-			err(EXIT_FAILURE, "error accessing %s", failed_path ?: "");
-		}
+			start = phase_begin(PHASE_SCAN);
+			root = lcfs_build_with_cb(AT_FDCWD, src_path,
+						  buildflag_copy, &failed_path,
+						  stats_count_node, NULL);
+			if (root == NULL) {
+				// An allocation error in maybe_join_path() can cause
+				// failed_path to be set to NULL
+				err(EXIT_FAILURE, "error accessing %s",
+				    failed_path ?: "");
+			}
+			phase_end(PHASE_SCAN, start);
 
-		if (compute_digest(threads, root, src_path, buildflags) < 0)
-			err(EXIT_FAILURE, "error computing digest");
+			if (compute_digest(threads, root, src_path, buildflags) < 0)
+				err(EXIT_FAILURE, "error computing digest");
 
-		if (digest_store_path &&
-		    fill_store(threads, root, src_path, digest_store_path) < 0)
-			err(EXIT_FAILURE, "cannot fill store");
+			if (digest_store_path &&
+			    fill_store(threads, root, src_path, digest_store_path) < 0)
+				err(EXIT_FAILURE, "cannot fill store");
+		}
 	}
 
-	if (out_file) {
+	if (seekable_out) {
+		options.flags |= LCFS_FLAGS_SEEKABLE_FD;
+		options.fd = fileno(out_file);
+	} else if (out_file) {
 		options.file = out_file;
 		options.file_write_cb = write_cb;
 	}
+	/* Collected first, so an image that can't be indexed isn't written */
+	if (object_index_path) {
+		const char *failed = collect_objects(root, &object_index);
+		if (failed != NULL) {
+			if (seekable_out)
+				unlink(out);
+			errx(EXIT_FAILURE,
+			     "Can't index backing file %s, it isn't stored by digest",
+			     failed);
+		}
+	}
 	if (print_digest)
 		options.digest_out = digest;
+	if (dedup_blocks)
+		options.flags |= LCFS_FLAGS_DEDUP_BLOCKS;
+	if (pack_inodes)
+		options.flags |= LCFS_FLAGS_PACK_INODES;
 
 	options.format = LCFS_FORMAT_EROFS;
 	options.version = (int)min_version;
 	options.max_version = (int)max_version;
+	options.threads = threads;
+	options.layout = layout;
+	if (layout_hint_path) {
+		layout_hints = read_layout_hints(layout_hint_path);
+		options.layout_hints = (const char *const *)layout_hints;
+	}
+	options.stats_out = &write_stats;
 
+	phase_begin(PHASE_LAYOUT);
 	if (lcfs_write_to(root, &options) < 0)
 		err(EXIT_FAILURE, "cannot write file");
 
+	stats.phase_ns[PHASE_LAYOUT] = write_stats.layout_time_ns;
+	stats.phase_ns[PHASE_WRITE] = write_stats.write_time_ns;
+	stats.inodes_written = write_stats.n_inodes;
+	stats.image_size = write_stats.image_size;
+	stats.data_blocks = write_stats.n_data_blocks;
+	stats.dedup_blocks = write_stats.n_dedup_blocks;
+	stats.tail_padding = write_stats.tail_padding;
+	stats.padding_saved = write_stats.padding_saved;
+
+	if (progress)
+		stop_progress();
+	if (stats_format)
+		print_stats(strcmp(stats_format, "json") == 0);
+
+	if (object_index_path)
+		write_object_index(&object_index, object_index_path);
+
 	if (print_digest) {
 		char digest_str[LCFS_DIGEST_SIZE * 2 + 1] = { 0 };
 		digest_to_string(digest, digest_str);
@@ -1727,6 +3156,8 @@ int main(int argc, char **argv)
 	if (out_file && fclose(out_file) == EOF)
 		err(EXIT_FAILURE, "close output file");
 
+	free_layout_hints(layout_hints);
+	free(object_index.entries);
 	lcfs_node_unref(root);
 	return 0;
 }